@@ -2,6 +2,7 @@
 #include "Game.hpp"
 #include "Renderer.hpp"
 #include "Shader.hpp"
+#include "TraceProfiler.hpp"
 
 #include <stdio.h>
 
@@ -190,6 +191,7 @@ void Renderer::handleEvent(Event *event)
 
 void Renderer::renderFrame()
 {
+    TAREA2_TRACE_ZONE("Renderer::renderFrame");
     // Set the clearing and clear the framebuffer.
     glClearColor(0, 0, 0, 0);
     glClearStencil(0);
@@ -217,6 +219,7 @@ void Renderer::renderFrame()
 
 void Renderer::prepareFrame()
 {
+    TAREA2_TRACE_ZONE("Renderer::prepareFrame");
     // Clear the builders.
     backgroundBuilder.clear();
     shadowBuilder.clear();
@@ -242,6 +245,7 @@ void Renderer::prepareFrame()
 
 void Renderer::setupShadowVolumes()
 {
+    TAREA2_TRACE_ZONE("Renderer::setupShadowVolumes");
     // Setup the stencil buffer.
     glStencilFunc(GL_ALWAYS, 0, ~0);
     glStencilOp(GL_KEEP, GL_KEEP, GL_INCR);
@@ -308,6 +312,7 @@ void Renderer::setupReceivers()
 
 void Renderer::drawBackground()
 {
+    TAREA2_TRACE_ZONE("Renderer::drawBackground");
     if(backgroundBuilder.empty())
         return;
 
@@ -322,6 +327,7 @@ void Renderer::drawBackground()
 
 void Renderer::drawShadowCasters()
 {
+    TAREA2_TRACE_ZONE("Renderer::drawShadowCasters");
     if(shadowBuilder.empty())
         return;
 
@@ -336,6 +342,7 @@ void Renderer::drawShadowCasters()
 
 void Renderer::drawNoShadow()
 {
+    TAREA2_TRACE_ZONE("Renderer::drawNoShadow");
     if(noShadowBuilder.empty())
         return;
 
@@ -1,7 +1,9 @@
 #include <stdio.h>
+#include <string.h>
 #include <SDL/SDL.h>
 #include <GL/glew.h>
 #include "System.hpp"
+#include "TraceProfiler.hpp"
 
 namespace Tarea2
 {
@@ -36,6 +38,20 @@ void System::setTitle(const std::string &title)
 
 bool System::initialize(int argc, const char *argv[])
 {
+    // Parse the options.
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "--trace") && i + 1 < argc)
+        {
+            traceFileName_ = argv[++i];
+#ifdef TAREA2_ENABLE_TRACE
+            TraceProfiler::get().setEnabled(true);
+#else
+            fprintf(stderr, "The tracing was disabled at compile time\n");
+#endif
+        }
+    }
+
     // Initialize SDL.
     int ret = SDL_Init(SDL_INIT_VIDEO);
     if(ret)
@@ -83,11 +99,17 @@ void System::mainloop()
     Uint32 availableTime = 0;
 
     // Main loop
+    TAREA2_TRACE_THREAD_NAME("main");
     quitting_ = false;
     while(!quitting_)
     {
+        TAREA2_TRACE_ZONE("System::mainloop");
+
         // Read events from SDL.
-        sendEvents();
+        {
+            TAREA2_TRACE_ZONE("System::sendEvents");
+            sendEvents();
+        }
 
         // Compute the delta.
         newTime = SDL_GetTicks();
@@ -112,6 +134,7 @@ void System::mainloop()
         // Perform updates by intervals.
         while(availableTime >= UpdateInterval)
         {     
+            TAREA2_TRACE_ZONE("FrameUpdate");
             float delta = UpdateInterval*0.001;
             FrameUpdateEvent updateEvent(Event::FrameUpdate, delta);
             fire(&updateEvent);
@@ -119,23 +142,37 @@ void System::mainloop()
         }
 
         // Send a frame event.
-        Event drawEvent(Event::FrameDraw);
-        fire(&drawEvent);
+        {
+            TAREA2_TRACE_ZONE("FrameDraw");
+            Event drawEvent(Event::FrameDraw);
+            fire(&drawEvent);
+        }
 
         // Swap buffers.
-        SDL_GL_SwapBuffers();
+        {
+            TAREA2_TRACE_ZONE("SDL_GL_SwapBuffers");
+            SDL_GL_SwapBuffers();
+        }
         framesCount++;
 
         // Don't eat the CPU.
         int sleepTime = 5 - deltaTime;
         if(sleepTime > 0)
+        {
+            TAREA2_TRACE_ZONE("SDL_Delay");
             SDL_Delay(sleepTime);
+        }
     }
 }
 
 
 void System::shutdown()
 {
+#ifdef TAREA2_ENABLE_TRACE
+    if(!traceFileName_.empty())
+        TraceProfiler::get().writeJSON(traceFileName_);
+#endif
+
     SDL_Quit();
 }
 
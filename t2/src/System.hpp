@@ -33,6 +33,7 @@ private:
 
     bool quitting_;
     int width_, height_;
+    std::string traceFileName_;
 };
 
 } // namespace Rot
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <time.h>
+#include "TraceProfiler.hpp"
+
+namespace Tarea2
+{
+
+#ifdef TAREA2_ENABLE_TRACE
+
+// Zones kept per thread. The oldest ones are overwritten.
+const size_t TraceBufferCapacity = 1<<16;
+
+static __thread TraceThreadBuffer *currentThreadBuffer = NULL;
+
+bool TraceProfiler::enabled = false;
+
+//-----------------------------------------------------------------------------
+// Trace thread buffer
+//
+
+TraceThreadBuffer::TraceThreadBuffer(int threadId)
+    : threadId(threadId), next(0), wrapped(false)
+{
+    events.resize(TraceBufferCapacity);
+}
+
+void TraceThreadBuffer::add(const char *name, Uint64 start, Uint64 end)
+{
+    TraceEvent &event = events[next];
+    event.name = name;
+    event.start = start;
+    event.duration = end - start;
+
+    if(++next == events.size())
+    {
+        next = 0;
+        wrapped = true;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Trace profiler
+//
+
+TraceProfiler::TraceProfiler()
+{
+    mutex = SDL_CreateMutex();
+    startTime = now();
+}
+
+TraceProfiler::~TraceProfiler()
+{
+    for(size_t i = 0; i < buffers.size(); ++i)
+        delete buffers[i];
+    SDL_DestroyMutex(mutex);
+}
+
+TraceProfiler &TraceProfiler::get()
+{
+    static TraceProfiler profiler;
+    return profiler;
+}
+
+void TraceProfiler::setEnabled(bool value)
+{
+    enabled = value;
+}
+
+void TraceProfiler::setThreadName(const char *name)
+{
+    TraceThreadBuffer *buffer = getThreadBuffer();
+    SDL_LockMutex(mutex);
+    buffer->threadName = name;
+    SDL_UnlockMutex(mutex);
+}
+
+void TraceProfiler::addZone(const char *name, Uint64 start, Uint64 end)
+{
+    getThreadBuffer()->add(name, start, end);
+}
+
+TraceThreadBuffer *TraceProfiler::getThreadBuffer()
+{
+    if(!currentThreadBuffer)
+    {
+        SDL_LockMutex(mutex);
+        currentThreadBuffer = new TraceThreadBuffer(buffers.size() + 1);
+        buffers.push_back(currentThreadBuffer);
+        SDL_UnlockMutex(mutex);
+    }
+
+    return currentThreadBuffer;
+}
+
+bool TraceProfiler::writeJSON(const std::string &fileName)
+{
+    FILE *out = fopen(fileName.c_str(), "w");
+    if(!out)
+    {
+        fprintf(stderr, "Failed to open the trace file %s\n", fileName.c_str());
+        return false;
+    }
+
+    SDL_LockMutex(mutex);
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for(size_t i = 0; i < buffers.size(); ++i)
+    {
+        TraceThreadBuffer *buffer = buffers[i];
+
+        // Thread name metadata.
+        if(!buffer->threadName.empty())
+        {
+            fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",\n", buffer->threadId, buffer->threadName.c_str());
+            first = false;
+        }
+
+        // Write the zones from the oldest one.
+        size_t count = buffer->wrapped ? buffer->events.size() : buffer->next;
+        size_t start = buffer->wrapped ? buffer->next : 0;
+        for(size_t j = 0; j < count; ++j)
+        {
+            const TraceEvent &event = buffer->events[(start + j) % buffer->events.size()];
+            fprintf(out, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %llu, \"dur\": %llu}",
+                first ? "" : ",\n", event.name, buffer->threadId,
+                (unsigned long long)(event.start - startTime), (unsigned long long)event.duration);
+            first = false;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    SDL_UnlockMutex(mutex);
+    fclose(out);
+    return true;
+}
+
+Uint64 TraceProfiler::now()
+{
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (Uint64)time.tv_sec*1000000 + time.tv_nsec/1000;
+}
+
+#endif
+
+} // namespace Tarea2
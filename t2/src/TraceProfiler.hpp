@@ -0,0 +1,108 @@
+#ifndef _TAREA2_TRACE_PROFILER_HPP
+#define _TAREA2_TRACE_PROFILER_HPP
+
+#include <string>
+#include <vector>
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+
+namespace Tarea2
+{
+
+#ifdef TAREA2_ENABLE_TRACE
+
+/**
+ * A completed zone, with times in microseconds.
+ */
+struct TraceEvent
+{
+    const char *name;
+    Uint64 start;
+    Uint64 duration;
+};
+
+/**
+ * Ring buffer with the zones of a single thread.
+ */
+class TraceThreadBuffer
+{
+public:
+    TraceThreadBuffer(int threadId);
+
+    void add(const char *name, Uint64 start, Uint64 end);
+
+    int threadId;
+    std::string threadName;
+    std::vector<TraceEvent> events;
+    size_t next;
+    bool wrapped;
+};
+
+/**
+ * Scoped zone profiler that writes Chrome/Perfetto trace event files.
+ */
+class TraceProfiler
+{
+public:
+    static TraceProfiler &get();
+
+    void setEnabled(bool value);
+
+    static bool isEnabled()
+    {
+        return enabled;
+    }
+
+    void setThreadName(const char *name);
+    void addZone(const char *name, Uint64 start, Uint64 end);
+    bool writeJSON(const std::string &fileName);
+
+    static Uint64 now();
+
+private:
+    TraceProfiler();
+    ~TraceProfiler();
+
+    TraceThreadBuffer *getThreadBuffer();
+
+    static bool enabled;
+
+    SDL_mutex *mutex;
+    std::vector<TraceThreadBuffer*> buffers;
+    Uint64 startTime;
+};
+
+/**
+ * Records the lifetime of a scope.
+ */
+class TraceZone
+{
+public:
+    TraceZone(const char *name)
+        : name(name), start(TraceProfiler::isEnabled() ? TraceProfiler::now() : 0) {}
+    ~TraceZone()
+    {
+        if(start)
+            TraceProfiler::get().addZone(name, start, TraceProfiler::now());
+    }
+
+private:
+    const char *name;
+    Uint64 start;
+};
+
+#define TAREA2_TRACE_CONCAT_(a, b) a##b
+#define TAREA2_TRACE_CONCAT(a, b) TAREA2_TRACE_CONCAT_(a, b)
+#define TAREA2_TRACE_ZONE(name) Tarea2::TraceZone TAREA2_TRACE_CONCAT(traceZone, __LINE__)(name)
+#define TAREA2_TRACE_THREAD_NAME(name) Tarea2::TraceProfiler::get().setThreadName(name)
+
+#else
+
+#define TAREA2_TRACE_ZONE(name)
+#define TAREA2_TRACE_THREAD_NAME(name)
+
+#endif
+
+} // namespace Tarea2
+
+#endif //_TAREA2_TRACE_PROFILER_HPP
@@ -1,14 +1,22 @@
+#include <stdlib.h>
+#include <string.h>
 #include "Application.hpp"
+#include "TraceProfiler.hpp"
 
 namespace T3
 {
 
+// Time between the recorded camera keyframes.
+const float RecordTimeStep = 1.0f/30.0f;
+
 Application::Application()
     : display(this), raytracer(this), scene(NULL)
 {
     velocity = Vector3::zero();
     angularVelocity = Vector3::zero();
     elapsedTime = 0.0f;
+    nextRecordTime = 0.0f;
+    startTime = FrameProfiler::now();
 }
 
 Application::~Application()
@@ -20,6 +28,21 @@ Display *Application::getDisplay()
     return &display;
 }
 
+FrameProfiler *Application::getProfiler()
+{
+    return &profiler;
+}
+
+Raytracer *Application::getRaytracer()
+{
+    return &raytracer;
+}
+
+double Application::getStartTime() const
+{
+    return startTime;
+}
+
 Scene *Application::getScene()
 {
     Lock l(mutex);
@@ -35,23 +58,180 @@ void Application::setScene(Scene *newScene)
 bool Application::initialize(int argc, const char *argv[])
 {
     const char *sceneName = NULL;
+    farm.setCommandLine(argc, argv);
     for(int i = 1; i < argc; ++i)
     {
-        sceneName = argv[i];
+        if(!strcmp(argv[i], "--retune"))
+            raytracer.setRetuneWorkGroups(true);
+        else if(!strcmp(argv[i], "--morton"))
+            raytracer.setPixelOrder(PixelOrder_MortonTiles);
+        else if(!strcmp(argv[i], "--benchmark-pixel-order") && i + 1 < argc)
+            raytracer.setPixelOrderBenchmarkFrames(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--adaptive-aa") && i + 1 < argc)
+            raytracer.setAdaptiveSampleGridSize(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--reprojection"))
+            raytracer.setReprojection(true);
+        else if(!strcmp(argv[i], "--min-throughput") && i + 1 < argc)
+            raytracer.setMinThroughput(atof(argv[++i]));
+        else if(!strcmp(argv[i], "--russian-roulette"))
+            raytracer.setRussianRoulette(true);
+        else if(!strcmp(argv[i], "--ray-stats"))
+            raytracer.setRayStatistics(true);
+        else if(!strcmp(argv[i], "--soft-shadows") && i + 2 < argc)
+        {
+            int probes = atoi(argv[++i]);
+            raytracer.setSoftShadows(probes, atoi(argv[++i]));
+        }
+        else if(!strcmp(argv[i], "--hard-shadows"))
+            raytracer.setSoftShadows(0, 0);
+        else if(!strcmp(argv[i], "--mesh-chunks") && i + 1 < argc)
+            raytracer.setMeshChunkCount(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--max-alloc") && i + 1 < argc)
+            raytracer.setMaxAllocSize(strtoull(argv[++i], NULL, 10));
+        else if(!strcmp(argv[i], "--no-camera-constants"))
+            raytracer.setCameraConstants(false);
+        else if(!strcmp(argv[i], "--benchmark-camera-constants") && i + 1 < argc)
+            raytracer.setCameraConstantsBenchmarkFrames(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--sky-cache") && i + 1 < argc)
+            raytracer.setSkyCache(argv[++i]);
+        else if(!strcmp(argv[i], "--sky-keyframes") && i + 1 < argc)
+            raytracer.setSkyKeyframeCount(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--exact-sky"))
+            raytracer.setSkyCache(std::string());
+        else if(!strcmp(argv[i], "--sky-error"))
+            raytracer.setSkyErrorReport(true);
+        else if(!strcmp(argv[i], "--platform") && i + 1 < argc)
+            raytracer.setPlatform(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--cpu"))
+            raytracer.setDeviceType(CL_DEVICE_TYPE_CPU);
+        else if(!strcmp(argv[i], "--device") && i + 1 < argc)
+            raytracer.setDevice(argv[++i]);
+        else if(!strcmp(argv[i], "--benchmark-devices"))
+            raytracer.setBenchmarkDevices(true);
+        else if(!strcmp(argv[i], "--math-benchmark"))
+            mathBenchmark.setEnabled(true);
+        else if(!strcmp(argv[i], "--regression") && i + 1 < argc)
+            regression.setReferenceDirectory(argv[++i]);
+        else if(!strcmp(argv[i], "--regression-update"))
+            regression.setUpdateReferences(true);
+        else if(!strcmp(argv[i], "--regression-threshold") && i + 1 < argc)
+            regression.setMaxSlowdown(atof(argv[++i]));
+        else if(!strcmp(argv[i], "--regression-psnr") && i + 1 < argc)
+            regression.setMinPSNR(atof(argv[++i]));
+        else if(!strcmp(argv[i], "--regression-ssim") && i + 1 < argc)
+            regression.setMinSSIM(atof(argv[++i]));
+        else if(!strcmp(argv[i], "--regression-frames") && i + 1 < argc)
+            regression.setFrameCount(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--farm") && i + 1 < argc)
+            farm.setCameraPathFile(argv[++i]);
+        else if(!strcmp(argv[i], "--farm-workers") && i + 1 < argc)
+            farm.setWorkerCount(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--farm-fps") && i + 1 < argc)
+            farm.setFramesPerSecond(atof(argv[++i]));
+        else if(!strcmp(argv[i], "--farm-output") && i + 1 < argc)
+            farm.setOutputDirectory(argv[++i]);
+        else if(!strcmp(argv[i], "--farm-scaling"))
+            farm.setScaling(true);
+        else if(!strcmp(argv[i], "--farm-worker") && i + 1 < argc)
+            farm.setWorkerSocket(argv[++i]);
+        else if(!strcmp(argv[i], "--serve") && i + 1 < argc)
+            server.setSocketPath(argv[++i]);
+        else if(!strcmp(argv[i], "--serve-scenes") && i + 1 < argc)
+            server.setMaxCachedScenes(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--render-path") && i + 1 < argc)
+            sequence.setCameraPathFile(argv[++i]);
+        else if(!strcmp(argv[i], "--render-output") && i + 1 < argc)
+            sequence.setOutputDirectory(argv[++i]);
+        else if(!strcmp(argv[i], "--render-fps") && i + 1 < argc)
+            sequence.setFramesPerSecond(atof(argv[++i]));
+        else if(!strcmp(argv[i], "--render-writers") && i + 1 < argc)
+            sequence.setWriterThreads(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--record-path") && i + 1 < argc)
+            recordPathFile = argv[++i];
+        else if(!strcmp(argv[i], "--play-path") && i + 1 < argc)
+        {
+            if(!playbackPath.loadFromFile(argv[++i]))
+                return false;
+        }
+        else if(!strcmp(argv[i], "--profile-csv") && i + 1 < argc)
+        {
+            if(!profiler.openCSV(argv[++i]))
+                return false;
+        }
+        else if(!strcmp(argv[i], "--trace") && i + 1 < argc)
+        {
+            traceFileName = argv[++i];
+#ifdef T3_ENABLE_TRACE
+            TraceProfiler::get().setEnabled(true);
+#else
+            fprintf(stderr, "The tracing was disabled at compile time\n");
+#endif
+        }
+        else
+        {
+            sceneName = argv[i];
+            regression.addScene(argv[i]);
+        }
     }
 
+    // The math benchmark does not need a scene.
+    if(mathBenchmark.isEnabled())
+        return true;
+
     // Make sure there's a scene
     if(!sceneName)
     {
         fprintf(stderr, "Please, submit a scene\n");
         return false;
     }
+    // The render farm coordinator leaves the scene to the workers.
+    if(farm.isCoordinator())
+        return true;
+
+    // The render farm workers, the render server and the sequence
+    // renderer render offline.
+    if(farm.isWorker() || server.isEnabled() || sequence.isEnabled())
+    {
+        server.setInitialScene(sceneName);
+        scene = Scene::loadFromFile(sceneName);
+        if(!scene)
+            return false;
+        SDL_Init(SDL_INIT_TIMER);
+        return raytracer.initializeOffline();
+    }
+
+    // The regression suite renders offline every scene, starting with the
+    // first one. It counts the secondary rays for the Mrays/s, and compares
+    // the exact sky and the point light shadows with the references.
+    if(regression.isEnabled())
+    {
+        sceneName = regression.getScenes()[0].c_str();
+        scene = Scene::loadFromFile(sceneName);
+        if(!scene)
+            return false;
+        raytracer.setRayStatistics(true);
+        raytracer.setSkyCache(std::string());
+        raytracer.setSoftShadows(0, 0);
+        SDL_Init(SDL_INIT_TIMER);
+        return raytracer.initializeOffline();
+    }
+
+    // Set up OpenCL while the scene loads and the window opens. The
+    // program is built once the scene is loaded.
+    SDL_Init(SDL_INIT_TIMER);
+    if(!raytracer.initialize())
+        return false;
+
     scene = Scene::loadFromFile(sceneName);
+    if(!scene)
+    {
+        raytracer.shutdown();
+        return false;
+    }
+    raytracer.setSceneReady();
 
     if(!display.initialize())
         return false;
-    if(!raytracer.initialize())
-        return false;
     return true;
 }
 
@@ -110,14 +290,62 @@ void Application::createScene()
     scene->addShape(new SphereShape(Vector3(2, 5, 1 ), 0.1f, light2Material->getId()));
 }
 
-void Application::run()
+int Application::run()
 {
+    if(mathBenchmark.isEnabled())
+        return mathBenchmark.run() ? 0 : 1;
+
+    if(farm.isCoordinator())
+        return farm.runCoordinator() ? 0 : 1;
+
+    if(farm.isWorker())
+    {
+        bool success = farm.runWorker(this, &raytracer);
+        shutdown();
+        return success ? 0 : 1;
+    }
+
+    if(server.isEnabled())
+    {
+        bool success = server.run(this, &raytracer);
+        shutdown();
+        return success ? 0 : 1;
+    }
+
+    if(sequence.isEnabled())
+    {
+        bool success = sequence.run(this, &raytracer);
+        shutdown();
+        return success ? 0 : 1;
+    }
+
+    if(regression.isEnabled())
+    {
+        bool passed = regression.run(this, &raytracer);
+        shutdown();
+        return passed ? 0 : 1;
+    }
+
     display.run();
+    return raytracer.hasStartupFailed() ? 1 : 0;
 }
 
 void Application::shutdown()
 {
     raytracer.shutdown();
+
+    if(!recordPathFile.empty() && !recordedPath.empty())
+    {
+        if(recordedPath.saveToFile(recordPathFile))
+            printf("Recorded %d camera keyframes into %s\n", (int)recordedPath.getKeyframeCount(), recordPathFile.c_str());
+        recordedPath.clear();
+    }
+
+#ifdef T3_ENABLE_TRACE
+    // The raytracer thread is stopped, so the trace can be written.
+    if(!traceFileName.empty())
+        TraceProfiler::get().writeJSON(traceFileName);
+#endif
 }
 
 void Application::quit()
@@ -127,6 +355,14 @@ void Application::quit()
 
 void Application::update(float delta)
 {
+    // The played path replaces the camera and sun animation.
+    if(!playbackPath.empty())
+    {
+        elapsedTime += delta;
+        applyCameraKeyframe(playbackPath.sample(elapsedTime));
+        return;
+    }
+
     rotation = rotation + angularVelocity*delta;
     Camera camera = scene->getCamera();
     Matrix3 newOrientation = Matrix3::xyzRot(rotation).transpose();
@@ -140,6 +376,20 @@ void Application::update(float delta)
     float c = cos(theta);
     Vector3 sunDir = Vector3(0.0f, s, c);
     scene->setSunDirection(sunDir);
+
+    // Sample the state at fixed timesteps, so it can be replayed.
+    if(!recordPathFile.empty())
+    {
+        CameraKeyframe keyframe;
+        keyframe.position = camera.getPosition();
+        keyframe.rotation = rotation;
+        keyframe.sunDirection = sunDir;
+        for(; nextRecordTime <= elapsedTime; nextRecordTime += RecordTimeStep)
+        {
+            keyframe.time = nextRecordTime;
+            recordedPath.addKeyframe(keyframe);
+        }
+    }
 }
 
 const Vector3 &Application::getVelocity()
@@ -172,6 +422,16 @@ void Application::setRotation(const Vector3 &newRotation)
     rotation = newRotation;
 }
 
+void Application::applyCameraKeyframe(const CameraKeyframe &keyframe)
+{
+    rotation = keyframe.rotation;
+    Camera camera = scene->getCamera();
+    camera.setPosition(keyframe.position);
+    camera.setOrientation(Matrix3::xyzRot(rotation).transpose());
+    scene->setCamera(camera);
+    scene->setSunDirection(keyframe.sunDirection);
+}
+
 
 } // namespace T3
 
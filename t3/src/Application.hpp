@@ -4,6 +4,13 @@
 #include "Display.hpp"
 #include "Raytracer.hpp"
 #include "Scene.hpp"
+#include "FrameProfiler.hpp"
+#include "MathBenchmark.hpp"
+#include "RegressionSuite.hpp"
+#include "RenderFarm.hpp"
+#include "RenderServer.hpp"
+#include "SequenceRenderer.hpp"
+#include "CameraPath.hpp"
 
 namespace T3
 {
@@ -20,6 +27,15 @@ public:
     /// Gets the current display.
     Display *getDisplay();
 
+    /// Gets the frame stage profiler.
+    FrameProfiler *getProfiler();
+
+    /// Gets the raytracer.
+    Raytracer *getRaytracer();
+
+    /// Host time when the application started, in milliseconds.
+    double getStartTime() const;
+
     /// Gets the current scene.
     Scene *getScene();
 
@@ -29,8 +45,9 @@ public:
     /// Initializes the applications.
     bool initialize(int argc, const char *argv[]);
 
-    /// Enters into the application main loop.
-    void run();
+    /// Enters into the application main loop, or runs one of the offline
+    /// modes. Returns the process exit code.
+    int run();
 
     /// Notification about the main window being closed.
     void quit();
@@ -59,9 +76,13 @@ public:
     // Sets the rotation.
     void setRotation(const Vector3 &rotation);
 
+    // Moves the camera and the sun to the state of a keyframe.
+    void applyCameraKeyframe(const CameraKeyframe &keyframe);
+
 private:
     void createScene();
 
+    FrameProfiler profiler;
     Display display;
     Raytracer raytracer;
     Scene *scene;
@@ -72,6 +93,33 @@ private:
     Vector3 angularVelocity;
     float elapsedTime;
 
+    // Startup time, for the time to first frame.
+    double startTime;
+
+    // Chrome trace output.
+    std::string traceFileName;
+
+    // Checks and timings of the host vector math.
+    MathBenchmark mathBenchmark;
+
+    // Image and performance regression checks.
+    RegressionSuite regression;
+
+    // Offline rendering of camera paths on worker processes.
+    RenderFarm farm;
+
+    // Rendering daemon, serving the requests of other processes.
+    RenderServer server;
+
+    // Pipelined offline rendering of a camera path in this process.
+    SequenceRenderer sequence;
+
+    // Camera path recording and playback.
+    std::string recordPathFile;
+    CameraPath recordedPath;
+    float nextRecordTime;
+    CameraPath playbackPath;
+
     // Scene mutex.
     Mutex mutex;
 };
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <math.h>
+#include <fstream>
+#include <sstream>
+#include "CameraPath.hpp"
+
+namespace T3
+{
+
+inline Vector3 lerp(const Vector3 &a, const Vector3 &b, float alpha)
+{
+    return a*(1.0f - alpha) + b*alpha;
+}
+
+CameraPath::CameraPath()
+{
+}
+
+CameraPath::~CameraPath()
+{
+}
+
+bool CameraPath::loadFromFile(const std::string &fileName)
+{
+    std::ifstream in(fileName.c_str());
+    if(!in.good())
+    {
+        fprintf(stderr, "Failed to open the camera path %s\n", fileName.c_str());
+        return false;
+    }
+
+    keyframes.clear();
+    std::string line;
+    int lineNumber = 0;
+    while(std::getline(in, line))
+    {
+        ++lineNumber;
+        size_t start = line.find_first_not_of(" \t\r");
+        if(start == std::string::npos || line[start] == '#')
+            continue;
+
+        CameraKeyframe keyframe;
+        std::istringstream fields(line);
+        fields >> keyframe.time
+            >> keyframe.position.x >> keyframe.position.y >> keyframe.position.z
+            >> keyframe.rotation.x >> keyframe.rotation.y >> keyframe.rotation.z
+            >> keyframe.sunDirection.x >> keyframe.sunDirection.y >> keyframe.sunDirection.z;
+        if(fields.fail())
+        {
+            fprintf(stderr, "%s:%d: invalid camera keyframe\n", fileName.c_str(), lineNumber);
+            return false;
+        }
+
+        addKeyframe(keyframe);
+    }
+
+    if(keyframes.empty())
+    {
+        fprintf(stderr, "The camera path %s has no keyframes\n", fileName.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool CameraPath::saveToFile(const std::string &fileName) const
+{
+    FILE *file = fopen(fileName.c_str(), "w");
+    if(!file)
+    {
+        fprintf(stderr, "Failed to write the camera path %s\n", fileName.c_str());
+        return false;
+    }
+
+    fprintf(file, "# time px py pz rx ry rz sx sy sz\n");
+    for(size_t i = 0; i < keyframes.size(); ++i)
+    {
+        const CameraKeyframe &k = keyframes[i];
+        fprintf(file, "%.4f %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f\n", k.time,
+            k.position.x, k.position.y, k.position.z,
+            k.rotation.x, k.rotation.y, k.rotation.z,
+            k.sunDirection.x, k.sunDirection.y, k.sunDirection.z);
+    }
+
+    fclose(file);
+    return true;
+}
+
+void CameraPath::addKeyframe(const CameraKeyframe &keyframe)
+{
+    // Keep the keyframes sorted.
+    std::vector<CameraKeyframe>::iterator it = keyframes.end();
+    while(it != keyframes.begin() && (it - 1)->time > keyframe.time)
+        --it;
+    keyframes.insert(it, keyframe);
+}
+
+void CameraPath::clear()
+{
+    keyframes.clear();
+}
+
+bool CameraPath::empty() const
+{
+    return keyframes.empty();
+}
+
+size_t CameraPath::getKeyframeCount() const
+{
+    return keyframes.size();
+}
+
+float CameraPath::getDuration() const
+{
+    if(keyframes.empty())
+        return 0.0f;
+    return keyframes.back().time - keyframes.front().time;
+}
+
+int CameraPath::getFrameCount(float framesPerSecond) const
+{
+    if(keyframes.empty())
+        return 0;
+    return (int)floor(getDuration()*framesPerSecond + 0.5f) + 1;
+}
+
+CameraKeyframe CameraPath::sample(float time) const
+{
+    if(keyframes.empty())
+        return CameraKeyframe();
+
+    // Clamp to the ends.
+    if(time <= keyframes.front().time)
+        return keyframes.front();
+    if(time >= keyframes.back().time)
+        return keyframes.back();
+
+    // Find the segment.
+    size_t next = 1;
+    while(keyframes[next].time < time)
+        ++next;
+    const CameraKeyframe &a = keyframes[next - 1];
+    const CameraKeyframe &b = keyframes[next];
+    float span = b.time - a.time;
+    float alpha = span > 0.0f ? (time - a.time)/span : 1.0f;
+
+    CameraKeyframe result;
+    result.time = time;
+    result.position = lerp(a.position, b.position, alpha);
+    result.rotation = lerp(a.rotation, b.rotation, alpha);
+    result.sunDirection = lerp(a.sunDirection, b.sunDirection, alpha);
+    if(result.sunDirection.length2() > 0.0f)
+        result.sunDirection = result.sunDirection.normalized();
+    return result;
+}
+
+} // namespace T3
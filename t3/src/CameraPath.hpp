@@ -0,0 +1,62 @@
+#ifndef T3_CAMERA_PATH_HPP
+#define T3_CAMERA_PATH_HPP
+
+#include <string>
+#include <vector>
+#include "Vector3.hpp"
+
+namespace T3
+{
+
+/**
+ * Camera and sun state at a point of time.
+ */
+struct CameraKeyframe
+{
+    CameraKeyframe()
+        : time(0.0f), sunDirection(0, 1, 0) {}
+
+    float time;
+    Vector3 position;
+    Vector3 rotation;
+    Vector3 sunDirection;
+};
+
+/**
+ * Keyframed camera path. The keyframes are sorted by time, and the state
+ * between them is linearly interpolated.
+ *
+ * The file has one keyframe per line:
+ *   time px py pz rx ry rz sx sy sz
+ * where r is the rotation of the camera in radians around x, y and z, and
+ * s the sun direction. Lines starting with '#' are comments.
+ */
+class CameraPath
+{
+public:
+    CameraPath();
+    ~CameraPath();
+
+    bool loadFromFile(const std::string &fileName);
+    bool saveToFile(const std::string &fileName) const;
+
+    void addKeyframe(const CameraKeyframe &keyframe);
+    void clear();
+
+    bool empty() const;
+    size_t getKeyframeCount() const;
+    float getDuration() const;
+
+    /// Number of frames sampled at a fixed rate, including both ends.
+    int getFrameCount(float framesPerSecond) const;
+
+    /// Interpolates the state at a time.
+    CameraKeyframe sample(float time) const;
+
+private:
+    std::vector<CameraKeyframe> keyframes;
+};
+
+} // namespace T3
+
+#endif //T3_CAMERA_PATH_HPP
@@ -3,6 +3,7 @@
 
 #include <CL/cl.h>
 #include "Vector2.hpp" // For closeTo
+#include "VectorSIMD.hpp"
 
 namespace T3
 {
@@ -13,7 +14,15 @@ class Color
 {
 public:
     Color(float r=0.0f, float g=0.0f, float b=0.0f, float a=1.0f)
-        : r(r), g(g), b(b), a(a) {}
+    {
+        simdStore(&this->r, simdSet(r, g, b, a));
+    }
+
+    explicit Color(SimdFloat4 v)
+    {
+        simdStore(&this->r, v);
+    }
+
     ~Color() {}
 
     union
@@ -25,10 +34,15 @@ public:
         cl_float4 data;
     };
 
+    SimdFloat4 simd() const
+    {
+        return simdLoad(&r);
+    }
+
 public:
     Color applyIntensity(float intensity) const
     {
-        return Color(r*intensity, g*intensity, b*intensity, a);
+        return Color(simdMul(simd(), simdSet(intensity, intensity, intensity, 1.0f)));
     }
 
 public:
@@ -41,17 +55,39 @@ public:
 public:
     friend Color operator+(const Color &a, const Color &b)
     {
-        return Color(a.r + b.r, a.g + b.g, a.b + b.b, a.a + b.a);
+        return Color(simdAdd(a.simd(), b.simd()));
+    }
+
+    friend Color operator-(const Color &a, const Color &b)
+    {
+        return Color(simdSub(a.simd(), b.simd()));
+    }
+
+    friend Color operator*(const Color &a, const Color &b)
+    {
+        return Color(simdMul(a.simd(), b.simd()));
     }
 
     friend Color operator*(float s, const Color c)
     {
-        return Color(c.r*s, c.g*s, c.b*s, c.a*s);
+        return Color(simdMul(c.simd(), simdSplat(s)));
     }
 
     friend Color operator*(const Color c, const float s)
     {
-        return Color(c.r*s, c.g*s, c.b*s, c.a*s);
+        return Color(simdMul(c.simd(), simdSplat(s)));
+    }
+
+    Color &operator+=(const Color &c)
+    {
+        simdStore(&r, simdAdd(simd(), c.simd()));
+        return *this;
+    }
+
+    Color &operator*=(const Color &c)
+    {
+        simdStore(&r, simdMul(simd(), c.simd()));
+        return *this;
     }
 
 public:
@@ -118,7 +154,17 @@ inline float lerp(float t, float a, float b)
 
 inline Color lerpColor(float t, const Color &a, const Color b)
 {
-    return Color(lerp(t, a.r, b.r), lerp(t, a.g, b.g), lerp(t, a.b, b.b), lerp(t, a.a, b.a));
+    return (1.0f - t)*a + t*b;
+}
+
+inline Color fmin(const Color &a, const Color &b)
+{
+    return Color(simdMin(a.simd(), b.simd()));
+}
+
+inline Color fmax(const Color &a, const Color &b)
+{
+    return Color(simdMax(a.simd(), b.simd()));
 }
 
 }
@@ -5,9 +5,13 @@
 #define NULL 0
 #include "VectorCL.hpp"
 
+// Offsets into the scene buffers, which may be bigger than 4 GB.
+typedef ulong SceneOffset;
+
 #else
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include "Color.hpp"
 #include "Vector2.hpp"
 #include "Vector3.hpp"
@@ -23,10 +27,39 @@ using namespace T3;
 #define constant_vector3 Vector3
 #define constant_vector4 Vector4
 
+typedef uint64_t SceneOffset;
+
+// Host versions of the OpenCL built-ins used by the shared code.
 template<typename T>
 T mix(T a, T b, float alpha)
 {
-    return (1.0f - alpha)*a + alpha*b;
+    return a + (b - a)*alpha;
+}
+
+inline float clamp(float x, float minValue, float maxValue)
+{
+    return fmin(fmax(x, minValue), maxValue);
+}
+
+inline Vector3 clamp(const Vector3 &x, float minValue, float maxValue)
+{
+    return fmin(fmax(x, Vector3(minValue, minValue, minValue)), Vector3(maxValue, maxValue, maxValue));
+}
+
+inline Vector4 clamp(const Vector4 &x, float minValue, float maxValue)
+{
+    return fmin(fmax(x, Vector4(minValue, minValue, minValue, minValue)), Vector4(maxValue, maxValue, maxValue, maxValue));
+}
+
+inline float step(float edge, float x)
+{
+    return x < edge ? 0.0f : 1.0f;
+}
+
+inline float smoothstep(float edge0, float edge1, float x)
+{
+    float t = clamp((x - edge0)/(edge1 - edge0), 0.0f, 1.0f);
+    return t*t*(3.0f - 2.0f*t);
 }
 
 #define get_global_id(x) 0
@@ -43,12 +76,39 @@ static const __constant Vector4 vector_axis[] = {
     constant_vector4(0, 0, 1, 0),
 };
 
+/**
+ * Maximum number of chunks of the mesh data buffer. Every chunk is a kernel
+ * argument.
+ */
+#define MESH_DATA_CHUNK_COUNT 4
+
+/**
+ * Order in which the work items are mapped to the pixels.
+ */
+enum PixelOrder
+{
+    PixelOrder_Scanline = 0,
+    PixelOrder_MortonTiles,
+
+    PixelOrder_Count,
+};
+
+// Side of the tiles used by PixelOrder_MortonTiles.
+__constant const int PixelTileSize = 8;
+
+// Side of the screen tiles with their own list of bounded lights.
+__constant const int LightTileSize = 16;
+
+// One of each ReprojectionRefreshPeriod pixels is traced again every frame,
+// even when it can be reprojected from the last frame.
+__constant const int ReprojectionRefreshPeriod = 16;
+
 inline Vector3 vectorAxis(Vector4 v)
 {
 #ifdef CL_RAYTRACER
     return v.xyz;
 #else
-    abort();
+    return Vector3(v.x, v.y, v.z);
 #endif
 }
 
@@ -58,7 +118,10 @@ inline int bestVectorAxis(Vector3 v)
     int best = 0;
     float val = fabs(dot(v, vectorAxis(vector_axis[1])));
     if(val > bestVal)
+    {
         best = 1;
+        bestVal = val;
+    }
     val = fabs(dot(v, vectorAxis(vector_axis[2])));
     if(val > bestVal)
         best = 2;
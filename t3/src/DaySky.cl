@@ -0,0 +1,166 @@
+// Day sky generation. It is built as its own program, only for the scenes
+// with daylight.
+
+#include "Geometry.hpp"
+
+/// Constants taken from http://www.gamedev.net/topic/584256-atmospheric-scattering-and-dark-sky/
+
+__constant const int ScatteringSamples = 20;
+__constant const float ScatteringInvSamples = 1.0f/20.0f;
+
+__constant const float EarthRadius = 6360e3f;
+__constant const float AtmosphereRadius = 6420e3f;
+
+__constant const float RayleighScaleHeight = 7994.0f;
+__constant const float MieScaleHeight = 1200.0f;
+__constant const Vector4 RayleighConstants = constant_vector4(5.5e-6f, 13.0e-6f, 22.4e-6f, 0.0f);
+__constant const Vector4 MieConstants = constant_vector4(21e-6f, 21e-6f, 21e-6f, 0.0f);
+__constant const float ScatterG = 0.75f;
+
+float rayleighScatterPhase(float c)
+{
+    return (1 + c*c)*0.75f;
+}
+
+float mieScatterPhase(float c, float g)
+{
+    float gg = g*g;
+    float A = 1.5f*(1.0f  - gg)/(2.0f + gg);
+    float B = (1.0f + c*c)/pow(1.0f + gg - 2.0f*g*c, 1.5f);
+    return A*B;
+}
+
+/**
+ * Sky scattering computation.
+ * Code adapted from: http://www.scratchapixel.com/lessons/3d-advanced-lessons/simulating-the-colors-of-the-sky/atmospheric-scattering/
+ */
+Color inScattering(Vector3 camera, Vector3 b, Vector3 sunDirection, Color sunColor)
+{
+    // Phase functions.
+    Vector3 a = camera;
+    float cosTheta = dot(normalize(b - camera), sunDirection);
+    float phaseR = rayleighScatterPhase(cosTheta);
+    float phaseM = mieScatterPhase(cosTheta, ScatterG);
+
+    // Loop state.
+    Vector3 delta = (b - a)*ScatteringInvSamples;
+    float sampleLength = length(delta);
+    float opticalDepthR = 0.0;
+    float opticalDepthM = 0.0;
+    Color sumR = color_zero();
+    Color sumM = color_zero();
+
+    // Used for light direction.
+    SphereShape atmosSphere(vector3_zero(), AtmosphereRadius);
+   
+    // Integral evaluation
+    Vector3 samplePoint = a;
+    for(int i = 0; i < ScatteringSamples; ++i)
+    {
+        samplePoint += 0.5f*delta;
+
+        // Optical depth
+        float height = length(samplePoint) - EarthRadius;
+        float hr = exp(-height/RayleighScaleHeight)*sampleLength;
+        float hm = exp(-height/MieScaleHeight)*sampleLength;
+        opticalDepthR += hr;
+        opticalDepthM += hm;
+
+        // Light optical depth.
+        Ray ray = Ray(samplePoint, sunDirection.xyz);
+        Vector3 la = samplePoint;
+        Vector3 lb = ray.at(atmosSphere.intersects(ray));
+        Vector3 ldelta = (lb - la)*ScatteringInvSamples;
+        float opticalDepthLightR = 0.0f, opticalDepthLightM = 0.0f;
+        float lightSampleLength = length(ldelta);
+        int j = 0;
+        Vector3 lightSamplePoint = la;
+        for(j = 0; j < ScatteringSamples; ++j)
+        {
+            lightSamplePoint += 0.5f*ldelta;
+            float lightHeight = length(lightSamplePoint) - EarthRadius;
+            if(lightHeight < 0) break;
+            opticalDepthLightR += exp(-lightHeight/RayleighScaleHeight)*lightSampleLength;
+            opticalDepthLightM += exp(-lightHeight/MieScaleHeight)*lightSampleLength;
+        }
+
+        if(j == ScatteringSamples)
+        {
+            Color tau = RayleighConstants*(opticalDepthR + opticalDepthLightR) + MieConstants* 1.1 *(opticalDepthM + opticalDepthLightM);
+            Color att = make_color(exp(-tau.x), exp(-tau.y), exp(-tau.z), 0.0f);
+            sumR += hr*tau;
+            sumM += hm*att;
+        }
+    }
+
+    return 5.0f*sunColor*(sumR*phaseR*RayleighConstants + sumM*phaseM*MieConstants);
+}
+
+Vector3 sphericalCoordinates(float radius, float phi, float theta)
+{
+    // Compute the actual position.
+    return make_vector3(radius*sin(theta)*cos(phi), radius*cos(theta), radius*sin(theta)*sin(phi));
+}
+
+__kernel void createDaySky(int offset, int width, int height, __global float4 *image,
+                            float skyRadius, Color sunColor, Vector4 sunDirection)
+{
+    // Compute the buffer coordinates.
+    size_t xc = get_global_id(0);
+    size_t yc = get_global_id(1);
+
+    // Compute the angle.
+    float phi = 2.0f*M_PI_F*(xc+0.5f)/(float)width;
+    float theta = M_PI_F*(yc+0.5f)/(float)height;
+    Vector3 direction = sphericalCoordinates(1.0f, phi, theta);
+
+    // Compute a end position.
+    Vector3 start = EarthRadius*make_vector3(0, 1, 0);
+
+    // Correct the end position.
+    Ray ray(start, direction);
+    SphereShape sphere(vector3_zero(), AtmosphereRadius);
+    Vector3 end = ray.at(sphere.intersects(ray));
+
+    // Emit the result.
+    image[offset + yc*width + xc] = inScattering(start, end, sunDirection.xyz, sunColor);
+}
+
+
+float4 sampleSkyKeyframe(__global const float4 *keyframe, int width, int height, float u, float v)
+{
+    // Wrap around the azimuth, and clamp at the poles.
+    float x = u*width - 0.5f;
+    float y = clamp(v*height - 0.5f, 0.0f, height - 1.0f);
+    float fx = floor(x);
+    float fy = floor(y);
+    int x0 = ((int)fx % width + width) % width;
+    int x1 = (x0 + 1) % width;
+    int y0 = (int)fy;
+    int y1 = min(y0 + 1, height - 1);
+
+    float4 top = mix(keyframe[y0*width + x0], keyframe[y0*width + x1], x - fx);
+    float4 bottom = mix(keyframe[y1*width + x0], keyframe[y1*width + x1], x - fx);
+    return mix(top, bottom, y - fy);
+}
+
+/**
+ * Day sky from the keyframes of the two sun elevations around the current
+ * one. They were computed with the sun at a zero azimuth, so the sky is
+ * rotated by the sun azimuth, and with a white sun.
+ */
+__kernel void blendDaySky(int offset, int width, int height, __global float4 *image,
+                          __global const float4 *keyframes, int keyframeWidth, int keyframeHeight,
+                          int firstKeyframe, float keyframeBlend, float azimuth, Color sunColor)
+{
+    size_t xc = get_global_id(0);
+    size_t yc = get_global_id(1);
+
+    float u = (xc + 0.5f)/(float)width - azimuth*(0.5f/M_PI_F);
+    float v = (yc + 0.5f)/(float)height;
+    int keyframeSize = keyframeWidth*keyframeHeight;
+    __global const float4 *first = keyframes + firstKeyframe*keyframeSize;
+    float4 a = sampleSkyKeyframe(first, keyframeWidth, keyframeHeight, u, v);
+    float4 b = sampleSkyKeyframe(first + keyframeSize, keyframeWidth, keyframeHeight, u, v);
+    image[offset + yc*width + xc] = sunColor*mix(a, b, keyframeBlend);
+}
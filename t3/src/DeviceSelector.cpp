@@ -0,0 +1,273 @@
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "DeviceSelector.hpp"
+#include "Raytracer.hpp"
+
+namespace T3
+{
+
+DeviceSelector::DeviceSelector()
+    : platformIndex(-1), deviceType(CL_DEVICE_TYPE_ALL), forceBenchmark(false),
+      cacheFileName("devices.cache"), selected(-1)
+{
+}
+
+DeviceSelector::~DeviceSelector()
+{
+}
+
+void DeviceSelector::setPlatform(int index)
+{
+    platformIndex = index;
+}
+
+void DeviceSelector::setDeviceType(cl_device_type type)
+{
+    deviceType = type;
+}
+
+void DeviceSelector::setOverride(const std::string &nameOrIndex)
+{
+    overrideDevice = nameOrIndex;
+}
+
+void DeviceSelector::setForceBenchmark(bool value)
+{
+    forceBenchmark = value;
+}
+
+bool DeviceSelector::enumerate()
+{
+    char buffer[1024];
+    devices.clear();
+    selected = -1;
+
+    // Query the platforms.
+    cl_uint numplatforms = 0;
+    clGetPlatformIDs(0, NULL, &numplatforms);
+    std::vector<cl_platform_id> platforms(numplatforms);
+    if(numplatforms)
+        clGetPlatformIDs(numplatforms, &platforms[0], &numplatforms);
+
+    if(platformIndex >= 0 && (cl_uint)platformIndex >= numplatforms)
+    {
+        fprintf(stderr, "Invalid OpenCL platform %d\n", platformIndex);
+        return false;
+    }
+
+    for(cl_uint i = 0; i < numplatforms; ++i)
+    {
+        if(platformIndex >= 0 && i != (cl_uint)platformIndex)
+            continue;
+
+        // Query the devices of the platform.
+        cl_uint numdevices = 0;
+        if(clGetDeviceIDs(platforms[i], deviceType, 0, NULL, &numdevices) != CL_SUCCESS || !numdevices)
+            continue;
+        std::vector<cl_device_id> platformDevices(numdevices);
+        clGetDeviceIDs(platforms[i], deviceType, numdevices, &platformDevices[0], NULL);
+
+        clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, sizeof(buffer), buffer, NULL);
+        std::string platformName = buffer;
+        for(cl_uint j = 0; j < numdevices; ++j)
+        {
+            cl_bool available = CL_FALSE;
+            clGetDeviceInfo(platformDevices[j], CL_DEVICE_AVAILABLE, sizeof(available), &available, NULL);
+            if(!available)
+                continue;
+
+            ComputeDevice device;
+            device.platform = platforms[i];
+            device.device = platformDevices[j];
+            clGetDeviceInfo(platformDevices[j], CL_DEVICE_NAME, sizeof(buffer), buffer, NULL);
+            device.name = platformName + ": " + buffer;
+            clGetDeviceInfo(platformDevices[j], CL_DRIVER_VERSION, sizeof(buffer), buffer, NULL);
+            device.driver = buffer;
+            devices.push_back(device);
+        }
+    }
+
+    printf("OpenCL devices[%d]\n", (int)devices.size());
+    for(size_t i = 0; i < devices.size(); ++i)
+        printf("%d: %s, driver %s\n", (int)i, devices[i].name.c_str(), devices[i].driver.c_str());
+
+    if(devices.empty())
+    {
+        fprintf(stderr, "No OpenCL device found\n");
+        return false;
+    }
+
+    loadCache();
+    return true;
+}
+
+bool DeviceSelector::needsBenchmark() const
+{
+    if(devices.size() < 2 || !overrideDevice.empty())
+        return false;
+    return forceBenchmark || findCached() < 0;
+}
+
+bool DeviceSelector::select(Application *app)
+{
+    if(!overrideDevice.empty())
+    {
+        selected = findOverride();
+        if(selected < 0)
+        {
+            fprintf(stderr, "There's no OpenCL device %s\n", overrideDevice.c_str());
+            return false;
+        }
+    }
+    else if(devices.size() == 1)
+    {
+        selected = 0;
+    }
+    else if(!needsBenchmark())
+    {
+        selected = findCached();
+        printf("Using the device chosen by an earlier benchmark\n");
+    }
+    else
+    {
+        selected = benchmark(app);
+        if(selected < 0)
+        {
+            fprintf(stderr, "No OpenCL device could run the raytracer\n");
+            return false;
+        }
+
+        cachedChoices[makeHostKey()] = devices[selected].name;
+        saveCache();
+    }
+
+    printf("[Selected] %s\n", devices[selected].name.c_str());
+    return true;
+}
+
+const ComputeDevice &DeviceSelector::getSelected() const
+{
+    return devices[selected];
+}
+
+std::string DeviceSelector::makeHostKey() const
+{
+    // The candidates and their drivers identify the host configuration.
+    std::string key;
+    for(size_t i = 0; i < devices.size(); ++i)
+    {
+        if(i)
+            key += " | ";
+        key += devices[i].name + " " + devices[i].driver;
+    }
+    return key;
+}
+
+int DeviceSelector::findOverride() const
+{
+    // An index into the printed list.
+    if(overrideDevice.find_first_not_of("0123456789") == std::string::npos)
+    {
+        int index = atoi(overrideDevice.c_str());
+        return index < (int)devices.size() ? index : -1;
+    }
+
+    // Part of a name.
+    for(size_t i = 0; i < devices.size(); ++i)
+    {
+        if(devices[i].name.find(overrideDevice) != std::string::npos)
+            return i;
+    }
+    return -1;
+}
+
+int DeviceSelector::findCached() const
+{
+    std::map<std::string, std::string>::const_iterator it = cachedChoices.find(makeHostKey());
+    if(it == cachedChoices.end())
+        return -1;
+
+    for(size_t i = 0; i < devices.size(); ++i)
+    {
+        if(devices[i].name == it->second)
+            return i;
+    }
+    return -1;
+}
+
+int DeviceSelector::benchmark(Application *app)
+{
+    int best = -1;
+    double bestTime = 0.0;
+    for(size_t i = 0; i < devices.size(); ++i)
+    {
+        // A raytracer of its own, so nothing is left in this one.
+        Raytracer probe(app);
+        double frameTime = probe.benchmarkDevice(devices[i]);
+        if(frameTime < 0.0)
+        {
+            printf("Device %d %s: failed\n", (int)i, devices[i].name.c_str());
+            continue;
+        }
+
+        printf("Device %d %s: %.3f ms per frame\n", (int)i, devices[i].name.c_str(), frameTime);
+        if(best < 0 || frameTime < bestTime)
+        {
+            best = i;
+            bestTime = frameTime;
+        }
+    }
+
+    return best;
+}
+
+void DeviceSelector::loadCache()
+{
+    cachedChoices.clear();
+    std::ifstream in(cacheFileName.c_str());
+    std::string line;
+    while(std::getline(in, line))
+    {
+        if(line.empty() || line[0] == '#')
+            continue;
+
+        size_t separator = line.rfind('\t');
+        if(separator == std::string::npos || separator == 0)
+            continue;
+        cachedChoices[line.substr(0, separator)] = line.substr(separator + 1);
+    }
+}
+
+void DeviceSelector::saveCache()
+{
+    // Other processes, such as the render farm workers, may have stored
+    // their choices since the cache was read. Only the choice of this host
+    // configuration is replaced.
+    std::string key = makeHostKey();
+    std::string choice = cachedChoices[key];
+    loadCache();
+    cachedChoices[key] = choice;
+
+    // Write a file of this process, and move it into place, so the readers
+    // never see a partial file.
+    char suffix[32];
+    sprintf(suffix, ".%d.tmp", (int)getpid());
+    std::string tempFileName = cacheFileName + suffix;
+    {
+        std::ofstream out(tempFileName.c_str());
+        out << "# host configuration\tdevice\n";
+        std::map<std::string, std::string>::iterator it = cachedChoices.begin();
+        for(; it != cachedChoices.end(); ++it)
+            out << it->first << '\t' << it->second << '\n';
+        out.close();
+        if(out && rename(tempFileName.c_str(), cacheFileName.c_str()) == 0)
+            return;
+    }
+
+    fprintf(stderr, "Failed to write the device cache %s\n", cacheFileName.c_str());
+    unlink(tempFileName.c_str());
+}
+
+} // namespace T3
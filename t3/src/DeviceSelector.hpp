@@ -0,0 +1,83 @@
+#ifndef T3_DEVICE_SELECTOR_HPP
+#define T3_DEVICE_SELECTOR_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+
+namespace T3
+{
+
+class Application;
+
+/**
+ * OpenCL device that can run the raytracer.
+ */
+struct ComputeDevice
+{
+    cl_platform_id platform;
+    cl_device_id device;
+    std::string name;
+    std::string driver;
+};
+
+/**
+ * Chooses the OpenCL device. Without an override, the primary rays kernel
+ * is timed on every device, and the fastest one is stored in a cache file
+ * per host configuration.
+ */
+class DeviceSelector
+{
+public:
+    DeviceSelector();
+    ~DeviceSelector();
+
+    /// Only considers the devices of a platform. Negative for any.
+    void setPlatform(int index);
+
+    /// Only considers the devices of this type.
+    void setDeviceType(cl_device_type type);
+
+    /// Uses the device with this index in the printed list, or whose name
+    /// contains the string.
+    void setOverride(const std::string &nameOrIndex);
+
+    /// Times the devices again, even when the choice is cached.
+    void setForceBenchmark(bool value);
+
+    /// Lists the candidate devices.
+    bool enumerate();
+
+    /// Tells whether the choice needs the benchmark, which uses the scene.
+    bool needsBenchmark() const;
+
+    /// Chooses the device, timing the candidates when needed.
+    bool select(Application *app);
+
+    /// Gets the chosen device.
+    const ComputeDevice &getSelected() const;
+
+private:
+    std::string makeHostKey() const;
+    int findOverride() const;
+    int findCached() const;
+    int benchmark(Application *app);
+
+    void loadCache();
+    void saveCache();
+
+    int platformIndex;
+    cl_device_type deviceType;
+    std::string overrideDevice;
+    bool forceBenchmark;
+    std::string cacheFileName;
+
+    std::vector<ComputeDevice> devices;
+    std::map<std::string, std::string> cachedChoices;
+    int selected;
+};
+
+} // namespace T3
+
+#endif //T3_DEVICE_SELECTOR_HPP
@@ -1,5 +1,7 @@
+#include <ctype.h>
 #include "Display.hpp"
 #include "Application.hpp"
+#include "TraceProfiler.hpp"
 
 namespace T3
 {
@@ -7,15 +9,55 @@ namespace T3
 const float Speed = 10.0f;
 const float AngularSpeed = 2.0f;
 
+// Profile overlay font, 3x5 pixels per glyph scaled by FontScale.
+const int FontScale = 2;
+const int GlyphWidth = 3;
+const int GlyphHeight = 5;
+
+struct Glyph
+{
+    char character;
+    unsigned char rows[GlyphHeight];
+};
+
+static const Glyph FontGlyphs[] = {
+    {'0', {7,5,5,5,7}}, {'1', {2,6,2,2,7}}, {'2', {7,1,7,4,7}}, {'3', {7,1,7,1,7}},
+    {'4', {5,5,7,1,1}}, {'5', {7,4,7,1,7}}, {'6', {7,4,7,5,7}}, {'7', {7,1,1,1,1}},
+    {'8', {7,5,7,5,7}}, {'9', {7,5,7,1,7}},
+    {'A', {2,5,7,5,5}}, {'B', {6,5,6,5,6}}, {'C', {3,4,4,4,3}}, {'D', {6,5,5,5,6}},
+    {'E', {7,4,6,4,7}}, {'F', {7,4,6,4,4}}, {'G', {3,4,5,5,3}}, {'H', {5,5,7,5,5}},
+    {'I', {7,2,2,2,7}}, {'J', {1,1,1,5,2}}, {'K', {5,5,6,5,5}}, {'L', {4,4,4,4,7}},
+    {'M', {5,7,7,5,5}}, {'N', {6,5,5,5,5}}, {'O', {2,5,5,5,2}}, {'P', {6,5,6,4,4}},
+    {'Q', {2,5,5,6,3}}, {'R', {6,5,6,5,5}}, {'S', {3,4,2,1,6}}, {'T', {7,2,2,2,2}},
+    {'U', {5,5,5,5,7}}, {'V', {5,5,5,5,2}}, {'W', {5,5,7,7,5}}, {'X', {5,5,2,5,5}},
+    {'Y', {5,5,2,2,2}}, {'Z', {7,1,2,4,7}},
+    {'.', {0,0,0,0,2}}, {':', {0,2,0,2,0}}, {'-', {0,0,7,0,0}}, {'/', {1,1,2,4,4}},
+    {'%', {5,1,2,4,5}},
+};
+
+static const Glyph *findGlyph(char c)
+{
+    c = toupper(c);
+    for(size_t i = 0; i < sizeof(FontGlyphs)/sizeof(FontGlyphs[0]); ++i)
+    {
+        if(FontGlyphs[i].character == c)
+            return &FontGlyphs[i];
+    }
+
+    return NULL;
+}
+
 Display::Display(Application *app)
     : app(app)
 {
     quit = false;
+    showProfile = false;
     width = 640;
     height = 480;
     bpp = 32;
     frameCount = 0;
     lastDisplayedFrame = -1;
+    currentProfileFrame = -1;
     currentImage = NULL;
 }
 
@@ -90,6 +132,9 @@ void Display::keyDown(SDLKey key)
     case SDLK_ESCAPE:
         quit = true;
         break;
+    case SDLK_F1:
+        showProfile = !showProfile;
+        break;
     case SDLK_LEFT:
         angularVelocity.y = 1;
         break;
@@ -175,6 +220,7 @@ void Display::keyUp(SDLKey key)
 
 void Display::receiveEvents()
 {
+    T3_TRACE_ZONE("Display::receiveEvents");
     SDL_Event event;
     while(SDL_PollEvent(&event))
     {
@@ -196,21 +242,38 @@ void Display::receiveEvents()
 
 void Display::displayFrame()
 {
+    T3_TRACE_ZONE("Display::displayFrame");
     // Check the presence of a current image.
     SDL_LockMutex(mutex);
     int frameCount = this->frameCount;
-    if(!currentImage || lastDisplayedFrame == frameCount)
+    int profileFrame = currentProfileFrame;
+    if(!currentImage)
     {
         SDL_UnlockMutex(mutex);
+        drawStartupFrame();
         return;
     }
+    if(lastDisplayedFrame == frameCount)
+    {
+        SDL_UnlockMutex(mutex);
+        return;
+    }
+    bool firstFrame = lastDisplayedFrame < 0;
 
     // Lock the main surface.
     if(SDL_MUSTLOCK(mainSurface))
         SDL_LockSurface(mainSurface);
 
     // Convert the current image.
-    convertCurrentImage();
+    FrameProfiler *profiler = app->getProfiler();
+    {
+        HostStageTimer timer(profiler, ProfileStage_ConvertImage, profileFrame);
+        T3_TRACE_ZONE("Display::convertCurrentImage");
+        convertCurrentImage();
+    }
+
+    if(showProfile)
+        drawProfileOverlay();
 
     // Set the new last displayed frame.
     lastDisplayedFrame = frameCount;
@@ -222,6 +285,37 @@ void Display::displayFrame()
     SDL_UnlockMutex(mutex);
 
     // Display the changes.
+    T3_TRACE_ZONE("SDL_Flip");
+    HostStageTimer timer(profiler, ProfileStage_Flip, profileFrame);
+    SDL_Flip(mainSurface);
+
+    if(firstFrame)
+    {
+        printf("Time to first frame: %.1f ms, %.1f ms building the program\n",
+            FrameProfiler::now() - app->getStartTime(), app->getRaytracer()->getProgramBuildTime());
+    }
+}
+
+void Display::drawStartupFrame()
+{
+    T3_TRACE_ZONE("Display::drawStartupFrame");
+    char text[128];
+    double elapsed = (FrameProfiler::now() - app->getStartTime())*0.001;
+    sprintf(text, "%s  %.1f s", app->getRaytracer()->getStartupStatus().c_str(), elapsed);
+    if(startupText == text)
+        return;
+    startupText = text;
+
+    SDL_FillRect(mainSurface, NULL, 0);
+    if(SDL_MUSTLOCK(mainSurface))
+        SDL_LockSurface(mainSurface);
+
+    SDL_PixelFormat *format = mainSurface->format;
+    int white = (255<<format->Rshift) | (255<<format->Gshift) | (255<<format->Bshift);
+    drawText(4, height - (GlyphHeight + 4)*FontScale, text, white);
+
+    if(SDL_MUSTLOCK(mainSurface))
+        SDL_UnlockSurface(mainSurface);
     SDL_Flip(mainSurface);
 }
 
@@ -256,6 +350,53 @@ void Display::convertCurrentImage()
     }
 }
 
+void Display::drawProfileOverlay()
+{
+    std::vector<std::string> lines = app->getProfiler()->getSummaryLines();
+    SDL_PixelFormat *format = mainSurface->format;
+    int white = (255<<format->Rshift) | (255<<format->Gshift) | (255<<format->Bshift);
+
+    int lineHeight = (GlyphHeight + 2)*FontScale;
+    for(size_t i = 0; i < lines.size(); ++i)
+    {
+        int y = 4 + i*lineHeight;
+
+        // Draw with a shadow, to be readable over the sky.
+        drawText(4 + FontScale, y + FontScale, lines[i].c_str(), 0);
+        drawText(4, y, lines[i].c_str(), white);
+    }
+}
+
+void Display::drawText(int x, int y, const char *text, int color)
+{
+    int *dst = static_cast<int*> (mainSurface->pixels);
+    int pitch = mainSurface->pitch/4;
+    for(; *text; ++text, x += (GlyphWidth + 1)*FontScale)
+    {
+        const Glyph *glyph = findGlyph(*text);
+        if(!glyph)
+            continue;
+
+        for(int gy = 0; gy < GlyphHeight*FontScale; ++gy)
+        {
+            int py = y + gy;
+            if(py < 0 || py >= height)
+                continue;
+
+            int row = glyph->rows[gy/FontScale];
+            for(int gx = 0; gx < GlyphWidth*FontScale; ++gx)
+            {
+                int px = x + gx;
+                if(px < 0 || px >= width)
+                    continue;
+
+                if(row & (1 << (GlyphWidth - 1 - gx/FontScale)))
+                    dst[py*pitch + px] = color;
+            }
+        }
+    }
+}
+
 void Display::run()
 {
     Uint32 newTime = SDL_GetTicks();
@@ -263,6 +404,7 @@ void Display::run()
     int lastFrameCount = 0;
     Uint32 fpsTime = 0;
     oldTime = newTime;
+    T3_TRACE_THREAD_NAME("display");
 
     while(!quit)
     {
@@ -284,10 +426,17 @@ void Display::run()
         }
 
         // Process the events and display.
-        app->update(deltaTime*0.001f);
+        {
+            T3_TRACE_ZONE("Application::update");
+            app->update(deltaTime*0.001f);
+        }
         receiveEvents();
         displayFrame();
 
+        // Leave when the raytracer could not start.
+        if(app->getRaytracer()->hasStartupFailed())
+            quit = true;
+
         // Don't eat the CPU.
         SDL_Delay(5);
     }
@@ -296,11 +445,13 @@ void Display::run()
     app->quit();
 }
 
-void Display::setImage(Image2D *image)
+void Display::setImage(Image2D *image, int profileFrame)
 {
+    T3_TRACE_ZONE("Display::setImage");
     SDL_LockMutex(mutex);
     delete currentImage;
     currentImage = image;
+    currentProfileFrame = profileFrame;
     frameCount++;
     SDL_UnlockMutex(mutex);
 }
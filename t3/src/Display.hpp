@@ -2,6 +2,7 @@
 #define T3_DISPLAY_HPP
 
 #include <SDL/SDL.h>
+#include <string>
 #include "Image.hpp"
 
 namespace T3
@@ -23,7 +24,10 @@ public:
 
     bool initialize();
     void run();
-    void setImage(Image2D *image);
+
+    /// Shows a finished frame. The display stages are profiled as part of
+    /// the profiler frame.
+    void setImage(Image2D *image, int profileFrame);
 
 private:
     void keyDown(SDLKey key);
@@ -32,6 +36,9 @@ private:
     void receiveEvents();
     void displayFrame();
     void convertCurrentImage();
+    void drawProfileOverlay();
+    void drawStartupFrame();
+    void drawText(int x, int y, const char *text, int color);
 
     // The application.
     Application *app;
@@ -44,12 +51,17 @@ private:
 
     // Application flags.
     bool quit;
+    bool showProfile;
 
     // Image.
     SDL_mutex *mutex;
     Image2D *currentImage;
     int frameCount;
     int lastDisplayedFrame;
+    int currentProfileFrame;
+
+    // Text of the progress frame shown until the first image.
+    std::string startupText;
 };
 
 
@@ -0,0 +1,272 @@
+#include <time.h>
+#include <algorithm>
+#include "FrameProfiler.hpp"
+
+namespace T3
+{
+
+// Number of frames in the rolling statistics.
+const size_t TimingWindowSize = 128;
+
+// Finished frames kept for the display stages. The older ones were
+// skipped by the display.
+const size_t MaxFinishedFrames = 4;
+
+static const char *StageNames[ProfileStage_Count] = {
+    "frame",
+    "upload scene",
+    "create sky",
+    "primary rays",
+    "adaptive samples",
+    "readback",
+    "convert image",
+    "flip",
+};
+
+//-----------------------------------------------------------------------------
+// Timing window
+//
+
+TimingWindow::TimingWindow()
+    : next(0)
+{
+}
+
+TimingWindow::~TimingWindow()
+{
+}
+
+void TimingWindow::add(double time)
+{
+    if(samples.size() < TimingWindowSize)
+    {
+        samples.push_back(time);
+        return;
+    }
+
+    samples[next] = time;
+    next = (next + 1) % TimingWindowSize;
+}
+
+void TimingWindow::clear()
+{
+    samples.clear();
+    next = 0;
+}
+
+bool TimingWindow::empty() const
+{
+    return samples.empty();
+}
+
+void TimingWindow::computeStatistics(double *min, double *average, double *p99) const
+{
+    std::vector<double> sorted = samples;
+    std::sort(sorted.begin(), sorted.end());
+
+    double sum = 0.0;
+    for(size_t i = 0; i < sorted.size(); ++i)
+        sum += sorted[i];
+
+    *min = sorted.front();
+    *average = sum / sorted.size();
+    *p99 = sorted[(sorted.size() - 1)*99/100];
+}
+
+//-----------------------------------------------------------------------------
+// Frame profiler
+//
+
+FrameProfiler::FrameTimes::FrameTimes()
+    : index(0)
+{
+    for(int i = 0; i < ProfileStage_Count; ++i)
+    {
+        hostTimes[i] = 0.0;
+        deviceTimes[i] = 0.0;
+        hasDeviceTime[i] = false;
+    }
+}
+
+FrameProfiler::FrameProfiler()
+    : csvFile(NULL)
+{
+}
+
+FrameProfiler::~FrameProfiler()
+{
+    if(csvFile)
+    {
+        writeFrames(current.index);
+        fclose(csvFile);
+    }
+}
+
+bool FrameProfiler::openCSV(const std::string &fileName)
+{
+    Lock l(mutex);
+    csvFile = fopen(fileName.c_str(), "w");
+    if(!csvFile)
+    {
+        fprintf(stderr, "Failed to open the profile file %s\n", fileName.c_str());
+        return false;
+    }
+
+    // Write the header.
+    fprintf(csvFile, "frame");
+    for(int i = 0; i < ProfileStage_Count; ++i)
+        fprintf(csvFile, ",%s host ms,%s device ms", StageNames[i], StageNames[i]);
+    fprintf(csvFile, "\n");
+    return true;
+}
+
+void FrameProfiler::addHostTime(ProfileStage stage, double time)
+{
+    Lock l(mutex);
+    current.hostTimes[stage] += time;
+}
+
+void FrameProfiler::addDeviceTime(ProfileStage stage, double time)
+{
+    Lock l(mutex);
+    current.deviceTimes[stage] += time;
+    current.hasDeviceTime[stage] = true;
+}
+
+void FrameProfiler::addDisplayTime(int frame, ProfileStage stage, double time)
+{
+    Lock l(mutex);
+    hostTimes[stage].add(time);
+    for(size_t i = 0; i < finishedFrames.size(); ++i)
+    {
+        if(finishedFrames[i].index == frame)
+            finishedFrames[i].hostTimes[stage] += time;
+    }
+
+    // The flip is the last display stage.
+    if(stage == ProfileStage_Flip)
+        writeFrames(frame);
+}
+
+int FrameProfiler::endFrame()
+{
+    Lock l(mutex);
+
+    // Add the frame into the windows. The display stages are added when
+    // the frame is displayed.
+    for(int i = 0; i < ProfileStage_Count; ++i)
+    {
+        if(i == ProfileStage_ConvertImage || i == ProfileStage_Flip)
+            continue;
+        hostTimes[i].add(current.hostTimes[i]);
+        if(current.hasDeviceTime[i])
+            deviceTimes[i].add(current.deviceTimes[i]);
+    }
+
+    // Keep it for the display, and start the next frame.
+    int frame = current.index;
+    finishedFrames.push_back(current);
+    if(finishedFrames.size() > MaxFinishedFrames)
+        writeFrames(finishedFrames.front().index);
+
+    current = FrameTimes();
+    current.index = frame + 1;
+    return frame;
+}
+
+void FrameProfiler::writeFrames(int lastFrame)
+{
+    // Write the CSV rows up to the frame, in order.
+    while(!finishedFrames.empty() && finishedFrames.front().index <= lastFrame)
+    {
+        const FrameTimes &frame = finishedFrames.front();
+        if(csvFile)
+        {
+            fprintf(csvFile, "%d", frame.index);
+            for(int i = 0; i < ProfileStage_Count; ++i)
+            {
+                fprintf(csvFile, ",%.4f,", frame.hostTimes[i]);
+                if(frame.hasDeviceTime[i])
+                    fprintf(csvFile, "%.4f", frame.deviceTimes[i]);
+            }
+            fprintf(csvFile, "\n");
+        }
+        finishedFrames.pop_front();
+    }
+}
+
+std::vector<std::string> FrameProfiler::getSummaryLines() const
+{
+    Lock l(mutex);
+    std::vector<std::string> lines;
+    lines.push_back("stage            host min/avg/p99 ms   device min/avg/p99 ms");
+    for(int i = 0; i < ProfileStage_Count; ++i)
+    {
+        char line[256];
+        int length = sprintf(line, "%-16s", StageNames[i]);
+
+        double min, average, p99;
+        if(hostTimes[i].empty())
+        {
+            length += sprintf(line + length, " %-21s", "-");
+        }
+        else
+        {
+            hostTimes[i].computeStatistics(&min, &average, &p99);
+            length += sprintf(line + length, " %6.2f/%6.2f/%6.2f ", min, average, p99);
+        }
+
+        if(deviceTimes[i].empty())
+        {
+            sprintf(line + length, " -");
+        }
+        else
+        {
+            deviceTimes[i].computeStatistics(&min, &average, &p99);
+            sprintf(line + length, " %6.2f/%6.2f/%6.2f", min, average, p99);
+        }
+
+        lines.push_back(line);
+    }
+
+    return lines;
+}
+
+void FrameProfiler::getAverageTimes(double *hostAverages, double *deviceAverages) const
+{
+    Lock l(mutex);
+    for(int i = 0; i < ProfileStage_Count; ++i)
+    {
+        double min, p99;
+        hostAverages[i] = 0.0;
+        deviceAverages[i] = -1.0;
+        if(!hostTimes[i].empty())
+            hostTimes[i].computeStatistics(&min, &hostAverages[i], &p99);
+        if(!deviceTimes[i].empty())
+            deviceTimes[i].computeStatistics(&min, &deviceAverages[i], &p99);
+    }
+}
+
+void FrameProfiler::reset()
+{
+    Lock l(mutex);
+    for(int i = 0; i < ProfileStage_Count; ++i)
+    {
+        hostTimes[i].clear();
+        deviceTimes[i].clear();
+    }
+}
+
+double FrameProfiler::now()
+{
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec*1000.0 + time.tv_nsec*1e-6;
+}
+
+const char *FrameProfiler::getStageName(ProfileStage stage)
+{
+    return StageNames[stage];
+}
+
+} // namespace T3
@@ -0,0 +1,147 @@
+#ifndef T3_FRAME_PROFILER_HPP
+#define T3_FRAME_PROFILER_HPP
+
+#include <stdio.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "Threading.hpp"
+
+namespace T3
+{
+
+/**
+ * Profiled frame stages.
+ */
+enum ProfileStage
+{
+    ProfileStage_Frame = 0,
+    ProfileStage_UploadScene,
+    ProfileStage_CreateSky,
+    ProfileStage_PrimaryRays,
+    ProfileStage_AdaptiveSamples,
+    ProfileStage_Readback,
+    ProfileStage_ConvertImage,
+    ProfileStage_Flip,
+
+    ProfileStage_Count,
+};
+
+/**
+ * Rolling window of stage timings.
+ */
+class TimingWindow
+{
+public:
+    TimingWindow();
+    ~TimingWindow();
+
+    void add(double time);
+    void clear();
+    bool empty() const;
+
+    void computeStatistics(double *min, double *average, double *p99) const;
+
+private:
+    std::vector<double> samples;
+    size_t next;
+};
+
+/**
+ * Collects the host and device time spent in each stage of the frames.
+ * The statistics are computed over the last frames, and each frame can
+ * optionally be written into a CSV file.
+ *
+ * The display stages run on the display thread after the frame is
+ * finished, while the raytracer already works on the next ones. They are
+ * added into the frame that was displayed, whose CSV row is written once
+ * it is flipped, or once it is too old to be displayed.
+ */
+class FrameProfiler
+{
+public:
+    FrameProfiler();
+    ~FrameProfiler();
+
+    /// Starts writing each frame into a CSV file.
+    bool openCSV(const std::string &fileName);
+
+    /// Adds host time, in milliseconds.
+    void addHostTime(ProfileStage stage, double time);
+
+    /// Adds device time, in milliseconds.
+    void addDeviceTime(ProfileStage stage, double time);
+
+    /// Adds the host time of a display stage of a finished frame.
+    void addDisplayTime(int frame, ProfileStage stage, double time);
+
+    /// Finishes the current frame, and returns its index.
+    int endFrame();
+
+    /// Formats the statistics as text lines.
+    std::vector<std::string> getSummaryLines() const;
+
+    /// Gets the average host and device time of each stage, in milliseconds.
+    /// The stages without device time get a negative value.
+    void getAverageTimes(double *hostAverages, double *deviceAverages) const;
+
+    /// Discards the statistics of the previous frames.
+    void reset();
+
+    /// Current host time in milliseconds.
+    static double now();
+
+    /// Gets the name of a stage.
+    static const char *getStageName(ProfileStage stage);
+
+private:
+    struct FrameTimes
+    {
+        FrameTimes();
+
+        int index;
+        double hostTimes[ProfileStage_Count];
+        double deviceTimes[ProfileStage_Count];
+        bool hasDeviceTime[ProfileStage_Count];
+    };
+
+    void writeFrames(int lastFrame);
+
+    Mutex mutex;
+    TimingWindow hostTimes[ProfileStage_Count];
+    TimingWindow deviceTimes[ProfileStage_Count];
+
+    // Current frame, and the finished frames waiting for the display.
+    FrameTimes current;
+    std::deque<FrameTimes> finishedFrames;
+
+    FILE *csvFile;
+};
+
+/**
+ * Adds the host time of a scope into a stage.
+ */
+class HostStageTimer
+{
+public:
+    /// Without a frame, the time goes into the current one.
+    HostStageTimer(FrameProfiler *profiler, ProfileStage stage, int frame = -1)
+        : profiler(profiler), stage(stage), frame(frame), startTime(FrameProfiler::now()) {}
+    ~HostStageTimer()
+    {
+        if(frame < 0)
+            profiler->addHostTime(stage, FrameProfiler::now() - startTime);
+        else
+            profiler->addDisplayTime(frame, stage, FrameProfiler::now() - startTime);
+    }
+
+private:
+    FrameProfiler *profiler;
+    ProfileStage stage;
+    int frame;
+    double startTime;
+};
+
+} // namespace T3
+
+#endif //T3_FRAME_PROFILER_HPP
@@ -186,6 +186,120 @@ public:
 
 };
 
+/**
+ * Sphere intersection.
+ */
+inline float intersectSphere(Vector3 center, float radius, const Ray &ray)
+{
+    Vector3 v = ray.start - center;
+    float b = -dot(v, ray.direction );
+    float det = (b*b) - dot(v, v) + radius*radius;
+
+    if (det > 0)
+    {
+        det = sqrt( det );
+        float i1 = b - det;
+        float i2 = b + det;
+        if (i2 > 0)
+            return (i1 < 0) ? i2 : i1;
+    }
+
+    return -1.0f;
+}
+
+/**
+ * Sphere intersection of a ray from the camera. The terms that only depend
+ * on the ray start are precomputed: the start relative to the center in
+ * xyz, and dot(v, v) - radius^2 in w.
+ */
+inline float intersectSphereFromCamera(Vector4 constants, Vector3 direction)
+{
+    float b = -dot(vectorAxis(constants), direction);
+    float det = (b*b) - constants.w;
+
+    if (det > 0)
+    {
+        det = sqrt( det );
+        float i1 = b - det;
+        float i2 = b + det;
+        if (i2 > 0)
+            return (i1 < 0) ? i2 : i1;
+    }
+
+    return -1.0f;
+}
+
+/**
+ * Plane intersection.
+ */
+inline float intersectPlane(Vector3 normal, float distance, const Ray &ray)
+{
+    float d = dot(normal, ray.direction);
+    if(d != 0.0)
+        return -(dot(normal, ray.start) + distance) / d;
+    return -1.0f;
+}
+
+/**
+ * Plane intersection of a ray from the camera, with the signed distance of
+ * the start, dot(normal, start) + distance, precomputed.
+ */
+inline float intersectPlaneFromCamera(Vector3 normal, float startDistance, Vector3 direction)
+{
+    float d = dot(normal, direction);
+    if(d != 0.0)
+        return -startDistance / d;
+    return -1.0f;
+}
+
+/**
+ * Terrain intersection.
+ */
+inline float intersectTerrain(Vector3 boxMin, Vector3 boxMax, const Ray &ray)
+{
+    return -1.0f;
+}
+
+/**
+ * Box intersection, with the slabs method. Tells if the ray enters the box
+ * before maxAmount.
+ */
+inline bool intersectBox(Vector3 boxMin, Vector3 boxMax, Vector3 start, Vector3 invDirection, float maxAmount)
+{
+    Vector3 t0 = (boxMin - start)*invDirection;
+    Vector3 t1 = (boxMax - start)*invDirection;
+    float tmin = fmax(fmax(fmin(t0.x, t1.x), fmin(t0.y, t1.y)), fmin(t0.z, t1.z));
+    float tmax = fmin(fmin(fmax(t0.x, t1.x), fmax(t0.y, t1.y)), fmax(t0.z, t1.z));
+    return tmax >= fmax(tmin, 0.0f) && tmin < maxAmount;
+}
+
+/**
+ * Triangle intersection, with the Moller-Trumbore algorithm.
+ */
+inline float intersectTriangle(Vector3 v0, Vector3 v1, Vector3 v2, const Ray &ray)
+{
+    Vector3 e1 = v1 - v0;
+    Vector3 e2 = v2 - v0;
+    Vector3 p = cross(ray.direction, e2);
+    float det = dot(e1, p);
+    if(fabs(det) < 1e-8f)
+        return -1.0f;
+
+    float invDet = 1.0f/det;
+    Vector3 s = ray.start - v0;
+    float u = dot(s, p)*invDet;
+    if(u < 0.0f || u > 1.0f)
+        return -1.0f;
+
+    Vector3 q = cross(s, e1);
+    float v = dot(ray.direction, q)*invDet;
+    if(v < 0.0f || u + v > 1.0f)
+        return -1.0f;
+
+    float t = dot(e2, q)*invDet;
+    return (t > 0.0f) ? t : -1.0f;
+}
+
 /**
  * Shape base class.
  */
@@ -197,16 +311,11 @@ public:
         ShapeType_Plane = 0,
         ShapeType_Sphere,
         ShapeType_Terrain,
+        ShapeType_Mesh,
     };
 
     ~Shape() {}
 
-    static size_t size(const __global Shape *shape);
-    static float intersects(const __global Shape *shape, const Ray &ray);
-    static Vector3 normalAt(const __global Shape *shape, Vector3 position);
-    static Vector3 lightDir(const __global Shape *shape, Vector3 position);
-    static float computeSideFactor(const __global Shape *shape, Vector3 position);
-
     int materialId;
 
     Type getType() const
@@ -238,10 +347,7 @@ public:
 
     float intersects(const Ray &ray) const
     {
-        float d = dot(normal, ray.direction);
-        if(d != 0.0)
-            return -(dot(normal, ray.start) + distance) / d;
-        return -1.0f;
+        return intersectPlane(normal, distance, ray);
     }
 
     Vector3 normalAt(Vector3 pos) const
@@ -278,20 +384,7 @@ public:
 
     float intersects(const Ray &ray) const
     {
-	    Vector3 v = ray.start - position;
-	    float b = -dot(v, ray.direction );
-	    float det = (b*b) - dot(v, v) + radius*radius;
-
-	    if (det > 0)
-	    {
-		    det = sqrt( det );
-		    float i1 = b - det;
-		    float i2 = b + det;
-		    if (i2 > 0)
-                return (i1 < 0) ? i2 : i1;
-	    }
-
-        return -1.0f;
+        return intersectSphere(position, radius, ray);
     }
 
     Vector3 normalAt(Vector3 pos) const
@@ -327,7 +420,7 @@ public:
 
     float intersects(const Ray &ray) const
     {
-        return -1.0f;
+        return intersectTerrain(boundingBox.min, boundingBox.max, ray);
     }
 
     Vector3 normalAt(Vector3 pos) const
@@ -349,97 +442,6 @@ public:
     AABox boundingBox;
 };
 
-/**
- * Reports the size of a shape.
- */
-inline size_t Shape::size(const __global Shape *shape)
-{
-    switch(shape->type)
-    {
-    case ShapeType_Plane:
-        return sizeof(PlaneShape);
-    case ShapeType_Sphere:
-        return sizeof(SphereShape);
-    case ShapeType_Terrain:
-        return sizeof(TerrainShape);
-    default:
-        return 0;
-    }
-
-}
-
-/**
- * Dispatch shape intersects.
- */
-inline float Shape::intersects(const __global Shape *shape, const Ray &ray)
-{
-    switch(shape->type)
-    {
-    case ShapeType_Plane:
-        return ((const __global PlaneShape*) shape)->intersects(ray);
-    case ShapeType_Sphere:
-        return ((const __global SphereShape*) shape)->intersects(ray);
-    case ShapeType_Terrain:
-        return ((const __global TerrainShape*) shape)->intersects(ray);
-    default:
-        return -1.0;
-    }
-}
-
-/**
- * Dispatch normal computation.
- */
-inline Vector3 Shape::normalAt(const __global Shape *shape, Vector3 position)
-{
-    switch(shape->type)
-    {
-    case ShapeType_Plane:
-        return ((const __global PlaneShape*) shape)->normalAt(position);
-    case ShapeType_Sphere:
-        return ((const __global SphereShape*) shape)->normalAt(position);
-    case ShapeType_Terrain:
-        return ((const __global TerrainShape*) shape)->normalAt(position);
-    default:
-        return make_vector3(0.0, 1.0, 0.0);
-    }
-}
-
-/**
- * Dispatch light direction computation.
- */
-inline Vector3 Shape::lightDir(const __global Shape *shape, Vector3 position)
-{
-    switch(shape->type)
-    {
-    case ShapeType_Plane:
-        return ((const __global PlaneShape*) shape)->lightDir(position);
-    case ShapeType_Sphere:
-        return ((const __global SphereShape*) shape)->lightDir(position);
-    case ShapeType_Terrain:
-        return ((const __global TerrainShape*) shape)->lightDir(position);
-    default:
-        return make_vector3(0.0f, 1.0f, 0.0f);
-    }
-}
-
-/**
- *
- */
-inline float Shape::computeSideFactor(const __global Shape *shape, Vector3 position)
-{
-    switch(shape->type)
-    {
-    case ShapeType_Plane:
-        return ((const __global PlaneShape*) shape)->computeSideFactor(position);
-    case ShapeType_Sphere:
-        return ((const __global SphereShape*) shape)->computeSideFactor(position);
-    case ShapeType_Terrain:
-        return ((const __global TerrainShape*) shape)->computeSideFactor(position);
-    default:
-        return 1.0;
-    }
-}
-
 /**
  * Texture
  */
@@ -515,26 +517,241 @@ public:
     float reflection;
     float refraction;
     float refractionIndex;
-    Vector4 padding; // To ensure alignment.
+};
+
+/**
+ * Procedural texture, as stored in the scene buffer. Flat color textures are
+ * folded into the materials, so only the noise textures are kept here.
+ */
+class PackedTexture: public NoiseElement
+{
+public:
+    PackedTexture() {}
+    ~PackedTexture() {}
+
+    Color computeColor(Vector3 position) const
+    {
+        return mix(startColor, color, computeNoiseFunction(position));
+    }
+
+    Color startColor;
+    Color color;
+};
+
+/**
+ * Material, as stored in the material buffer. The colors already include
+ * the flat texture colors. A texture id is only used for procedural textures,
+ * and it is -1 otherwise.
+ */
+class PackedMaterial
+{
+public:
+    PackedMaterial() {}
+    ~PackedMaterial() {}
+
+    Color emission;
+    Color diffuse;
+    Color specular;
+
+    float shininess;
+    float reflection;
+    float refraction;
+    float refractionIndex;
+
+    short emissionTexture;
+    short diffuseTexture;
+    short specularTexture;
+    short normalTexture;
+    int light;
+    int padding; // To ensure alignment.
+};
+
+// Triangle count bits of the BVH leaves.
+#define BVH_LEAF_COUNT_BITS 4
+
+// Maximum depth of the BVH traversal.
+#define BVH_STACK_SIZE 64
+
+/**
+ * Mesh BVH node, 16 bytes. The bounds are quantized to 16 bits, relative to
+ * the mesh bounds, and rounded outwards. The nodes are stored in depth
+ * first order, so the first child of an inner node is the next node.
+ * For an inner node, data is the index of the second child. For a leaf,
+ * data is ~(firstTriangle << BVH_LEAF_COUNT_BITS | triangleCount).
+ */
+class QuantizedBVHNode
+{
+public:
+    QuantizedBVHNode()
+        : boundsMin(), boundsMax(), data(0) {}
+    ~QuantizedBVHNode() {}
+
+    bool isLeaf() const
+    {
+        return data < 0;
+    }
+
+    int getSecondChild() const
+    {
+        return data;
+    }
+
+    int getFirstTriangle() const
+    {
+        return (~data) >> BVH_LEAF_COUNT_BITS;
+    }
+
+    int getTriangleCount() const
+    {
+        return (~data) & ((1 << BVH_LEAF_COUNT_BITS) - 1);
+    }
+
+    unsigned short boundsMin[3];
+    unsigned short boundsMax[3];
+    int data;
+};
+
+/**
+ * Mesh, as stored in the scene buffer. The node and triangle indices point
+ * into the mesh data buffer, whose vertex indices are already global.
+ */
+class MeshInstance
+{
+public:
+    MeshInstance() {}
+    ~MeshInstance() {}
+
+    Vector3 boundsMin;
+    Vector3 boundsMax;
+    Vector3 quantizationScale;
+    int firstNode;
+    int firstTriangle;
+    int padding[2]; // To ensure alignment.
+};
+
+/**
+ * The material buffer is placed in constant memory when it fits.
+ */
+#ifdef RAYTRACER_CONSTANT_MATERIALS
+#define __material __constant
+#else
+#define __material __global
+#endif
+
+/**
+ * Mesh data buffer, split into chunks of 2^shift bytes so that each one fits
+ * in a device allocation. The chunk size is a power of two, at least 16
+ * bytes, so the BVH nodes never cross a chunk boundary. The vertices and the
+ * indices are read a scalar at a time.
+ */
+struct MeshDataChunks
+{
+    const __global unsigned char *chunks[MESH_DATA_CHUNK_COUNT];
+    int shift;
+
+    const __global unsigned char *address(SceneOffset offset) const
+    {
+        return chunks[offset >> shift] + (offset & ((((SceneOffset)1) << shift) - 1));
+    }
+};
+
+inline MeshDataChunks makeMeshDataChunks(const __global unsigned char *chunk0,
+                                         const __global unsigned char *chunk1,
+                                         const __global unsigned char *chunk2,
+                                         const __global unsigned char *chunk3,
+                                         int shift)
+{
+    MeshDataChunks result;
+    result.chunks[0] = chunk0;
+    result.chunks[1] = chunk1;
+    result.chunks[2] = chunk2;
+    result.chunks[3] = chunk3;
+    result.shift = shift;
+    return result;
+}
+
+/**
+ * Scene buffer header fields.
+ */
+enum SceneHeaderField
+{
+    SceneHeader_MaterialCount = 0,
+    SceneHeader_TextureCount,
+    SceneHeader_SphereCount,
+    SceneHeader_PlaneCount,
+    SceneHeader_TerrainCount,
+    SceneHeader_MeshCount,
+    SceneHeader_LightCount,
+    SceneHeader_UnboundedLightCount,
+
+    SceneHeader_Textures,
+    SceneHeader_SphereCenters,
+    SceneHeader_SphereRadii,
+    SceneHeader_SphereMaterials,
+    SceneHeader_PlaneNormals,
+    SceneHeader_PlaneDistances,
+    SceneHeader_PlaneMaterials,
+    SceneHeader_TerrainBoxes,
+    SceneHeader_TerrainNoises,
+    SceneHeader_TerrainMaterials,
+    SceneHeader_Meshes,
+    SceneHeader_MeshMaterials,
+    SceneHeader_LightShapes,
+    SceneHeader_LightRadii,
+
+    // Offsets into the mesh data buffer.
+    SceneHeader_MeshNodes,
+    SceneHeader_MeshVertices,
+    SceneHeader_MeshIndices,
+
+    SceneHeader_FieldCount,
 };
 
 /**
  * Scene buffer
  * ------------------
- * unsigned int numMaterials;
- * unsigned int numShapes;
- * unsigned int numTextures;
- * unsigned int padding[];
- * Material materials[numMaterials];
- * Texture textures[numTextures];
- * unsigned int shapeOffsets[numShapes];
- * Shape shapes[numShapes];
+ * SceneOffset header[SceneHeader_FieldCount]; // Counts and section offsets.
+ * PackedTexture textures[numTextures];
+ * Vector3 sphereCenters[numSpheres];
+ * float sphereRadii[numSpheres];
+ * int sphereMaterials[numSpheres];
+ * Vector3 planeNormals[numPlanes];
+ * float planeDistances[numPlanes];
+ * int planeMaterials[numPlanes];
+ * AABox terrainBoxes[numTerrains];
+ * NoiseElement terrainNoises[numTerrains];
+ * int terrainMaterials[numTerrains];
+ * MeshInstance meshes[numMeshes];
+ * int meshMaterials[numMeshes];
+ * int lightShapes[numLights];
+ * float lightRadii[numLights];
+ *
+ * The materials are kept in a separate buffer, see PackedMaterial.
+ * Every section starts at a 16 byte boundary. Shapes are grouped by type,
+ * so that the intersection loops read contiguous arrays. A shape id is an
+ * index into the spheres, then the planes, then the terrains, then the
+ * meshes.
+ *
+ * The lights are the shapes with a light material. The first
+ * numUnboundedLights have an unbounded reach. The rest are spheres, whose
+ * reach is limited by their influence radius.
+ *
+ * Mesh data buffer
+ * ------------------
+ * QuantizedBVHNode nodes[];
+ * float vertices[][3];
+ * int indices[][3]; // Sorted by BVH leaf.
+ *
+ * The mesh data only changes when meshes are added, so it is kept in its
+ * own buffer. It is addressed with 64-bit offsets, through MeshDataChunks.
+ * A mesh hit also reports the global triangle index.
  */
 class SceneAccess
 {
 public:
-    SceneAccess(const __global unsigned char *data)
-        : data(data)
+    SceneAccess(const __global unsigned char *data, const __material PackedMaterial *materials,
+                const MeshDataChunks &meshData)
+        : materials(materials), data(data), meshData(meshData)
     {
         readStructure();
     }
@@ -554,54 +771,334 @@ public:
         return numTextures;
     }
 
-    const __global Material *getMaterial(size_t id) const
+    int getLightCount() const
+    {
+        return numLights;
+    }
+
+    int getUnboundedLightCount() const
+    {
+        return numUnboundedLights;
+    }
+
+    int getLightShape(int light) const
+    {
+        return lightShapes[light];
+    }
+
+    /**
+     * Falloff of a bounded light at a position. It is an inverse square of
+     * the distance to the light surface, windowed to reach zero at the
+     * influence radius.
+     */
+    float lightAttenuation(int light, Vector3 position) const
+    {
+        int shape = lightShapes[light];
+        Vector3 delta = sphereCenters[shape] - position;
+        float distance2 = dot(delta, delta);
+        float radius = lightRadii[light];
+        float x = distance2/(radius*radius);
+        if(x >= 1.0f)
+            return 0.0f;
+
+        float surfaceDistance = fmax(sqrt(distance2) - sphereRadii[shape], 0.0f);
+        float window = 1.0f - x*x;
+        return window*window/(1.0f + surfaceDistance*surfaceDistance);
+    }
+
+    float getSphereRadius(int id) const
+    {
+        return sphereRadii[id];
+    }
+
+    const __material PackedMaterial *getMaterial(size_t id) const
     {
         return &materials[id];
     }
 
-    const __global Texture *getTexture(size_t id) const
+    const __global PackedTexture *getTexture(size_t id) const
     {
         return &textures[id];
     }
 
-    const __global Shape *getShape(size_t id) const
+    Shape::Type getShapeType(int id) const
+    {
+        if(id < firstPlane)
+            return Shape::ShapeType_Sphere;
+        else if(id < firstTerrain)
+            return Shape::ShapeType_Plane;
+        else if(id < firstMesh)
+            return Shape::ShapeType_Terrain;
+        return Shape::ShapeType_Mesh;
+    }
+
+    int getShapeMaterialId(int id) const
+    {
+        switch(getShapeType(id))
+        {
+        case Shape::ShapeType_Sphere:
+            return sphereMaterials[id];
+        case Shape::ShapeType_Plane:
+            return planeMaterials[id - firstPlane];
+        case Shape::ShapeType_Terrain:
+            return terrainMaterials[id - firstTerrain];
+        case Shape::ShapeType_Mesh:
+        default:
+            return meshMaterials[id - firstMesh];
+        }
+    }
+
+    float intersects(int id, const Ray &ray) const
+    {
+        switch(getShapeType(id))
+        {
+        case Shape::ShapeType_Sphere:
+            return intersectSphere(sphereCenters[id], sphereRadii[id], ray);
+        case Shape::ShapeType_Plane:
+            return intersectPlane(planeNormals[id - firstPlane], planeDistances[id - firstPlane], ray);
+        case Shape::ShapeType_Terrain:
+            return intersectTerrain(terrainBoxes[id - firstTerrain].min, terrainBoxes[id - firstTerrain].max, ray);
+        case Shape::ShapeType_Mesh:
+            {
+                int triangle;
+                return intersectMesh(id - firstMesh, ray, INFINITY, false, &triangle);
+            }
+        default:
+            return -1.0f;
+        }
+    }
+
+    Vector3 normalAt(int id, Vector3 position) const
     {
-        return (__global Shape*)(shapeOffsets[id] + data);
+        switch(getShapeType(id))
+        {
+        case Shape::ShapeType_Sphere:
+            return (position - sphereCenters[id])/sphereRadii[id];
+        case Shape::ShapeType_Plane:
+            return planeNormals[id - firstPlane];
+        case Shape::ShapeType_Terrain:
+            return normalize(position - terrainBoxes[id - firstTerrain].center());
+        case Shape::ShapeType_Mesh:
+            return normalize(position - getMeshCenter(id - firstMesh));
+        default:
+            return make_vector3(0.0f, 1.0f, 0.0f);
+        }
+    }
+
+    Vector3 lightDir(int id, Vector3 position) const
+    {
+        switch(getShapeType(id))
+        {
+        case Shape::ShapeType_Sphere:
+            return sphereCenters[id] - position;
+        case Shape::ShapeType_Plane:
+            return -planeNormals[id - firstPlane];
+        case Shape::ShapeType_Terrain:
+            return terrainBoxes[id - firstTerrain].center() - position;
+        case Shape::ShapeType_Mesh:
+            return getMeshCenter(id - firstMesh) - position;
+        default:
+            return make_vector3(0.0f, 1.0f, 0.0f);
+        }
     }
 
-    bool firstIntersection(const Ray &ray, float *amount, const __global Shape **element) const
+    float computeSideFactor(int id, Vector3 position) const
+    {
+        if(getShapeType(id) == Shape::ShapeType_Sphere)
+        {
+            Vector3 v = position - sphereCenters[id];
+            float radius = sphereRadii[id];
+            return (dot(v, v) > radius*radius) ? 1.0f : -1.0f;
+        }
+
+        return 1.0f;
+    }
+
+    /**
+     * Geometric normal of a mesh triangle.
+     */
+    Vector3 triangleNormal(int triangle) const
+    {
+        Vector3 v0 = loadMeshVertex(loadMeshIndex(triangle, 0));
+        Vector3 v1 = loadMeshVertex(loadMeshIndex(triangle, 1));
+        Vector3 v2 = loadMeshVertex(loadMeshIndex(triangle, 2));
+        return normalize(cross(v1 - v0, v2 - v0));
+    }
+
+    /**
+     * Walks the BVH of a mesh. The triangle is the global index of the hit
+     * triangle, or -1. With anyHit, it stops in the first hit before maxAmount.
+     */
+    float intersectMesh(int mesh, const Ray &ray, float maxAmount, bool anyHit, int *triangle) const
+    {
+        const __global MeshInstance *instance = &meshes[mesh];
+        Vector3 boundsMin = instance->boundsMin;
+        Vector3 scale = instance->quantizationScale;
+        Vector3 invDirection = make_vector3(1.0f/ray.direction.x, 1.0f/ray.direction.y, 1.0f/ray.direction.z);
+        int firstNode = instance->firstNode;
+
+        float best = maxAmount;
+        *triangle = -1;
+
+        int stack[BVH_STACK_SIZE];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while(stackSize > 0)
+        {
+            int nodeIndex = stack[--stackSize];
+            const __global QuantizedBVHNode *node = loadMeshNode(firstNode + nodeIndex);
+
+            // Dequantize the bounds.
+            Vector3 nodeMin = boundsMin + make_vector3(node->boundsMin[0], node->boundsMin[1], node->boundsMin[2])*scale;
+            Vector3 nodeMax = boundsMin + make_vector3(node->boundsMax[0], node->boundsMax[1], node->boundsMax[2])*scale;
+            if(!intersectBox(nodeMin, nodeMax, ray.start, invDirection, best))
+                continue;
+
+            if(!node->isLeaf())
+            {
+                stack[stackSize++] = node->getSecondChild();
+                stack[stackSize++] = nodeIndex + 1;
+                continue;
+            }
+
+            // Test the leaf triangles.
+            int first = instance->firstTriangle + node->getFirstTriangle();
+            int count = node->getTriangleCount();
+            for(int i = first; i < first + count; ++i)
+            {
+                Vector3 v0 = loadMeshVertex(loadMeshIndex(i, 0));
+                Vector3 v1 = loadMeshVertex(loadMeshIndex(i, 1));
+                Vector3 v2 = loadMeshVertex(loadMeshIndex(i, 2));
+                float res = intersectTriangle(v0, v1, v2, ray);
+                if(res >= 0.0f && res < best)
+                {
+                    best = res;
+                    *triangle = i;
+                    if(anyHit)
+                        return best;
+                }
+            }
+        }
+
+        return (*triangle >= 0) ? best : -1.0f;
+    }
+
+    bool firstIntersection(const Ray &ray, float *amount, int *shape, int *triangle) const
     {
         *amount = -1.0f;
-        *element = NULL;
+        *shape = -1;
+        *triangle = -1;
+
+        for(int i = 0; i < numSpheres; ++i)
+        {
+            float res = intersectSphere(sphereCenters[i], sphereRadii[i], ray);
+            if(res >= 0.0f && (*shape < 0 || res < *amount))
+            {
+                *amount = res;
+                *shape = i;
+            }
+        }
 
-        for(unsigned int i = 0; i < numShapes; ++i)
+        for(int i = 0; i < numPlanes; ++i)
         {
-            const __global Shape *shape = getShape(i);
-            float res = Shape::intersects(shape, ray);
-            if(res >= 0.0f && (*element == NULL || res < *amount))
+            float res = intersectPlane(planeNormals[i], planeDistances[i], ray);
+            if(res >= 0.0f && (*shape < 0 || res < *amount))
             {
                 *amount = res;
-                *element = shape;
+                *shape = firstPlane + i;
             }
         }
 
-        return *element != NULL;
+        return firstComplexIntersection(ray, amount, shape, triangle);
     }
 
-    bool blockedLine(const Ray &ray, const __global Shape *testShape) const
+    /**
+     * Spheres and planes, in this order, have terms that only depend on
+     * the ray start. They are shared by every ray from the camera.
+     */
+    int getCameraConstantCount() const
     {
-        float maxAmount = Shape::intersects(testShape, ray);
+        return numSpheres + numPlanes;
+    }
+
+    Vector4 computeCameraConstants(int id, Vector3 origin) const
+    {
+        if(id < numSpheres)
+        {
+            Vector3 v = origin - sphereCenters[id];
+            float radius = sphereRadii[id];
+            return make_vector4(v.x, v.y, v.z, dot(v, v) - radius*radius);
+        }
+
+        int plane = id - firstPlane;
+        return make_vector4(dot(planeNormals[plane], origin) + planeDistances[plane], 0.0f, 0.0f, 0.0f);
+    }
+
+    /**
+     * First intersection of a ray that starts at the camera, with the
+     * sphere and plane terms of computeCameraConstants.
+     */
+    bool firstCameraIntersection(const Ray &ray, const __global Vector4 *cameraConstants,
+                                 float *amount, int *shape, int *triangle) const
+    {
+        *amount = -1.0f;
+        *shape = -1;
+        *triangle = -1;
+
+        for(int i = 0; i < numSpheres; ++i)
+        {
+            float res = intersectSphereFromCamera(cameraConstants[i], ray.direction);
+            if(res >= 0.0f && (*shape < 0 || res < *amount))
+            {
+                *amount = res;
+                *shape = i;
+            }
+        }
+
+        for(int i = 0; i < numPlanes; ++i)
+        {
+            float res = intersectPlaneFromCamera(planeNormals[i], cameraConstants[firstPlane + i].x, ray.direction);
+            if(res >= 0.0f && (*shape < 0 || res < *amount))
+            {
+                *amount = res;
+                *shape = firstPlane + i;
+            }
+        }
+
+        return firstComplexIntersection(ray, amount, shape, triangle);
+    }
+
+    bool blockedLine(const Ray &ray, int testShape) const
+    {
+        float maxAmount = intersects(testShape, ray);
         if(maxAmount <= 0.0)
             return true;
 
-        for(unsigned int i = 0; i < numShapes; ++i)
+        for(int i = 0; i < numSpheres; ++i)
         {
-            const __global Shape *shape = getShape(i);
-            if(shape == testShape)
-                continue;
+            float res = intersectSphere(sphereCenters[i], sphereRadii[i], ray);
+            if(res >= 0.0f && res < maxAmount && i != testShape)
+                return true;
+        }
 
-            float res = Shape::intersects(shape, ray);
-            if(res >= 0.0f && res < maxAmount)
+        for(int i = 0; i < numPlanes; ++i)
+        {
+            float res = intersectPlane(planeNormals[i], planeDistances[i], ray);
+            if(res >= 0.0f && res < maxAmount && firstPlane + i != testShape)
+                return true;
+        }
+
+        for(int i = 0; i < numTerrains; ++i)
+        {
+            float res = intersectTerrain(terrainBoxes[i].min, terrainBoxes[i].max, ray);
+            if(res >= 0.0f && res < maxAmount && firstTerrain + i != testShape)
+                return true;
+        }
+
+        for(int i = 0; i < numMeshes; ++i)
+        {
+            int triangle;
+            if(firstMesh + i != testShape && intersectMesh(i, ray, maxAmount, true, &triangle) >= 0.0f)
                 return true;
         }
 
@@ -609,29 +1106,144 @@ public:
     }
 
 private:
-    int readInt(const __global unsigned char *data)
+    // Continues a first intersection search with the terrains and meshes.
+    bool firstComplexIntersection(const Ray &ray, float *amount, int *shape, int *triangle) const
+    {
+        for(int i = 0; i < numTerrains; ++i)
+        {
+            float res = intersectTerrain(terrainBoxes[i].min, terrainBoxes[i].max, ray);
+            if(res >= 0.0f && (*shape < 0 || res < *amount))
+            {
+                *amount = res;
+                *shape = firstTerrain + i;
+            }
+        }
+
+        for(int i = 0; i < numMeshes; ++i)
+        {
+            int meshTriangle;
+            float res = intersectMesh(i, ray, (*shape < 0) ? INFINITY : *amount, false, &meshTriangle);
+            if(res >= 0.0f)
+            {
+                *amount = res;
+                *shape = firstMesh + i;
+                *triangle = meshTriangle;
+            }
+        }
+
+        return *shape >= 0;
+    }
+
+    Vector3 getMeshCenter(int mesh) const
     {
-        return *((__global int*)data);
+        return (meshes[mesh].boundsMin + meshes[mesh].boundsMax)*0.5f;
     }
 
-    void readStructure()
+    SceneOffset readHeader(int field)
     {
-        numMaterials = readInt(data);
-        numTextures = readInt(data + sizeof(int));
-        numShapes = readInt(data + 2*sizeof(int));
+        return ((const __global SceneOffset*)data)[field];
+    }
 
-        materials = (__global Material*)(data + sizeof(int)*4);
-        textures = (__global Texture*)(data + sizeof(int)*4 + numMaterials*sizeof(Material));
-        shapeOffsets = (const __global unsigned int *)(data + sizeof(int)*4 + numMaterials*sizeof(Material) + numTextures*sizeof(Texture));
+    const __global QuantizedBVHNode *loadMeshNode(int node) const
+    {
+        return (const __global QuantizedBVHNode*)meshData.address(meshNodesOffset + (SceneOffset)node*sizeof(QuantizedBVHNode));
+    }
+
+    int loadMeshIndex(int triangle, int corner) const
+    {
+        SceneOffset offset = meshIndicesOffset + ((SceneOffset)triangle*3 + corner)*sizeof(int);
+        return *(const __global int*)meshData.address(offset);
+    }
+
+    Vector3 loadMeshVertex(int vertex) const
+    {
+        SceneOffset offset = meshVerticesOffset + (SceneOffset)vertex*3*sizeof(float);
+        return make_vector3(*(const __global float*)meshData.address(offset),
+                            *(const __global float*)meshData.address(offset + sizeof(float)),
+                            *(const __global float*)meshData.address(offset + 2*sizeof(float)));
+    }
+
+    void readStructure()
+    {
+        numMaterials = readHeader(SceneHeader_MaterialCount);
+        numTextures = readHeader(SceneHeader_TextureCount);
+        numSpheres = readHeader(SceneHeader_SphereCount);
+        numPlanes = readHeader(SceneHeader_PlaneCount);
+        numTerrains = readHeader(SceneHeader_TerrainCount);
+        numMeshes = readHeader(SceneHeader_MeshCount);
+        numLights = readHeader(SceneHeader_LightCount);
+        numUnboundedLights = readHeader(SceneHeader_UnboundedLightCount);
+        numShapes = numSpheres + numPlanes + numTerrains + numMeshes;
+        firstPlane = numSpheres;
+        firstTerrain = numSpheres + numPlanes;
+        firstMesh = firstTerrain + numTerrains;
+
+        textures = (const __global PackedTexture*)(data + readHeader(SceneHeader_Textures));
+
+        sphereCenters = (const __global Vector3*)(data + readHeader(SceneHeader_SphereCenters));
+        sphereRadii = (const __global float*)(data + readHeader(SceneHeader_SphereRadii));
+        sphereMaterials = (const __global int*)(data + readHeader(SceneHeader_SphereMaterials));
+
+        planeNormals = (const __global Vector3*)(data + readHeader(SceneHeader_PlaneNormals));
+        planeDistances = (const __global float*)(data + readHeader(SceneHeader_PlaneDistances));
+        planeMaterials = (const __global int*)(data + readHeader(SceneHeader_PlaneMaterials));
+
+        terrainBoxes = (const __global AABox*)(data + readHeader(SceneHeader_TerrainBoxes));
+        terrainNoises = (const __global NoiseElement*)(data + readHeader(SceneHeader_TerrainNoises));
+        terrainMaterials = (const __global int*)(data + readHeader(SceneHeader_TerrainMaterials));
+
+        meshes = (const __global MeshInstance*)(data + readHeader(SceneHeader_Meshes));
+        meshMaterials = (const __global int*)(data + readHeader(SceneHeader_MeshMaterials));
+        lightShapes = (const __global int*)(data + readHeader(SceneHeader_LightShapes));
+        lightRadii = (const __global float*)(data + readHeader(SceneHeader_LightRadii));
+        meshNodesOffset = readHeader(SceneHeader_MeshNodes);
+        meshVerticesOffset = readHeader(SceneHeader_MeshVertices);
+        meshIndicesOffset = readHeader(SceneHeader_MeshIndices);
     }
 
     unsigned int numMaterials;
     unsigned int numTextures;
     unsigned int numShapes;
-    const __global Material *materials;
-    const __global Texture *textures;
-    const __global unsigned int *shapeOffsets;
+    int numSpheres;
+    int numPlanes;
+    int numTerrains;
+    int numMeshes;
+    int numLights;
+    int numUnboundedLights;
+    int firstPlane;
+    int firstTerrain;
+    int firstMesh;
+    const __material PackedMaterial *materials;
+    const __global PackedTexture *textures;
+
+    // Spheres
+    const __global Vector3 *sphereCenters;
+    const __global float *sphereRadii;
+    const __global int *sphereMaterials;
+
+    // Planes
+    const __global Vector3 *planeNormals;
+    const __global float *planeDistances;
+    const __global int *planeMaterials;
+
+    // Terrains
+    const __global AABox *terrainBoxes;
+    const __global NoiseElement *terrainNoises;
+    const __global int *terrainMaterials;
+
+    // Meshes
+    const __global MeshInstance *meshes;
+    const __global int *meshMaterials;
+    SceneOffset meshNodesOffset;
+    SceneOffset meshVerticesOffset;
+    SceneOffset meshIndicesOffset;
+
+    // Lights
+    const __global int *lightShapes;
+    const __global float *lightRadii;
+
     const __global unsigned char *data;
+    MeshDataChunks meshData;
 };
 
 #endif //T3_GEOMETRY_HPP
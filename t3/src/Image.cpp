@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <vector>
 #include "Image.hpp"
 
 namespace T3
@@ -34,5 +36,71 @@ Color *Image2D::getPixels()
     return pixels;
 }
 
+void Image2D::getRGB8(unsigned char *data) const
+{
+    for(int i = 0; i < width*height; ++i)
+    {
+        const float channels[] = {pixels[i].r, pixels[i].g, pixels[i].b};
+        for(int c = 0; c < 3; ++c)
+        {
+            float value = channels[c] < 0.0f ? 0.0f : (channels[c] > 1.0f ? 1.0f : channels[c]);
+            data[i*3 + c] = (unsigned char)(value*255.0f + 0.5f);
+        }
+    }
+}
+
+void Image2D::setRGB8(const unsigned char *data)
+{
+    for(int i = 0; i < width*height; ++i)
+        pixels[i] = Color(data[i*3]/255.0f, data[i*3 + 1]/255.0f, data[i*3 + 2]/255.0f);
+}
+
+bool Image2D::saveToPPM(const std::string &fileName) const
+{
+    FILE *file = fopen(fileName.c_str(), "wb");
+    if(!file)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", fileName.c_str());
+        return false;
+    }
+
+    std::vector<unsigned char> data(width*height*3);
+    getRGB8(&data[0]);
+
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    bool success = fwrite(&data[0], data.size(), 1, file) == 1;
+    fclose(file);
+    return success;
+}
+
+Image2D *Image2D::loadFromPPM(const std::string &fileName)
+{
+    FILE *file = fopen(fileName.c_str(), "rb");
+    if(!file)
+        return NULL;
+
+    // Read the header. Only 8-bit images are supported.
+    int w, h, maxValue;
+    if(fscanf(file, "P6 %d %d %d", &w, &h, &maxValue) != 3 || w <= 0 || h <= 0 ||
+        maxValue != 255 || fgetc(file) == EOF)
+    {
+        fprintf(stderr, "Unsupported PPM image %s\n", fileName.c_str());
+        fclose(file);
+        return NULL;
+    }
+
+    std::vector<unsigned char> data(w*h*3);
+    bool success = fread(&data[0], data.size(), 1, file) == 1;
+    fclose(file);
+    if(!success)
+    {
+        fprintf(stderr, "Truncated PPM image %s\n", fileName.c_str());
+        return NULL;
+    }
+
+    Image2D *image = new Image2D(w, h);
+    image->setRGB8(&data[0]);
+    return image;
 }
 
+}
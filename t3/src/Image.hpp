@@ -1,6 +1,7 @@
 #ifndef T3_IMAGE_HPP
 #define T3_IMAGE_HPP
 
+#include <string>
 #include "Color.hpp"
 
 namespace T3
@@ -20,6 +21,18 @@ public:
     const Color *getPixels() const;
     Color *getPixels();
 
+    /// Converts the pixels into 8-bit RGB, clamping the colors.
+    void getRGB8(unsigned char *data) const;
+
+    /// Sets the pixels from 8-bit RGB.
+    void setRGB8(const unsigned char *data);
+
+    /// Writes the image as a binary 8-bit PPM, clamping the colors.
+    bool saveToPPM(const std::string &fileName) const;
+
+    /// Reads a binary 8-bit PPM. Returns NULL on failure.
+    static Image2D *loadFromPPM(const std::string &fileName);
+
 private:
     int width, height;
     Color *pixels;
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include "LightTiles.hpp"
+#include "CommonCL.hpp"
+
+namespace T3
+{
+
+inline Vector3 toVector3(const Vector4 &v)
+{
+    return Vector3(v.x, v.y, v.z);
+}
+
+LightTiles::LightTiles()
+{
+}
+
+LightTiles::~LightTiles()
+{
+}
+
+void LightTiles::build(const std::vector<Vector4> &lightBounds, const Vector4 &cameraPosition,
+                       const Vector4 *screenPlaneVerts, int width, int height)
+{
+    offsets.clear();
+    lights.clear();
+    if(lightBounds.empty())
+        return;
+
+    int tilesX = (width + LightTileSize - 1)/LightTileSize;
+    int tilesY = (height + LightTileSize - 1)/LightTileSize;
+    Vector3 origin = toVector3(cameraPosition);
+    Vector3 screenOrigin = toVector3(screenPlaneVerts[0]);
+    Vector3 screenU = toVector3(screenPlaneVerts[1]) - screenOrigin;
+    Vector3 screenV = toVector3(screenPlaneVerts[3]) - screenOrigin;
+    Vector3 forward = cross(screenU, screenV).normalized();
+    if(forward.dot(screenOrigin - origin) < 0.0f)
+        forward = -forward;
+
+    // The pixel x is traced through the screen point x/width. The boundaries
+    // are moved half a pixel back, to keep the jittered samples inside.
+    columnNormals.resize(tilesX + 1);
+    for(int i = 0; i <= tilesX; ++i)
+    {
+        float x = std::min(i*LightTileSize, width) - 0.5f;
+        Vector3 edge = screenOrigin + screenU*(x/width) - origin;
+        Vector3 normal = cross(screenV, edge).normalized();
+        columnNormals[i] = normal.dot(screenU) < 0.0f ? -normal : normal;
+    }
+
+    rowNormals.resize(tilesY + 1);
+    for(int i = 0; i <= tilesY; ++i)
+    {
+        float y = std::min(i*LightTileSize, height) - 0.5f;
+        Vector3 edge = screenOrigin + screenV*(y/height) - origin;
+        Vector3 normal = cross(screenU, edge).normalized();
+        rowNormals[i] = normal.dot(screenV) < 0.0f ? -normal : normal;
+    }
+
+    // Find the tiles covered by each light. The column and the row ranges
+    // are tested separately, so the corners are conservative.
+    int tileCount = tilesX*tilesY;
+    offsets.assign(tileCount + 1, 0);
+    lightRects.resize(lightBounds.size()*4);
+    for(size_t i = 0; i < lightBounds.size(); ++i)
+    {
+        const Vector4 &bounds = lightBounds[i];
+        Vector3 center = toVector3(bounds) - origin;
+        int *rect = &lightRects[i*4];
+        rect[0] = rect[2] = 0;
+        rect[1] = rect[3] = -1;
+        if(forward.dot(center) < -bounds.w)
+            continue;
+
+        computeCoveredRange(columnNormals, center, bounds.w, &rect[0], &rect[1]);
+        computeCoveredRange(rowNormals, center, bounds.w, &rect[2], &rect[3]);
+        for(int y = rect[2]; y <= rect[3]; ++y)
+        {
+            for(int x = rect[0]; x <= rect[1]; ++x)
+                offsets[y*tilesX + x + 1]++;
+        }
+    }
+
+    // Pack the lists.
+    for(int i = 0; i < tileCount; ++i)
+        offsets[i + 1] += offsets[i];
+    lights.resize(std::max(offsets.back(), 1));
+    std::vector<int> cursors(offsets.begin(), offsets.end() - 1);
+    for(size_t i = 0; i < lightBounds.size(); ++i)
+    {
+        const int *rect = &lightRects[i*4];
+        for(int y = rect[2]; y <= rect[3]; ++y)
+        {
+            for(int x = rect[0]; x <= rect[1]; ++x)
+                lights[cursors[y*tilesX + x]++] = i;
+        }
+    }
+}
+
+void LightTiles::computeCoveredRange(const std::vector<Vector3> &boundaryNormals, const Vector3 &center,
+                                     float radius, int *first, int *last) const
+{
+    // A tile is covered unless the sphere is fully before its first boundary,
+    // or fully after its second one.
+    *first = 0;
+    *last = -1;
+    int tileCount = boundaryNormals.size() - 1;
+    for(int i = 0; i < tileCount; ++i)
+    {
+        if(boundaryNormals[i].dot(center) < -radius || boundaryNormals[i + 1].dot(center) > radius)
+            continue;
+
+        if(*last < 0)
+            *first = i;
+        *last = i;
+    }
+}
+
+bool LightTiles::empty() const
+{
+    return offsets.empty();
+}
+
+int LightTiles::getTileCount() const
+{
+    return offsets.empty() ? 0 : offsets.size() - 1;
+}
+
+const std::vector<int> &LightTiles::getOffsets() const
+{
+    return offsets;
+}
+
+const std::vector<int> &LightTiles::getLights() const
+{
+    return lights;
+}
+
+} // namespace T3
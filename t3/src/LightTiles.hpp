@@ -0,0 +1,47 @@
+#ifndef T3_LIGHT_TILES_HPP
+#define T3_LIGHT_TILES_HPP
+
+#include <vector>
+#include "Vector4.hpp"
+
+namespace T3
+{
+
+/**
+ * Per screen tile lists of the bounded lights, for the primary hits. A light
+ * is listed in a tile when its influence sphere touches the tile frustum.
+ *
+ * The lists are packed as in the kernel: the lights of the tile i are
+ * lights[offsets[i]] up to lights[offsets[i + 1]], as indices into the
+ * bounded lights.
+ */
+class LightTiles
+{
+public:
+    LightTiles();
+    ~LightTiles();
+
+    /// Builds the lists for a camera. The screen plane is given by its
+    /// corners, as the raytracer passes them to the kernels.
+    void build(const std::vector<Vector4> &lightBounds, const Vector4 &origin,
+               const Vector4 *screenPlaneVerts, int width, int height);
+
+    bool empty() const;
+    int getTileCount() const;
+    const std::vector<int> &getOffsets() const;
+    const std::vector<int> &getLights() const;
+
+private:
+    void computeCoveredRange(const std::vector<Vector3> &boundaryNormals, const Vector3 &center,
+                             float radius, int *first, int *last) const;
+
+    std::vector<Vector3> columnNormals;
+    std::vector<Vector3> rowNormals;
+    std::vector<int> lightRects;
+    std::vector<int> offsets;
+    std::vector<int> lights;
+};
+
+} // namespace T3
+
+#endif //T3_LIGHT_TILES_HPP
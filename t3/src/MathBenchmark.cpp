@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+#include "MathBenchmark.hpp"
+#include "CommonCL.hpp"
+#include "FrameProfiler.hpp"
+#include "Geometry.hpp"
+#include "Matrix3.hpp"
+#include "Noise.hpp"
+
+namespace T3
+{
+
+// Values used by each timing loop, and the times that it goes over them.
+const int BenchmarkValueCount = 1024;
+const int BenchmarkRepetitions = 2000;
+
+// Relative error allowed between the float results and the references.
+const double CheckTolerance = 1e-5;
+
+/**
+ * Small deterministic generator, so that every run uses the same values.
+ */
+class RandomValues
+{
+public:
+    RandomValues() : state(12345u) {}
+
+    float next(float minValue, float maxValue)
+    {
+        state = state*1664525u + 1013904223u;
+        return minValue + (maxValue - minValue)*((state >> 8)/16777216.0f);
+    }
+
+    Vector3 nextVector(float scale)
+    {
+        float x = next(-scale, scale);
+        float y = next(-scale, scale);
+        float z = next(-scale, scale);
+        return Vector3(x, y, z);
+    }
+
+private:
+    unsigned int state;
+};
+
+static bool checkValue(const char *name, double value, double reference)
+{
+    double error = fabs(value - reference);
+    if(error <= CheckTolerance*std::max(1.0, fabs(reference)))
+        return true;
+
+    fprintf(stderr, "Math check %s failed: got %.9g, expected %.9g\n", name, value, reference);
+    return false;
+}
+
+static bool checkVector(const char *name, const Vector3 &v, double x, double y, double z)
+{
+    return checkValue(name, v.x, x) && checkValue(name, v.y, y) && checkValue(name, v.z, z);
+}
+
+MathBenchmark::MathBenchmark()
+    : enabled(false), failures(0)
+{
+}
+
+MathBenchmark::~MathBenchmark()
+{
+}
+
+void MathBenchmark::setEnabled(bool enabled)
+{
+    this->enabled = enabled;
+}
+
+bool MathBenchmark::isEnabled() const
+{
+    return enabled;
+}
+
+bool MathBenchmark::run()
+{
+#if defined(T3_SIMD_SSE)
+    printf("Host vector math using SSE\n");
+#elif defined(T3_SIMD_NEON)
+    printf("Host vector math using NEON\n");
+#else
+    printf("Host vector math using scalar code\n");
+#endif
+
+    bool passed = runChecks();
+    runTimings();
+    return passed;
+}
+
+bool MathBenchmark::runChecks()
+{
+    failures = 0;
+    int checks = 0;
+    RandomValues random;
+    for(int i = 0; i < BenchmarkValueCount; ++i, checks += 10)
+    {
+        Vector3 a = random.nextVector(10.0f);
+        Vector3 b = random.nextVector(10.0f);
+        double ax = a.x, ay = a.y, az = a.z;
+        double bx = b.x, by = b.y, bz = b.z;
+
+        if(!checkVector("add", a + b, ax + bx, ay + by, az + bz))
+            ++failures;
+        if(!checkValue("dot", a.dot(b), ax*bx + ay*by + az*bz))
+            ++failures;
+        if(!checkVector("cross", cross(a, b), ay*bz - az*by, az*bx - ax*bz, ax*by - ay*bx))
+            ++failures;
+
+        double length = sqrt(ax*ax + ay*ay + az*az);
+        if(!checkValue("length", a.length(), length))
+            ++failures;
+        if(!checkVector("normalize", a.normalized(), ax/length, ay/length, az/length))
+            ++failures;
+
+        // Cross products are orthogonal to their operands.
+        Vector3 c = cross(a, b);
+        if(!checkValue("cross orthogonal", c.dot(a)/(length*c.length() + 1.0), 0.0))
+            ++failures;
+
+        Vector4 a4(a.x, a.y, a.z, b.x);
+        Vector4 b4(b.y, b.z, a.x, a.y);
+        if(!checkValue("dot4", a4.dot(b4), ax*by + ay*bz + az*ax + bx*ay))
+            ++failures;
+
+        float t = random.next(-0.5f, 1.5f);
+        if(!checkVector("mix", mix(a, b, t), ax + (bx - ax)*t, ay + (by - ay)*t, az + (bz - az)*t))
+            ++failures;
+
+        double st = std::min(std::max((t + 0.25)/1.5, 0.0), 1.0);
+        if(!checkValue("smoothstep", smoothstep(-0.25f, 1.25f, t), st*st*(3.0 - 2.0*st)))
+            ++failures;
+
+        if(!checkVector("clamp", clamp(a, -5.0f, 5.0f), std::min(std::max(ax, -5.0), 5.0),
+            std::min(std::max(ay, -5.0), 5.0), std::min(std::max(az, -5.0), 5.0)))
+            ++failures;
+    }
+
+    // The matrix products.
+    for(int i = 0; i < BenchmarkValueCount; ++i, checks += 2)
+    {
+        float ma[9], mb[9];
+        for(int j = 0; j < 9; ++j)
+        {
+            ma[j] = random.next(-2.0f, 2.0f);
+            mb[j] = random.next(-2.0f, 2.0f);
+        }
+
+        Matrix3 a(ma);
+        Matrix3 b(mb);
+        Vector3 v = random.nextVector(10.0f);
+        double vx = v.x, vy = v.y, vz = v.z;
+        if(!checkVector("matrix vector", a*v,
+            ma[0]*vx + ma[1]*vy + ma[2]*vz,
+            ma[3]*vx + ma[4]*vy + ma[5]*vz,
+            ma[6]*vx + ma[7]*vy + ma[8]*vz))
+            ++failures;
+
+        Matrix3 ab = a*b;
+        for(int r = 0; r < 3; ++r)
+        {
+            for(int c = 0; c < 3; ++c)
+            {
+                double reference = 0.0;
+                for(int k = 0; k < 3; ++k)
+                    reference += double(ma[r*3 + k])*mb[k*3 + c];
+                if(!checkValue("matrix matrix", ab.at(r, c), reference))
+                    ++failures;
+            }
+        }
+    }
+
+    // Corner cases that follow the OpenCL built-ins.
+    checks += 4;
+    if(Vector3().normalized() != Vector3())
+    {
+        fprintf(stderr, "Math check normalize failed: the zero vector is not kept\n");
+        ++failures;
+    }
+    if(!checkVector("vectorAxis", vectorAxis(Vector4(1, 2, 3, 4)), 1, 2, 3))
+        ++failures;
+    if(bestVectorAxis(Vector3(0.1f, -0.9f, 0.2f)) != 1)
+    {
+        fprintf(stderr, "Math check bestVectorAxis failed\n");
+        ++failures;
+    }
+    if(!checkValue("step", step(0.5f, 0.5f), 1.0))
+        ++failures;
+
+    printf("%d math checks, %d failed\n", checks, failures);
+    return failures == 0;
+}
+
+// The results are added into this, so the loops are not optimized away.
+static volatile float benchmarkSink;
+
+static void reportTiming(const char *name, double startTime)
+{
+    double elapsed = FrameProfiler::now() - startTime;
+    double operations = double(BenchmarkValueCount)*BenchmarkRepetitions;
+    printf("%-20s %8.2f ns/op\n", name, elapsed*1e6/operations);
+}
+
+void MathBenchmark::runTimings()
+{
+    RandomValues random;
+    std::vector<Vector3> a(BenchmarkValueCount);
+    std::vector<Vector3> b(BenchmarkValueCount);
+    std::vector<Matrix3> matrices(BenchmarkValueCount);
+    std::vector<Color> colors(BenchmarkValueCount);
+    for(int i = 0; i < BenchmarkValueCount; ++i)
+    {
+        a[i] = random.nextVector(10.0f);
+        b[i] = random.nextVector(10.0f);
+        for(int j = 0; j < 9; ++j)
+            matrices[i].setAt(j, random.next(-2.0f, 2.0f));
+        float r = random.next(0.0f, 1.0f);
+        float g = random.next(0.0f, 1.0f);
+        float bl = random.next(0.0f, 1.0f);
+        colors[i] = Color(r, g, bl);
+    }
+
+    double start = FrameProfiler::now();
+    Vector3 sum;
+    for(int r = 0; r < BenchmarkRepetitions; ++r)
+        for(int i = 0; i < BenchmarkValueCount; ++i)
+            sum += a[i] + b[i];
+    benchmarkSink = sum.x;
+    reportTiming("add", start);
+
+    start = FrameProfiler::now();
+    float total = 0.0f;
+    for(int r = 0; r < BenchmarkRepetitions; ++r)
+        for(int i = 0; i < BenchmarkValueCount; ++i)
+            total += a[i].dot(b[i]);
+    benchmarkSink = total;
+    reportTiming("dot", start);
+
+    start = FrameProfiler::now();
+    sum = Vector3();
+    for(int r = 0; r < BenchmarkRepetitions; ++r)
+        for(int i = 0; i < BenchmarkValueCount; ++i)
+            sum += cross(a[i], b[i]);
+    benchmarkSink = sum.x;
+    reportTiming("cross", start);
+
+    start = FrameProfiler::now();
+    sum = Vector3();
+    for(int r = 0; r < BenchmarkRepetitions; ++r)
+        for(int i = 0; i < BenchmarkValueCount; ++i)
+            sum += a[i].normalized();
+    benchmarkSink = sum.x;
+    reportTiming("normalize", start);
+
+    start = FrameProfiler::now();
+    sum = Vector3();
+    for(int r = 0; r < BenchmarkRepetitions; ++r)
+        for(int i = 0; i < BenchmarkValueCount; ++i)
+            sum += matrices[i]*a[i];
+    benchmarkSink = sum.x;
+    reportTiming("matrix * vector", start);
+
+    start = FrameProfiler::now();
+    total = 0.0f;
+    for(int r = 0; r < BenchmarkRepetitions; ++r)
+        for(int i = 0; i < BenchmarkValueCount; ++i)
+            total += (matrices[i]*matrices[BenchmarkValueCount - 1 - i]).at(0, 0);
+    benchmarkSink = total;
+    reportTiming("matrix * matrix", start);
+
+    start = FrameProfiler::now();
+    Color color;
+    for(int r = 0; r < BenchmarkRepetitions; ++r)
+        for(int i = 0; i < BenchmarkValueCount; ++i)
+            color += mix(colors[i], colors[BenchmarkValueCount - 1 - i], 0.25f);
+    benchmarkSink = color.r;
+    reportTiming("color mix", start);
+
+    start = FrameProfiler::now();
+    total = 0.0f;
+    for(int r = 0; r < BenchmarkRepetitions; ++r)
+    {
+        for(int i = 0; i < BenchmarkValueCount; ++i)
+        {
+            Ray ray(a[i], b[i].normalized());
+            total += intersectSphere(Vector3(), 4.0f, ray);
+        }
+    }
+    benchmarkSink = total;
+    reportTiming("sphere intersection", start);
+
+    start = FrameProfiler::now();
+    total = 0.0f;
+    for(int r = 0; r < BenchmarkRepetitions; ++r)
+        for(int i = 0; i < BenchmarkValueCount; ++i)
+            total += noise3D(a[i]);
+    benchmarkSink = total;
+    reportTiming("simplex noise", start);
+}
+
+} // namespace T3
@@ -0,0 +1,34 @@
+#ifndef T3_MATH_BENCHMARK_HPP
+#define T3_MATH_BENCHMARK_HPP
+
+namespace T3
+{
+
+/**
+ * Checks the host vector math against plain double precision formulas, and
+ * measures the cost of the operations used by the host side of the
+ * raytracer.
+ */
+class MathBenchmark
+{
+public:
+    MathBenchmark();
+    ~MathBenchmark();
+
+    void setEnabled(bool enabled);
+    bool isEnabled() const;
+
+    /// Runs the checks and the timings. Returns false when a check fails.
+    bool run();
+
+private:
+    bool runChecks();
+    void runTimings();
+
+    bool enabled;
+    int failures;
+};
+
+} // namespace T3
+
+#endif //T3_MATH_BENCHMARK_HPP
@@ -8,46 +8,47 @@ namespace T3
 {
 
 /**
- * 3x3 Matrix
+ * 3x3 Matrix. The rows are padded to four floats, so that the products use
+ * the SIMD lanes.
  */
 class Matrix3
 {
 public:
-    explicit Matrix3() {}
+    explicit Matrix3()
+    {
+        for(int i = 0; i < 3; ++i)
+            simdStore(rows[i], simdSplat(0.0f));
+    }
+
     Matrix3(float newData[9])
     {
-        for(int i = 0; i < 9; ++i)
-            this->data[i] = newData[i];
+        for(int i = 0; i < 3; ++i)
+            simdStore(rows[i], simdSet(newData[i*3], newData[i*3 + 1], newData[i*3 + 2], 0.0f));
     }
 
     float at(int i) const
     {
-        return data[i];
+        return rows[i / 3][i % 3];
     }
 
     float at(int i, int j) const
     {
-        return data[i*3 + j];
+        return rows[i][j];
     }
 
     void setAt(int i, float v)
     {
-        data[i] = v;
+        rows[i / 3][i % 3] = v;
     }
 
     void setAt(int i, int j, float v)
     {
-        data[i*3 + j] = v;
+        rows[i][j] = v;
     }
 
-    float *rawData()
+    SimdFloat4 row(int i) const
     {
-        return data;
-    }
-
-    const float *rawData() const
-    {
-        return data;
+        return simdLoad(rows[i]);
     }
 
     Matrix3 transpose() const
@@ -62,16 +63,14 @@ public:
 public:
     friend Matrix3 operator*(const Matrix3 &a, const Matrix3 &b)
     {
+        // Each row of the result is a combination of the rows of b.
         Matrix3 ret;
         for(int i = 0; i < 3; ++i)
         {
-            for(int j = 0; j < 3; ++j)
-            {
-                float s = 0.0f;
-                for(int k = 0; k < 3; ++k)
-                    s += a.at(i, k)*b.at(k, j);
-                ret.setAt(i, j, s);
-            }
+            SimdFloat4 r = simdMul(simdSplat(a.at(i, 0)), b.row(0));
+            r = simdAdd(r, simdMul(simdSplat(a.at(i, 1)), b.row(1)));
+            r = simdAdd(r, simdMul(simdSplat(a.at(i, 2)), b.row(2)));
+            simdStore(ret.rows[i], r);
         }
 
         return ret;
@@ -79,9 +78,10 @@ public:
 
     friend Vector3 operator*(const Matrix3 &a, const Vector3 &v)
     {
-        return Vector3(a.at(0, 0)*v.x + a.at(0, 1)*v.y + a.at(0, 2)*v.z,
-                       a.at(1, 0)*v.x + a.at(1, 1)*v.y + a.at(1, 2)*v.z,
-                       a.at(2, 0)*v.x + a.at(2, 1)*v.y + a.at(2, 2)*v.z);
+        SimdFloat4 vs = v.simd();
+        return Vector3(simdSum3(simdMul(a.row(0), vs)),
+                       simdSum3(simdMul(a.row(1), vs)),
+                       simdSum3(simdMul(a.row(2), vs)));
     }
 
     void dump() const
@@ -172,7 +172,7 @@ public:
     }
 
 private:
-    float data[3*3];
+    float rows[3][4];
 };
 
 }
@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <algorithm>
+#include "Mesh.hpp"
+
+namespace T3
+{
+
+// Maximum number of triangles in a BVH leaf.
+const size_t MaxLeafTriangles = 4;
+
+// Quantization steps of the node bounds.
+const float QuantizationLevels = 65535.0f;
+
+inline float getAxis(const Vector3 &v, int axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+inline Vector3 minVector(const Vector3 &a, const Vector3 &b)
+{
+    return Vector3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
+
+inline Vector3 maxVector(const Vector3 &a, const Vector3 &b)
+{
+    return Vector3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
+
+/**
+ * Compares the triangle centroids along an axis.
+ */
+struct CentroidLess
+{
+    CentroidLess(const std::vector<Vector3> &centroids, int axis)
+        : centroids(centroids), axis(axis) {}
+
+    bool operator()(int a, int b) const
+    {
+        return getAxis(centroids[a], axis) < getAxis(centroids[b], axis);
+    }
+
+    const std::vector<Vector3> &centroids;
+    int axis;
+};
+
+MeshShape::MeshShape(int materialId)
+    : Shape(ShapeType_Mesh, materialId)
+{
+    boundingBox.min = Vector3::zero();
+    boundingBox.max = Vector3::zero();
+}
+
+MeshShape::~MeshShape()
+{
+}
+
+MeshShape *MeshShape::loadFromFile(const std::string &fileName)
+{
+    // Get the extension.
+    std::string extension;
+    size_t dot = fileName.rfind('.');
+    if(dot != std::string::npos)
+        extension = fileName.substr(dot + 1);
+    for(size_t i = 0; i < extension.size(); ++i)
+        extension[i] = tolower(extension[i]);
+
+    MeshShape *mesh = new MeshShape();
+    bool loaded = false;
+    if(extension == "obj")
+        loaded = mesh->loadOBJ(fileName);
+    else if(extension == "ply")
+        loaded = mesh->loadPLY(fileName);
+    else
+        fprintf(stderr, "Unsupported mesh format %s\n", fileName.c_str());
+
+    if(!loaded || mesh->getTriangleCount() == 0)
+    {
+        if(loaded)
+            fprintf(stderr, "The mesh %s does not have triangles\n", fileName.c_str());
+        delete mesh;
+        return NULL;
+    }
+
+    return mesh;
+}
+
+void MeshShape::addVertex(float x, float y, float z)
+{
+    Vector3 vertex(x, y, z);
+    if(vertices.empty())
+    {
+        boundingBox.min = vertex;
+        boundingBox.max = vertex;
+    }
+    else
+    {
+        boundingBox.min = minVector(boundingBox.min, vertex);
+        boundingBox.max = maxVector(boundingBox.max, vertex);
+    }
+
+    vertices.push_back(x);
+    vertices.push_back(y);
+    vertices.push_back(z);
+}
+
+void MeshShape::addPolygon(const int *polygon, int count)
+{
+    // Ignore the polygons with invalid vertices.
+    int vertexCount = getVertexCount();
+    for(int i = 0; i < count; ++i)
+    {
+        if(polygon[i] < 0 || polygon[i] >= vertexCount)
+            return;
+    }
+
+    // Triangulate as a fan.
+    for(int i = 2; i < count; ++i)
+    {
+        indices.push_back(polygon[0]);
+        indices.push_back(polygon[i - 1]);
+        indices.push_back(polygon[i]);
+    }
+}
+
+void MeshShape::transform(const Vector3 &scale, const Vector3 &translation)
+{
+    // Add the vertices again, to recompute the bounds.
+    std::vector<float> oldVertices;
+    oldVertices.swap(vertices);
+    for(size_t i = 0; i < oldVertices.size(); i += 3)
+    {
+        addVertex(oldVertices[i]*scale.x + translation.x,
+                  oldVertices[i + 1]*scale.y + translation.y,
+                  oldVertices[i + 2]*scale.z + translation.z);
+    }
+}
+
+size_t MeshShape::getVertexCount() const
+{
+    return vertices.size() / 3;
+}
+
+size_t MeshShape::getTriangleCount() const
+{
+    return indices.size() / 3;
+}
+
+size_t MeshShape::getMemorySize() const
+{
+    return nodes.size()*sizeof(QuantizedBVHNode) + vertices.size()*sizeof(float) + indices.size()*sizeof(int);
+}
+
+const AABox &MeshShape::getBoundingBox() const
+{
+    return boundingBox;
+}
+
+Vector3 MeshShape::getQuantizationScale() const
+{
+    return (boundingBox.max - boundingBox.min)/QuantizationLevels;
+}
+
+const std::vector<QuantizedBVHNode> &MeshShape::getNodes() const
+{
+    return nodes;
+}
+
+const std::vector<float> &MeshShape::getVertices() const
+{
+    return vertices;
+}
+
+const std::vector<int> &MeshShape::getIndices() const
+{
+    return indices;
+}
+
+//----------------------------------------------------------------------------
+// OBJ loading
+//
+
+bool MeshShape::loadOBJ(const std::string &fileName)
+{
+    FILE *file = fopen(fileName.c_str(), "r");
+    if(!file)
+    {
+        fprintf(stderr, "Failed to open the mesh %s\n", fileName.c_str());
+        return false;
+    }
+
+    char line[4096];
+    std::vector<int> polygon;
+    while(fgets(line, sizeof(line), file))
+    {
+        if(line[0] == 'v' && isspace(line[1]))
+        {
+            float x, y, z;
+            if(sscanf(line + 2, "%f %f %f", &x, &y, &z) == 3)
+                addVertex(x, y, z);
+        }
+        else if(line[0] == 'f' && isspace(line[1]))
+        {
+            polygon.clear();
+            char *pos = line + 2;
+            for(;;)
+            {
+                char *end;
+                long index = strtol(pos, &end, 10);
+                if(end == pos)
+                    break;
+
+                // Skip the texture coordinate and the normal indices.
+                pos = end;
+                while(*pos && !isspace(*pos))
+                    ++pos;
+
+                // Indices are one based, or relative to the end when negative.
+                polygon.push_back(index < 0 ? getVertexCount() + index : index - 1);
+            }
+
+            if(polygon.size() >= 3)
+                addPolygon(&polygon[0], polygon.size());
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// PLY loading
+//
+
+enum PlyFormat
+{
+    PlyFormat_Ascii = 0,
+    PlyFormat_BinaryLittleEndian,
+    PlyFormat_BinaryBigEndian,
+};
+
+enum PlyType
+{
+    PlyType_Invalid = 0,
+    PlyType_Int8,
+    PlyType_UInt8,
+    PlyType_Int16,
+    PlyType_UInt16,
+    PlyType_Int32,
+    PlyType_UInt32,
+    PlyType_Float32,
+    PlyType_Float64,
+};
+
+struct PlyProperty
+{
+    std::string name;
+    PlyType type;
+    PlyType countType; // Only for lists.
+    bool list;
+};
+
+struct PlyElement
+{
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+};
+
+static PlyType parsePlyType(const char *name)
+{
+    if(!strcmp(name, "char") || !strcmp(name, "int8"))
+        return PlyType_Int8;
+    else if(!strcmp(name, "uchar") || !strcmp(name, "uint8"))
+        return PlyType_UInt8;
+    else if(!strcmp(name, "short") || !strcmp(name, "int16"))
+        return PlyType_Int16;
+    else if(!strcmp(name, "ushort") || !strcmp(name, "uint16"))
+        return PlyType_UInt16;
+    else if(!strcmp(name, "int") || !strcmp(name, "int32"))
+        return PlyType_Int32;
+    else if(!strcmp(name, "uint") || !strcmp(name, "uint32"))
+        return PlyType_UInt32;
+    else if(!strcmp(name, "float") || !strcmp(name, "float32"))
+        return PlyType_Float32;
+    else if(!strcmp(name, "double") || !strcmp(name, "float64"))
+        return PlyType_Float64;
+    return PlyType_Invalid;
+}
+
+static bool readPlyValue(FILE *file, PlyFormat format, PlyType type, double *value)
+{
+    if(format == PlyFormat_Ascii)
+        return fscanf(file, "%lf", value) == 1;
+
+    static const size_t sizes[] = {0, 1, 1, 2, 2, 4, 4, 4, 8};
+    unsigned char bytes[8];
+    size_t size = sizes[type];
+    if(fread(bytes, size, 1, file) != 1)
+        return false;
+
+    // The device layouts assume a little endian host.
+    if(format == PlyFormat_BinaryBigEndian)
+        std::reverse(bytes, bytes + size);
+
+    switch(type)
+    {
+    case PlyType_Int8: *value = *(signed char*)bytes; break;
+    case PlyType_UInt8: *value = *(unsigned char*)bytes; break;
+    case PlyType_Int16: *value = *(short*)bytes; break;
+    case PlyType_UInt16: *value = *(unsigned short*)bytes; break;
+    case PlyType_Int32: *value = *(int*)bytes; break;
+    case PlyType_UInt32: *value = *(unsigned int*)bytes; break;
+    case PlyType_Float32: *value = *(float*)bytes; break;
+    case PlyType_Float64: *value = *(double*)bytes; break;
+    default: return false;
+    }
+
+    return true;
+}
+
+bool MeshShape::loadPLY(const std::string &fileName)
+{
+    FILE *file = fopen(fileName.c_str(), "rb");
+    if(!file)
+    {
+        fprintf(stderr, "Failed to open the mesh %s\n", fileName.c_str());
+        return false;
+    }
+
+    // Parse the header.
+    char line[256];
+    PlyFormat format = PlyFormat_Ascii;
+    std::vector<PlyElement> elements;
+    bool valid = fgets(line, sizeof(line), file) && !strncmp(line, "ply", 3);
+    while(valid && fgets(line, sizeof(line), file))
+    {
+        char word[64], typeName[64], countTypeName[64], name[64];
+        unsigned long count;
+        if(!strncmp(line, "end_header", 10))
+            break;
+        else if(sscanf(line, "format %63s", word) == 1)
+        {
+            if(!strcmp(word, "binary_little_endian"))
+                format = PlyFormat_BinaryLittleEndian;
+            else if(!strcmp(word, "binary_big_endian"))
+                format = PlyFormat_BinaryBigEndian;
+        }
+        else if(sscanf(line, "element %63s %lu", name, &count) == 2)
+        {
+            PlyElement element;
+            element.name = name;
+            element.count = count;
+            elements.push_back(element);
+        }
+        else if(sscanf(line, "property list %63s %63s %63s", countTypeName, typeName, name) == 3)
+        {
+            PlyProperty property;
+            property.name = name;
+            property.type = parsePlyType(typeName);
+            property.countType = parsePlyType(countTypeName);
+            property.list = true;
+            valid = !elements.empty() && property.type && property.countType;
+            if(valid)
+                elements.back().properties.push_back(property);
+        }
+        else if(sscanf(line, "property %63s %63s", typeName, name) == 2)
+        {
+            PlyProperty property;
+            property.name = name;
+            property.type = parsePlyType(typeName);
+            property.countType = PlyType_Invalid;
+            property.list = false;
+            valid = !elements.empty() && property.type;
+            if(valid)
+                elements.back().properties.push_back(property);
+        }
+    }
+
+    if(!valid)
+    {
+        fprintf(stderr, "Invalid PLY header in %s\n", fileName.c_str());
+        fclose(file);
+        return false;
+    }
+
+    // Read the elements.
+    std::vector<int> polygon;
+    for(size_t e = 0; e < elements.size() && valid; ++e)
+    {
+        const PlyElement &element = elements[e];
+        bool isVertex = element.name == "vertex";
+        bool isFace = element.name == "face";
+        for(size_t i = 0; i < element.count && valid; ++i)
+        {
+            float position[3] = {0.0f, 0.0f, 0.0f};
+            for(size_t p = 0; p < element.properties.size() && valid; ++p)
+            {
+                const PlyProperty &property = element.properties[p];
+                double value;
+                if(!property.list)
+                {
+                    valid = readPlyValue(file, format, property.type, &value);
+                    if(isVertex && property.name.size() == 1 && 'x' <= property.name[0] && property.name[0] <= 'z')
+                        position[property.name[0] - 'x'] = value;
+                    continue;
+                }
+
+                // Read the list.
+                double count;
+                valid = readPlyValue(file, format, property.countType, &count);
+                polygon.clear();
+                for(int j = 0; j < (int)count && valid; ++j)
+                {
+                    valid = readPlyValue(file, format, property.type, &value);
+                    polygon.push_back((int)value);
+                }
+
+                bool indices = property.name == "vertex_indices" || property.name == "vertex_index";
+                if(valid && isFace && indices && polygon.size() >= 3)
+                    addPolygon(&polygon[0], polygon.size());
+            }
+
+            if(isVertex)
+                addVertex(position[0], position[1], position[2]);
+        }
+    }
+
+    fclose(file);
+    if(!valid)
+        fprintf(stderr, "Unexpected end of the PLY file %s\n", fileName.c_str());
+    return valid;
+}
+
+//----------------------------------------------------------------------------
+// BVH building
+//
+
+void MeshShape::buildBVH()
+{
+    size_t triangleCount = getTriangleCount();
+    nodes.clear();
+    if(triangleCount == 0)
+        return;
+
+    // Compute the triangle bounds.
+    std::vector<AABox> triangleBoxes(triangleCount);
+    std::vector<Vector3> centroids(triangleCount);
+    std::vector<int> triangles(triangleCount);
+    for(size_t i = 0; i < triangleCount; ++i)
+    {
+        const float *v0 = &vertices[indices[i*3]*3];
+        const float *v1 = &vertices[indices[i*3 + 1]*3];
+        const float *v2 = &vertices[indices[i*3 + 2]*3];
+        Vector3 a(v0[0], v0[1], v0[2]);
+        Vector3 b(v1[0], v1[1], v1[2]);
+        Vector3 c(v2[0], v2[1], v2[2]);
+        triangleBoxes[i].min = minVector(a, minVector(b, c));
+        triangleBoxes[i].max = maxVector(a, maxVector(b, c));
+        centroids[i] = (triangleBoxes[i].min + triangleBoxes[i].max)*0.5f;
+        triangles[i] = i;
+    }
+
+    // Build the tree, storing the triangles by leaf.
+    std::vector<int> sortedIndices;
+    sortedIndices.reserve(indices.size());
+    nodes.reserve(triangleCount*2/MaxLeafTriangles + 1);
+    buildNode(triangles, 0, triangleCount, triangleBoxes, centroids, sortedIndices);
+    indices.swap(sortedIndices);
+}
+
+int MeshShape::buildNode(std::vector<int> &triangles, size_t begin, size_t end,
+                         const std::vector<AABox> &triangleBoxes, const std::vector<Vector3> &centroids,
+                         std::vector<int> &sortedIndices)
+{
+    int nodeIndex = nodes.size();
+    nodes.push_back(QuantizedBVHNode());
+
+    // Compute the node bounds.
+    AABox box = triangleBoxes[triangles[begin]];
+    AABox centroidBox(centroids[triangles[begin]], centroids[triangles[begin]]);
+    for(size_t i = begin + 1; i < end; ++i)
+    {
+        int triangle = triangles[i];
+        box.min = minVector(box.min, triangleBoxes[triangle].min);
+        box.max = maxVector(box.max, triangleBoxes[triangle].max);
+        centroidBox.min = minVector(centroidBox.min, centroids[triangle]);
+        centroidBox.max = maxVector(centroidBox.max, centroids[triangle]);
+    }
+    quantizeBox(box, &nodes[nodeIndex]);
+
+    // Create a leaf.
+    size_t count = end - begin;
+    if(count <= MaxLeafTriangles)
+    {
+        int first = sortedIndices.size() / 3;
+        for(size_t i = begin; i < end; ++i)
+        {
+            int triangle = triangles[i];
+            sortedIndices.push_back(indices[triangle*3]);
+            sortedIndices.push_back(indices[triangle*3 + 1]);
+            sortedIndices.push_back(indices[triangle*3 + 2]);
+        }
+
+        nodes[nodeIndex].data = ~((first << BVH_LEAF_COUNT_BITS) | (int)count);
+        return nodeIndex;
+    }
+
+    // Split in the median of the longest centroid axis.
+    Vector3 extent = centroidBox.max - centroidBox.min;
+    int axis = 0;
+    if(extent.y > getAxis(extent, axis))
+        axis = 1;
+    if(extent.z > getAxis(extent, axis))
+        axis = 2;
+
+    size_t middle = begin + count/2;
+    std::nth_element(triangles.begin() + begin, triangles.begin() + middle, triangles.begin() + end,
+                     CentroidLess(centroids, axis));
+
+    // The first child is the next node.
+    buildNode(triangles, begin, middle, triangleBoxes, centroids, sortedIndices);
+    int secondChild = buildNode(triangles, middle, end, triangleBoxes, centroids, sortedIndices);
+    nodes[nodeIndex].data = secondChild;
+    return nodeIndex;
+}
+
+void MeshShape::quantizeBox(const AABox &box, QuantizedBVHNode *node) const
+{
+    Vector3 scale = getQuantizationScale();
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        float origin = getAxis(boundingBox.min, axis);
+        float step = getAxis(scale, axis);
+        if(step <= 0.0f)
+        {
+            node->boundsMin[axis] = 0;
+            node->boundsMax[axis] = 0;
+            continue;
+        }
+
+        // Round outwards, with a step of margin for the float errors.
+        float qmin = floor((getAxis(box.min, axis) - origin)/step) - 1.0f;
+        float qmax = ceil((getAxis(box.max, axis) - origin)/step) + 1.0f;
+        node->boundsMin[axis] = (unsigned short)std::max(qmin, 0.0f);
+        node->boundsMax[axis] = (unsigned short)std::min(qmax, QuantizationLevels);
+    }
+}
+
+} // namespace T3
@@ -0,0 +1,62 @@
+#ifndef T3_MESH_HPP
+#define T3_MESH_HPP
+
+#include <vector>
+#include <string>
+#include "Geometry.hpp"
+
+namespace T3
+{
+
+/**
+ * Triangle mesh shape, loaded from OBJ or PLY files. The triangles are
+ * sorted by the leaves of a quantized BVH.
+ */
+class MeshShape: public Shape
+{
+public:
+    MeshShape(int materialId=-1);
+    ~MeshShape();
+
+    /// Loads an OBJ or PLY file, depending on the extension.
+    static MeshShape *loadFromFile(const std::string &fileName);
+
+    /// Scales and then translates the vertices. Call before building the BVH.
+    void transform(const Vector3 &scale, const Vector3 &translation);
+
+    /// Builds the BVH, reordering the triangles.
+    void buildBVH();
+
+    size_t getVertexCount() const;
+    size_t getTriangleCount() const;
+
+    /// Memory used by the device data.
+    size_t getMemorySize() const;
+
+    const AABox &getBoundingBox() const;
+    Vector3 getQuantizationScale() const;
+
+    const std::vector<QuantizedBVHNode> &getNodes() const;
+    const std::vector<float> &getVertices() const;
+    const std::vector<int> &getIndices() const;
+
+private:
+    bool loadOBJ(const std::string &fileName);
+    bool loadPLY(const std::string &fileName);
+    void addVertex(float x, float y, float z);
+    void addPolygon(const int *polygon, int count);
+
+    int buildNode(std::vector<int> &triangles, size_t begin, size_t end,
+                  const std::vector<AABox> &triangleBoxes, const std::vector<Vector3> &centroids,
+                  std::vector<int> &sortedIndices);
+    void quantizeBox(const AABox &box, QuantizedBVHNode *node) const;
+
+    std::vector<float> vertices;
+    std::vector<int> indices;
+    std::vector<QuantizedBVHNode> nodes;
+    AABox boundingBox;
+};
+
+} // namespace T3
+
+#endif //T3_MESH_HPP
@@ -0,0 +1,28 @@
+// Night sky generation. It is built as its own program, only for the night
+// scenes.
+
+#include "Noise.hpp"
+
+__kernel void createNightSky(int offset, int width, int height, __global float4 *image,
+                            float skyRadius, float starScale, float starThreshold)
+{
+    // Compute the buffer coordinates.
+    size_t xc = get_global_id(0);
+    size_t yc = get_global_id(1);
+
+    // Compute the angle.
+    float phi = 2.0f*M_PI_F*(xc+0.5f)/(float)width;
+    float theta = M_PI_F*(yc+0.5f)/(float)height;
+
+    // Compute the actual position.
+    float x = skyRadius*sin(theta)*cos(phi);
+    float y = skyRadius*cos(theta);
+    float z = skyRadius*sin(theta)*sin(phi);
+
+    // Compute the stars.
+    float star = smoothstep(starThreshold, 1.0f, simplex_noise3D(x*starScale, y*starScale, z*starScale));
+
+    // Emit a color
+    image[offset + yc*width + xc] = color_white()*star;
+}
+
@@ -0,0 +1,166 @@
+#include <fstream>
+#include <vector>
+#include <stdio.h>
+#include "ProgramBuilder.hpp"
+#include "FrameProfiler.hpp"
+#include "TraceProfiler.hpp"
+
+namespace T3
+{
+
+static std::vector<char> readSourceFile(const std::string &fileName)
+{
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+    return std::vector<char> ((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+}
+
+ProgramBuilder::ProgramBuilder(const char *name, const char *fileName)
+    : name(name), fileName(fileName), device(NULL), program(NULL), thread(NULL),
+      built(false), buildError(CL_SUCCESS), finished(false), success(false),
+      startTime(0.0), buildTime(0.0)
+{
+}
+
+ProgramBuilder::~ProgramBuilder()
+{
+    release();
+}
+
+bool ProgramBuilder::start(cl_context context, cl_device_id device, const std::string &options)
+{
+    T3_TRACE_ZONE("ProgramBuilder::start");
+    release();
+
+    std::vector<char> sourceCode = readSourceFile(fileName);
+    if(sourceCode.empty())
+    {
+        fprintf(stderr, "Failed to read the %s program source %s.\n", name.c_str(), fileName.c_str());
+        return false;
+    }
+
+    size_t sourceCodeSize = sourceCode.size();
+    const char *sourceCodePtr = &sourceCode[0];
+    program = clCreateProgramWithSource(context, 1, &sourceCodePtr, &sourceCodeSize, NULL);
+    if(!program)
+    {
+        fprintf(stderr, "Failed to create the %s program.\n", name.c_str());
+        return false;
+    }
+
+    this->device = device;
+    this->options = options;
+    built = false;
+    finished = false;
+    success = false;
+    startTime = FrameProfiler::now();
+    thread = SDL_CreateThread(&threadEntryPoint, this);
+    if(!thread)
+    {
+        fprintf(stderr, "Failed to start the %s program build thread.\n", name.c_str());
+        clReleaseProgram(program);
+        program = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+int ProgramBuilder::threadEntryPoint(void *obj)
+{
+    ProgramBuilder *self = static_cast<ProgramBuilder*> (obj);
+    T3_TRACE_THREAD_NAME("program builder");
+    T3_TRACE_ZONE("clBuildProgram");
+
+    // The callback is not called when the build could not be started.
+    cl_int error = clBuildProgram(self->program, 1, &self->device, self->options.c_str(), &builtCallback, self);
+    if(error != CL_SUCCESS)
+        self->setBuilt(error);
+    return 0;
+}
+
+void CL_CALLBACK ProgramBuilder::builtCallback(cl_program program, void *userData)
+{
+    static_cast<ProgramBuilder*> (userData)->setBuilt(CL_SUCCESS);
+}
+
+void ProgramBuilder::setBuilt(cl_int error)
+{
+    Lock l(mutex);
+    built = true;
+    buildError = error;
+    buildTime = FrameProfiler::now() - startTime;
+    builtCond.broadcast();
+}
+
+bool ProgramBuilder::finish()
+{
+    if(!program)
+        return false;
+    if(finished)
+        return success;
+
+    T3_TRACE_ZONE("ProgramBuilder::finish");
+    {
+        Lock l(mutex);
+        while(!built)
+            builtCond.wait(l);
+    }
+    SDL_WaitThread(thread, NULL);
+    thread = NULL;
+    finished = true;
+
+    // Print the build log.
+    size_t bufferSize = 0;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &bufferSize);
+    char *buffer = new char[bufferSize+1];
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, bufferSize, buffer, NULL);
+    buffer[bufferSize] = 0;
+    fprintf(stderr, "%s\n", buffer);
+    delete [] buffer;
+
+    cl_build_status status = CL_BUILD_ERROR;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, NULL);
+    if(buildError != CL_SUCCESS || status != CL_BUILD_SUCCESS)
+    {
+        fprintf(stderr, "Failed to build the %s program.\n", name.c_str());
+        return false;
+    }
+
+    printf("Program %s built in %.1f ms\n", name.c_str(), buildTime);
+    success = true;
+    return true;
+}
+
+bool ProgramBuilder::isStarted() const
+{
+    return program != NULL;
+}
+
+cl_program ProgramBuilder::getProgram() const
+{
+    return program;
+}
+
+double ProgramBuilder::getBuildTime() const
+{
+    Lock l(mutex);
+    return buildTime;
+}
+
+void ProgramBuilder::release()
+{
+    if(!program)
+        return;
+
+    // The program can't be released while it is being built.
+    if(!finished)
+        finish();
+
+    clReleaseProgram(program);
+    program = NULL;
+    finished = false;
+    success = false;
+}
+
+} // namespace T3
@@ -0,0 +1,68 @@
+#ifndef T3_PROGRAM_BUILDER_HPP
+#define T3_PROGRAM_BUILDER_HPP
+
+#include <string>
+#include <CL/cl.h>
+#include "Threading.hpp"
+
+namespace T3
+{
+
+/**
+ * Builds an OpenCL program from a source file on a worker thread, so that
+ * several programs are compiled at the same time. The end of the build is
+ * reported by the clBuildProgram callback.
+ */
+class ProgramBuilder
+{
+public:
+    ProgramBuilder(const char *name, const char *fileName);
+    ~ProgramBuilder();
+
+    /// Creates the program and starts building it.
+    bool start(cl_context context, cl_device_id device, const std::string &options);
+
+    /// Waits for the build and prints its log. Returns false when the
+    /// program could not be built.
+    bool finish();
+
+    /// Tells whether the build was started since the last release.
+    bool isStarted() const;
+
+    /// Gets the built program.
+    cl_program getProgram() const;
+
+    /// Time taken by the build, in milliseconds.
+    double getBuildTime() const;
+
+    /// Waits for a pending build and releases the program.
+    void release();
+
+private:
+    static int threadEntryPoint(void *obj);
+    static void CL_CALLBACK builtCallback(cl_program program, void *userData);
+    void setBuilt(cl_int error);
+
+    std::string name;
+    std::string fileName;
+    std::string options;
+    cl_device_id device;
+    cl_program program;
+
+    // Build thread and completion.
+    SDL_Thread *thread;
+    Mutex mutex;
+    Condition builtCond;
+    bool built;
+    cl_int buildError;
+    bool finished;
+    bool success;
+
+    // Build timing.
+    double startTime;
+    double buildTime;
+};
+
+} // namespace T3
+
+#endif //T3_PROGRAM_BUILDER_HPP
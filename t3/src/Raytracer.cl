@@ -6,45 +6,46 @@
 __constant const float PositionDisp = 0.001f;
 __constant const float ShadowMin = 0.1f;
 
-template<typename T, int N=7>
-class BoundedStack
-{
-public:
-    typedef T Frame;
-
-    BoundedStack()
-        : size(0) {}
-    ~BoundedStack() {}
-
-    bool empty() const
-    {
-        return size == 0;
-    }
-
-    bool full() const
-    {
-        return size == N;
-    }
-
-    void push(const Frame &frame)
-    {
-        frames[size++] = frame;
-    }
+// Maximum number of hits along a camera path. It is chosen per scene when
+// the program is built.
+#ifndef RAYTRACER_MAX_DEPTH
+#define RAYTRACER_MAX_DEPTH 7
+#endif
+
+// Paths whose throughput drops below this weight are terminated, or played
+// by Russian roulette when RAYTRACER_RUSSIAN_ROULETTE is defined.
+#ifndef RAYTRACER_MIN_THROUGHPUT
+#define RAYTRACER_MIN_THROUGHPUT 0.0f
+#endif
+
+// Shadow rays of a sphere light. The probes are traced for every shading
+// point, and the rest of the samples only in the penumbra. Zero probes
+// treat the sphere lights as points.
+#ifndef RAYTRACER_SHADOW_PROBES
+#define RAYTRACER_SHADOW_PROBES 0
+#endif
+
+#ifndef RAYTRACER_SHADOW_SAMPLES
+#define RAYTRACER_SHADOW_SAMPLES RAYTRACER_SHADOW_PROBES
+#endif
 
-    Frame &back()
-    {
-        return frames[size-1];
-    }
-
-    void pop()
-    {
-        --size;
-    }
+/**
+ * Integer hash used for the sample jittering and the Russian roulette.
+ */
+inline unsigned int hashSample(unsigned int v)
+{
+    v = (v ^ 61u) ^ (v >> 16);
+    v *= 9u;
+    v = v ^ (v >> 4);
+    v *= 0x27d4eb2du;
+    v = v ^ (v >> 15);
+    return v;
+}
 
-private:
-    size_t size;
-    Frame frames[N];
-};
+inline float hashSampleFloat(unsigned int v)
+{
+    return (hashSample(v) & 0xFFFFFF)*(1.0f/16777216.0f);
+}
 
 inline Vector3 reflect(Vector3 I, Vector3 N)
 {
@@ -58,18 +59,83 @@ class GpuRaytracer
 {
 public:
     GpuRaytracer(const __global unsigned char *sceneData,
+                 const __material PackedMaterial *materials,
+                 const MeshDataChunks &meshData,
                  const __global unsigned int *imageDescs,
-                 const __global float4 *images)
-        : scene(sceneData), imageDescs(imageDescs), images(images) {}
+                 const __global float4 *images,
+                 unsigned int frameSeed)
+        : scene(sceneData, materials, meshData), imageDescs(imageDescs), images(images),
+          primaryLights(NULL), primaryLightCount(0), cameraConstants(NULL),
+          randomState(hashSample(get_global_id(1)*get_global_size(0) + get_global_id(0) + hashSample(frameSeed))),
+          secondaryRays(0), terminatedPaths(0), shadowRays(0), sphereShadowTests(0),
+          penumbraTests(0), penumbraVariance(0) {}
+
+    // Restricts the bounded lights of the primary hits to the list of the
+    // screen tile of a pixel.
+    void setLightTile(const __global int *tileOffsets, const __global int *tileLights, int2 coord, int2 dims)
+    {
+        if(!tileOffsets)
+            return;
+
+        int tilesPerRow = (dims.x + LightTileSize - 1)/LightTileSize;
+        int tile = (coord.y/LightTileSize)*tilesPerRow + coord.x/LightTileSize;
+        primaryLights = tileLights + tileOffsets[tile];
+        primaryLightCount = tileOffsets[tile + 1] - tileOffsets[tile];
+    }
+
+    // Uses the sphere and plane terms shared by the rays from the camera
+    // for the primary ray. NULL computes them for every ray.
+    void setCameraConstants(const __global Vector4 *constants)
+    {
+        cameraConstants = constants;
+    }
 
-    float sampleShadow(Vector3 position,  const __global Shape *lightShape);
+    float sampleShadow(Vector3 position, int lightShape);
     Color raytrace(const Ray &primaryRay);
 
+    // Continues from a primary hit found by the caller, so the primary
+    // ray isn't intersected twice.
+    Color raytrace(const Ray &primaryRay, bool hit, float rayAmount, int shape, int triangle);
+
+    // The shape hit by the last primary ray, or -1.
+    int getPrimaryShape() const
+    {
+        return primaryShape;
+    }
+
+#ifdef RAYTRACER_RAY_STATS
+    // Adds the secondary rays and the terminated paths of this work-item
+    // into the frame counters.
+    void addRayStatistics(volatile __global unsigned int *rayStats)
+    {
+        if(secondaryRays)
+            atomic_add(&rayStats[0], secondaryRays);
+        if(terminatedPaths)
+            atomic_add(&rayStats[1], terminatedPaths);
+        if(shadowRays)
+            atomic_add(&rayStats[2], shadowRays);
+        if(sphereShadowTests)
+            atomic_add(&rayStats[3], sphereShadowTests);
+        if(penumbraTests)
+            atomic_add(&rayStats[4], penumbraTests);
+        if(penumbraVariance)
+            atomic_add(&rayStats[5], penumbraVariance);
+    }
+#endif
+
 private:
+    // Path termination.
+    bool continuePath(Color &throughput);
+
+    // Soft shadows.
+    float sampleSphereShadow(Vector3 position, int lightShape);
+    bool isLightPointVisible(Vector3 position, int lightShape, Vector3 target);
+
     // Shading
-    void setShadingShape(const __global Shape *shape, const Ray &ray, float amount);
-    Color addLightContribution(const __global Shape *lightShape);
-    Color computeShading();
+    void setShadingShape(int shape, int triangle, const Ray &ray, float amount);
+    Color addLightContribution(int lightShape);
+    Color addBoundedLightContribution(int light);
+    Color computeShading(bool primaryHit);
 
     // Texture images.
     Color sampleImageNormalized(int id, Vector2 texCoord);
@@ -87,8 +153,8 @@ private:
     const __global float4 *images;
 
     // Shading data.
-    const __global Shape* currentShape;
-    const __global Material* currentMaterial;
+    int currentShape;
+    const __material PackedMaterial* currentMaterial;
     Vector3 P; // Position vector
     Vector3 SN; // Surface normal vector.
     Vector3 N; // Normal vector.
@@ -100,23 +166,110 @@ private:
 
     int lastTextureId;
     Color lastTextureColor;
+
+    int primaryShape;
+
+    // Bounded lights of the primary hits, or NULL to test all of them.
+    const __global int *primaryLights;
+    int primaryLightCount;
+
+    // Camera relative terms of the spheres and planes, or NULL.
+    const __global Vector4 *cameraConstants;
+
+    // Path statistics and random numbers.
+    unsigned int randomState;
+    unsigned int secondaryRays;
+    unsigned int terminatedPaths;
+    unsigned int shadowRays;
+    unsigned int sphereShadowTests;
+    unsigned int penumbraTests;
+    unsigned int penumbraVariance;
 };
 
-float GpuRaytracer::sampleShadow(Vector3 position,  const __global Shape *lightShape)
+float GpuRaytracer::sampleShadow(Vector3 position, int lightShape)
 {
+#if RAYTRACER_SHADOW_PROBES > 0
+    if(scene.getShapeType(lightShape) == Shape::ShapeType_Sphere)
+        return sampleSphereShadow(position, lightShape);
+#endif
+
+    shadowRays++;
     float res = 0.0f;
-    Vector3 lightDir = normalize(Shape::lightDir(lightShape, position));
+    Vector3 lightDir = normalize(scene.lightDir(lightShape, position));
     if(!scene.blockedLine(Ray(position, lightDir), lightShape))
         res = 1.0f;
 
     return res;
 }
 
-Color GpuRaytracer::addLightContribution(const __global Shape *lightShape)
+#if RAYTRACER_SHADOW_PROBES > 0
+/**
+ * Visible fraction of a sphere light. The probes are spread evenly over a
+ * ring of the disk of the sphere facing the position, so any occluder edge
+ * crossing most of the disk splits them. When they all agree the position
+ * is taken as fully lit or in the umbra. Otherwise it is in the penumbra,
+ * and the rest of the samples are traced over the whole disk.
+ */
+float GpuRaytracer::sampleSphereShadow(Vector3 position, int lightShape)
 {
-    const __global Material *lightMaterial = scene.getMaterial(lightShape->materialId);
-    if(!lightMaterial->light)
-        return color_zero();
+    Vector3 toCenter = scene.lightDir(lightShape, position);
+    float radius = scene.getSphereRadius(lightShape);
+    if(dot(toCenter, toCenter) <= radius*radius)
+        return 1.0f;
+
+    // Disk basis, turned by a random angle so the samples of the neighbour
+    // pixels do not line up.
+    Vector3 w = normalize(toCenter);
+    Vector3 up = fabs(w.y) < 0.9f ? make_vector3(0.0f, 1.0f, 0.0f) : make_vector3(1.0f, 0.0f, 0.0f);
+    Vector3 u = normalize(cross(up, w))*radius;
+    Vector3 v = cross(w, u);
+    Vector3 center = position + toCenter;
+    float rotation = hashSampleFloat(randomState++)*2.0f*M_PI_F;
+
+    // The probe ring leaves a quarter of the disk area outside.
+    sphereShadowTests++;
+    int visible = 0;
+    for(int i = 0; i < RAYTRACER_SHADOW_PROBES; ++i)
+    {
+        float angle = rotation + (i + 0.5f)*(2.0f*M_PI_F/RAYTRACER_SHADOW_PROBES);
+        Vector3 target = center + 0.8660254f*(cos(angle)*u + sin(angle)*v);
+        if(isLightPointVisible(position, lightShape, target))
+            visible++;
+    }
+
+    if(visible == 0 || visible == RAYTRACER_SHADOW_PROBES ||
+       RAYTRACER_SHADOW_SAMPLES <= RAYTRACER_SHADOW_PROBES)
+        return visible*(1.0f/RAYTRACER_SHADOW_PROBES);
+
+    // Penumbra. The disk is split in equal sectors, and the radii follow
+    // the golden ratio sequence, so the samples cover the whole disk.
+    const int extraSamples = RAYTRACER_SHADOW_SAMPLES - RAYTRACER_SHADOW_PROBES;
+    penumbraTests++;
+    for(int i = 0; i < extraSamples; ++i)
+    {
+        float angle = rotation + (i + hashSampleFloat(randomState++))*(2.0f*M_PI_F/extraSamples);
+        float area = i*0.618034f + hashSampleFloat(randomState++)*(1.0f/extraSamples);
+        Vector3 target = center + sqrt(area - floor(area))*(cos(angle)*u + sin(angle)*v);
+        if(isLightPointVisible(position, lightShape, target))
+            visible++;
+    }
+
+    // The binomial variance of the visible fraction, times the cube of the
+    // sample count, measures the noise left in the penumbra.
+    penumbraVariance += visible*(RAYTRACER_SHADOW_SAMPLES - visible);
+    return visible*(1.0f/RAYTRACER_SHADOW_SAMPLES);
+}
+
+bool GpuRaytracer::isLightPointVisible(Vector3 position, int lightShape, Vector3 target)
+{
+    shadowRays++;
+    return !scene.blockedLine(Ray(position, normalize(target - position)), lightShape);
+}
+#endif
+
+Color GpuRaytracer::addLightContribution(int lightShape)
+{
+    const __material PackedMaterial *lightMaterial = scene.getMaterial(scene.getShapeMaterialId(lightShape));
 
     // Compute the shadow
     float shadow = sampleShadow(P, lightShape);
@@ -127,7 +280,7 @@ Color GpuRaytracer::addLightContribution(const __global Shape *lightShape)
 
     // Compute the diffuse lighting.
     Color res = color_zero();
-    Vector3 L = normalize(Shape::lightDir(lightShape, P));
+    Vector3 L = normalize(scene.lightDir(lightShape, P));
     float NdotL = dot(L, N);
     if(NdotL > 0.0f)
     {
@@ -146,29 +299,50 @@ Color GpuRaytracer::addLightContribution(const __global Shape *lightShape)
     return res*lightColor;
 }
 
-Color GpuRaytracer::computeShading()
+Color GpuRaytracer::addBoundedLightContribution(int light)
+{
+    // Skip the lights out of reach before tracing the shadow ray.
+    float attenuation = scene.lightAttenuation(light, P);
+    if(attenuation <= 0.0f)
+        return color_zero();
+
+    return attenuation*addLightContribution(scene.getLightShape(light));
+}
+
+Color GpuRaytracer::computeShading(bool primaryHit)
 {
     Color color = emissionColor;
 
-    // Add the lights contributions.
-    for(int i = 0; i < scene.getShapeCount(); ++i)
-        color += addLightContribution(scene.getShape(i));
+    // Add the lights with an unbounded reach.
+    int unboundedLightCount = scene.getUnboundedLightCount();
+    for(int i = 0; i < unboundedLightCount; ++i)
+        color += addLightContribution(scene.getLightShape(i));
 
+    // The primary hits only visit the bounded lights of their tile.
+    if(primaryHit && primaryLights)
+    {
+        for(int i = 0; i < primaryLightCount; ++i)
+            color += addBoundedLightContribution(unboundedLightCount + primaryLights[i]);
+        return color;
+    }
+
+    for(int i = unboundedLightCount; i < scene.getLightCount(); ++i)
+        color += addBoundedLightContribution(i);
     return color;
 }
 
 Color GpuRaytracer::getTextureColor(int textureId)
 {
+    // Flat colors are already in the material.
+    if(textureId < 0)
+        return color_white();
+
     // Avoid computing the texture.
     if(textureId == lastTextureId)
         return lastTextureColor;
 
-    if(textureId >= 0)
-        lastTextureColor = scene.getTexture(textureId)->computeColor(P);
-    else if(textureId == -2)
-        lastTextureColor = color_white();
-    else
-        lastTextureColor = color_black();
+    lastTextureId = textureId;
+    lastTextureColor = scene.getTexture(textureId)->computeColor(P);
     return lastTextureColor;
 }
 
@@ -179,14 +353,24 @@ Vector3 GpuRaytracer::getTextureNormal(int textureId)
     return scene.getTexture(textureId)->computeNormal(P, SN);
 }
 
-void GpuRaytracer::setShadingShape(const __global Shape *shape, const Ray &ray, float rayAmount)
+void GpuRaytracer::setShadingShape(int shape, int triangle, const Ray &ray, float rayAmount)
 {
     // Compute the shading vectors.
     currentShape = shape;
     P = ray.at(rayAmount);
-    SN = Shape::normalAt(shape, P);
     V = ray.direction;
-    currentMaterial = scene.getMaterial(shape->materialId);
+    if(triangle >= 0)
+    {
+        // Face the triangles towards the ray.
+        SN = scene.triangleNormal(triangle);
+        if(dot(SN, V) > 0.0f)
+            SN = -SN;
+    }
+    else
+    {
+        SN = scene.normalAt(shape, P);
+    }
+    currentMaterial = scene.getMaterial(scene.getShapeMaterialId(shape));
 
     // Get the material data.
     lastTextureId = -3;
@@ -217,124 +401,120 @@ Color GpuRaytracer::computeSkyColor(const Vector3 &direction)
     return sampleImageNormalized(0, make_vector2(phi*M_1_PI_F*0.5, theta*M_1_PI_F));
 }
 
-enum RaytraceState
-{
-    RS_Initial = 0,
-    RS_ReflectionReturn,
-    RS_RefractionReturn,
-    RS_Return,
-};
-
+/**
+ * Raytrace path state. Each hit continues with at most one reflection or
+ * refraction, so the reflection and refraction multipliers of the previous
+ * hits are folded into a single throughput weight instead of being kept in
+ * a stack.
+ */
 struct RaytraceFrame
 {
-    RaytraceFrame() {}
-    RaytraceFrame(const Ray &ray, const Color &color, RaytraceState returnState = RS_Return, float rindex=1.0f)
-        : ray(ray), color(color), returnState(returnState), refractionIndex(rindex) {}
+    RaytraceFrame(const Ray &ray)
+        : ray(ray), throughput(color_white()), refractionIndex(1.0f) {}
     ~RaytraceFrame() {}
 
-    const __global Shape *shape;
     Ray ray;
-    Color color;
-    Color reflectionColor;
-    Color refractionColor;
+    Color throughput;
     float refractionIndex;
-    RaytraceState returnState;
 };
 
+bool GpuRaytracer::continuePath(Color &throughput)
+{
+    float weight = fmax(throughput.x, fmax(throughput.y, throughput.z));
+    if(weight >= RAYTRACER_MIN_THROUGHPUT)
+        return true;
+
+#ifdef RAYTRACER_RUSSIAN_ROULETTE
+    // Keep the path with a probability proportional to its weight. The
+    // survivors are compensated, so the estimate stays unbiased.
+    float survival = weight / RAYTRACER_MIN_THROUGHPUT;
+    if(survival > 0.0f && hashSampleFloat(randomState++) < survival)
+    {
+        throughput *= 1.0f/survival;
+        return true;
+    }
+#endif
+
+    terminatedPaths++;
+    return false;
+}
+
 Color GpuRaytracer::raytrace(const Ray &primaryRay)
 {
-    BoundedStack<RaytraceFrame> stack;
+    // The primary ray starts at the camera.
+    float rayAmount;
+    int shape;
+    int triangle;
+    bool hit = cameraConstants ?
+        scene.firstCameraIntersection(primaryRay, cameraConstants, &rayAmount, &shape, &triangle) :
+        scene.firstIntersection(primaryRay, &rayAmount, &shape, &triangle);
+    return raytrace(primaryRay, hit, rayAmount, shape, triangle);
+}
+
+Color GpuRaytracer::raytrace(const Ray &primaryRay, bool hit, float rayAmount, int shape, int triangle)
+{
     Color color = color_zero();
-    RaytraceState state = RS_Initial;
 
-    // Start with the primary ray.
-    stack.push(RaytraceFrame(primaryRay, color_zero()));
-    while(!stack.empty())
+    // Start with the primary hit.
+    primaryShape = -1;
+    RaytraceFrame frame(primaryRay);
+    for(int depth = 0; depth < RAYTRACER_MAX_DEPTH; ++depth)
     {
-        // References to the stack frame.
-        Ray &ray = stack.back().ray;
-        const __global Shape *&shape = stack.back().shape;
-        Color &currentColor = stack.back().color;
-        Color &reflectionColor = stack.back().reflectionColor;
-        Color &refractionColor = stack.back().refractionColor;
-        float &currentRIndex = stack.back().refractionIndex;
-
-        // Act according to the state.
-        switch(state)
+        const Ray &ray = frame.ray;
+
+        // Cast the secondary rays. They are counted whether they hit or
+        // reach the sky.
+        if(depth > 0)
         {
-        case RS_Initial:
-            {
-                // Cast the ray.
-                float rayAmount;                
-
-                // Check the result.                
-                if(scene.firstIntersection(ray, &rayAmount, &shape))
-                {
-                    // Set the shading shape data.
-                    setShadingShape(shape, ray, rayAmount);
-                    color = currentColor = computeShading();
-
-                    // Finish when the stack is full
-                    if(!stack.full())
-                    {
-                        // Try to add reflection.
-                        if(currentMaterial->reflection > 0.0f)
-                        {
-                            // Compute the reflected vector
-                            Vector3 R = reflect(ray.direction, N);
-
-                            // Cast the reflection.
-                            reflectionColor = currentMaterial->reflection*this->specularColor;
-                            Vector3 pos = P;
-                            stack.push(RaytraceFrame(Ray(pos, R), color_zero(), RS_ReflectionReturn));
-                            state = RS_Initial;
-                            continue;
-                        }
-                        else if(currentMaterial->refraction > 0.0f)
-                        {
-                            float rindex = currentMaterial->refractionIndex;
-	                        float n = currentRIndex / rindex;
-
-                            Vector3 RN = N*Shape::computeSideFactor(shape, ray.start);
-	                        float cosI = -dot(ray.direction, RN);
-	                        float cosT2 = 1.0f - n * n * (1.0f - cosI * cosI);
-	                        if (cosT2 > 0.0f)
-	                        {
-                                // Compute the refracted vector
-                                Vector3 T = (n * ray.direction) + (n * cosI - sqrt(cosT2)) * RN;
-
-                                // Cast the refraction.
-                                refractionColor = currentMaterial->refraction*this->specularColor;
-                                Vector3 pos = ray.at(rayAmount) + T*PositionDisp;
-                                stack.push(RaytraceFrame(Ray(pos, T), color_zero(), RS_RefractionReturn, rindex));
-                                state = RS_Initial;
-                                continue;
-                            }
-                        }
-                    }
-                }
-                else
-                {
-                    color = currentColor = computeSkyColor(ray.direction);
-                }
-            }
-            break;
-        case RS_ReflectionReturn:
-            currentColor += reflectionColor*color;
-            color = currentColor;
+            secondaryRays++;
+            hit = scene.firstIntersection(ray, &rayAmount, &shape, &triangle);
+        }
+        if(!hit)
+        {
+            color += frame.throughput*computeSkyColor(ray.direction);
             break;
-        case RS_RefractionReturn:
-            currentColor += refractionColor*color;
-            color = currentColor;
+        }
+
+        if(depth == 0)
+            primaryShape = shape;
+
+        // Set the shading shape data.
+        setShadingShape(shape, triangle, ray, rayAmount);
+        color += frame.throughput*computeShading(depth == 0);
+
+        // Continue with the reflection. Like the old reflection frames, it
+        // starts again in a medium of index 1.
+        if(currentMaterial->reflection > 0.0f)
+        {
+            frame.throughput *= currentMaterial->reflection*this->specularColor;
+            if(!continuePath(frame.throughput))
+                break;
+            frame.refractionIndex = 1.0f;
+            frame.ray = Ray(P, reflect(ray.direction, N));
+            continue;
+        }
+
+        // Or with the refraction.
+        if(currentMaterial->refraction <= 0.0f)
             break;
-        default:
-            color = currentColor;
+
+        float rindex = currentMaterial->refractionIndex;
+        float n = frame.refractionIndex / rindex;
+
+        Vector3 RN = N*scene.computeSideFactor(shape, ray.start);
+        float cosI = -dot(ray.direction, RN);
+        float cosT2 = 1.0f - n * n * (1.0f - cosI * cosI);
+        if(cosT2 <= 0.0f)
             break;
-        }
 
-        // Pop the stack.
-        state = stack.back().returnState;
-        stack.pop();
+        // Compute the refracted vector
+        Vector3 T = (n * ray.direction) + (n * cosI - sqrt(cosT2)) * RN;
+        Vector3 pos = ray.at(rayAmount) + T*PositionDisp;
+        frame.throughput *= currentMaterial->refraction*this->specularColor;
+        if(!continuePath(frame.throughput))
+            break;
+        frame.refractionIndex = rindex;
+        frame.ray = Ray(pos, T);
     }
 
     return color;
@@ -351,184 +531,383 @@ inline Color toneMap(Color c)
     return make_color(exposeChannel(c.x, l), exposeChannel(c.y, l), exposeChannel(c.z, l), exposeChannel(c.w, l));
 }
 
+/**
+ * Gathers the even bits of a morton code.
+ */
+inline int compactMortonBits(int v)
+{
+    v &= 0x55555555;
+    v = (v | (v >> 1)) & 0x33333333;
+    v = (v | (v >> 2)) & 0x0f0f0f0f;
+    v = (v | (v >> 4)) & 0x00ff00ff;
+    v = (v | (v >> 8)) & 0x0000ffff;
+    return v;
+}
+
+/**
+ * Maps the work item into a pixel. In the morton tiles order, consecutive
+ * work items are walked in Z-order inside of small screen tiles, so that
+ * nearby work items trace nearby rays.
+ */
+inline int2 computePixelCoord(int pixelOrder, int2 dims)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if(pixelOrder == PixelOrder_MortonTiles)
+    {
+        int index = y*get_global_size(0) + x;
+        int tileArea = PixelTileSize*PixelTileSize;
+        int tile = index / tileArea;
+        int tileIndex = index % tileArea;
+        int tilesPerRow = dims.x / PixelTileSize;
+        x = (tile % tilesPerRow)*PixelTileSize + compactMortonBits(tileIndex);
+        y = (tile / tilesPerRow)*PixelTileSize + compactMortonBits(tileIndex >> 1);
+    }
+
+    return (int2)(x, y);
+}
+
+/**
+ * Creates the ray that passes through a point of the screen plane, given in
+ * pixel units.
+ */
+inline Ray makePrimaryRay(float4 origin, float4 screenPlaneP1, float4 screenPlaneP2,
+                          float4 screenPlaneP4, float2 pixel, int2 dims)
+{
+    float3 screenU = screenPlaneP2.xyz - screenPlaneP1.xyz;
+    float3 screenV = screenPlaneP4.xyz - screenPlaneP1.xyz;
+    float3 screenCoord = screenPlaneP1.xyz + screenU*(pixel.x/(float)dims.x) + screenV*(pixel.y/(float)dims.y);
+
+    // Create the ray.
+    float3 rayDir = normalize(screenCoord - origin.xyz);
+    return Ray(origin.xyz, rayDir);
+}
+
+/**
+ * Computes the sphere and plane terms that only depend on the ray start,
+ * once per frame for every primary ray.
+ */
+__kernel void computeCameraConstants(const __global unsigned char *sceneData,
+                                     const __material PackedMaterial *materials,
+                                     const __global unsigned char *meshData,
+                                     float4 origin,
+                                     float4 screenPlaneP1, float4 screenPlaneP2,
+                                     float4 screenPlaneP3, float4 screenPlaneP4,
+                                     const __global unsigned int *imageDescs,
+                                     const __global float4 *images,
+                                     __write_only image2d_t colorBuffer,
+                                     volatile __global unsigned int *rayStats,
+                                     const __global int *lightTileOffsets,
+                                     const __global int *lightTileLights,
+                                     const __global unsigned char *meshData1,
+                                     const __global unsigned char *meshData2,
+                                     const __global unsigned char *meshData3,
+                                     int meshChunkShift,
+                                     unsigned int frameSeed,
+                                     __global float4 *cameraConstants)
+{
+    int id = get_global_id(0);
+    MeshDataChunks meshChunks = makeMeshDataChunks(meshData, meshData1, meshData2, meshData3, meshChunkShift);
+    SceneAccess scene(sceneData, materials, meshChunks);
+    if(id < scene.getCameraConstantCount())
+        cameraConstants[id] = scene.computeCameraConstants(id, origin.xyz);
+}
+
 __kernel void castPrimaryRays(const __global unsigned char *sceneData,
+                              const __material PackedMaterial *materials,
+                              const __global unsigned char *meshData,
                               float4 origin,
                               float4 screenPlaneP1, float4 screenPlaneP2,
                               float4 screenPlaneP3, float4 screenPlaneP4,
                               const __global unsigned int *imageDescs,
                               const __global float4 *images,
-                              __write_only image2d_t colorBuffer)
+                              __write_only image2d_t colorBuffer,
+                              volatile __global unsigned int *rayStats,
+                              const __global int *lightTileOffsets,
+                              const __global int *lightTileLights,
+                              const __global unsigned char *meshData1,
+                              const __global unsigned char *meshData2,
+                              const __global unsigned char *meshData3,
+                              int meshChunkShift,
+                              unsigned int frameSeed,
+                              int pixelOrder,
+                              __global float4 *pixelColors,
+                              __global int *pixelShapes,
+                              const __global float4 *cameraConstants)
 {
     // Compute the buffer coordinates.
-    size_t x = get_global_id(0);
-    size_t y = get_global_id(1);
-    int2 coord = (int2)(x, y);
-
-    // Compute the image coordinate.
     int2 dims = get_image_dim(colorBuffer);
-    float3 screenU = screenPlaneP2.xyz - screenPlaneP1.xyz;
-    float3 screenV = screenPlaneP4.xyz - screenPlaneP1.xyz;
-    float3 screenCoord = screenPlaneP1.xyz + screenU*((float)x/(float)dims.x) + screenV*((float)y/(float)dims.y);
+    int2 coord = computePixelCoord(pixelOrder, dims);
 
     // Create the ray.
-    float3 rayDir = normalize(screenCoord - origin.xyz);
-    Ray ray(origin.xyz, rayDir);
+    Ray ray = makePrimaryRay(origin, screenPlaneP1, screenPlaneP2, screenPlaneP4,
+                             (float2)(coord.x, coord.y), dims);
 
     // Perform raytracing.
-    GpuRaytracer raytracer(sceneData, imageDescs, images);
+    MeshDataChunks meshChunks = makeMeshDataChunks(meshData, meshData1, meshData2, meshData3, meshChunkShift);
+    GpuRaytracer raytracer(sceneData, materials, meshChunks, imageDescs, images, frameSeed);
+    raytracer.setLightTile(lightTileOffsets, lightTileLights, coord, dims);
+    raytracer.setCameraConstants(cameraConstants);
     Color color = raytracer.raytrace(ray);
+#ifdef RAYTRACER_RAY_STATS
+    raytracer.addRayStatistics(rayStats);
+#endif
+
+    // Keep the sample for the adaptive antialiasing.
+    if(pixelColors)
+    {
+        int index = coord.y*dims.x + coord.x;
+        pixelColors[index] = color;
+        pixelShapes[index] = raytracer.getPrimaryShape();
+    }
 
     // Emit a color
     write_imagef(colorBuffer, coord, toneMap(color));
 }
 
 //------------------------------------------------------------------------------
-// Sky
+// Temporal reprojection
 //
 
-/// Constants taken from http://www.gamedev.net/topic/584256-atmospheric-scattering-and-dark-sky/
+// Maximum distance between the reprojected hit points, relative to the
+// distance to the camera.
+__constant const float ReprojectionTolerance = 0.01f;
 
-__constant const int ScatteringSamples = 20;
-__constant const float ScatteringInvSamples = 1.0f/20.0f;
-
-__constant const float EarthRadius = 6360e3f;
-__constant const float AtmosphereRadius = 6420e3f;
-
-__constant const float RayleighScaleHeight = 7994.0f;
-__constant const float MieScaleHeight = 1200.0f;
-__constant const Vector4 RayleighConstants = constant_vector4(5.5e-6f, 13.0e-6f, 22.4e-6f, 0.0f);
-__constant const Vector4 MieConstants = constant_vector4(21e-6f, 21e-6f, 21e-6f, 0.0f);
-__constant const float ScatterG = 0.75f;
-
-float rayleighScatterPhase(float c)
-{
-    return (1 + c*c)*0.75f;
-}
-
-float mieScatterPhase(float c, float g)
+/**
+ * Projects a point into the screen of a camera, in pixel units.
+ * Returns false when the point is behind the camera.
+ */
+inline bool projectIntoScreen(float3 point, float4 origin, float4 screenPlaneP1,
+                              float4 screenPlaneP2, float4 screenPlaneP4, int2 dims, int2 *pixel)
 {
-    float gg = g*g;
-    float A = 1.5f*(1.0f  - gg)/(2.0f + gg);
-    float B = (1.0f + c*c)/pow(1.0f + gg - 2.0f*g*c, 1.5f);
-    return A*B;
+    float3 screenU = screenPlaneP2.xyz - screenPlaneP1.xyz;
+    float3 screenV = screenPlaneP4.xyz - screenPlaneP1.xyz;
+    float3 normal = cross(screenU, screenV);
+
+    // Intersect the line of sight with the screen plane.
+    float3 dir = point - origin.xyz;
+    float d = dot(dir, normal);
+    if(d == 0.0f)
+        return false;
+    float t = dot(screenPlaneP1.xyz - origin.xyz, normal) / d;
+    if(t <= 0.0f)
+        return false;
+
+    // Compute the screen coordinates.
+    float3 screenPoint = origin.xyz + dir*t - screenPlaneP1.xyz;
+    float u = dot(screenPoint, screenU)/dot(screenU, screenU);
+    float v = dot(screenPoint, screenV)/dot(screenV, screenV);
+    *pixel = (int2)(floor(u*dims.x + 0.5f), floor(v*dims.y + 0.5f));
+    return 0 <= pixel->x && pixel->x < dims.x && 0 <= pixel->y && pixel->y < dims.y;
 }
 
 /**
- * Sky scattering computation.
- * Code adapted from: http://www.scratchapixel.com/lessons/3d-advanced-lessons/simulating-the-colors-of-the-sky/atmospheric-scattering/
+ * Casts the primary rays, reusing the color of the last frame for the
+ * pixels whose primary hit is still visible on the same shape. Only the
+ * disoccluded pixels, and a rotating fraction used as refresh, are shaded.
  */
-Color inScattering(Vector3 camera, Vector3 b, Vector3 sunDirection, Color sunColor)
+__kernel void castReprojectedRays(const __global unsigned char *sceneData,
+                                  const __material PackedMaterial *materials,
+                                  const __global unsigned char *meshData,
+                                  float4 origin,
+                                  float4 screenPlaneP1, float4 screenPlaneP2,
+                                  float4 screenPlaneP3, float4 screenPlaneP4,
+                                  const __global unsigned int *imageDescs,
+                                  const __global float4 *images,
+                                  __write_only image2d_t colorBuffer,
+                                  volatile __global unsigned int *rayStats,
+                                  const __global int *lightTileOffsets,
+                                  const __global int *lightTileLights,
+                                  const __global unsigned char *meshData1,
+                                  const __global unsigned char *meshData2,
+                                  const __global unsigned char *meshData3,
+                                  int meshChunkShift,
+                                  unsigned int frameSeed,
+                                  int pixelOrder,
+                                  __global float4 *pixelColors,
+                                  __global int *pixelShapes,
+                                  __global float4 *pixelPositions,
+                                  const __global float4 *previousColors,
+                                  const __global int *previousShapes,
+                                  const __global float4 *previousPositions,
+                                  float4 previousOrigin,
+                                  float4 previousScreenPlaneP1, float4 previousScreenPlaneP2,
+                                  float4 previousScreenPlaneP4,
+                                  int cacheValid, int refreshPhase,
+                                  volatile __global int *reusedPixelCount)
 {
-    // Phase functions.
-    Vector3 a = camera;
-    float cosTheta = dot(normalize(b - camera), sunDirection);
-    float phaseR = rayleighScatterPhase(cosTheta);
-    float phaseM = mieScatterPhase(cosTheta, ScatterG);
-
-    // Loop state.
-    Vector3 delta = (b - a)*ScatteringInvSamples;
-    float sampleLength = length(delta);
-    float opticalDepthR = 0.0;
-    float opticalDepthM = 0.0;
-    Color sumR = color_zero();
-    Color sumM = color_zero();
-
-    // Used for light direction.
-    SphereShape atmosSphere(vector3_zero(), AtmosphereRadius);
-   
-    // Integral evaluation
-    Vector3 samplePoint = a;
-    for(int i = 0; i < ScatteringSamples; ++i)
+    // Compute the buffer coordinates.
+    int2 dims = get_image_dim(colorBuffer);
+    int2 coord = computePixelCoord(pixelOrder, dims);
+    int index = coord.y*dims.x + coord.x;
+
+    // Find the primary hit.
+    Ray ray = makePrimaryRay(origin, screenPlaneP1, screenPlaneP2, screenPlaneP4,
+                             (float2)(coord.x, coord.y), dims);
+    MeshDataChunks meshChunks = makeMeshDataChunks(meshData, meshData1, meshData2, meshData3, meshChunkShift);
+    SceneAccess scene(sceneData, materials, meshChunks);
+    float rayAmount;
+    int shape;
+    int triangle;
+    bool hit = scene.firstIntersection(ray, &rayAmount, &shape, &triangle);
+    float3 position = ray.at(rayAmount);
+
+    // Try to reuse the last frame color.
+    Color color;
+    bool reused = false;
+    bool refresh = (coord.x + coord.y*3) % ReprojectionRefreshPeriod == refreshPhase;
+    int2 previousCoord;
+    if(cacheValid && hit && !refresh &&
+        projectIntoScreen(position, previousOrigin, previousScreenPlaneP1, previousScreenPlaneP2,
+                          previousScreenPlaneP4, dims, &previousCoord))
     {
-        samplePoint += 0.5f*delta;
-
-        // Optical depth
-        float height = length(samplePoint) - EarthRadius;
-        float hr = exp(-height/RayleighScaleHeight)*sampleLength;
-        float hm = exp(-height/MieScaleHeight)*sampleLength;
-        opticalDepthR += hr;
-        opticalDepthM += hm;
-
-        // Light optical depth.
-        Ray ray = Ray(samplePoint, sunDirection.xyz);
-        Vector3 la = samplePoint;
-        Vector3 lb = ray.at(atmosSphere.intersects(ray));
-        Vector3 ldelta = (lb - la)*ScatteringInvSamples;
-        float opticalDepthLightR = 0.0f, opticalDepthLightM = 0.0f;
-        float lightSampleLength = length(ldelta);
-        int j = 0;
-        Vector3 lightSamplePoint = la;
-        for(j = 0; j < ScatteringSamples; ++j)
+        int previousIndex = previousCoord.y*dims.x + previousCoord.x;
+        float4 previousPosition = previousPositions[previousIndex];
+        float tolerance = ReprojectionTolerance*rayAmount;
+        if(previousShapes[previousIndex] == shape && previousPosition.w != 0.0f &&
+            length(previousPosition.xyz - position) < tolerance)
         {
-            lightSamplePoint += 0.5f*ldelta;
-            float lightHeight = length(lightSamplePoint) - EarthRadius;
-            if(lightHeight < 0) break;
-            opticalDepthLightR += exp(-lightHeight/RayleighScaleHeight)*lightSampleLength;
-            opticalDepthLightM += exp(-lightHeight/MieScaleHeight)*lightSampleLength;
+            color = previousColors[previousIndex];
+            reused = true;
+            atomic_inc(reusedPixelCount);
         }
+    }
 
-        if(j == ScatteringSamples)
-        {
-            Color tau = RayleighConstants*(opticalDepthR + opticalDepthLightR) + MieConstants* 1.1 *(opticalDepthM + opticalDepthLightM);
-            Color att = make_color(exp(-tau.x), exp(-tau.y), exp(-tau.z), 0.0f);
-            sumR += hr*tau;
-            sumM += hm*att;
-        }
+    // Shade the pixel.
+    if(!reused)
+    {
+        GpuRaytracer raytracer(sceneData, materials, meshChunks, imageDescs, images, frameSeed);
+        raytracer.setLightTile(lightTileOffsets, lightTileLights, coord, dims);
+        color = raytracer.raytrace(ray, hit, rayAmount, shape, triangle);
+#ifdef RAYTRACER_RAY_STATS
+        raytracer.addRayStatistics(rayStats);
+#endif
     }
 
-    return 5.0f*sunColor*(sumR*phaseR*RayleighConstants + sumM*phaseM*MieConstants);
+    // Store the G-buffer.
+    pixelColors[index] = color;
+    pixelShapes[index] = hit ? shape : -1;
+    pixelPositions[index] = hit ? (float4)(position, 1.0f) : (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+
+    // Emit a color
+    write_imagef(colorBuffer, coord, toneMap(color));
 }
 
-Vector3 sphericalCoordinates(float radius, float phi, float theta)
+//------------------------------------------------------------------------------
+// Adaptive antialiasing
+//
+
+/**
+ * Tells if a tone mapped color is too different from a neighbour.
+ */
+inline bool isColorEdge(Color color, Color neighbour, float threshold)
 {
-    // Compute the actual position.
-    return make_vector3(radius*sin(theta)*cos(phi), radius*cos(theta), radius*sin(theta)*sin(phi));
+    Color delta = fabs(color - neighbour);
+    return max(delta.x, max(delta.y, delta.z)) > threshold;
 }
 
-__kernel void createDaySky(int offset, int width, int height, __global float4 *image,
-                            float skyRadius, Color sunColor, Vector4 sunDirection)
+/**
+ * Finds the pixels whose shape or color differs from one of their
+ * neighbours, and appends them into a compact list.
+ */
+__kernel void detectEdges(const __global float4 *pixelColors,
+                          const __global int *pixelShapes,
+                          int width, int height, float threshold,
+                          __global int *edgePixels,
+                          volatile __global int *edgePixelCount)
 {
-    // Compute the buffer coordinates.
-    size_t xc = get_global_id(0);
-    size_t yc = get_global_id(1);
-
-    // Compute the angle.
-    float phi = 2.0f*M_PI_F*(xc+0.5f)/(float)width;
-    float theta = M_PI_F*(yc+0.5f)/(float)height;
-    Vector3 direction = sphericalCoordinates(1.0f, phi, theta);
-
-    // Compute a end position.
-    Vector3 start = EarthRadius*make_vector3(0, 1, 0);
-
-    // Correct the end position.
-    Ray ray(start, direction);
-    SphereShape sphere(vector3_zero(), AtmosphereRadius);
-    Vector3 end = ray.at(sphere.intersects(ray));
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int index = y*width + x;
+    Color color = toneMap(pixelColors[index]);
+    int shape = pixelShapes[index];
+
+    int neighbours[4];
+    int neighbourCount = 0;
+    if(x > 0)
+        neighbours[neighbourCount++] = index - 1;
+    if(x + 1 < width)
+        neighbours[neighbourCount++] = index + 1;
+    if(y > 0)
+        neighbours[neighbourCount++] = index - width;
+    if(y + 1 < height)
+        neighbours[neighbourCount++] = index + width;
+
+    bool edge = false;
+    for(int i = 0; i < neighbourCount && !edge; ++i)
+    {
+        int n = neighbours[i];
+        edge = pixelShapes[n] != shape || isColorEdge(color, toneMap(pixelColors[n]), threshold);
+    }
 
-    // Emit the result.
-    image[offset + yc*width + xc] = inScattering(start, end, sunDirection.xyz, sunColor);
+    if(edge)
+    {
+        int slot = atomic_inc(edgePixelCount);
+        if(slot < width*height)
+            edgePixels[slot] = index;
+    }
 }
 
-__kernel void createNightSky(int offset, int width, int height, __global float4 *image,
-                            float skyRadius, float starScale, float starThreshold)
+/**
+ * Traces sampleGridSize^2 stratified, jittered samples for each one of the
+ * edge pixels, and blends them with the primary sample.
+ */
+__kernel void castAdaptiveSamples(const __global unsigned char *sceneData,
+                                  const __material PackedMaterial *materials,
+                                  const __global unsigned char *meshData,
+                                  float4 origin,
+                                  float4 screenPlaneP1, float4 screenPlaneP2,
+                                  float4 screenPlaneP3, float4 screenPlaneP4,
+                                  const __global unsigned int *imageDescs,
+                                  const __global float4 *images,
+                                  __write_only image2d_t colorBuffer,
+                                  volatile __global unsigned int *rayStats,
+                                  const __global int *lightTileOffsets,
+                                  const __global int *lightTileLights,
+                                  const __global unsigned char *meshData1,
+                                  const __global unsigned char *meshData2,
+                                  const __global unsigned char *meshData3,
+                                  int meshChunkShift,
+                                  unsigned int frameSeed,
+                                  const __global int *edgePixels,
+                                  int edgePixelCount,
+                                  const __global float4 *pixelColors,
+                                  int sampleGridSize)
 {
-    // Compute the buffer coordinates.
-    size_t xc = get_global_id(0);
-    size_t yc = get_global_id(1);
-
-    // Compute the angle.
-    float phi = 2.0f*M_PI_F*(xc+0.5f)/(float)width;
-    float theta = M_PI_F*(yc+0.5f)/(float)height;
+    int edgeIndex = get_global_id(0);
+    if(edgeIndex >= edgePixelCount)
+        return;
 
-    // Compute the actual position.
-    float x = skyRadius*sin(theta)*cos(phi);
-    float y = skyRadius*cos(theta);
-    float z = skyRadius*sin(theta)*sin(phi);
+    // Compute the buffer coordinates.
+    int2 dims = get_image_dim(colorBuffer);
+    int index = edgePixels[edgeIndex];
+    int2 coord = (int2)(index % dims.x, index / dims.x);
+
+    // Trace the samples around the pixel.
+    MeshDataChunks meshChunks = makeMeshDataChunks(meshData, meshData1, meshData2, meshData3, meshChunkShift);
+    GpuRaytracer raytracer(sceneData, materials, meshChunks, imageDescs, images, frameSeed);
+    raytracer.setLightTile(lightTileOffsets, lightTileLights, coord, dims);
+    Color color = pixelColors[index];
+    float cellSize = 1.0f/sampleGridSize;
+    for(int sy = 0; sy < sampleGridSize; ++sy)
+    {
+        for(int sx = 0; sx < sampleGridSize; ++sx)
+        {
+            unsigned int seed = index*64 + sy*sampleGridSize + sx;
+            float jx = (sx + hashSampleFloat(seed*2))*cellSize - 0.5f;
+            float jy = (sy + hashSampleFloat(seed*2 + 1))*cellSize - 0.5f;
+            Ray ray = makePrimaryRay(origin, screenPlaneP1, screenPlaneP2, screenPlaneP4,
+                                     (float2)(coord.x + jx, coord.y + jy), dims);
+            color += raytracer.raytrace(ray);
+        }
+    }
 
-    // Compute the stars.
-    float star = smoothstep(starThreshold, 1.0f, simplex_noise3D(x*starScale, y*starScale, z*starScale));
+#ifdef RAYTRACER_RAY_STATS
+    raytracer.addRayStatistics(rayStats);
+#endif
 
-    // Emit a color
-    image[offset + yc*width + xc] = color_white()*star;
+    // Emit the average.
+    color *= 1.0f/(sampleGridSize*sampleGridSize + 1);
+    write_imagef(colorBuffer, coord, toneMap(color));
 }
 
@@ -1,6 +1,7 @@
 #include <string>
-#include <fstream>
 #include <vector>
+#include <algorithm>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include "Vector4.hpp"
@@ -8,34 +9,136 @@
 #include "Raytracer.hpp"
 #include "Display.hpp"
 #include "Scene.hpp"
+#include "SceneStreamer.hpp"
 #include "Image.hpp"
+#include "TraceProfiler.hpp"
 
 namespace T3
 {
 
-inline std::vector<char> readWholeFile(const char* filename)
-{
-    // open the file:
-    std::ifstream file(filename, std::ios::binary);
+// Adaptive antialiasing parameters.
+const float AdaptiveEdgeThreshold = 0.1f;
+const size_t AdaptiveSamplesGroupSize = 64;
 
-    // read the data:
-    return std::vector<char> ((std::istreambuf_iterator<char>(file)),
-                              std::istreambuf_iterator<char>());
-}
+// Arguments set by setSceneArguments, before the kernel specific ones.
+const int SceneArgumentCount = 19;
+
+// Smallest mesh data chunk, so that a BVH node never crosses a chunk.
+const int MinMeshChunkShift = 4;
+
+// Default throughput below which the secondary rays are not traced. It is
+// under one step of an 8-bit channel.
+const float DefaultMinThroughput = 1.0f/256.0f;
+
+// Counters of the ray statistics buffer: secondary rays, terminated paths,
+// shadow rays, sphere light tests, sphere light tests in the penumbra and
+// the variance of the penumbra tests.
+const int RayStatCount = 6;
+
+// Flops of the sphere and plane tests of a primary ray, with and without
+// the camera constants, counted by hand on the kernel source. The square
+// root and the hit selection are shared. They leave out the terrains, the
+// meshes and the shading, so they only estimate the saving of the tests.
+const int SphereTestFlops = 17;
+const int SphereCameraTestFlops = 7;
+const int PlaneTestFlops = 12;
+const int PlaneCameraTestFlops = 6;
+
+// Frames between full frames when reprojecting.
+const int ReprojectionFullFrameInterval = 256;
+
+// Cosine of the largest step of the sun between two reprojected frames,
+// about one degree. The refreshed pixels catch up with smaller steps.
+const float ReprojectionSunCosine = 0.99985f;
+
+// Reduced frame used to time the devices.
+const int DeviceBenchmarkWidth = 160;
+const int DeviceBenchmarkHeight = 120;
+const int DeviceBenchmarkFrames = 8;
+
+// Build options shared by every program.
+const char *const BaseBuildOptions = "-D CL_RAYTRACER -x clc++ -I cl";
+
+// Source of the day sky program, which also keys the sky cache.
+const char *const DaySkySourceFile = "cl/DaySky.cl";
 
 Raytracer::Raytracer(Application *app)
-    : app(app)
+    : app(app),
+      tracerProgram("raytracer", "cl/Raytracer.cl"),
+      daySkyProgram("day sky", DaySkySourceFile),
+      nightSkyProgram("night sky", "cl/NightSky.cl")
 {
-    selectedPlatform = 0;
+    computeContext = NULL;
+    commandQueue = NULL;
+    imagesDescBuffer = NULL;
+    imagesBuffer = NULL;
+    skyKeyframesBuffer = NULL;
+    skyErrorReport = false;
     sceneData = NULL;
     sceneDataBuffer = NULL;
+    materialBuffer = NULL;
+    for(int i = 0; i < MESH_DATA_CHUNK_COUNT; ++i)
+        meshDataBuffers[i] = NULL;
+    meshDataVersion = -1;
+    uploadedScene = NULL;
+    uploadedSceneVersion = -1;
+    sceneUploadCount = 0;
+    meshChunkShift = MinMeshChunkShift;
+    meshChunkCount = 0;
+    meshDataSize = 0;
+    maxAllocLimit = 0;
+    maxMemAllocSize = 0;
+    lightTileOffsetsBuffer = NULL;
+    lightTileLightsBuffer = NULL;
+    retuneWorkGroups = false;
+    pixelOrder = PixelOrder_Scanline;
+    pixelOrderBenchmarkFrames = 0;
+    cameraConstantsBenchmarkFrames = 0;
+    adaptiveSampleGridSize = 0;
+    pixelColorsBuffer = NULL;
+    pixelShapesBuffer = NULL;
+    edgePixelsBuffer = NULL;
+    edgePixelCountBuffer = NULL;
+    reprojectionEnabled = false;
+    pixelPositionsBuffer = NULL;
+    previousColorsBuffer = NULL;
+    previousShapesBuffer = NULL;
+    previousPositionsBuffer = NULL;
+    reusedPixelCountBuffer = NULL;
+    minThroughput = DefaultMinThroughput;
+    russianRoulette = false;
+    rayStatsEnabled = false;
+    rayStatsBuffer = NULL;
+    lastFrameRays = 0;
+    shadowProbes = 0;
+    shadowSamples = 0;
+    cameraConstantsEnabled = true;
+    cameraConstantsBuffer = NULL;
+    cameraConstantsCapacity = 0;
+    cameraConstantSpheres = -1;
+    cameraConstantPlanes = -1;
+    lastProfileFrame = -1;
+    frameSeed = 0;
+    thread = NULL;
+    sceneReady = false;
+    startupFailed = false;
+    programBuildStart = 0.0;
+    programBuildTime = 0.0;
+    primaryRaysKernel = NULL;
+    edgeDetectionKernel = NULL;
+    adaptiveSamplesKernel = NULL;
+    reprojectionKernel = NULL;
+    cameraConstantsKernel = NULL;
+    daySkyCreationKernel = NULL;
+    daySkyBlendKernel = NULL;
+    nightSkyCreationKernel = NULL;
 }
 
 Raytracer::~Raytracer()
 {
 }
 
-bool Raytracer::initialize()
+void Raytracer::readExtents()
 {
     // Get the width and the height of the surface.
     Display *display = app->getDisplay();
@@ -43,73 +146,257 @@ bool Raytracer::initialize()
     height = display->getHeight();
     skyWidth = 512;
     skyHeight = 512;
+}
+
+bool Raytracer::initialize()
+{
+    readExtents();
 
     // Reset the thread finish flag.
     threadFinishFlag = false;
+    startupFailed = false;
+    startupStatus = "Starting OpenCL";
 
-    // Start the thread.
-    Lock l(threadMutex);
+    // Start the thread. The display shows the progress until the first
+    // frame is ready.
     thread = SDL_CreateThread(&threadEntryPoint, this);
+    return thread != NULL;
+}
 
-    // Wait for initialization to finish.
-    threadStartedCond.wait(l);
-    bool result = threadStartedSuccess;
-    return result;
+void Raytracer::setSceneReady()
+{
+    Lock l(threadMutex);
+    sceneReady = true;
+    sceneReadyCond.broadcast();
 }
 
-void Raytracer::shutdown()
+std::string Raytracer::getStartupStatus()
+{
+    Lock l(threadMutex);
+    return startupStatus;
+}
+
+bool Raytracer::hasStartupFailed()
+{
+    Lock l(threadMutex);
+    return startupFailed;
+}
+
+double Raytracer::getProgramBuildTime() const
+{
+    Lock l(threadMutex);
+    return programBuildTime;
+}
+
+void Raytracer::setStartupStatus(const char *status)
+{
+    Lock l(threadMutex);
+    startupStatus = status;
+}
+
+bool Raytracer::initializeOffline()
+{
+    readExtents();
+    sceneReady = true;
+    if(!initializeRaytracerThread())
+        return false;
+
+    createSky();
+    return true;
+}
+
+bool Raytracer::reloadScene()
+{
+    T3_TRACE_ZONE("Raytracer::reloadScene");
+
+    // The build options depend on the scene. The program is kept when
+    // they don't change.
+    if((!primaryRaysKernel || makeTracerBuildOptions() != tracerBuildOptions) && !buildProgram())
+        return false;
+
+    meshDataVersion = -1;
+    uploadedScene = NULL;
+    reprojectionValid = false;
+    if(!uploadScene())
+        return false;
+    createSky();
+    return true;
+}
+
+void Raytracer::setRetuneWorkGroups(bool value)
+{
+    retuneWorkGroups = value;
+}
+
+void Raytracer::setPixelOrder(PixelOrder order)
+{
+    pixelOrder = order;
+}
+
+void Raytracer::setPixelOrderBenchmarkFrames(int frames)
+{
+    pixelOrderBenchmarkFrames = frames;
+}
+
+void Raytracer::setCameraConstantsBenchmarkFrames(int frames)
+{
+    cameraConstantsBenchmarkFrames = frames;
+}
+
+void Raytracer::setAdaptiveSampleGridSize(int gridSize)
+{
+    adaptiveSampleGridSize = gridSize;
+}
+
+void Raytracer::setReprojection(bool value)
+{
+    reprojectionEnabled = value;
+}
+
+void Raytracer::setPlatform(int index)
+{
+    deviceSelector.setPlatform(index);
+}
+
+void Raytracer::setDeviceType(cl_device_type type)
+{
+    deviceSelector.setDeviceType(type);
+}
+
+void Raytracer::setDevice(const std::string &nameOrIndex)
+{
+    deviceSelector.setOverride(nameOrIndex);
+}
+
+void Raytracer::setBenchmarkDevices(bool value)
 {
-    // Set the thread finish flag.
+    deviceSelector.setForceBenchmark(value);
+}
+
+double Raytracer::benchmarkDevice(const ComputeDevice &device)
+{
+    T3_TRACE_ZONE("Raytracer::benchmarkDevice");
+    width = DeviceBenchmarkWidth;
+    height = DeviceBenchmarkHeight;
+    skyWidth = DeviceBenchmarkWidth;
+    skyHeight = DeviceBenchmarkHeight;
+
+    // Only the tracer program is needed. The work group sizes are left to
+    // the driver.
+    if(!initializeOpenCL(device) || !createResources() ||
+        !startTracerProgramBuild() || !finishTracerProgramBuild())
     {
-        Lock l(threadMutex);
-        threadFinishFlag = true;
+        shutdownOpenCL();
+        return -1.0;
     }
 
-    // Wait the thread to finish.
-    SDL_WaitThread(thread, NULL);
+    if(!uploadScene())
+    {
+        shutdownOpenCL();
+        return -1.0;
+    }
+    updateCamera();
+    uploadLightTiles();
+
+    // Warm up, then time the frames.
+    castPrimaryRays();
+    clFinish(commandQueue);
+    double startTime = FrameProfiler::now();
+    for(int i = 0; i < DeviceBenchmarkFrames; ++i)
+        castPrimaryRays();
+    clFinish(commandQueue);
+    double frameTime = (FrameProfiler::now() - startTime)/DeviceBenchmarkFrames;
+
+    collectStageEvents(false);
+    shutdownOpenCL();
+    return frameTime;
+}
+
+void Raytracer::setMinThroughput(float threshold)
+{
+    minThroughput = threshold;
+}
+
+void Raytracer::setRussianRoulette(bool value)
+{
+    russianRoulette = value;
+}
+
+void Raytracer::setRayStatistics(bool value)
+{
+    rayStatsEnabled = value;
+}
+
+void Raytracer::setSoftShadows(int probes, int samples)
+{
+    shadowProbes = std::max(probes, 0);
+    shadowSamples = std::max(samples, shadowProbes);
+}
+
+void Raytracer::setMeshChunkCount(int count)
+{
+    meshChunkCount = std::min(std::max(count, 0), MESH_DATA_CHUNK_COUNT);
+}
+
+void Raytracer::setMaxAllocSize(cl_ulong size)
+{
+    maxAllocLimit = size;
+}
+
+void Raytracer::setCameraConstants(bool value)
+{
+    cameraConstantsEnabled = value;
 }
 
-bool Raytracer::initializeOpenCL()
+void Raytracer::setSkyCache(const std::string &fileName)
 {
-    char buffer[1024];
+    skyCache.setFileName(fileName);
+}
 
-    // Query the number of platforms.
-    cl_uint numplatforms;
-    clGetPlatformIDs(0, NULL, &numplatforms);
+void Raytracer::setSkyKeyframeCount(int count)
+{
+    skyCache.setKeyframeCount(count);
+}
 
-    // Query the platforms
-    cl_platform_id *platforms = new cl_platform_id[numplatforms];
-    clGetPlatformIDs(numplatforms, platforms, &numplatforms);
+void Raytracer::setSkyErrorReport(bool value)
+{
+    skyErrorReport = value;
+}
 
-    printf("OpenCL platforms[%d]\n", numplatforms);
-    for(cl_uint i = 0; i < numplatforms; ++i)
+void Raytracer::shutdown()
+{
+    // The offline rendering has no thread.
+    if(!thread)
     {
-        // Print the name and the vendor.
-        clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, sizeof(buffer), buffer, NULL);
-        if(i == (cl_uint)selectedPlatform)
-            printf("[Selected]");
-        printf("Name: %s\n", buffer);
-        clGetPlatformInfo(platforms[i], CL_PLATFORM_VENDOR, sizeof(buffer), buffer, NULL);
-        printf("Vendor: %s\n", buffer);
+        shutdownOpenCL();
+        return;
+    }
 
+    // Set the thread finish flag. It also stops the wait for a scene that
+    // failed to load.
+    {
+        Lock l(threadMutex);
+        threadFinishFlag = true;
+        sceneReadyCond.broadcast();
     }
 
-    cl_platform_id currentPlatform = platforms[selectedPlatform];
-    delete [] platforms;
+    // Wait the thread to finish.
+    SDL_WaitThread(thread, NULL);
+    thread = NULL;
+}
 
+bool Raytracer::initializeOpenCL(const ComputeDevice &device)
+{
     // The context properties.
     cl_context_properties contextProperties[] = {
-         CL_CONTEXT_PLATFORM, (cl_context_properties)currentPlatform,
+         CL_CONTEXT_PLATFORM, (cl_context_properties)device.platform,
          0,
     };
 
-    // Try to create a GPU only context.
+    // Create a context with the chosen device.
     cl_int errCode;
-    computeContext = clCreateContextFromType(contextProperties, CL_DEVICE_TYPE_GPU , NULL, NULL, &errCode);
-
-    // Try with any other device, such as a CPU.
-    if(!computeContext)
-        computeContext = clCreateContextFromType(contextProperties, CL_DEVICE_TYPE_DEFAULT , NULL, NULL, &errCode);
+    computeDevice = device.device;
+    computeContext = clCreateContext(contextProperties, 1, &computeDevice, NULL, NULL, &errCode);
 
     // Check the error code.
     if(!computeContext)
@@ -121,14 +408,14 @@ bool Raytracer::initializeOpenCL()
         case CL_INVALID_PLATFORM:
             msg = "Invalid platform.";
             break;
-        case CL_INVALID_DEVICE_TYPE:
-            msg = "Invalid device type.";
+        case CL_INVALID_DEVICE:
+            msg = "Invalid device.";
             break;
         case CL_DEVICE_NOT_AVAILABLE:
             msg = "Device not available.";
             break;
-        case CL_DEVICE_NOT_FOUND:
-            msg = "Device not found.";
+        case CL_OUT_OF_HOST_MEMORY:
+            msg = "Out of host memory.";
             break;
         default:
             break;
@@ -138,12 +425,13 @@ bool Raytracer::initializeOpenCL()
         return false;
     }
 
-    // Query the compute device.
-    // Assume that there's at least one.
-    clGetContextInfo(computeContext, CL_CONTEXT_DEVICES, sizeof(computeDevice), &computeDevice, NULL);
+    clGetDeviceInfo(computeDevice, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(maxConstantBufferSize), &maxConstantBufferSize, NULL);
+    clGetDeviceInfo(computeDevice, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxMemAllocSize), &maxMemAllocSize, NULL);
+    if(maxAllocLimit > 0 && maxAllocLimit < maxMemAllocSize)
+        maxMemAllocSize = maxAllocLimit;
 
-    // Create the command queue.
-    commandQueue = clCreateCommandQueue(computeContext, computeDevice, 0, NULL);
+    // Create the command queue. The profiling is used for the stage timings.
+    commandQueue = clCreateCommandQueue(computeContext, computeDevice, CL_QUEUE_PROFILING_ENABLE, NULL);
     if(!commandQueue)
     {
         fprintf(stderr, "Failed to create the command queue.\n");
@@ -155,11 +443,82 @@ bool Raytracer::initializeOpenCL()
 
 void Raytracer::shutdownOpenCL()
 {
-    clReleaseProgram(raytracerProgram);
+    releaseProgram();
+    releaseSkyPrograms();
+    releaseResources();
+    frontBuffer.release();
+    backBuffer.release();
+    if(commandQueue)
+        clReleaseCommandQueue(commandQueue);
+    if(computeContext)
+        clReleaseContext(computeContext);
+    commandQueue = NULL;
+    computeContext = NULL;
+}
+
+void Raytracer::releaseResources()
+{
+    cl_mem *buffers[] = {
+        &sceneDataBuffer, &materialBuffer,
+        &meshDataBuffers[0], &meshDataBuffers[1], &meshDataBuffers[2], &meshDataBuffers[3],
+        &lightTileOffsetsBuffer, &lightTileLightsBuffer,
+        &imagesDescBuffer, &imagesBuffer, &skyKeyframesBuffer, &cameraConstantsBuffer,
+    };
+    for(size_t i = 0; i < sizeof(buffers)/sizeof(buffers[0]); ++i)
+    {
+        if(*buffers[i])
+            clReleaseMemObject(*buffers[i]);
+        *buffers[i] = NULL;
+    }
+    releasePixelBuffers();
+    cameraConstantsCapacity = 0;
+
+    delete sceneData;
+    sceneData = NULL;
+    meshDataVersion = -1;
+    meshDataSize = 0;
+    uploadedScene = NULL;
+}
+
+void Raytracer::releasePixelBuffers()
+{
+    cl_mem *buffers[] = {
+        &pixelColorsBuffer, &pixelShapesBuffer, &edgePixelsBuffer, &edgePixelCountBuffer,
+        &pixelPositionsBuffer, &previousColorsBuffer, &previousShapesBuffer,
+        &previousPositionsBuffer, &reusedPixelCountBuffer, &rayStatsBuffer,
+    };
+    for(size_t i = 0; i < sizeof(buffers)/sizeof(buffers[0]); ++i)
+    {
+        if(*buffers[i])
+            clReleaseMemObject(*buffers[i]);
+        *buffers[i] = NULL;
+    }
+}
+
+bool Raytracer::setResolution(int newWidth, int newHeight)
+{
+    if((size_t)newWidth == width && (size_t)newHeight == height)
+        return true;
+
+    width = newWidth;
+    height = newHeight;
+    reprojectionValid = false;
     frontBuffer.release();
     backBuffer.release();
-    clReleaseCommandQueue(commandQueue);
-    clReleaseContext(computeContext);
+    releasePixelBuffers();
+    return frontBuffer.create(computeContext, width, height) &&
+        backBuffer.create(computeContext, width, height) &&
+        createPixelBuffers();
+}
+
+int Raytracer::getWidth() const
+{
+    return width;
+}
+
+int Raytracer::getHeight() const
+{
+    return height;
 }
 
 
@@ -168,61 +527,216 @@ bool Raytracer::createResources()
     // Create the frame buffers.
     if(!frontBuffer.create(computeContext, width, height) ||
         !backBuffer.create(computeContext, width, height) ||
-        !createImages())
+        !createImages() ||
+        !createPixelBuffers())
         return false;
 
-    // Load the raytracer program
-    std::vector<char> sourceCode = readWholeFile("cl/Raytracer.cl");
-    size_t sourceCodeSize = sourceCode.size();
-    const char *sourceCodePtr = &sourceCode[0];
-    raytracerProgram = clCreateProgramWithSource(computeContext, 1, &sourceCodePtr, &sourceCodeSize, NULL);
-    if(!raytracerProgram)
-    {
-        fprintf(stderr, "Failed to create the raytracer program.\n");
+    return true;
+}
+
+bool Raytracer::buildProgram()
+{
+    return startProgramBuild() && finishProgramBuild();
+}
+
+bool Raytracer::startProgramBuild()
+{
+    T3_TRACE_ZONE("Raytracer::startProgramBuild");
+    programBuildStart = FrameProfiler::now();
+
+    // Build the raytracer program, and the sky program of the scene at the
+    // same time.
+    return startTracerProgramBuild() && startSkyProgramBuild(app->getScene()->isDay());
+}
+
+bool Raytracer::finishProgramBuild()
+{
+    T3_TRACE_ZONE("Raytracer::finishProgramBuild");
+    if(!finishTracerProgramBuild() || !finishSkyProgramBuild(app->getScene()->isDay()))
         return false;
+
+    // The display reads the time for its first frame report.
+    double buildTime = FrameProfiler::now() - programBuildStart;
+    {
+        Lock l(threadMutex);
+        programBuildTime = buildTime;
     }
+    printf("Programs built in %.1f ms\n", buildTime);
+    return true;
+}
+
+bool Raytracer::startTracerProgramBuild()
+{
+    releaseProgram();
+    tracerBuildOptions = makeTracerBuildOptions();
+    return tracerProgram.start(computeContext, computeDevice, tracerBuildOptions);
+}
 
-    // Build the raytracer program.
-    cl_int error = clBuildProgram(raytracerProgram, 1, &computeDevice, "-D CL_RAYTRACER -x clc++ -I cl", NULL, NULL);
-    size_t bufferSize;
-    clGetProgramBuildInfo(raytracerProgram, computeDevice,  CL_PROGRAM_BUILD_LOG, 0, NULL, &bufferSize);
-    char *buffer = new char[bufferSize+1];
-    clGetProgramBuildInfo(raytracerProgram, computeDevice,  CL_PROGRAM_BUILD_LOG, bufferSize, buffer, NULL);
-    fprintf(stderr, "%s\n", buffer);
-    delete [] buffer;
-    if(error != CL_SUCCESS)
+std::string Raytracer::makeTracerBuildOptions()
+{
+    // Place the materials in constant memory when they fit.
+    std::string buildOptions = BaseBuildOptions;
+    if(app->getScene()->getMaterialDataSize() <= maxConstantBufferSize)
+        buildOptions += " -D RAYTRACER_CONSTANT_MATERIALS";
+
+    // Bake the ray depth of the scene, so the path loop has a known bound.
+    char depthOption[64];
+    sprintf(depthOption, " -D RAYTRACER_MAX_DEPTH=%d", app->getScene()->getMaxRayDepth());
+    buildOptions += depthOption;
+
+    // Path termination.
+    char throughputOption[64];
+    sprintf(throughputOption, " -D RAYTRACER_MIN_THROUGHPUT=%ef", minThroughput);
+    buildOptions += throughputOption;
+    if(russianRoulette)
+        buildOptions += " -D RAYTRACER_RUSSIAN_ROULETTE";
+    if(rayStatsEnabled)
+        buildOptions += " -D RAYTRACER_RAY_STATS";
+
+    // Sphere light shadows.
+    if(shadowProbes > 0)
     {
-        fprintf(stderr, "Failed to build the raytracer program:\n");
-        return false;
+        char shadowOptions[96];
+        sprintf(shadowOptions, " -D RAYTRACER_SHADOW_PROBES=%d -D RAYTRACER_SHADOW_SAMPLES=%d",
+            shadowProbes, shadowSamples);
+        buildOptions += shadowOptions;
     }
+    return buildOptions;
+}
+
+bool Raytracer::finishTracerProgramBuild()
+{
+    if(!tracerProgram.finish())
+        return false;
 
     // Create the primary rays kernel
-    primaryRaysKernel = clCreateKernel(raytracerProgram, "castPrimaryRays", NULL);
+    cl_program program = tracerProgram.getProgram();
+    primaryRaysKernel = clCreateKernel(program, "castPrimaryRays", NULL);
     if(!primaryRaysKernel)
     {
         fprintf(stderr, "Failed to create the primary rays kernel.\n");
         return false;
     }
 
-    // Create the day sky kernel
-    daySkyCreationKernel = clCreateKernel(raytracerProgram, "createDaySky", NULL);
-    if(!daySkyCreationKernel)
+    // Create the adaptive antialiasing kernels.
+    edgeDetectionKernel = clCreateKernel(program, "detectEdges", NULL);
+    adaptiveSamplesKernel = clCreateKernel(program, "castAdaptiveSamples", NULL);
+    if(!edgeDetectionKernel || !adaptiveSamplesKernel)
+    {
+        fprintf(stderr, "Failed to create the adaptive antialiasing kernels.\n");
+        return false;
+    }
+
+    // Create the reprojection kernel.
+    reprojectionKernel = clCreateKernel(program, "castReprojectedRays", NULL);
+    if(!reprojectionKernel)
+    {
+        fprintf(stderr, "Failed to create the reprojection kernel.\n");
+        return false;
+    }
+
+    // Create the camera constants kernel.
+    cameraConstantsKernel = clCreateKernel(program, "computeCameraConstants", NULL);
+    if(!cameraConstantsKernel)
     {
-        fprintf(stderr, "Failed to create the day sky generation kernel.\n");
+        fprintf(stderr, "Failed to create the camera constants kernel.\n");
         return false;
     }
 
-    // Create the night sky kernel
-    nightSkyCreationKernel = clCreateKernel(raytracerProgram, "createNightSky", NULL);
-    if(!nightSkyCreationKernel)
+    // Report the register spills and occupancy limits of the path kernels.
+    printf("Raytracer max ray depth: %d\n", app->getScene()->getMaxRayDepth());
+    printKernelResources(primaryRaysKernel, "castPrimaryRays");
+    printKernelResources(adaptiveSamplesKernel, "castAdaptiveSamples");
+    printKernelResources(reprojectionKernel, "castReprojectedRays");
+    return true;
+}
+
+bool Raytracer::startSkyProgramBuild(bool day)
+{
+    // The sky programs don't depend on the scene, so they are kept.
+    ProgramBuilder &program = day ? daySkyProgram : nightSkyProgram;
+    if(program.isStarted())
+        return true;
+    return program.start(computeContext, computeDevice, BaseBuildOptions);
+}
+
+bool Raytracer::finishSkyProgramBuild(bool day)
+{
+    cl_kernel &kernel = day ? daySkyCreationKernel : nightSkyCreationKernel;
+    if(kernel)
+        return true;
+
+    // Build the program when it's first needed.
+    ProgramBuilder &program = day ? daySkyProgram : nightSkyProgram;
+    if(!startSkyProgramBuild(day) || !program.finish())
+        return false;
+
+    const char *name = day ? "createDaySky" : "createNightSky";
+    kernel = clCreateKernel(program.getProgram(), name, NULL);
+    if(!kernel)
     {
-        fprintf(stderr, "Failed to create the night sky generation kernel.\n");
+        fprintf(stderr, "Failed to create the %s kernel.\n", name);
         return false;
     }
 
+    // The day sky can also be blended from the cached keyframes.
+    if(day)
+    {
+        daySkyBlendKernel = clCreateKernel(program.getProgram(), "blendDaySky", NULL);
+        if(!daySkyBlendKernel)
+        {
+            fprintf(stderr, "Failed to create the blendDaySky kernel.\n");
+            return false;
+        }
+    }
+
     return true;
 }
 
+void Raytracer::releaseProgram()
+{
+    cl_kernel *kernels[] = {
+        &primaryRaysKernel, &edgeDetectionKernel, &adaptiveSamplesKernel,
+        &reprojectionKernel, &cameraConstantsKernel,
+    };
+    for(size_t i = 0; i < sizeof(kernels)/sizeof(kernels[0]); ++i)
+    {
+        if(*kernels[i])
+            clReleaseKernel(*kernels[i]);
+        *kernels[i] = NULL;
+    }
+
+    tracerProgram.release();
+}
+
+void Raytracer::releaseSkyPrograms()
+{
+    cl_kernel *kernels[] = {
+        &daySkyCreationKernel, &daySkyBlendKernel, &nightSkyCreationKernel,
+    };
+    for(size_t i = 0; i < sizeof(kernels)/sizeof(kernels[0]); ++i)
+    {
+        if(*kernels[i])
+            clReleaseKernel(*kernels[i]);
+        *kernels[i] = NULL;
+    }
+
+    daySkyProgram.release();
+    nightSkyProgram.release();
+}
+
+void Raytracer::printKernelResources(cl_kernel kernel, const char *name)
+{
+    cl_ulong privateMemory = 0;
+    cl_ulong localMemory = 0;
+    size_t maxWorkGroupSize = 0;
+    clGetKernelWorkGroupInfo(kernel, computeDevice, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(privateMemory), &privateMemory, NULL);
+    clGetKernelWorkGroupInfo(kernel, computeDevice, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(localMemory), &localMemory, NULL);
+    clGetKernelWorkGroupInfo(kernel, computeDevice, CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxWorkGroupSize), &maxWorkGroupSize, NULL);
+    printf("Kernel %s: %lu bytes private, %lu bytes local, max work group size %lu\n", name,
+        (unsigned long)privateMemory, (unsigned long)localMemory, (unsigned long)maxWorkGroupSize);
+}
+
 bool Raytracer::createImages()
 {
     unsigned int desc[] = {
@@ -242,41 +756,167 @@ bool Raytracer::createImages()
 }
 
 
-bool Raytracer::initializeRaytracerThread()
+bool Raytracer::createPixelBuffers()
 {
-    if(!initializeOpenCL())
-        return false;
+    size_t pixelCount = width*height;
 
-    if(!createResources())
+    // The samples of the current frame.
+    if(adaptiveSampleGridSize > 0 || reprojectionEnabled)
+    {
+        pixelColorsBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, pixelCount*sizeof(Color), NULL, NULL);
+        pixelShapesBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, pixelCount*sizeof(int), NULL, NULL);
+        if(!pixelColorsBuffer || !pixelShapesBuffer)
+        {
+            fprintf(stderr, "Failed to create the pixel buffers.\n");
+            return false;
+        }
+    }
+
+    // Adaptive antialiasing.
+    if(adaptiveSampleGridSize > 0)
+    {
+        edgePixelsBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, pixelCount*sizeof(int), NULL, NULL);
+        edgePixelCountBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, sizeof(int), NULL, NULL);
+        if(!edgePixelsBuffer || !edgePixelCountBuffer)
+        {
+            fprintf(stderr, "Failed to create the adaptive antialiasing buffers.\n");
+            return false;
+        }
+    }
+
+    // Temporal reprojection.
+    if(reprojectionEnabled)
+    {
+        pixelPositionsBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, pixelCount*sizeof(Vector4), NULL, NULL);
+        previousColorsBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, pixelCount*sizeof(Color), NULL, NULL);
+        previousShapesBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, pixelCount*sizeof(int), NULL, NULL);
+        previousPositionsBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, pixelCount*sizeof(Vector4), NULL, NULL);
+        reusedPixelCountBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, sizeof(int), NULL, NULL);
+        if(!pixelPositionsBuffer || !previousColorsBuffer || !previousShapesBuffer ||
+            !previousPositionsBuffer || !reusedPixelCountBuffer)
+        {
+            fprintf(stderr, "Failed to create the reprojection buffers.\n");
+            return false;
+        }
+    }
+
+    // Secondary ray counters. The kernels always take them, but they are
+    // only written when the statistics are enabled.
+    cl_uint rayStats[RayStatCount] = {0};
+    rayStatsBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(rayStats), rayStats, NULL);
+    if(!rayStatsBuffer)
+    {
+        fprintf(stderr, "Failed to create the ray statistics buffer.\n");
         return false;
-    createImages();
+    }
 
-    // TODO: Try to uploada changing scene.
-    uploadScene();
+    rayStatsFrames = 0;
+    rayStatsSecondary = 0;
+    rayStatsTerminated = 0;
+    rayStatsShadow = 0;
+    rayStatsSphereShadow = 0;
+    rayStatsPenumbra = 0;
+    rayStatsPenumbraVariance = 0;
+    rayStatsStart = SDL_GetTicks();
+
+    adaptiveStatsFrames = 0;
+    adaptiveStatsEdgePixels = 0;
+    adaptiveStatsTime = 0;
+    adaptiveStatsStart = SDL_GetTicks();
+
+    reprojectionValid = false;
+    reprojectionFrame = 0;
+    reprojectionDay = false;
+    reprojectionStatsFrames = 0;
+    reprojectionStatsReused = 0;
+    reprojectionStatsTime = 0;
+    reprojectionStatsStart = SDL_GetTicks();
+    fullFrameTime = 0;
     return true;
 }
 
-int Raytracer::threadEntryPoint(void *obj)
+bool Raytracer::waitForScene()
 {
-    return static_cast<Raytracer*> (obj)->threadEntry();
+    setStartupStatus("Loading scene");
+    Lock l(threadMutex);
+    while(!sceneReady && !threadFinishFlag)
+        sceneReadyCond.wait(l);
+    return sceneReady;
 }
 
-int Raytracer::threadEntry()
+bool Raytracer::initializeRaytracerThread()
 {
-    // Thread iniitialization.
-    bool success = initializeRaytracerThread();
+    // Timing the devices needs the scene.
+    if(!deviceSelector.enumerate())
+        return false;
+    if(deviceSelector.needsBenchmark())
     {
-        Lock l(threadMutex);
-        threadStartedSuccess = success;
-        threadStartedCond.broadcast();
-        if(!success)
-            return 0;
+        if(!waitForScene())
+            return false;
+        setStartupStatus("Benchmarking devices");
     }
+    if(!deviceSelector.select(app) || !initializeOpenCL(deviceSelector.getSelected()))
+        return false;
 
-    // Create the sky once.
-    createSky();
+    // Load the tuned work group sizes.
+    workGroupTuner.initialize(computeContext, computeDevice, commandQueue, "workgroups.cache", retuneWorkGroups);
 
-    // Thread main loop.
+    if(!createResources())
+        return false;
+
+    // The build options depend on the scene.
+    if(!waitForScene())
+        return false;
+
+    setStartupStatus("Building program");
+    if(!startProgramBuild())
+        return false;
+
+    // Upload the scene while the program builds.
+    // TODO: Try to uploada changing scene.
+    if(!uploadScene())
+    {
+        finishProgramBuild();
+        return false;
+    }
+    if(!finishProgramBuild())
+        return false;
+
+    setStartupStatus("Rendering first frame");
+    return true;
+}
+
+int Raytracer::threadEntryPoint(void *obj)
+{
+    return static_cast<Raytracer*> (obj)->threadEntry();
+}
+
+int Raytracer::threadEntry()
+{
+    T3_TRACE_THREAD_NAME("raytracer");
+
+    // Thread iniitialization.
+    bool success = initializeRaytracerThread();
+    if(!success)
+    {
+        Lock l(threadMutex);
+        startupFailed = true;
+        startupStatus = "Failed to start the raytracer";
+        return 0;
+    }
+
+    // Create the sky once.
+    createSky();
+
+    // Compare the pixel orders.
+    if(pixelOrderBenchmarkFrames > 0)
+        benchmarkPixelOrders();
+
+    // Measure the camera constants.
+    if(cameraConstantsBenchmarkFrames > 0)
+        benchmarkCameraConstants();
+
+    // Thread main loop.
     for(;;)
     {
         // Read the finish flag.
@@ -298,12 +938,243 @@ int Raytracer::threadEntry()
 
 void Raytracer::raytracerJob()
 {
-    if(lastSunDir != app->getScene()->getSunDirection())
-        createSky();
+    T3_TRACE_ZONE("Raytracer::raytracerJob");
+    Image2D *image = new Image2D(width, height);
+    if(!renderFrame(image))
+    {
+        // Stop rendering instead of repeating the error every frame.
+        delete image;
+        Lock l(threadMutex);
+        threadFinishFlag = true;
+        return;
+    }
 
-    uploadScene();
-    castPrimaryRays();
-    displayFrameBuffer();
+    // Send the image to the display.
+    app->getDisplay()->setImage(image, lastProfileFrame);
+}
+
+bool Raytracer::renderFrame(Image2D *image)
+{
+    T3_TRACE_ZONE("Raytracer::renderFrame");
+    bool success = enqueueFrame(image);
+    finishFrame();
+    return success;
+}
+
+bool Raytracer::enqueueFrame(Image2D *image)
+{
+    T3_TRACE_ZONE("Raytracer::enqueueFrame");
+    FrameProfiler *profiler = app->getProfiler();
+    lastFrameRays = 0;
+
+    // The random numbers change every frame, so the sampling patterns don't
+    // stay still on the screen.
+    frameSeed++;
+    bool success;
+    {
+        HostStageTimer frameTimer(profiler, ProfileStage_Frame);
+        if(lastSunDir != app->getScene()->getSunDirection())
+        {
+            HostStageTimer timer(profiler, ProfileStage_CreateSky);
+            createSky();
+        }
+
+        updateCamera();
+        {
+            HostStageTimer timer(profiler, ProfileStage_UploadScene);
+
+            // Stream the chunks around the camera. The offline frames wait
+            // for them. The reprojection can't reuse the shape ids when the
+            // shapes change.
+            SceneStreamer *streamer = app->getScene()->getStreamer();
+            if(streamer && streamer->update(app->getScene()->getCamera().getPosition(), !thread))
+                reprojectionValid = false;
+            success = uploadScene();
+            if(success)
+                uploadLightTiles();
+        }
+
+        // Without the scene buffers the kernels can't run.
+        if(success)
+            castFrameRays(image);
+    }
+
+    // The events are collected when the frame is finished.
+    pendingFrameEvents.push_back(StageEventList());
+    pendingFrameEvents.back().swap(stageEvents);
+    return success;
+}
+
+void Raytracer::castFrameRays(Image2D *image)
+{
+    FrameProfiler *profiler = app->getProfiler();
+    {
+        HostStageTimer timer(profiler, ProfileStage_PrimaryRays);
+        if(reprojectionEnabled)
+            castReprojectedRays();
+        else
+            castPrimaryRays();
+    }
+
+    {
+        HostStageTimer timer(profiler, ProfileStage_AdaptiveSamples);
+        castAdaptiveSamples();
+    }
+
+    swapPixelBuffers();
+    collectRayStatistics(true);
+    {
+        HostStageTimer timer(profiler, ProfileStage_Readback);
+        readFrameBuffer(image);
+    }
+}
+
+void Raytracer::finishFrame()
+{
+    T3_TRACE_ZONE("Raytracer::finishFrame");
+    if(pendingFrameEvents.empty())
+        return;
+
+    // Waiting for the events of the oldest frame includes its readback.
+    stageEvents.swap(pendingFrameEvents.front());
+    pendingFrameEvents.pop_front();
+    collectStageEvents(true);
+    lastProfileFrame = app->getProfiler()->endFrame();
+}
+
+size_t Raytracer::getLastFrameRayCount() const
+{
+    return lastFrameRays;
+}
+
+void Raytracer::addStageEvent(ProfileStage stage, cl_event event)
+{
+    stageEvents.push_back(std::make_pair(stage, event));
+}
+
+void Raytracer::collectStageEvents(bool record)
+{
+    T3_TRACE_ZONE("Raytracer::collectStageEvents");
+    FrameProfiler *profiler = app->getProfiler();
+    for(size_t i = 0; i < stageEvents.size(); ++i)
+    {
+        cl_event event = stageEvents[i].second;
+        if(record)
+        {
+            cl_ulong start = 0, end = 0;
+            clWaitForEvents(1, &event);
+            clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+            clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+            profiler->addDeviceTime(stageEvents[i].first, (end - start)*1e-6);
+        }
+        clReleaseEvent(event);
+    }
+
+    stageEvents.clear();
+}
+
+void Raytracer::enqueueKernel2D(cl_kernel kernel, const char *name, size_t width, size_t height, ProfileStage stage)
+{
+    size_t globalWorkSize[] = {width, height};
+    size_t localWorkSize[2];
+    const size_t *localWorkSizePtr = NULL;
+
+    // The trial runs of the tuner add into the frame counters, so they are
+    // restored afterwards.
+    bool tuning = workGroupTuner.needsTuning(name, globalWorkSize);
+    cl_uint rayStats[RayStatCount];
+    int reusedPixelCount = 0;
+    if(tuning)
+    {
+        clEnqueueReadBuffer(commandQueue, rayStatsBuffer, CL_TRUE, 0, sizeof(rayStats), rayStats, 0, NULL, NULL);
+        if(reusedPixelCountBuffer)
+            clEnqueueReadBuffer(commandQueue, reusedPixelCountBuffer, CL_TRUE, 0, sizeof(int), &reusedPixelCount, 0, NULL, NULL);
+    }
+
+    if(workGroupTuner.getLocalSize(kernel, name, globalWorkSize, localWorkSize))
+        localWorkSizePtr = localWorkSize;
+
+    if(tuning)
+    {
+        clEnqueueWriteBuffer(commandQueue, rayStatsBuffer, CL_TRUE, 0, sizeof(rayStats), rayStats, 0, NULL, NULL);
+        if(reusedPixelCountBuffer)
+            clEnqueueWriteBuffer(commandQueue, reusedPixelCountBuffer, CL_TRUE, 0, sizeof(int), &reusedPixelCount, 0, NULL, NULL);
+    }
+
+    cl_event event;
+    if(clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, globalWorkSize, localWorkSizePtr, 0, NULL, &event) == CL_SUCCESS)
+        addStageEvent(stage, event);
+}
+
+void Raytracer::benchmarkPixelOrders()
+{
+    T3_TRACE_ZONE("Raytracer::benchmarkPixelOrders");
+    const char *names[PixelOrder_Count] = {"scanline", "morton tiles"};
+    PixelOrder oldOrder = pixelOrder;
+
+    if(!uploadScene())
+        return;
+    updateCamera();
+    uploadLightTiles();
+    for(int i = 0; i < PixelOrder_Count; ++i)
+    {
+        pixelOrder = (PixelOrder)i;
+
+        // Warm up.
+        castPrimaryRays();
+        clFinish(commandQueue);
+
+        // Time the frames.
+        Uint32 startTime = SDL_GetTicks();
+        for(int frame = 0; frame < pixelOrderBenchmarkFrames; ++frame)
+            castPrimaryRays();
+        clFinish(commandQueue);
+        Uint32 elapsed = SDL_GetTicks() - startTime;
+
+        printf("Pixel order %s: %.3f ms per frame\n", names[i], elapsed/(float)pixelOrderBenchmarkFrames);
+    }
+
+    // Keep the benchmark out of the frame timings.
+    collectStageEvents(false);
+    collectRayStatistics(false);
+
+    pixelOrder = oldOrder;
+}
+
+void Raytracer::benchmarkCameraConstants()
+{
+    T3_TRACE_ZONE("Raytracer::benchmarkCameraConstants");
+    bool oldEnabled = cameraConstantsEnabled;
+
+    if(!uploadScene())
+        return;
+    updateCamera();
+    uploadLightTiles();
+    double times[2];
+    for(int i = 0; i < 2; ++i)
+    {
+        cameraConstantsEnabled = i == 1;
+
+        // Warm up.
+        castPrimaryRays();
+        clFinish(commandQueue);
+
+        // Time the frames, the camera constants included.
+        double startTime = FrameProfiler::now();
+        for(int frame = 0; frame < cameraConstantsBenchmarkFrames; ++frame)
+            castPrimaryRays();
+        clFinish(commandQueue);
+        times[i] = (FrameProfiler::now() - startTime)/cameraConstantsBenchmarkFrames;
+    }
+
+    printf("Primary rays: %.3f ms per frame without the camera constants, %.3f ms with them (%.1f%% saved)\n",
+        times[0], times[1], times[0] > 0.0 ? (times[0] - times[1])*100.0/times[0] : 0.0);
+
+    // Keep the benchmark out of the frame timings.
+    collectStageEvents(false);
+    collectRayStatistics(false);
+
+    cameraConstantsEnabled = oldEnabled;
 }
 
 void Raytracer::swapBuffers()
@@ -313,15 +1184,156 @@ void Raytracer::swapBuffers()
     frontBuffer = temp;
 }
 
-void Raytracer::uploadScene()
+bool Raytracer::uploadScene()
 {
-    if(sceneData)
-        delete sceneData;
-    if(sceneDataBuffer)
-        clReleaseMemObject(sceneDataBuffer);
+    T3_TRACE_ZONE("Raytracer::uploadScene");
+
+    // The scene buffers only change with the scene content.
+    Scene *scene = app->getScene();
+    int contentVersion = scene->getContentVersion();
+    if(sceneDataBuffer && scene == uploadedScene && contentVersion == uploadedSceneVersion)
+        return true;
+    uploadedScene = NULL;
+    releaseSceneData();
 
     sceneData = app->getScene()->getSceneData();
+    if(sceneData->getSize() > maxMemAllocSize)
+    {
+        fprintf(stderr, "The scene buffer takes %lu bytes, more than the device allocation limit of %lu bytes\n",
+            (unsigned long)sceneData->getSize(), (unsigned long)maxMemAllocSize);
+        releaseSceneData();
+        return false;
+    }
+
     sceneDataBuffer = clCreateBuffer(computeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR , sceneData->getSize(), (void*)sceneData->getData(), NULL);
+    materialBuffer = clCreateBuffer(computeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR , sceneData->getMaterialSize(), (void*)sceneData->getMaterialData(), NULL);
+    if(!sceneDataBuffer || !materialBuffer)
+    {
+        fprintf(stderr, "Failed to create the scene buffers\n");
+        releaseSceneData();
+        return false;
+    }
+
+    // The mesh data is only uploaded when it changes. The mesh offsets in
+    // the new scene buffer don't match the old mesh data, so the whole
+    // upload fails with it, and the mesh data is uploaded again next time.
+    std::vector<unsigned char> meshData;
+    if(app->getScene()->updateMeshData(&meshDataVersion, &meshData))
+    {
+        // Avoid an empty buffer.
+        if(meshData.empty())
+            meshData.resize(16, 0);
+        if(!uploadMeshData(meshData))
+        {
+            meshDataVersion = -1;
+            releaseSceneData();
+            return false;
+        }
+    }
+
+    uploadedScene = scene;
+    uploadedSceneVersion = contentVersion;
+    ++sceneUploadCount;
+
+    // The streamer keeps the scene buffers within its device budget.
+    SceneStreamer *streamer = scene->getStreamer();
+    if(streamer)
+        streamer->setDeviceMemoryUsed(sceneData->getSize() + sceneData->getMaterialSize() + meshDataSize);
+    return true;
+}
+
+void Raytracer::releaseSceneData()
+{
+    delete sceneData;
+    sceneData = NULL;
+    if(sceneDataBuffer)
+        clReleaseMemObject(sceneDataBuffer);
+    sceneDataBuffer = NULL;
+    if(materialBuffer)
+        clReleaseMemObject(materialBuffer);
+    materialBuffer = NULL;
+}
+
+int Raytracer::getSceneUploadCount() const
+{
+    return sceneUploadCount;
+}
+
+bool Raytracer::uploadMeshData(const std::vector<unsigned char> &meshData)
+{
+    T3_TRACE_ZONE("Raytracer::uploadMeshData");
+
+    // The chunks are the biggest power of two that fits in an allocation,
+    // or the smallest one that splits the data in the requested count.
+    int shift = MinMeshChunkShift;
+    while(shift < 62 && ((cl_ulong)2 << shift) <= maxMemAllocSize)
+        ++shift;
+    if(meshChunkCount > 0)
+    {
+        int splitShift = MinMeshChunkShift;
+        while(((cl_ulong)meshChunkCount << splitShift) < meshData.size())
+            ++splitShift;
+        shift = std::min(shift, splitShift);
+    }
+
+    cl_ulong dataSize = meshData.size();
+    cl_ulong chunkSize = (cl_ulong)1 << shift;
+    int count = (int)((dataSize + chunkSize - 1) >> shift);
+    if(count > MESH_DATA_CHUNK_COUNT)
+    {
+        fprintf(stderr, "The mesh data takes %.1f MB, more than %d chunks of %.1f MB\n",
+            dataSize/(1024.0*1024.0), MESH_DATA_CHUNK_COUNT, chunkSize/(1024.0*1024.0));
+        return false;
+    }
+
+    cl_mem buffers[MESH_DATA_CHUNK_COUNT] = {NULL};
+    for(int i = 0; i < count; ++i)
+    {
+        cl_ulong offset = (cl_ulong)i << shift;
+        size_t size = (size_t)std::min(chunkSize, dataSize - offset);
+        buffers[i] = clCreateBuffer(computeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, (void*)&meshData[offset], NULL);
+        if(!buffers[i])
+        {
+            fprintf(stderr, "Failed to create the mesh data chunk %d of %lu bytes\n", i, (unsigned long)size);
+            for(int j = 0; j < i; ++j)
+                clReleaseMemObject(buffers[j]);
+            return false;
+        }
+    }
+
+    for(int i = 0; i < MESH_DATA_CHUNK_COUNT; ++i)
+    {
+        if(meshDataBuffers[i])
+            clReleaseMemObject(meshDataBuffers[i]);
+        meshDataBuffers[i] = buffers[i];
+    }
+    meshChunkShift = shift;
+    meshDataSize = meshData.size();
+
+    if(count > 1)
+        printf("Mesh data split in %d chunks of %lu bytes\n", count, (unsigned long)chunkSize);
+    return true;
+}
+
+void Raytracer::uploadLightTiles()
+{
+    T3_TRACE_ZONE("Raytracer::uploadLightTiles");
+    if(lightTileOffsetsBuffer)
+        clReleaseMemObject(lightTileOffsetsBuffer);
+    if(lightTileLightsBuffer)
+        clReleaseMemObject(lightTileLightsBuffer);
+    lightTileOffsetsBuffer = NULL;
+    lightTileLightsBuffer = NULL;
+
+    // Without bounded lights, every light is shaded everywhere.
+    lightTiles.build(sceneData->getLightBounds(), cameraPosition, screenPlaneVerts, width, height);
+    if(lightTiles.empty())
+        return;
+
+    const std::vector<int> &offsets = lightTiles.getOffsets();
+    const std::vector<int> &lights = lightTiles.getLights();
+    lightTileOffsetsBuffer = clCreateBuffer(computeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, offsets.size()*sizeof(int), (void*)&offsets[0], NULL);
+    lightTileLightsBuffer = clCreateBuffer(computeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, lights.size()*sizeof(int), (void*)&lights[0], NULL);
 }
 
 void Raytracer::createNightSky()
@@ -348,15 +1360,97 @@ void Raytracer::createNightSky()
     clSetKernelArg(kernel, 6, sizeof(starThreshold), &starThreshold);
 
     // Run the kernel.
-    size_t globalWorkSize[] = {skyWidth, skyHeight};
-    clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
+    enqueueKernel2D(kernel, "createNightSky", skyWidth, skyHeight, ProfileStage_CreateSky);
 }
 
 void Raytracer::createDaySky()
+{
+    // Blend the cached keyframes, when they are available.
+    Scene *scene = app->getScene();
+    if(skyCache.isEnabled() && (skyKeyframesBuffer || createSkyKeyframes()))
+    {
+        blendDaySky();
+        if(skyErrorReport)
+            reportSkyError();
+    }
+    else
+        enqueueDaySky(imagesBuffer, 0, skyWidth, skyHeight, scene->getSunColor(), scene->getSunDirection());
+
+    // Store the sun direction.
+    lastSunDir = scene->getSunDirection();
+}
+
+void Raytracer::enqueueDaySky(cl_mem image, int offset, int width, int height, const Color &sunColor, const Vector3 &sunDirection)
 {
     // Choose the kernel
     cl_kernel kernel = daySkyCreationKernel;
 
+    // Set the arguments.
+    clSetKernelArg(kernel, 0, sizeof(offset), &offset);
+    clSetKernelArg(kernel, 1, sizeof(width), &width);
+    clSetKernelArg(kernel, 2, sizeof(height), &height);
+    clSetKernelArg(kernel, 3, sizeof(image), &image);
+
+    // Set the sky parameters.
+    float skyRadius = app->getScene()->getSkyRadius();
+    Vector4 sunDirection4 = sunDirection;
+    clSetKernelArg(kernel, 4, sizeof(skyRadius), &skyRadius);
+    clSetKernelArg(kernel, 5, sizeof(sunColor), &sunColor);
+    clSetKernelArg(kernel, 6, sizeof(sunDirection4), &sunDirection4);
+
+    // Run the kernel.
+    enqueueKernel2D(kernel, "createDaySky", width, height, ProfileStage_CreateSky);
+}
+
+bool Raytracer::createSkyKeyframes()
+{
+    T3_TRACE_ZONE("Raytracer::createSkyKeyframes");
+    size_t bufferSize = skyCache.getKeyframesSize();
+    skyKeyframesBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, bufferSize, NULL, NULL);
+    if(!skyKeyframesBuffer)
+    {
+        fprintf(stderr, "Failed to create the sky keyframes buffer, the sky is computed for every sun.\n");
+        skyCache.setFileName(std::string());
+        return false;
+    }
+
+    // Load them from the cache file.
+    int count = skyCache.getKeyframeCount();
+    std::vector<float> pixels;
+    if(skyCache.load(DaySkySourceFile, &pixels))
+    {
+        if(clEnqueueWriteBuffer(commandQueue, skyKeyframesBuffer, CL_TRUE, 0, bufferSize, &pixels[0], 0, NULL, NULL) == CL_SUCCESS)
+        {
+            printf("Loaded %d sky keyframes\n", count);
+            return true;
+        }
+        fprintf(stderr, "Failed to upload the cached sky keyframes, they are computed again.\n");
+    }
+
+    // Compute them once, for a white sun, and store them.
+    double startTime = FrameProfiler::now();
+    int keyframeWidth = skyCache.getKeyframeWidth();
+    int keyframeHeight = skyCache.getKeyframeHeight();
+    for(int i = 0; i < count; ++i)
+    {
+        enqueueDaySky(skyKeyframesBuffer, i*keyframeWidth*keyframeHeight, keyframeWidth, keyframeHeight,
+            Color(1.0f, 1.0f, 1.0f, 1.0f), skyCache.getKeyframeSunDirection(i));
+    }
+
+    pixels.resize(bufferSize/sizeof(float));
+    if(clEnqueueReadBuffer(commandQueue, skyKeyframesBuffer, CL_TRUE, 0, bufferSize, &pixels[0], 0, NULL, NULL) == CL_SUCCESS)
+    {
+        printf("Computed %d sky keyframes in %.1f ms\n", count, FrameProfiler::now() - startTime);
+        skyCache.save(DaySkySourceFile, pixels);
+    }
+    return true;
+}
+
+void Raytracer::blendDaySky()
+{
+    // Choose the kernel
+    cl_kernel kernel = daySkyBlendKernel;
+
     // Set the arguments.
     int offset = 0;
     int width = skyWidth;
@@ -366,73 +1460,428 @@ void Raytracer::createDaySky()
     clSetKernelArg(kernel, 2, sizeof(height), &height);
     clSetKernelArg(kernel, 3, sizeof(imagesBuffer), &imagesBuffer);
 
-    // Set the sky parameters.
+    // Set the keyframes around the sun.
     Scene *scene = app->getScene();
-    float skyRadius = scene->getSkyRadius();
+    int keyframeWidth = skyCache.getKeyframeWidth();
+    int keyframeHeight = skyCache.getKeyframeHeight();
+    int firstKeyframe;
+    float blend, azimuth;
+    skyCache.locate(scene->getSunDirection(), &firstKeyframe, &blend, &azimuth);
     Color sunColor = scene->getSunColor();
-    Vector4 sunDirection = scene->getSunDirection();
-    clSetKernelArg(kernel, 4, sizeof(skyRadius), &skyRadius);
-    clSetKernelArg(kernel, 5, sizeof(sunColor), &sunColor);
-    clSetKernelArg(kernel, 6, sizeof(sunDirection), &sunDirection);
+    clSetKernelArg(kernel, 4, sizeof(skyKeyframesBuffer), &skyKeyframesBuffer);
+    clSetKernelArg(kernel, 5, sizeof(keyframeWidth), &keyframeWidth);
+    clSetKernelArg(kernel, 6, sizeof(keyframeHeight), &keyframeHeight);
+    clSetKernelArg(kernel, 7, sizeof(firstKeyframe), &firstKeyframe);
+    clSetKernelArg(kernel, 8, sizeof(blend), &blend);
+    clSetKernelArg(kernel, 9, sizeof(azimuth), &azimuth);
+    clSetKernelArg(kernel, 10, sizeof(sunColor), &sunColor);
 
     // Run the kernel.
-    size_t globalWorkSize[] = {skyWidth, skyHeight};
-    clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
+    enqueueKernel2D(kernel, "blendDaySky", skyWidth, skyHeight, ProfileStage_CreateSky);
+}
 
-    // Store the sun direction.
-    lastSunDir = scene->getSunDirection();;
+void Raytracer::reportSkyError()
+{
+    // Compute the exact sky next to the blended one.
+    size_t valueCount = (size_t)skyWidth*skyHeight*4;
+    cl_mem exactBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, valueCount*sizeof(float), NULL, NULL);
+    if(!exactBuffer)
+    {
+        fprintf(stderr, "Failed to create the exact sky buffer.\n");
+        return;
+    }
+
+    Scene *scene = app->getScene();
+    enqueueDaySky(exactBuffer, 0, skyWidth, skyHeight, scene->getSunColor(), scene->getSunDirection());
+    std::vector<float> blended(valueCount);
+    std::vector<float> exact(valueCount);
+    bool read = clEnqueueReadBuffer(commandQueue, imagesBuffer, CL_TRUE, 0, valueCount*sizeof(float), &blended[0], 0, NULL, NULL) == CL_SUCCESS &&
+        clEnqueueReadBuffer(commandQueue, exactBuffer, CL_TRUE, 0, valueCount*sizeof(float), &exact[0], 0, NULL, NULL) == CL_SUCCESS;
+    clReleaseMemObject(exactBuffer);
+    if(!read)
+        return;
+
+    // The error is relative to the whole sky, and the maximum shows the
+    // halo of the sun, which the keyframes blur.
+    double errorSum = 0.0;
+    double exactSum = 0.0;
+    double maxError = 0.0;
+    double maxValue = 0.0;
+    for(size_t i = 0; i < valueCount; ++i)
+    {
+        // Skip the alpha.
+        if(i % 4 == 3)
+            continue;
+        double error = fabs(blended[i] - exact[i]);
+        errorSum += error*error;
+        exactSum += exact[i]*exact[i];
+        maxError = std::max(maxError, error);
+        maxValue = std::max(maxValue, (double)exact[i]);
+    }
+
+    printf("Sky keyframes error against the exact sky: %.2f%% RMS, %.2f%% of the brightest value at most\n",
+        exactSum > 0.0 ? sqrt(errorSum/exactSum)*100.0 : 0.0, maxValue > 0.0 ? maxError*100.0/maxValue : 0.0);
 }
 
 void Raytracer::createSky()
 {
-    if(app->getScene()->isDay())
+    T3_TRACE_ZONE("Raytracer::createSky");
+
+    // The reused pixels were shaded with the old sky and sun. An animated
+    // sun moves a little every frame, and the refreshed pixels follow it
+    // within ReprojectionRefreshPeriod frames. A jump or a switch between
+    // day and night needs a full frame.
+    bool day = app->getScene()->isDay();
+    if(day != reprojectionDay || app->getScene()->getSunDirection().dot(reprojectionSunDir) < ReprojectionSunCosine)
+        reprojectionValid = false;
+
+    if(!finishSkyProgramBuild(day))
+        return;
+
+    if(day)
         createDaySky();
     else
         createNightSky();
 }
 
-void Raytracer::castPrimaryRays()
+void Raytracer::updateCamera()
 {
     // Compute the camera parameters.
     Camera camera = app->getScene()->getCamera();
     Matrix3 orientation = camera.getOrientation();
-    Vector4 cameraPosition = camera.getPosition();
+    cameraPosition = camera.getPosition();
 
-    const Vector3 *screenPlaneVerts = camera.getScreenPlaneVerts();
-    Vector4 screenPlaneVertsTrans[4];
+    const Vector3 *cameraScreenPlaneVerts = camera.getScreenPlaneVerts();
     for(int i = 0; i < 4; ++i)
-        screenPlaneVertsTrans[i] = orientation*screenPlaneVerts[i] + camera.getPosition();
+        screenPlaneVerts[i] = orientation*cameraScreenPlaneVerts[i] + camera.getPosition();
+}
+
+void Raytracer::setSceneArguments(cl_kernel kernel)
+{
+    clSetKernelArg(kernel, 0, sizeof(sceneDataBuffer), &sceneDataBuffer);
+    clSetKernelArg(kernel, 1, sizeof(materialBuffer), &materialBuffer);
+    clSetKernelArg(kernel, 2, sizeof(meshDataBuffers[0]), &meshDataBuffers[0]);
+    clSetKernelArg(kernel, 3, sizeof(cameraPosition), &cameraPosition);
+    clSetKernelArg(kernel, 4, sizeof(screenPlaneVerts[0]), &screenPlaneVerts[0]);
+    clSetKernelArg(kernel, 5, sizeof(screenPlaneVerts[1]), &screenPlaneVerts[1]);
+    clSetKernelArg(kernel, 6, sizeof(screenPlaneVerts[2]), &screenPlaneVerts[2]);
+    clSetKernelArg(kernel, 7, sizeof(screenPlaneVerts[3]), &screenPlaneVerts[3]);
+    clSetKernelArg(kernel, 8, sizeof(imagesDescBuffer), &imagesDescBuffer);
+    clSetKernelArg(kernel, 9, sizeof(imagesBuffer), &imagesBuffer);
+    frontBuffer.setArguments(kernel, 10);
+    clSetKernelArg(kernel, 11, sizeof(rayStatsBuffer), &rayStatsBuffer);
+    clSetKernelArg(kernel, 12, sizeof(lightTileOffsetsBuffer), lightTileOffsetsBuffer ? &lightTileOffsetsBuffer : NULL);
+    clSetKernelArg(kernel, 13, sizeof(lightTileLightsBuffer), lightTileLightsBuffer ? &lightTileLightsBuffer : NULL);
+
+    // The first mesh data chunk is argument 2.
+    for(int i = 1; i < MESH_DATA_CHUNK_COUNT; ++i)
+        clSetKernelArg(kernel, 13 + i, sizeof(meshDataBuffers[i]), meshDataBuffers[i] ? &meshDataBuffers[i] : NULL);
+    clSetKernelArg(kernel, 17, sizeof(meshChunkShift), &meshChunkShift);
+    clSetKernelArg(kernel, 18, sizeof(frameSeed), &frameSeed);
+}
+
+void Raytracer::computeCameraConstants()
+{
+    if(!cameraConstantsEnabled || !sceneData)
+        return;
+
+    // The shape counts are in the header of the uploaded scene.
+    const SceneOffset *header = (const SceneOffset*)sceneData->getData();
+    int sphereCount = header[SceneHeader_SphereCount];
+    int planeCount = header[SceneHeader_PlaneCount];
+    size_t count = sphereCount + planeCount;
+    if(count > cameraConstantsCapacity)
+    {
+        if(cameraConstantsBuffer)
+            clReleaseMemObject(cameraConstantsBuffer);
+        cameraConstantsBuffer = clCreateBuffer(computeContext, CL_MEM_READ_WRITE, count*sizeof(Vector4), NULL, NULL);
+        cameraConstantsCapacity = cameraConstantsBuffer ? count : 0;
+    }
+    if(!count || !cameraConstantsBuffer)
+        return;
+
+    // Report the estimated work saved in the sphere and plane tests of
+    // every primary ray. The measured saving is in the camera constants
+    // benchmark.
+    if(sphereCount != cameraConstantSpheres || planeCount != cameraConstantPlanes)
+    {
+        int fullFlops = sphereCount*SphereTestFlops + planeCount*PlaneTestFlops;
+        int savedFlops = fullFlops - sphereCount*SphereCameraTestFlops - planeCount*PlaneCameraTestFlops;
+        printf("Camera constants: %d spheres, %d planes, estimated %d of %d sphere and plane test flops saved per primary ray\n",
+            sphereCount, planeCount, savedFlops, fullFlops);
+        cameraConstantSpheres = sphereCount;
+        cameraConstantPlanes = planeCount;
+    }
+
+    setSceneArguments(cameraConstantsKernel);
+    clSetKernelArg(cameraConstantsKernel, SceneArgumentCount, sizeof(cameraConstantsBuffer), &cameraConstantsBuffer);
+
+    cl_event event;
+    if(clEnqueueNDRangeKernel(commandQueue, cameraConstantsKernel, 1, NULL, &count, NULL, 0, NULL, &event) == CL_SUCCESS)
+        addStageEvent(ProfileStage_PrimaryRays, event);
+}
+
+void Raytracer::castPrimaryRays()
+{
+    T3_TRACE_ZONE("Raytracer::castPrimaryRays");
+    computeCameraConstants();
 
     // Set the arguments.
-    clSetKernelArg(primaryRaysKernel, 0, sizeof(sceneDataBuffer), &sceneDataBuffer);
-    clSetKernelArg(primaryRaysKernel, 1, sizeof(cameraPosition), &cameraPosition);
-    clSetKernelArg(primaryRaysKernel, 2, sizeof(screenPlaneVertsTrans[0]), &screenPlaneVertsTrans[0]);
-    clSetKernelArg(primaryRaysKernel, 3, sizeof(screenPlaneVertsTrans[1]), &screenPlaneVertsTrans[1]);
-    clSetKernelArg(primaryRaysKernel, 4, sizeof(screenPlaneVertsTrans[2]), &screenPlaneVertsTrans[2]);
-    clSetKernelArg(primaryRaysKernel, 5, sizeof(screenPlaneVertsTrans[3]), &screenPlaneVertsTrans[3]);
-    clSetKernelArg(primaryRaysKernel, 6, sizeof(imagesDescBuffer), &imagesDescBuffer);
-    clSetKernelArg(primaryRaysKernel, 7, sizeof(imagesBuffer), &imagesBuffer);
-    frontBuffer.setArguments(primaryRaysKernel, 8);
+    setSceneArguments(primaryRaysKernel);
+
+    // The morton tiles need whole tiles.
+    int order = pixelOrder;
+    if(width % PixelTileSize || height % PixelTileSize)
+        order = PixelOrder_Scanline;
+    clSetKernelArg(primaryRaysKernel, SceneArgumentCount, sizeof(order), &order);
+
+    // The samples are only kept for the adaptive antialiasing.
+    clSetKernelArg(primaryRaysKernel, SceneArgumentCount + 1, sizeof(pixelColorsBuffer), pixelColorsBuffer ? &pixelColorsBuffer : NULL);
+    clSetKernelArg(primaryRaysKernel, SceneArgumentCount + 2, sizeof(pixelShapesBuffer), pixelShapesBuffer ? &pixelShapesBuffer : NULL);
+
+    // The camera constants are only used while they are computed.
+    bool cameraConstants = cameraConstantsEnabled && cameraConstantsCapacity > 0;
+    clSetKernelArg(primaryRaysKernel, SceneArgumentCount + 3, sizeof(cameraConstantsBuffer), cameraConstants ? &cameraConstantsBuffer : NULL);
 
     // Run the kernel.
-    size_t globalWorkSize[] = {width, height};
-    clEnqueueNDRangeKernel(commandQueue, primaryRaysKernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
+    enqueueKernel2D(primaryRaysKernel, "castPrimaryRays", width, height, ProfileStage_PrimaryRays);
+    lastFrameRays += width*height;
 }
 
-void Raytracer::displayFrameBuffer()
+void Raytracer::castReprojectedRays()
 {
-    // Create the image.
-    Image2D *image = new Image2D(width, height);
+    T3_TRACE_ZONE("Raytracer::castReprojectedRays");
+    Uint32 startTime = SDL_GetTicks();
 
-    // Read the frame buffer data.
-    size_t origin[] = {0, 0, 0};
-    size_t region[] = {width, height, 1};
-    clEnqueueReadImage(commandQueue, frontBuffer.colorBuffer, CL_TRUE, origin, region,
-            width*sizeof(Color), 0, image->getPixels(), 0, NULL, NULL);
+    // Trace a full frame from time to time, as reference and refresh.
+    bool fullFrame = !reprojectionValid || reprojectionFrame % ReprojectionFullFrameInterval == 0;
+    int cacheValid = !fullFrame;
+    int refreshPhase = reprojectionFrame % ReprojectionRefreshPeriod;
+    int reusedPixelCount = 0;
+    clEnqueueWriteBuffer(commandQueue, reusedPixelCountBuffer, CL_TRUE, 0, sizeof(int), &reusedPixelCount, 0, NULL, NULL);
 
-    // Send the image to the display.
-    app->getDisplay()->setImage(image);
+    // Set the arguments.
+    cl_kernel kernel = reprojectionKernel;
+    setSceneArguments(kernel);
+    int order = pixelOrder;
+    if(width % PixelTileSize || height % PixelTileSize)
+        order = PixelOrder_Scanline;
+    clSetKernelArg(kernel, SceneArgumentCount, sizeof(order), &order);
+    clSetKernelArg(kernel, SceneArgumentCount + 1, sizeof(pixelColorsBuffer), &pixelColorsBuffer);
+    clSetKernelArg(kernel, SceneArgumentCount + 2, sizeof(pixelShapesBuffer), &pixelShapesBuffer);
+    clSetKernelArg(kernel, SceneArgumentCount + 3, sizeof(pixelPositionsBuffer), &pixelPositionsBuffer);
+    clSetKernelArg(kernel, SceneArgumentCount + 4, sizeof(previousColorsBuffer), &previousColorsBuffer);
+    clSetKernelArg(kernel, SceneArgumentCount + 5, sizeof(previousShapesBuffer), &previousShapesBuffer);
+    clSetKernelArg(kernel, SceneArgumentCount + 6, sizeof(previousPositionsBuffer), &previousPositionsBuffer);
+    clSetKernelArg(kernel, SceneArgumentCount + 7, sizeof(previousCameraPosition), &previousCameraPosition);
+    clSetKernelArg(kernel, SceneArgumentCount + 8, sizeof(previousScreenPlaneVerts[0]), &previousScreenPlaneVerts[0]);
+    clSetKernelArg(kernel, SceneArgumentCount + 9, sizeof(previousScreenPlaneVerts[1]), &previousScreenPlaneVerts[1]);
+    clSetKernelArg(kernel, SceneArgumentCount + 10, sizeof(previousScreenPlaneVerts[3]), &previousScreenPlaneVerts[3]);
+    clSetKernelArg(kernel, SceneArgumentCount + 11, sizeof(cacheValid), &cacheValid);
+    clSetKernelArg(kernel, SceneArgumentCount + 12, sizeof(refreshPhase), &refreshPhase);
+    clSetKernelArg(kernel, SceneArgumentCount + 13, sizeof(reusedPixelCountBuffer), &reusedPixelCountBuffer);
+
+    // Run the kernel.
+    enqueueKernel2D(kernel, "castReprojectedRays", width, height, ProfileStage_PrimaryRays);
+    lastFrameRays += width*height;
+    clEnqueueReadBuffer(commandQueue, reusedPixelCountBuffer, CL_TRUE, 0, sizeof(int), &reusedPixelCount, 0, NULL, NULL);
+    Uint32 elapsed = SDL_GetTicks() - startTime;
+
+    // Keep the camera for the next frame.
+    previousCameraPosition = cameraPosition;
+    for(int i = 0; i < 4; ++i)
+        previousScreenPlaneVerts[i] = screenPlaneVerts[i];
+    reprojectionValid = true;
+    reprojectionFrame++;
+    reprojectionSunDir = app->getScene()->getSunDirection();
+    reprojectionDay = app->getScene()->isDay();
+
+    // Report the cache hits and the time saved.
+    if(fullFrame)
+    {
+        fullFrameTime = elapsed;
+        return;
+    }
+
+    reprojectionStatsFrames++;
+    reprojectionStatsReused += reusedPixelCount;
+    reprojectionStatsTime += elapsed;
+    Uint32 now = SDL_GetTicks();
+    if(now - reprojectionStatsStart >= 1000)
+    {
+        float frameTime = reprojectionStatsTime/(float)reprojectionStatsFrames;
+        printf("Reprojection: %.1f%% cache hits, %.2f ms per frame, %.2f ms saved against a full frame\n",
+            reprojectionStatsReused*100.0f/(reprojectionStatsFrames*width*height), frameTime,
+            fullFrameTime - frameTime);
+
+        reprojectionStatsFrames = 0;
+        reprojectionStatsReused = 0;
+        reprojectionStatsTime = 0;
+        reprojectionStatsStart = now;
+    }
+}
 
+void Raytracer::swapPixelBuffers()
+{
+    if(!reprojectionEnabled)
+        return;
+
+    std::swap(pixelColorsBuffer, previousColorsBuffer);
+    std::swap(pixelShapesBuffer, previousShapesBuffer);
+    std::swap(pixelPositionsBuffer, previousPositionsBuffer);
+}
+
+void Raytracer::collectRayStatistics(bool record)
+{
+    if(!rayStatsEnabled)
+        return;
+
+    // Read and clear the counters.
+    cl_uint rayStats[RayStatCount];
+    clEnqueueReadBuffer(commandQueue, rayStatsBuffer, CL_TRUE, 0, sizeof(rayStats), rayStats, 0, NULL, NULL);
+    cl_uint zeros[RayStatCount] = {0};
+    clEnqueueWriteBuffer(commandQueue, rayStatsBuffer, CL_TRUE, 0, sizeof(zeros), zeros, 0, NULL, NULL);
+    if(!record)
+        return;
+    lastFrameRays += rayStats[0];
+
+    // Report the secondary rays per pixel.
+    rayStatsFrames++;
+    rayStatsSecondary += rayStats[0];
+    rayStatsTerminated += rayStats[1];
+    rayStatsShadow += rayStats[2];
+    rayStatsSphereShadow += rayStats[3];
+    rayStatsPenumbra += rayStats[4];
+    rayStatsPenumbraVariance += rayStats[5];
+    Uint32 now = SDL_GetTicks();
+    if(now - rayStatsStart >= 1000)
+    {
+        float pixelCount = (float)(width*height)*rayStatsFrames;
+        printf("Secondary rays: %.3f per pixel, %.3f paths per pixel cut below throughput %g%s\n",
+            rayStatsSecondary/pixelCount, rayStatsTerminated/pixelCount, minThroughput,
+            russianRoulette ? " (Russian roulette)" : "");
+
+        // The shadow ray budget of the sphere lights, against tracing every
+        // sample everywhere, and how often the penumbra gets the full
+        // quality of shadowSamples + 1 visibility levels.
+        if(shadowProbes > 0 && rayStatsSphereShadow > 0)
+        {
+            size_t probeRays = rayStatsSphereShadow*shadowProbes;
+            size_t penumbraRays = rayStatsPenumbra*(shadowSamples - shadowProbes);
+            size_t pointRays = rayStatsShadow - probeRays - penumbraRays;
+            double uniformRays = (double)rayStatsSphereShadow*shadowSamples + pointRays;
+            printf("Shadow rays: %.3f per pixel, %.2f per sphere light test (%d probes, %d samples), "
+                "%.1f%% in the penumbra, %.1f%% of uniform sampling\n",
+                rayStatsShadow/pixelCount, (double)(probeRays + penumbraRays)/rayStatsSphereShadow,
+                shadowProbes, shadowSamples, 100.0*rayStatsPenumbra/rayStatsSphereShadow,
+                100.0*rayStatsShadow/uniformRays);
+
+            // The standard error of the visible fraction of the penumbra
+            // tests, sqrt(p(1 - p)/n), averaged as a RMS.
+            if(rayStatsPenumbra > 0 && shadowSamples > shadowProbes)
+            {
+                double n = shadowSamples;
+                printf("Penumbra noise: %.4f RMS standard error of the light visibility\n",
+                    sqrt(rayStatsPenumbraVariance/(rayStatsPenumbra*n*n*n)));
+            }
+        }
+        else
+        {
+            printf("Shadow rays: %.3f per pixel\n", rayStatsShadow/pixelCount);
+        }
+
+        rayStatsFrames = 0;
+        rayStatsSecondary = 0;
+        rayStatsTerminated = 0;
+        rayStatsShadow = 0;
+        rayStatsSphereShadow = 0;
+        rayStatsPenumbra = 0;
+        rayStatsPenumbraVariance = 0;
+        rayStatsStart = now;
+    }
+}
+
+void Raytracer::castAdaptiveSamples()
+{
+    T3_TRACE_ZONE("Raytracer::castAdaptiveSamples");
+    if(adaptiveSampleGridSize <= 0)
+        return;
+
+    Uint32 startTime = SDL_GetTicks();
+
+    // Find the edge pixels.
+    int edgePixelCount = 0;
+    int imageWidth = width;
+    int imageHeight = height;
+    float threshold = AdaptiveEdgeThreshold;
+    clEnqueueWriteBuffer(commandQueue, edgePixelCountBuffer, CL_TRUE, 0, sizeof(int), &edgePixelCount, 0, NULL, NULL);
+    clSetKernelArg(edgeDetectionKernel, 0, sizeof(pixelColorsBuffer), &pixelColorsBuffer);
+    clSetKernelArg(edgeDetectionKernel, 1, sizeof(pixelShapesBuffer), &pixelShapesBuffer);
+    clSetKernelArg(edgeDetectionKernel, 2, sizeof(imageWidth), &imageWidth);
+    clSetKernelArg(edgeDetectionKernel, 3, sizeof(imageHeight), &imageHeight);
+    clSetKernelArg(edgeDetectionKernel, 4, sizeof(threshold), &threshold);
+    clSetKernelArg(edgeDetectionKernel, 5, sizeof(edgePixelsBuffer), &edgePixelsBuffer);
+    clSetKernelArg(edgeDetectionKernel, 6, sizeof(edgePixelCountBuffer), &edgePixelCountBuffer);
+
+    // The edge counter is incremented by every run, so the kernel is not
+    // tuned, which would run it more than once.
+    size_t edgeWorkSize[] = {width, height};
+    cl_event edgeEvent;
+    if(clEnqueueNDRangeKernel(commandQueue, edgeDetectionKernel, 2, NULL, edgeWorkSize, NULL, 0, NULL, &edgeEvent) == CL_SUCCESS)
+        addStageEvent(ProfileStage_AdaptiveSamples, edgeEvent);
+    clEnqueueReadBuffer(commandQueue, edgePixelCountBuffer, CL_TRUE, 0, sizeof(int), &edgePixelCount, 0, NULL, NULL);
+    edgePixelCount = std::min(edgePixelCount, imageWidth*imageHeight);
+
+    // Trace the extra samples only for the edge pixels.
+    if(edgePixelCount > 0)
+    {
+        setSceneArguments(adaptiveSamplesKernel);
+        clSetKernelArg(adaptiveSamplesKernel, SceneArgumentCount, sizeof(edgePixelsBuffer), &edgePixelsBuffer);
+        clSetKernelArg(adaptiveSamplesKernel, SceneArgumentCount + 1, sizeof(edgePixelCount), &edgePixelCount);
+        clSetKernelArg(adaptiveSamplesKernel, SceneArgumentCount + 2, sizeof(pixelColorsBuffer), &pixelColorsBuffer);
+        clSetKernelArg(adaptiveSamplesKernel, SceneArgumentCount + 3, sizeof(adaptiveSampleGridSize), &adaptiveSampleGridSize);
+
+        size_t localWorkSize = AdaptiveSamplesGroupSize;
+        size_t globalWorkSize = (edgePixelCount + localWorkSize - 1) / localWorkSize * localWorkSize;
+        cl_event event;
+        if(clEnqueueNDRangeKernel(commandQueue, adaptiveSamplesKernel, 1, NULL, &globalWorkSize, &localWorkSize, 0, NULL, &event) == CL_SUCCESS)
+            addStageEvent(ProfileStage_AdaptiveSamples, event);
+    }
+    clFinish(commandQueue);
+    lastFrameRays += (size_t)edgePixelCount*adaptiveSampleGridSize*adaptiveSampleGridSize;
+
+    // Report the ray count and the time.
+    adaptiveStatsFrames++;
+    adaptiveStatsEdgePixels += edgePixelCount;
+    adaptiveStatsTime += SDL_GetTicks() - startTime;
+    Uint32 now = SDL_GetTicks();
+    if(now - adaptiveStatsStart >= 1000)
+    {
+        size_t pixelCount = width*height;
+        int samples = adaptiveSampleGridSize*adaptiveSampleGridSize;
+        float edgePixels = adaptiveStatsEdgePixels/(float)adaptiveStatsFrames;
+        float raysPerPixel = 1.0f + edgePixels*samples/pixelCount;
+        printf("Adaptive AA: %.1f%% edge pixels, %.2f rays per pixel (%.1f%% of %dx SSAA), %.2f ms per frame\n",
+            edgePixels*100.0f/pixelCount, raysPerPixel, raysPerPixel*100.0f/(samples + 1), samples + 1,
+            adaptiveStatsTime/(float)adaptiveStatsFrames);
+
+        adaptiveStatsFrames = 0;
+        adaptiveStatsEdgePixels = 0;
+        adaptiveStatsTime = 0;
+        adaptiveStatsStart = now;
+    }
+}
+
+void Raytracer::readFrameBuffer(Image2D *image)
+{
+    T3_TRACE_ZONE("Raytracer::readFrameBuffer");
+    // Read the frame buffer data. The read is finished with the frame.
+    size_t origin[] = {0, 0, 0};
+    size_t region[] = {width, height, 1};
+    cl_event event;
+    if(clEnqueueReadImage(commandQueue, frontBuffer.colorBuffer, CL_FALSE, origin, region,
+            width*sizeof(Color), 0, image->getPixels(), 0, NULL, &event) == CL_SUCCESS)
+        addStageEvent(ProfileStage_Readback, event);
 }
 
 
@@ -475,7 +1924,9 @@ void FrameBuffer::setArguments(cl_kernel kernel, int start)
 
 void FrameBuffer::release()
 {
-    clReleaseMemObject(colorBuffer);
+    if(colorBuffer)
+        clReleaseMemObject(colorBuffer);
+    colorBuffer = NULL;
 }
 
 }
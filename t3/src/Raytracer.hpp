@@ -1,14 +1,26 @@
 #ifndef T3_RAYTRACER_HPP
 #define T3_RAYTRACER_HPP
 
-#include "Vector3.hpp"
+#include "Vector4.hpp"
+#include "CommonCL.hpp"
 #include "Threading.hpp"
+#include "WorkGroupTuner.hpp"
+#include "FrameProfiler.hpp"
+#include "DeviceSelector.hpp"
+#include "LightTiles.hpp"
+#include "ProgramBuilder.hpp"
+#include "SkyCache.hpp"
 #include <CL/cl.h>
+#include <string>
+#include <vector>
+#include <deque>
 
 namespace T3
 {
 class Application;
 class SceneDataHolder;
+class Image2D;
+class Scene;
 
 /**
  * T3 raytracer frame buffer.
@@ -16,6 +28,8 @@ class SceneDataHolder;
 class FrameBuffer
 {
 public:
+    FrameBuffer() : colorBuffer(NULL) {}
+
     void setArguments(cl_kernel kernel, int start);
     bool create(cl_context context, int width, int height);
     void release();
@@ -32,35 +46,205 @@ public:
     Raytracer(Application *app);
     ~Raytracer();
 
-    /// Initializes the raytracer.
+    /// Starts the raytracer thread, without waiting for it. The thread
+    /// sets up OpenCL while the scene loads, and builds the program once
+    /// setSceneReady is called.
     bool initialize();
 
+    /// Notifies the raytracer thread that the scene is loaded.
+    void setSceneReady();
+
+    /// Gets a description of the startup stage, for the progress frame.
+    std::string getStartupStatus();
+
+    /// Tells whether the raytracer thread failed to start.
+    bool hasStartupFailed();
+
+    /// Time taken by the last build of the programs, in milliseconds.
+    double getProgramBuildTime() const;
+
+    /// Initializes the raytracer in the calling thread, without the
+    /// raytracer thread. The frames are rendered with renderFrame.
+    bool initializeOffline();
+
+    /// Rebuilds the program and uploads the data of a new scene. Only for
+    /// the offline rendering.
+    bool reloadScene();
+
+    /// Renders a frame of the current scene into an image. Only for the
+    /// offline rendering. Returns false when the scene can't be uploaded,
+    /// and then the image is left untouched.
+    bool renderFrame(Image2D *image);
+
+    /// Enqueues a frame without waiting for it, so the next one can be
+    /// enqueued while the host works on this one. The image must stay
+    /// alive until the frame is finished. A frame whose scene can't be
+    /// uploaded is skipped, and false is returned, but it must still be
+    /// finished.
+    bool enqueueFrame(Image2D *image);
+
+    /// Waits for the oldest enqueued frame and records its timings.
+    void finishFrame();
+
+    /// Primary, adaptive and, with the ray statistics, secondary rays
+    /// traced by the last frame.
+    size_t getLastFrameRayCount() const;
+
+    /// Changes the size of the rendered frames. Only for the offline
+    /// rendering, between frames.
+    bool setResolution(int width, int height);
+
+    int getWidth() const;
+    int getHeight() const;
+
+    /// Times the scene data was uploaded. The upload is skipped while the
+    /// scene and its content are the same.
+    int getSceneUploadCount() const;
+
     /// Shuts down the raytracer.
     void shutdown();
 
+    /// Only considers the devices of the OpenCL platform with this index.
+    void setPlatform(int index);
+
+    /// Only considers the OpenCL devices of this type.
+    void setDeviceType(cl_device_type type);
+
+    /// Uses the OpenCL device with this index, or whose name contains
+    /// the string, instead of the fastest one.
+    void setDevice(const std::string &nameOrIndex);
+
+    /// Times the devices again, even when the choice is cached.
+    void setBenchmarkDevices(bool value);
+
+    /// Times the primary rays of the current scene on a device, with a
+    /// reduced frame. Returns the milliseconds per frame, or a negative
+    /// value when the device can't run the raytracer.
+    double benchmarkDevice(const ComputeDevice &device);
+
+    /// Forces measuring again the kernel work group sizes.
+    void setRetuneWorkGroups(bool value);
+
+    /// Sets the order in which the pixels are dispatched.
+    void setPixelOrder(PixelOrder order);
+
+    /// Sets the number of frames used to compare the pixel orders at startup.
+    void setPixelOrderBenchmarkFrames(int frames);
+
+    /// Sets the number of frames used to time the primary rays with and
+    /// without the camera constants at startup.
+    void setCameraConstantsBenchmarkFrames(int frames);
+
+    /// Enables the adaptive antialiasing, with gridSize^2 extra samples
+    /// for the edge pixels. Zero disables it.
+    void setAdaptiveSampleGridSize(int gridSize);
+
+    /// Enables reusing the last frame shading for the pixels that are
+    /// still visible.
+    void setReprojection(bool value);
+
+    /// Terminates the reflection and refraction paths whose weight drops
+    /// below the threshold. Zero traces them up to the scene max depth.
+    void setMinThroughput(float threshold);
+
+    /// Plays Russian roulette with the paths below the throughput threshold,
+    /// instead of cutting them.
+    void setRussianRoulette(bool value);
+
+    /// Counts the secondary rays, the terminated paths and the shadow rays
+    /// of each frame, and the noise of the soft shadows.
+    void setRayStatistics(bool value);
+
+    /// Soft shadows of the sphere lights. Every shading point traces the
+    /// probe rays, and up to the samples in the penumbra. Zero probes, the
+    /// default, treat the sphere lights as points.
+    void setSoftShadows(int probes, int samples);
+
+    /// Splits the mesh data in this number of chunks, even when it fits in
+    /// a single allocation. Zero only splits it when needed.
+    void setMeshChunkCount(int count);
+
+    /// Lowers the device allocation limit to this number of bytes, so the
+    /// splitting of the mesh data can be tested with small scenes. Zero
+    /// keeps the limit of the device.
+    void setMaxAllocSize(cl_ulong size);
+
+    /// Blends the day sky from keyframes stored in this cache file. An
+    /// empty name, the default, computes the sky again for every sun
+    /// direction.
+    void setSkyCache(const std::string &fileName);
+
+    /// Sun elevations with a day sky keyframe.
+    void setSkyKeyframeCount(int count);
+
+    /// Also computes the exact day sky every time the keyframes are
+    /// blended, and prints the error of the blend.
+    void setSkyErrorReport(bool value);
+
+    /// Computes the sphere and plane terms shared by the primary rays once
+    /// per frame, instead of in every primary ray.
+    void setCameraConstants(bool value);
+
 private:
     bool initializeRaytracerThread();
-    bool initializeOpenCL();
+    bool initializeOpenCL(const ComputeDevice &device);
+    bool waitForScene();
     bool createResources();
+    bool buildProgram();
+    bool startProgramBuild();
+    bool finishProgramBuild();
+    bool startTracerProgramBuild();
+    std::string makeTracerBuildOptions();
+    bool finishTracerProgramBuild();
+    bool startSkyProgramBuild(bool day);
+    bool finishSkyProgramBuild(bool day);
+    void setStartupStatus(const char *status);
+    void releaseProgram();
+    void releaseSkyPrograms();
+    void releaseResources();
+    void releasePixelBuffers();
     bool createImages();
+    bool createPixelBuffers();
+    void printKernelResources(cl_kernel kernel, const char *name);
 
     void shutdownOpenCL();
     void raytracerJob();
+    void enqueueKernel2D(cl_kernel kernel, const char *name, size_t width, size_t height, ProfileStage stage);
+    void addStageEvent(ProfileStage stage, cl_event event);
+    void collectStageEvents(bool record);
+    void benchmarkPixelOrders();
+    void benchmarkCameraConstants();
 
     // Main scene.
     void clearFrameBuffer();
     void swapBuffers();
-    void uploadScene();
+    bool uploadScene();
+    void releaseSceneData();
+    bool uploadMeshData(const std::vector<unsigned char> &meshData);
+    void uploadLightTiles();
+    void updateCamera();
+    void setSceneArguments(cl_kernel kernel);
+    void computeCameraConstants();
+    void castFrameRays(Image2D *image);
     void castPrimaryRays();
-    void displayFrameBuffer();
+    void castAdaptiveSamples();
+    void castReprojectedRays();
+    void swapPixelBuffers();
+    void collectRayStatistics(bool record);
+    void readFrameBuffer(Image2D *image);
 
     // Sky
     void createNightSky();
     void createDaySky();
+    void enqueueDaySky(cl_mem image, int offset, int width, int height, const Color &sunColor, const Vector3 &sunDirection);
+    bool createSkyKeyframes();
+    void blendDaySky();
+    void reportSkyError();
     void createSky();
 
     static int threadEntryPoint(void *obj);
     int threadEntry();
+    void readExtents();
 
     Application *app;
 
@@ -72,37 +256,156 @@ private:
     SDL_Thread *thread;
     Mutex threadMutex;
 
+    // Pixel dispatch.
+    PixelOrder pixelOrder;
+    int pixelOrderBenchmarkFrames;
+    int cameraConstantsBenchmarkFrames;
+
+    // Adaptive antialiasing.
+    int adaptiveSampleGridSize;
+    cl_mem pixelColorsBuffer;
+    cl_mem pixelShapesBuffer;
+    cl_mem edgePixelsBuffer;
+    cl_mem edgePixelCountBuffer;
+    int adaptiveStatsFrames;
+    size_t adaptiveStatsEdgePixels;
+    Uint32 adaptiveStatsTime;
+    Uint32 adaptiveStatsStart;
+
+    // Temporal reprojection.
+    bool reprojectionEnabled;
+    bool reprojectionValid;
+    int reprojectionFrame;
+    Vector3 reprojectionSunDir;
+    bool reprojectionDay;
+    cl_mem pixelPositionsBuffer;
+    cl_mem previousColorsBuffer;
+    cl_mem previousShapesBuffer;
+    cl_mem previousPositionsBuffer;
+    cl_mem reusedPixelCountBuffer;
+    Vector4 previousCameraPosition;
+    Vector4 previousScreenPlaneVerts[4];
+    int reprojectionStatsFrames;
+    size_t reprojectionStatsReused;
+    Uint32 reprojectionStatsTime;
+    Uint32 reprojectionStatsStart;
+    Uint32 fullFrameTime;
+
+    // Path termination.
+    float minThroughput;
+    bool russianRoulette;
+    bool rayStatsEnabled;
+    cl_mem rayStatsBuffer;
+    int rayStatsFrames;
+    size_t rayStatsSecondary;
+    size_t rayStatsTerminated;
+    size_t rayStatsShadow;
+    size_t rayStatsSphereShadow;
+    size_t rayStatsPenumbra;
+    size_t rayStatsPenumbraVariance;
+    Uint32 rayStatsStart;
+    size_t lastFrameRays;
+
+    // Sphere light shadow rays.
+    int shadowProbes;
+    int shadowSamples;
+
+    // Sphere and plane terms of the primary rays.
+    bool cameraConstantsEnabled;
+    cl_mem cameraConstantsBuffer;
+    size_t cameraConstantsCapacity;
+    int cameraConstantSpheres;
+    int cameraConstantPlanes;
+
+    // Camera of the current frame.
+    Vector4 cameraPosition;
+    Vector4 screenPlaneVerts[4];
+
     // Last sun direction.
     Vector3 lastSunDir;
 
-    // Thread initialitation condition.
-    bool threadStartedSuccess;
-    Condition threadStartedCond;
+    // Thread startup. The scene is loaded by the main thread while the
+    // raytracer thread sets up OpenCL.
+    bool sceneReady;
+    Condition sceneReadyCond;
+    bool startupFailed;
+    std::string startupStatus;
+
+    // Programs, built in parallel. The sky programs are only built for
+    // the kind of sky that is used.
+    ProgramBuilder tracerProgram;
+    ProgramBuilder daySkyProgram;
+    ProgramBuilder nightSkyProgram;
+    std::string tracerBuildOptions;
+    double programBuildStart;
+    double programBuildTime;
 
     // Thread finish flag.
     bool threadFinishFlag;
 
     // OpenCL
-    int selectedPlatform;
+    DeviceSelector deviceSelector;
     cl_context computeContext;
     cl_device_id computeDevice;
     cl_command_queue commandQueue;
-    cl_program raytracerProgram;
+    cl_ulong maxConstantBufferSize;
+    cl_ulong maxMemAllocSize;
+
+    // Pending device timings of the frame being enqueued, and of the
+    // frames enqueued but not finished.
+    typedef std::vector<std::pair<ProfileStage, cl_event> > StageEventList;
+    StageEventList stageEvents;
+    std::deque<StageEventList> pendingFrameEvents;
+    int lastProfileFrame;
+    unsigned int frameSeed;
+
+    // Work group sizes.
+    WorkGroupTuner workGroupTuner;
+    bool retuneWorkGroups;
 
     // Images.
     cl_mem imagesDescBuffer;
     cl_mem imagesBuffer;
 
+    // Day sky keyframes.
+    SkyCache skyCache;
+    cl_mem skyKeyframesBuffer;
+    bool skyErrorReport;
+
     // Frame buffers.
     FrameBuffer backBuffer, frontBuffer;
 
     // Scene data.
     SceneDataHolder *sceneData;
     cl_mem sceneDataBuffer;
+    cl_mem materialBuffer;
+    int meshDataVersion;
+
+    // Scene and content version of the uploaded data.
+    Scene *uploadedScene;
+    int uploadedSceneVersion;
+    int sceneUploadCount;
+
+    // Mesh data chunks, of 2^meshChunkShift bytes.
+    cl_mem meshDataBuffers[MESH_DATA_CHUNK_COUNT];
+    int meshChunkShift;
+    int meshChunkCount;
+    size_t meshDataSize;
+    cl_ulong maxAllocLimit;
+
+    // Per screen tile lists of the bounded lights.
+    LightTiles lightTiles;
+    cl_mem lightTileOffsetsBuffer;
+    cl_mem lightTileLightsBuffer;
 
     // Kernels
     cl_kernel primaryRaysKernel;
+    cl_kernel edgeDetectionKernel;
+    cl_kernel adaptiveSamplesKernel;
+    cl_kernel reprojectionKernel;
+    cl_kernel cameraConstantsKernel;
     cl_kernel daySkyCreationKernel;
+    cl_kernel daySkyBlendKernel;
     cl_kernel nightSkyCreationKernel;
 };
 
@@ -0,0 +1,451 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include "RegressionSuite.hpp"
+#include "Application.hpp"
+#include "Image.hpp"
+
+namespace T3
+{
+
+// PSNR reported for identical images.
+const double MaxPSNR = 100.0;
+
+// Structural similarity window.
+const int SSIMWindowSize = 8;
+const int SSIMWindowStride = 4;
+
+static const char *ResultStageNames[ProfileStage_Count] = {
+    "frame",
+    "upload_scene",
+    "create_sky",
+    "primary_rays",
+    "adaptive_samples",
+    "readback",
+    "convert_image",
+    "flip",
+};
+
+inline int quantizeChannel(float value)
+{
+    if(value <= 0.0f)
+        return 0;
+    if(value >= 1.0f)
+        return 255;
+    return (int)(value*255.0f + 0.5f);
+}
+
+inline double quantizedLuminance(const Color &color)
+{
+    return 0.299*quantizeChannel(color.r) + 0.587*quantizeChannel(color.g) + 0.114*quantizeChannel(color.b);
+}
+
+inline std::string getSceneName(const std::string &fileName)
+{
+    size_t start = fileName.find_last_of('/');
+    start = start == std::string::npos ? 0 : start + 1;
+    size_t end = fileName.rfind('.');
+    if(end == std::string::npos || end < start)
+        end = fileName.size();
+    return fileName.substr(start, end - start);
+}
+
+/**
+ * Finds a number after a quoted key, inside a line of the baseline.
+ */
+inline bool findNumber(const std::string &text, const char *key, double *value)
+{
+    std::string pattern = std::string("\"") + key + "\": ";
+    size_t position = text.find(pattern);
+    if(position == std::string::npos)
+        return false;
+    return sscanf(text.c_str() + position + pattern.size(), "%lf", value) == 1;
+}
+
+RegressionSuite::RegressionSuite()
+    : updateReferences(false), maxSlowdown(0.1f), minPSNR(40.0f), minSSIM(0.99f), frameCount(16)
+{
+}
+
+RegressionSuite::~RegressionSuite()
+{
+}
+
+void RegressionSuite::setReferenceDirectory(const std::string &directory)
+{
+    referenceDirectory = directory;
+}
+
+bool RegressionSuite::isEnabled() const
+{
+    return !referenceDirectory.empty();
+}
+
+void RegressionSuite::setUpdateReferences(bool value)
+{
+    updateReferences = value;
+}
+
+void RegressionSuite::setMaxSlowdown(float fraction)
+{
+    maxSlowdown = fraction;
+}
+
+void RegressionSuite::setMinPSNR(float decibels)
+{
+    minPSNR = decibels;
+}
+
+void RegressionSuite::setMinSSIM(float value)
+{
+    minSSIM = value;
+}
+
+void RegressionSuite::setFrameCount(int count)
+{
+    frameCount = count > 0 ? count : 1;
+}
+
+void RegressionSuite::addScene(const std::string &fileName)
+{
+    scenes.push_back(fileName);
+}
+
+const std::vector<std::string> &RegressionSuite::getScenes() const
+{
+    return scenes;
+}
+
+bool RegressionSuite::run(Application *app, Raytracer *raytracer)
+{
+    std::string baselineFile = referenceDirectory + "/baseline.json";
+    if(!updateReferences && !readBaseline(baselineFile))
+        printf("No baseline in %s, the performance is not compared\n", baselineFile.c_str());
+
+    int passed = 0;
+    results.clear();
+    for(size_t i = 0; i < scenes.size(); ++i)
+    {
+        if(runScene(app, raytracer, scenes[i]))
+            passed++;
+    }
+
+    // Store the new baseline, or the results next to the old one.
+    std::string resultsFile = updateReferences ? baselineFile : referenceDirectory + "/results.json";
+    if(!writeResults(resultsFile))
+        return false;
+
+    printf("Regression suite: %d of %d scenes passed, results in %s\n",
+        passed, (int)scenes.size(), resultsFile.c_str());
+    return passed == (int)scenes.size();
+}
+
+bool RegressionSuite::runScene(Application *app, Raytracer *raytracer, const std::string &fileName)
+{
+    // The application loads the first scene.
+    if(fileName != scenes[0])
+    {
+        if(!std::ifstream(fileName.c_str()).good())
+        {
+            fprintf(stderr, "Failed to open the scene %s\n", fileName.c_str());
+            return false;
+        }
+
+        Scene *newScene = Scene::loadFromFile(fileName);
+        if(!newScene)
+            return false;
+
+        Scene *oldScene = app->getScene();
+        app->setScene(newScene);
+        if(!raytracer->reloadScene())
+            return false;
+        delete oldScene;
+    }
+
+    RegressionResult result;
+    result.name = getSceneName(fileName);
+    result.width = app->getDisplay()->getWidth();
+    result.height = app->getDisplay()->getHeight();
+    printf("Scene %s (%dx%d)\n", result.name.c_str(), result.width, result.height);
+
+    // Warm up, so the first use of the kernels is out of the timings.
+    Image2D image(result.width, result.height);
+    if(!raytracer->renderFrame(&image))
+    {
+        fprintf(stderr, "    FAIL: the scene can't be rendered\n");
+        return false;
+    }
+
+    // Time the frames.
+    FrameProfiler *profiler = app->getProfiler();
+    profiler->reset();
+    double rays = 0.0;
+    double startTime = FrameProfiler::now();
+    for(int i = 0; i < frameCount; ++i)
+    {
+        if(!raytracer->renderFrame(&image))
+            return false;
+        rays += raytracer->getLastFrameRayCount();
+    }
+    double elapsed = FrameProfiler::now() - startTime;
+    result.megaRaysPerSecond = rays/(elapsed*1000.0);
+    profiler->getAverageTimes(result.hostTimes, result.deviceTimes);
+    printf("    %.3f Mrays/s, %.2f ms per frame\n", result.megaRaysPerSecond, result.hostTimes[ProfileStage_Frame]);
+
+    bool imagePassed = compareImage(&image, &result);
+    bool performancePassed = comparePerformance(result);
+    results.push_back(result);
+    return imagePassed && performancePassed;
+}
+
+bool RegressionSuite::compareImage(const Image2D *image, RegressionResult *result)
+{
+    std::string referenceFile = referenceDirectory + "/" + result->name + ".ppm";
+    if(updateReferences)
+    {
+        result->psnr = MaxPSNR;
+        result->ssim = 1.0;
+        return image->saveToPPM(referenceFile);
+    }
+
+    Image2D *reference = Image2D::loadFromPPM(referenceFile);
+    if(!reference)
+    {
+        fprintf(stderr, "    FAIL: missing reference image %s\n", referenceFile.c_str());
+        result->psnr = result->ssim = 0.0;
+        return false;
+    }
+
+    if(reference->getWidth() != image->getWidth() || reference->getHeight() != image->getHeight())
+    {
+        fprintf(stderr, "    FAIL: the reference image is %dx%d\n", reference->getWidth(), reference->getHeight());
+        result->psnr = result->ssim = 0.0;
+        delete reference;
+        return false;
+    }
+
+    result->psnr = computePSNR(image, reference);
+    result->ssim = computeSSIM(image, reference);
+    delete reference;
+
+    bool passed = result->psnr >= minPSNR && result->ssim >= minSSIM;
+    printf("    %s: PSNR %.2f dB (min %.2f), SSIM %.5f (min %.5f)\n", passed ? "image ok" : "FAIL",
+        result->psnr, minPSNR, result->ssim, minSSIM);
+    return passed;
+}
+
+bool RegressionSuite::comparePerformance(const RegressionResult &result)
+{
+    std::map<std::string, RegressionResult>::const_iterator it = baseline.find(result.name);
+    if(updateReferences || it == baseline.end())
+        return true;
+
+    const RegressionResult &base = it->second;
+    if(base.width != result.width || base.height != result.height)
+    {
+        printf("    The baseline was taken at %dx%d, the performance is not compared\n", base.width, base.height);
+        return true;
+    }
+
+    // The whole frame and the throughput decide.
+    bool passed = true;
+    double minRays = base.megaRaysPerSecond*(1.0 - maxSlowdown);
+    if(result.megaRaysPerSecond < minRays)
+    {
+        printf("    FAIL: %.3f Mrays/s against %.3f in the baseline\n", result.megaRaysPerSecond, base.megaRaysPerSecond);
+        passed = false;
+    }
+
+    double maxFrameTime = base.hostTimes[ProfileStage_Frame]*(1.0 + maxSlowdown);
+    if(result.hostTimes[ProfileStage_Frame] > maxFrameTime)
+    {
+        printf("    FAIL: %.2f ms per frame against %.2f in the baseline\n",
+            result.hostTimes[ProfileStage_Frame], base.hostTimes[ProfileStage_Frame]);
+        passed = false;
+    }
+
+    // The stages are only reported, their timings are too noisy to fail.
+    for(int i = 1; i < ProfileStage_Count; ++i)
+    {
+        if(base.deviceTimes[i] > 0.0 && result.deviceTimes[i] > base.deviceTimes[i]*(1.0 + maxSlowdown))
+        {
+            printf("    %s device time: %.3f ms against %.3f in the baseline\n",
+                FrameProfiler::getStageName((ProfileStage)i), result.deviceTimes[i], base.deviceTimes[i]);
+        }
+    }
+
+    if(passed)
+        printf("    performance ok, %+.1f%% Mrays/s\n", (result.megaRaysPerSecond/base.megaRaysPerSecond - 1.0)*100.0);
+    return passed;
+}
+
+double RegressionSuite::computePSNR(const Image2D *image, const Image2D *reference)
+{
+    const Color *a = image->getPixels();
+    const Color *b = reference->getPixels();
+    int pixelCount = image->getWidth()*image->getHeight();
+    double error = 0.0;
+    for(int i = 0; i < pixelCount; ++i)
+    {
+        double dr = quantizeChannel(a[i].r) - quantizeChannel(b[i].r);
+        double dg = quantizeChannel(a[i].g) - quantizeChannel(b[i].g);
+        double db = quantizeChannel(a[i].b) - quantizeChannel(b[i].b);
+        error += dr*dr + dg*dg + db*db;
+    }
+
+    double mse = error/(pixelCount*3.0);
+    if(mse == 0.0)
+        return MaxPSNR;
+    double psnr = 10.0*log10(255.0*255.0/mse);
+    return psnr < MaxPSNR ? psnr : MaxPSNR;
+}
+
+double RegressionSuite::computeSSIM(const Image2D *image, const Image2D *reference)
+{
+    // Standard constants for 8-bit values.
+    const double C1 = (0.01*255.0)*(0.01*255.0);
+    const double C2 = (0.03*255.0)*(0.03*255.0);
+    const double windowPixels = SSIMWindowSize*SSIMWindowSize;
+
+    int width = image->getWidth();
+    int height = image->getHeight();
+    std::vector<double> a(width*height);
+    std::vector<double> b(width*height);
+    for(int i = 0; i < width*height; ++i)
+    {
+        a[i] = quantizedLuminance(image->getPixels()[i]);
+        b[i] = quantizedLuminance(reference->getPixels()[i]);
+    }
+
+    // Average over overlapping windows of the luminance.
+    double sum = 0.0;
+    int windowCount = 0;
+    for(int y = 0; y + SSIMWindowSize <= height; y += SSIMWindowStride)
+    {
+        for(int x = 0; x + SSIMWindowSize <= width; x += SSIMWindowStride)
+        {
+            double meanA = 0.0, meanB = 0.0;
+            for(int wy = 0; wy < SSIMWindowSize; ++wy)
+            {
+                for(int wx = 0; wx < SSIMWindowSize; ++wx)
+                {
+                    int index = (y + wy)*width + x + wx;
+                    meanA += a[index];
+                    meanB += b[index];
+                }
+            }
+            meanA /= windowPixels;
+            meanB /= windowPixels;
+
+            double varianceA = 0.0, varianceB = 0.0, covariance = 0.0;
+            for(int wy = 0; wy < SSIMWindowSize; ++wy)
+            {
+                for(int wx = 0; wx < SSIMWindowSize; ++wx)
+                {
+                    int index = (y + wy)*width + x + wx;
+                    double da = a[index] - meanA;
+                    double db = b[index] - meanB;
+                    varianceA += da*da;
+                    varianceB += db*db;
+                    covariance += da*db;
+                }
+            }
+            varianceA /= windowPixels - 1.0;
+            varianceB /= windowPixels - 1.0;
+            covariance /= windowPixels - 1.0;
+
+            sum += ((2.0*meanA*meanB + C1)*(2.0*covariance + C2)) /
+                   ((meanA*meanA + meanB*meanB + C1)*(varianceA + varianceB + C2));
+            windowCount++;
+        }
+    }
+
+    return windowCount > 0 ? sum/windowCount : 1.0;
+}
+
+bool RegressionSuite::readBaseline(const std::string &fileName)
+{
+    std::ifstream in(fileName.c_str());
+    if(!in.good())
+        return false;
+
+    // Each scene is written in its own line.
+    std::string line;
+    while(std::getline(in, line))
+    {
+        size_t nameStart = line.find("\"name\": \"");
+        if(nameStart == std::string::npos)
+            continue;
+        nameStart += strlen("\"name\": \"");
+        size_t nameEnd = line.find('"', nameStart);
+        if(nameEnd == std::string::npos)
+            continue;
+
+        RegressionResult result;
+        result.name = line.substr(nameStart, nameEnd - nameStart);
+        double width = 0, height = 0;
+        findNumber(line, "width", &width);
+        findNumber(line, "height", &height);
+        result.width = (int)width;
+        result.height = (int)height;
+        result.megaRaysPerSecond = 0.0;
+        result.psnr = result.ssim = 0.0;
+        findNumber(line, "mrays_per_second", &result.megaRaysPerSecond);
+
+        // The stage times are in two objects.
+        size_t hostStart = line.find("\"host_ms\"");
+        size_t deviceStart = line.find("\"device_ms\"");
+        std::string hostText = hostStart == std::string::npos ? "" : line.substr(hostStart, deviceStart - hostStart);
+        std::string deviceText = deviceStart == std::string::npos ? "" : line.substr(deviceStart);
+        for(int i = 0; i < ProfileStage_Count; ++i)
+        {
+            result.hostTimes[i] = 0.0;
+            result.deviceTimes[i] = -1.0;
+            findNumber(hostText, ResultStageNames[i], &result.hostTimes[i]);
+            findNumber(deviceText, ResultStageNames[i], &result.deviceTimes[i]);
+        }
+
+        baseline[result.name] = result;
+    }
+
+    return true;
+}
+
+bool RegressionSuite::writeResults(const std::string &fileName) const
+{
+    FILE *file = fopen(fileName.c_str(), "w");
+    if(!file)
+    {
+        fprintf(stderr, "Failed to write %s\n", fileName.c_str());
+        return false;
+    }
+
+    fprintf(file, "{\n  \"scenes\": [\n");
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const RegressionResult &result = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"width\": %d, \"height\": %d, \"mrays_per_second\": %.4f, "
+            "\"psnr\": %.3f, \"ssim\": %.6f, \"host_ms\": {",
+            result.name.c_str(), result.width, result.height, result.megaRaysPerSecond, result.psnr, result.ssim);
+        for(int j = 0; j < ProfileStage_Count; ++j)
+            fprintf(file, "%s\"%s\": %.4f", j ? ", " : "", ResultStageNames[j], result.hostTimes[j]);
+
+        // Only the stages with device work.
+        fprintf(file, "}, \"device_ms\": {");
+        bool first = true;
+        for(int j = 0; j < ProfileStage_Count; ++j)
+        {
+            if(result.deviceTimes[j] < 0.0)
+                continue;
+            fprintf(file, "%s\"%s\": %.4f", first ? "" : ", ", ResultStageNames[j], result.deviceTimes[j]);
+            first = false;
+        }
+        fprintf(file, "}}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+} // namespace T3
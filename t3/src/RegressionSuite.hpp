@@ -0,0 +1,89 @@
+#ifndef T3_REGRESSION_SUITE_HPP
+#define T3_REGRESSION_SUITE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include "FrameProfiler.hpp"
+
+namespace T3
+{
+
+class Application;
+class Raytracer;
+class Image2D;
+
+/**
+ * Performance of a scene, as stored in the baseline.
+ */
+struct RegressionResult
+{
+    std::string name;
+    int width, height;
+    double megaRaysPerSecond;
+    double psnr, ssim;
+    double hostTimes[ProfileStage_Count];
+    double deviceTimes[ProfileStage_Count];
+};
+
+/**
+ * Renders a list of scenes from their own cameras, compares the images
+ * against stored references and the performance against a JSON baseline.
+ */
+class RegressionSuite
+{
+public:
+    RegressionSuite();
+    ~RegressionSuite();
+
+    /// Directory with the reference images and the baseline.
+    void setReferenceDirectory(const std::string &directory);
+    bool isEnabled() const;
+
+    /// Writes the references and the baseline instead of comparing.
+    void setUpdateReferences(bool value);
+
+    /// Maximum fraction by which the frame time and the Mrays/s can get worse.
+    void setMaxSlowdown(float fraction);
+
+    /// The images pass when both thresholds are met.
+    void setMinPSNR(float decibels);
+    void setMinSSIM(float value);
+
+    /// Number of timed frames per scene.
+    void setFrameCount(int count);
+
+    void addScene(const std::string &fileName);
+    const std::vector<std::string> &getScenes() const;
+
+    /// Runs the suite with an offline raytracer. Returns true when every
+    /// scene passed.
+    bool run(Application *app, Raytracer *raytracer);
+
+    /// Image metrics, over the 8-bit quantized colors.
+    static double computePSNR(const Image2D *image, const Image2D *reference);
+    static double computeSSIM(const Image2D *image, const Image2D *reference);
+
+private:
+    bool runScene(Application *app, Raytracer *raytracer, const std::string &fileName);
+    bool compareImage(const Image2D *image, RegressionResult *result);
+    bool comparePerformance(const RegressionResult &result);
+
+    bool readBaseline(const std::string &fileName);
+    bool writeResults(const std::string &fileName) const;
+
+    std::string referenceDirectory;
+    bool updateReferences;
+    float maxSlowdown;
+    float minPSNR;
+    float minSSIM;
+    int frameCount;
+
+    std::vector<std::string> scenes;
+    std::map<std::string, RegressionResult> baseline;
+    std::vector<RegressionResult> results;
+};
+
+} // namespace T3
+
+#endif //T3_REGRESSION_SUITE_HPP
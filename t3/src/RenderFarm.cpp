@@ -0,0 +1,515 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <deque>
+#include "RenderFarm.hpp"
+#include "Application.hpp"
+#include "FrameProfiler.hpp"
+#include "Image.hpp"
+
+namespace T3
+{
+
+// Time to wait for the workers to initialize OpenCL and connect, in ms.
+const int WorkerStartTimeout = 120000;
+
+// Options naming an output file, which get a suffix per worker.
+static const char *WorkerFileOptions[] = {"--profile-csv", "--trace", NULL};
+
+static bool readAll(int fd, void *buffer, size_t size)
+{
+    char *data = static_cast<char*> (buffer);
+    while(size > 0)
+    {
+        ssize_t count = read(fd, data, size);
+        if(count < 0 && errno == EINTR)
+            continue;
+        if(count <= 0)
+            return false;
+        data += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+static bool writeAll(int fd, const void *buffer, size_t size)
+{
+    const char *data = static_cast<const char*> (buffer);
+    while(size > 0)
+    {
+        // Don't die with SIGPIPE when a worker is gone.
+        ssize_t count = send(fd, data, size, MSG_NOSIGNAL);
+        if(count < 0 && errno == EINTR)
+            continue;
+        if(count <= 0)
+            return false;
+        data += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+inline void storeVector(float *dest, const Vector3 &v)
+{
+    dest[0] = v.x;
+    dest[1] = v.y;
+    dest[2] = v.z;
+}
+
+RenderFarm::RenderFarm()
+    : outputDirectory("."), workerCount(2), framesPerSecond(30.0f), scaling(false)
+{
+}
+
+RenderFarm::~RenderFarm()
+{
+}
+
+void RenderFarm::setCommandLine(int argc, const char *argv[])
+{
+    commandLine.assign(argv, argv + argc);
+}
+
+void RenderFarm::setCameraPathFile(const std::string &fileName)
+{
+    cameraPathFile = fileName;
+}
+
+void RenderFarm::setWorkerCount(int count)
+{
+    workerCount = count > 0 ? count : 1;
+}
+
+void RenderFarm::setFramesPerSecond(float fps)
+{
+    framesPerSecond = fps > 0.0f ? fps : 30.0f;
+}
+
+void RenderFarm::setOutputDirectory(const std::string &directory)
+{
+    outputDirectory = directory;
+}
+
+void RenderFarm::setScaling(bool value)
+{
+    scaling = value;
+}
+
+void RenderFarm::setWorkerSocket(const std::string &path)
+{
+    workerSocket = path;
+}
+
+bool RenderFarm::isCoordinator() const
+{
+    return !cameraPathFile.empty() && !isWorker();
+}
+
+bool RenderFarm::isWorker() const
+{
+    return !workerSocket.empty();
+}
+
+//-----------------------------------------------------------------------------
+// Coordinator
+//
+
+bool RenderFarm::runCoordinator()
+{
+    CameraPath path;
+    if(!path.loadFromFile(cameraPathFile))
+        return false;
+
+    // Fail before starting the workers when the frames can't be written.
+    if(mkdir(outputDirectory.c_str(), 0777) < 0 && errno != EEXIST)
+    {
+        perror(("Failed to create the render farm output directory " + outputDirectory).c_str());
+        return false;
+    }
+    if(access(outputDirectory.c_str(), W_OK) < 0)
+    {
+        perror(("The render farm output directory " + outputDirectory + " is not writable").c_str());
+        return false;
+    }
+
+    int frameCount = path.getFrameCount(framesPerSecond);
+    printf("Render farm: %d frames at %.1f fps into %s\n", frameCount, framesPerSecond, outputDirectory.c_str());
+
+    // Add the workers one by one when measuring the scaling.
+    int firstCount = scaling ? 1 : workerCount;
+    double baseRate = 0.0;
+    for(int count = firstCount; count <= workerCount; ++count)
+    {
+        double rate;
+        if(!renderSequence(path, count, &rate))
+            return false;
+
+        if(count == firstCount)
+            baseRate = rate;
+        printf("%d workers: %.2f frames/s, %.2fx the throughput of %d worker%s\n",
+            count, rate, rate/baseRate, firstCount, firstCount > 1 ? "s" : "");
+    }
+
+    return true;
+}
+
+bool RenderFarm::renderSequence(const CameraPath &path, int count, double *rate)
+{
+    std::vector<int> sockets;
+    std::vector<pid_t> pids;
+    if(!startWorkers(count, &sockets, &pids))
+    {
+        stopWorkers(&sockets, &pids);
+        return false;
+    }
+
+    // The workers are warm, start timing.
+    int frameCount = path.getFrameCount(framesPerSecond);
+    std::deque<int> pendingFrames;
+    for(int i = 0; i < frameCount; ++i)
+        pendingFrames.push_back(i);
+    std::vector<int> currentFrames(count, -1);
+    std::vector<int> workerFrames(count, 0);
+    std::vector<double> workerTimes(count, 0.0);
+    int completedFrames = 0;
+    double startTime = FrameProfiler::now();
+
+    bool success = true;
+    while(completedFrames < frameCount)
+    {
+        // Hand out the pending frames to the idle workers.
+        int busyWorkers = 0;
+        for(int i = 0; i < count; ++i)
+        {
+            if(sockets[i] < 0)
+                continue;
+
+            if(currentFrames[i] < 0 && !pendingFrames.empty())
+            {
+                int frame = pendingFrames.front();
+                pendingFrames.pop_front();
+                if(!sendJob(sockets[i], path, frame))
+                {
+                    fprintf(stderr, "Lost render farm worker %d\n", i);
+                    pendingFrames.push_front(frame);
+                    close(sockets[i]);
+                    sockets[i] = -1;
+                    continue;
+                }
+                currentFrames[i] = frame;
+            }
+
+            if(currentFrames[i] >= 0)
+                busyWorkers++;
+        }
+
+        if(busyWorkers == 0)
+        {
+            fprintf(stderr, "No render farm workers left, %d frames were not rendered\n", frameCount - completedFrames);
+            success = false;
+            break;
+        }
+
+        // Wait for the results.
+        std::vector<pollfd> pollFds;
+        std::vector<int> pollWorkers;
+        for(int i = 0; i < count; ++i)
+        {
+            if(sockets[i] < 0 || currentFrames[i] < 0)
+                continue;
+            pollfd pfd = {sockets[i], POLLIN, 0};
+            pollFds.push_back(pfd);
+            pollWorkers.push_back(i);
+        }
+
+        if(poll(&pollFds[0], pollFds.size(), -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            success = false;
+            break;
+        }
+
+        for(size_t i = 0; i < pollFds.size(); ++i)
+        {
+            if(!pollFds[i].revents)
+                continue;
+
+            int worker = pollWorkers[i];
+            int frame;
+            float renderTime;
+            bool saved = true;
+            if(!receiveFrame(sockets[worker], &frame, &renderTime, &saved) || frame != currentFrames[worker])
+            {
+                // Give the frame to another worker.
+                fprintf(stderr, "Lost render farm worker %d\n", worker);
+                pendingFrames.push_front(currentFrames[worker]);
+                close(sockets[worker]);
+                sockets[worker] = -1;
+            }
+            else if(!saved)
+            {
+                success = false;
+            }
+            else
+            {
+                completedFrames++;
+                workerFrames[worker]++;
+                workerTimes[worker] += renderTime;
+            }
+            currentFrames[worker] = -1;
+        }
+
+        // A frame that can't be written fails the job.
+        if(!success)
+            break;
+    }
+
+    double elapsed = FrameProfiler::now() - startTime;
+    stopWorkers(&sockets, &pids);
+
+    *rate = completedFrames*1000.0/elapsed;
+    for(int i = 0; i < count; ++i)
+    {
+        printf("    worker %d: %d frames, %.2f ms per frame\n", i, workerFrames[i],
+            workerFrames[i] ? workerTimes[i]/workerFrames[i] : 0.0);
+    }
+    return success;
+}
+
+bool RenderFarm::startWorkers(int count, std::vector<int> *sockets, std::vector<pid_t> *pids)
+{
+    // Listen in a socket of this process. The path is shorter than
+    // sun_path, so it keeps its terminator.
+    char socketPath[64];
+    snprintf(socketPath, sizeof(socketPath), "/tmp/t3-farm-%d.sock", (int)getpid());
+    unlink(socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+    if(listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, count) < 0)
+    {
+        perror("Failed to create the render farm socket");
+        if(listener >= 0)
+            close(listener);
+        return false;
+    }
+
+    // Start the workers with the same command line. The executable is
+    // taken from /proc, since argv[0] may have been found through the PATH.
+    fflush(stdout);
+    for(int i = 0; i < count; ++i)
+    {
+        std::vector<std::string> workerArguments;
+        makeWorkerArguments(i, &workerArguments);
+        workerArguments.push_back("--farm-worker");
+        workerArguments.push_back(socketPath);
+
+        std::vector<const char*> arguments;
+        for(size_t j = 0; j < workerArguments.size(); ++j)
+            arguments.push_back(workerArguments[j].c_str());
+        arguments.push_back(NULL);
+
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            execv("/proc/self/exe", const_cast<char**> (&arguments[0]));
+            perror("Failed to start a render farm worker");
+            _exit(1);
+        }
+        else if(pid < 0)
+        {
+            perror("fork");
+            break;
+        }
+
+        pids->push_back(pid);
+    }
+
+    // Wait for them to initialize and connect.
+    bool success = (int)pids->size() == count;
+    double startTime = FrameProfiler::now();
+    while(success && (int)sockets->size() < count)
+    {
+        pollfd pfd = {listener, POLLIN, 0};
+        int ready = poll(&pfd, 1, 1000);
+        if(ready > 0)
+        {
+            int fd = accept(listener, NULL, NULL);
+            if(fd >= 0)
+                sockets->push_back(fd);
+            continue;
+        }
+
+        // Check for a worker that failed to initialize.
+        int status;
+        if(waitpid(-1, &status, WNOHANG) > 0)
+        {
+            fprintf(stderr, "A render farm worker failed to start\n");
+            success = false;
+        }
+        else if(FrameProfiler::now() - startTime > WorkerStartTimeout)
+        {
+            fprintf(stderr, "Timeout waiting for the render farm workers\n");
+            success = false;
+        }
+    }
+
+    close(listener);
+    unlink(socketPath);
+    return success;
+}
+
+void RenderFarm::stopWorkers(std::vector<int> *sockets, std::vector<pid_t> *pids)
+{
+    RenderFarmJob stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.frame = -1;
+    for(size_t i = 0; i < sockets->size(); ++i)
+    {
+        if((*sockets)[i] < 0)
+            continue;
+        writeAll((*sockets)[i], &stop, sizeof(stop));
+        close((*sockets)[i]);
+    }
+
+    // Workers that never connected are killed.
+    if(sockets->size() < pids->size())
+    {
+        for(size_t i = 0; i < pids->size(); ++i)
+            kill((*pids)[i], SIGTERM);
+    }
+
+    for(size_t i = 0; i < pids->size(); ++i)
+        waitpid((*pids)[i], NULL, 0);
+
+    sockets->clear();
+    pids->clear();
+}
+
+void RenderFarm::makeWorkerArguments(int worker, std::vector<std::string> *arguments) const
+{
+    // Every worker writes its own profile and trace files.
+    char suffix[32];
+    sprintf(suffix, ".worker%d", worker);
+    arguments->assign(commandLine.begin(), commandLine.end());
+    for(size_t i = 1; i + 1 < arguments->size(); ++i)
+    {
+        for(int j = 0; WorkerFileOptions[j]; ++j)
+        {
+            if((*arguments)[i] == WorkerFileOptions[j])
+            {
+                (*arguments)[++i] += suffix;
+                break;
+            }
+        }
+    }
+}
+
+bool RenderFarm::sendJob(int socket, const CameraPath &path, int frame)
+{
+    CameraKeyframe keyframe = path.sample(frame/framesPerSecond);
+    RenderFarmJob job;
+    job.frame = frame;
+    storeVector(job.position, keyframe.position);
+    storeVector(job.rotation, keyframe.rotation);
+    storeVector(job.sunDirection, keyframe.sunDirection);
+
+    return writeAll(socket, &job, sizeof(job));
+}
+
+bool RenderFarm::receiveFrame(int socket, int *frame, float *renderTime, bool *saved)
+{
+    RenderFarmResult result;
+    if(!readAll(socket, &result, sizeof(result)) || result.width <= 0 || result.height <= 0)
+        return false;
+
+    std::vector<unsigned char> pixels(result.width*result.height*3);
+    if(!readAll(socket, &pixels[0], pixels.size()))
+        return false;
+
+    // The frame number orders the output sequence.
+    Image2D image(result.width, result.height);
+    image.setRGB8(&pixels[0]);
+    char fileName[64];
+    sprintf(fileName, "/frame_%05d.ppm", result.frame);
+    *saved = image.saveToPPM(outputDirectory + fileName);
+    if(!*saved)
+        fprintf(stderr, "Failed to write the frame %d into %s\n", result.frame, outputDirectory.c_str());
+
+    *frame = result.frame;
+    *renderTime = result.renderTime;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Worker
+//
+
+bool RenderFarm::runWorker(Application *app, Raytracer *raytracer)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, workerSocket.c_str(), sizeof(address.sun_path) - 1);
+    if(fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0)
+    {
+        perror("Failed to connect to the render farm coordinator");
+        if(fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    // The context, program and scene stay the same between the frames.
+    int width = app->getDisplay()->getWidth();
+    int height = app->getDisplay()->getHeight();
+    Image2D image(width, height);
+    std::vector<unsigned char> pixels(width*height*3);
+    RenderFarmJob job;
+    while(readAll(fd, &job, sizeof(job)) && job.frame >= 0)
+    {
+        CameraKeyframe keyframe;
+        keyframe.position = Vector3(job.position[0], job.position[1], job.position[2]);
+        keyframe.rotation = Vector3(job.rotation[0], job.rotation[1], job.rotation[2]);
+        keyframe.sunDirection = Vector3(job.sunDirection[0], job.sunDirection[1], job.sunDirection[2]);
+        app->applyCameraKeyframe(keyframe);
+
+        // The coordinator gives the job to another worker when this one
+        // disconnects.
+        double startTime = FrameProfiler::now();
+        if(!raytracer->renderFrame(&image))
+        {
+            fprintf(stderr, "Worker failed to render the frame %d\n", job.frame);
+            close(fd);
+            return false;
+        }
+        image.getRGB8(&pixels[0]);
+
+        RenderFarmResult result;
+        result.frame = job.frame;
+        result.width = width;
+        result.height = height;
+        result.renderTime = FrameProfiler::now() - startTime;
+        if(!writeAll(fd, &result, sizeof(result)) || !writeAll(fd, &pixels[0], pixels.size()))
+            break;
+    }
+
+    close(fd);
+    return true;
+}
+
+} // namespace T3
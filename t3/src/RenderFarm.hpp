@@ -0,0 +1,90 @@
+#ifndef T3_RENDER_FARM_HPP
+#define T3_RENDER_FARM_HPP
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "CameraPath.hpp"
+
+namespace T3
+{
+
+class Application;
+class Raytracer;
+
+/**
+ * Frame sent to a render farm worker. A negative frame stops the worker.
+ */
+struct RenderFarmJob
+{
+    int frame;
+    float position[3];
+    float rotation[3];
+    float sunDirection[3];
+};
+
+/**
+ * Header of a rendered frame, followed by width*height*3 bytes of RGB.
+ */
+struct RenderFarmResult
+{
+    int frame;
+    int width;
+    int height;
+    float renderTime;
+};
+
+/**
+ * Local render farm. The coordinator samples a camera path and hands the
+ * frames to worker processes over a Unix socket. The workers are this same
+ * executable, started with the coordinator command line plus --farm-worker,
+ * and they keep their OpenCL context, program and scene between frames.
+ */
+class RenderFarm
+{
+public:
+    RenderFarm();
+    ~RenderFarm();
+
+    /// The command line used to start the workers.
+    void setCommandLine(int argc, const char *argv[]);
+
+    /// Coordinator settings.
+    void setCameraPathFile(const std::string &fileName);
+    void setWorkerCount(int count);
+    void setFramesPerSecond(float fps);
+    void setOutputDirectory(const std::string &directory);
+
+    /// Renders the sequence with 1, 2, ... up to the worker count, to
+    /// report how the throughput scales.
+    void setScaling(bool value);
+
+    /// Worker settings.
+    void setWorkerSocket(const std::string &path);
+
+    bool isCoordinator() const;
+    bool isWorker() const;
+
+    bool runCoordinator();
+    bool runWorker(Application *app, Raytracer *raytracer);
+
+private:
+    bool renderSequence(const CameraPath &path, int workerCount, double *framesPerSecond);
+    bool startWorkers(int workerCount, std::vector<int> *sockets, std::vector<pid_t> *pids);
+    void stopWorkers(std::vector<int> *sockets, std::vector<pid_t> *pids);
+    bool sendJob(int socket, const CameraPath &path, int frame);
+    bool receiveFrame(int socket, int *frame, float *renderTime, bool *saved);
+    void makeWorkerArguments(int worker, std::vector<std::string> *arguments) const;
+
+    std::vector<std::string> commandLine;
+    std::string cameraPathFile;
+    std::string outputDirectory;
+    std::string workerSocket;
+    int workerCount;
+    float framesPerSecond;
+    bool scaling;
+};
+
+} // namespace T3
+
+#endif //T3_RENDER_FARM_HPP
@@ -0,0 +1,566 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include "RenderServer.hpp"
+#include "Application.hpp"
+#include "FrameProfiler.hpp"
+#include "Image.hpp"
+
+namespace T3
+{
+
+// Biggest frame side that can be requested.
+const int MaxRequestSize = 8192;
+
+// Longest request line, so a client can't grow the input without bound.
+const size_t MaxLineLength = 4096;
+
+static bool writeAll(int fd, const void *buffer, size_t size)
+{
+    const char *data = static_cast<const char*> (buffer);
+    while(size > 0)
+    {
+        // Don't die with SIGPIPE when a client is gone.
+        ssize_t count = send(fd, data, size, MSG_NOSIGNAL);
+        if(count < 0 && errno == EINTR)
+            continue;
+        if(count <= 0)
+            return false;
+        data += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+static bool parseVector(const std::string &value, Vector3 *result)
+{
+    char extra;
+    return sscanf(value.c_str(), "%f,%f,%f%c", &result->x, &result->y, &result->z, &extra) == 3;
+}
+
+static bool compareResolution(const RenderRequest &a, const RenderRequest &b)
+{
+    return a.width < b.width || (a.width == b.width && a.height < b.height);
+}
+
+RenderServer::RenderServer()
+    : maxCachedScenes(4), app(NULL), raytracer(NULL), listener(-1), currentScene(0),
+      nextRequestId(1), completedRequests(0), failedRequests(0), quitting(false)
+{
+}
+
+RenderServer::~RenderServer()
+{
+    closeSocket();
+}
+
+void RenderServer::setSocketPath(const std::string &path)
+{
+    socketPath = path;
+}
+
+void RenderServer::setMaxCachedScenes(int count)
+{
+    maxCachedScenes = count > 0 ? count : 0;
+}
+
+void RenderServer::setInitialScene(const std::string &fileName)
+{
+    initialScene = fileName;
+}
+
+bool RenderServer::isEnabled() const
+{
+    return !socketPath.empty();
+}
+
+bool RenderServer::run(Application *app, Raytracer *raytracer)
+{
+    this->app = app;
+    this->raytracer = raytracer;
+    if(!openSocket())
+        return false;
+
+    // The scene loaded by the application is the first one.
+    CachedScene initial;
+    initial.fileName = initialScene;
+    initial.scene = app->getScene();
+    initial.camera = initial.scene->getCamera();
+    initial.sunDirection = initial.scene->getSunDirection();
+    initial.lastUsedTime = FrameProfiler::now();
+    scenes.push_back(initial);
+    currentScene = 0;
+
+    printf("Render server listening on %s\n", socketPath.c_str());
+    fflush(stdout);
+    while(!quitting || !queue.empty())
+    {
+        // Take every request that is already waiting, so they can be
+        // batched, and only block when there's nothing to render.
+        pollClients(queue.empty());
+        if(!queue.empty())
+            renderBatch();
+    }
+
+    printf("Render server: %d requests rendered, %d failed, %d scene uploads\n",
+        completedRequests, failedRequests, raytracer->getSceneUploadCount());
+
+    // The server owns every scene, the initial one included.
+    app->setScene(NULL);
+    for(size_t i = 0; i < scenes.size(); ++i)
+        delete scenes[i].scene;
+    scenes.clear();
+    closeSocket();
+    return true;
+}
+
+bool RenderServer::openSocket()
+{
+    unlink(socketPath.c_str());
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    if(listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 16) < 0)
+    {
+        perror("Failed to create the render server socket");
+        closeSocket();
+        return false;
+    }
+
+    return true;
+}
+
+void RenderServer::closeSocket()
+{
+    for(size_t i = 0; i < clients.size(); ++i)
+        close(clients[i].fd);
+    clients.clear();
+
+    if(listener >= 0)
+    {
+        close(listener);
+        unlink(socketPath.c_str());
+    }
+    listener = -1;
+}
+
+void RenderServer::pollClients(bool wait)
+{
+    std::vector<pollfd> pollFds;
+    pollfd listenerFd = {listener, POLLIN, 0};
+    pollFds.push_back(listenerFd);
+    for(size_t i = 0; i < clients.size(); ++i)
+    {
+        pollfd pfd = {clients[i].fd, POLLIN, 0};
+        pollFds.push_back(pfd);
+    }
+
+    if(poll(&pollFds[0], pollFds.size(), wait ? -1 : 0) <= 0)
+        return;
+
+    // Read the clients before accepting, the indices match the poll list.
+    std::vector<int> closedClients;
+    for(size_t i = 1; i < pollFds.size(); ++i)
+    {
+        if(!pollFds[i].revents)
+            continue;
+
+        int fd = pollFds[i].fd;
+        char buffer[1024];
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if(count < 0 && errno == EINTR)
+            continue;
+        if(count <= 0)
+        {
+            closedClients.push_back(fd);
+            continue;
+        }
+
+        // Handle the complete lines.
+        std::string &input = clients[i - 1].input;
+        input.append(buffer, count);
+        size_t lineEnd;
+        while((lineEnd = input.find('\n')) != std::string::npos)
+        {
+            std::string line = input.substr(0, lineEnd);
+            input.erase(0, lineEnd + 1);
+            if(!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            if(!line.empty())
+                handleLine(fd, line);
+        }
+
+        if(input.size() > MaxLineLength)
+        {
+            reply(fd, "error request line too long");
+            closedClients.push_back(fd);
+        }
+    }
+
+    // Forget the closed clients and their queued requests.
+    for(size_t i = 0; i < closedClients.size(); ++i)
+    {
+        int fd = closedClients[i];
+        for(size_t j = 0; j < clients.size(); ++j)
+        {
+            if(clients[j].fd == fd)
+            {
+                clients.erase(clients.begin() + j);
+                break;
+            }
+        }
+
+        std::deque<RenderRequest>::iterator it = queue.begin();
+        while(it != queue.end())
+        {
+            if(it->client == fd)
+                it = queue.erase(it);
+            else
+                ++it;
+        }
+        close(fd);
+    }
+
+    if(pollFds[0].revents)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if(fd >= 0)
+        {
+            Client client;
+            client.fd = fd;
+            clients.push_back(client);
+        }
+    }
+}
+
+void RenderServer::handleLine(int client, const std::string &line)
+{
+    std::istringstream in(line);
+    std::string command;
+    in >> command;
+    if(command == "render")
+    {
+        RenderRequest request;
+        std::string error;
+        if(quitting)
+            reply(client, "error the server is quitting");
+        else if(!parseRequest(line, &request, &error))
+            reply(client, "error " + error);
+        else
+        {
+            request.client = client;
+            request.id = nextRequestId++;
+            queue.push_back(request);
+        }
+    }
+    else if(command == "stats")
+    {
+        char message[256];
+        sprintf(message, "ok rendered=%d failed=%d queued=%d uploads=%d scenes=%d",
+            completedRequests, failedRequests, (int)queue.size(),
+            raytracer->getSceneUploadCount(), (int)scenes.size());
+        reply(client, message);
+    }
+    else if(command == "quit")
+    {
+        // The queued requests are still rendered.
+        quitting = true;
+        reply(client, "ok");
+    }
+    else
+    {
+        reply(client, "error unknown command " + command);
+    }
+}
+
+bool RenderServer::parseRequest(const std::string &line, RenderRequest *request, std::string *error)
+{
+    request->sceneId = -1;
+    request->width = 0;
+    request->height = 0;
+    request->hasPosition = false;
+    request->hasRotation = false;
+    request->hasSunDirection = false;
+    request->receiveTime = FrameProfiler::now();
+
+    std::istringstream in(line);
+    std::string field;
+    in >> field;
+    while(in >> field)
+    {
+        size_t separator = field.find('=');
+        if(separator == std::string::npos)
+        {
+            *error = "expected key=value instead of " + field;
+            return false;
+        }
+
+        std::string key = field.substr(0, separator);
+        std::string value = field.substr(separator + 1);
+        bool valid = true;
+        if(key == "scene")
+        {
+            // A scene id, or a file name that is loaded when first used.
+            if(!value.empty() && value[0] == '#')
+            {
+                request->sceneId = atoi(value.c_str() + 1);
+                valid = request->sceneId >= 0 && request->sceneId < (int)scenes.size();
+            }
+            else
+            {
+                request->sceneId = findScene(value);
+                valid = request->sceneId >= 0;
+            }
+        }
+        else if(key == "size")
+        {
+            char extra;
+            valid = sscanf(value.c_str(), "%dx%d%c", &request->width, &request->height, &extra) == 2 &&
+                request->width > 0 && request->width <= MaxRequestSize &&
+                request->height > 0 && request->height <= MaxRequestSize;
+        }
+        else if(key == "position")
+            valid = request->hasPosition = parseVector(value, &request->position);
+        else if(key == "rotation")
+            valid = request->hasRotation = parseVector(value, &request->rotation);
+        else if(key == "sun")
+            valid = request->hasSunDirection = parseVector(value, &request->sunDirection);
+        else if(key == "output")
+            request->output = value;
+        else
+        {
+            *error = "unknown field " + key;
+            return false;
+        }
+
+        if(!valid)
+        {
+            *error = "invalid " + key + " " + value;
+            return false;
+        }
+    }
+
+    if(request->sceneId < 0 || request->width <= 0 || request->output.empty())
+    {
+        *error = "the scene, size and output are required";
+        return false;
+    }
+    return true;
+}
+
+int RenderServer::findScene(const std::string &fileName)
+{
+    for(size_t i = 0; i < scenes.size(); ++i)
+    {
+        if(scenes[i].fileName == fileName)
+            return i;
+    }
+
+    if(!std::ifstream(fileName.c_str()).good())
+        return -1;
+
+    // New scenes get the next id. They are loaded by the batch that uses them.
+    CachedScene cached;
+    cached.fileName = fileName;
+    cached.scene = NULL;
+    cached.lastUsedTime = 0.0;
+    scenes.push_back(cached);
+    return scenes.size() - 1;
+}
+
+void RenderServer::reply(int client, const std::string &message)
+{
+    std::string line = message + "\n";
+    writeAll(client, line.data(), line.size());
+}
+
+void RenderServer::renderBatch()
+{
+    // Take the queued requests of the scene of the oldest one, and group
+    // them by resolution, keeping their order inside each group.
+    int sceneId = queue.front().sceneId;
+    std::vector<RenderRequest> batch;
+    std::deque<RenderRequest>::iterator it = queue.begin();
+    while(it != queue.end())
+    {
+        if(it->sceneId == sceneId)
+        {
+            batch.push_back(*it);
+            it = queue.erase(it);
+        }
+        else
+            ++it;
+    }
+    std::stable_sort(batch.begin(), batch.end(), compareResolution);
+
+    // A scene switch uploads the scene before the first frame.
+    double batchStartTime = FrameProfiler::now();
+    int uploadCount = raytracer->getSceneUploadCount();
+    if(!selectScene(sceneId))
+    {
+        for(size_t i = 0; i < batch.size(); ++i)
+            reply(batch[i].client, "error failed to load the scene " + scenes[sceneId].fileName);
+        failedRequests += batch.size();
+        return;
+    }
+
+    // Pipeline the frames of each resolution, the device renders a frame
+    // while the previous one is written.
+    size_t groupStart = 0;
+    while(groupStart < batch.size())
+    {
+        size_t groupEnd = groupStart + 1;
+        while(groupEnd < batch.size() && !compareResolution(batch[groupStart], batch[groupEnd]))
+            ++groupEnd;
+
+        int width = batch[groupStart].width;
+        int height = batch[groupStart].height;
+        if(!raytracer->setResolution(width, height))
+        {
+            for(size_t i = groupStart; i < groupEnd; ++i)
+                reply(batch[i].client, "error failed to allocate the frame buffers");
+            failedRequests += groupEnd - groupStart;
+            groupStart = groupEnd;
+            continue;
+        }
+
+        Image2D *images[2] = {new Image2D(width, height), new Image2D(width, height)};
+        double enqueueTimes[2];
+        bool uploaded[2];
+        bool rendered[2];
+        for(size_t i = groupStart; i <= groupEnd; ++i)
+        {
+            if(i < groupEnd)
+            {
+                applyRequestCamera(batch[i]);
+                enqueueTimes[i % 2] = FrameProfiler::now();
+                rendered[i % 2] = raytracer->enqueueFrame(images[i % 2]);
+                uploaded[i % 2] = raytracer->getSceneUploadCount() != uploadCount;
+                uploadCount = raytracer->getSceneUploadCount();
+            }
+
+            if(i > groupStart)
+            {
+                size_t previous = i - 1;
+                raytracer->finishFrame();
+                if(!rendered[previous % 2])
+                {
+                    reply(batch[previous].client, "error failed to upload the scene " + scenes[sceneId].fileName);
+                    failedRequests++;
+                    continue;
+                }
+                finishRequest(batch[previous], images[previous % 2], batchStartTime,
+                    enqueueTimes[previous % 2], uploaded[previous % 2]);
+            }
+        }
+
+        delete images[0];
+        delete images[1];
+        groupStart = groupEnd;
+    }
+
+    scenes[sceneId].lastUsedTime = FrameProfiler::now();
+}
+
+bool RenderServer::selectScene(int sceneId)
+{
+    CachedScene &cached = scenes[sceneId];
+    if(sceneId == currentScene && cached.scene)
+        return true;
+
+    if(!cached.scene)
+    {
+        cached.scene = Scene::loadFromFile(cached.fileName);
+        if(!cached.scene)
+            return false;
+        cached.camera = cached.scene->getCamera();
+        cached.sunDirection = cached.scene->getSunDirection();
+    }
+
+    // The program is only rebuilt when the scene needs other options. When
+    // the new scene fails, the previous one is restored. If that fails too,
+    // no scene is current, and the next batch reloads its scene.
+    Scene *previousScene = app->getScene();
+    app->setScene(cached.scene);
+    if(!raytracer->reloadScene())
+    {
+        app->setScene(previousScene);
+        if(currentScene < 0 || !raytracer->reloadScene())
+            currentScene = -1;
+        return false;
+    }
+    currentScene = sceneId;
+    cached.lastUsedTime = FrameProfiler::now();
+    evictScenes();
+    return true;
+}
+
+void RenderServer::evictScenes()
+{
+    // Unload the least recently used scenes, except the current one and
+    // the one that the application holds.
+    for(;;)
+    {
+        size_t loadedCount = 0;
+        int oldest = -1;
+        for(size_t i = 0; i < scenes.size(); ++i)
+        {
+            if(!scenes[i].scene || (int)i == currentScene || scenes[i].scene == app->getScene())
+                continue;
+            loadedCount++;
+            if(oldest < 0 || scenes[i].lastUsedTime < scenes[oldest].lastUsedTime)
+                oldest = i;
+        }
+
+        if(loadedCount <= maxCachedScenes)
+            break;
+        delete scenes[oldest].scene;
+        scenes[oldest].scene = NULL;
+    }
+}
+
+void RenderServer::applyRequestCamera(const RenderRequest &request)
+{
+    // Start from the camera of the scene file, so the requests don't depend
+    // on the ones before.
+    const CachedScene &cached = scenes[request.sceneId];
+    Camera camera = cached.camera;
+    if(request.hasPosition)
+        camera.setPosition(request.position);
+    if(request.hasRotation)
+        camera.setOrientation(Matrix3::xyzRot(request.rotation).transpose());
+    cached.scene->setCamera(camera);
+    cached.scene->setSunDirection(request.hasSunDirection ? request.sunDirection.normalized() : cached.sunDirection);
+}
+
+void RenderServer::finishRequest(const RenderRequest &request, Image2D *image, double batchStartTime,
+    double enqueueTime, bool uploaded)
+{
+    if(!image->saveToPPM(request.output))
+    {
+        reply(request.client, "error failed to write " + request.output);
+        failedRequests++;
+        return;
+    }
+
+    double now = FrameProfiler::now();
+    char message[256];
+    sprintf(message, "ok id=%d scene=#%d queue=%.2f render=%.2f total=%.2f uploaded=%s",
+        request.id, request.sceneId, batchStartTime - request.receiveTime, now - enqueueTime,
+        now - request.receiveTime, uploaded ? "yes" : "no");
+    reply(request.client, message);
+    completedRequests++;
+}
+
+} // namespace T3
@@ -0,0 +1,124 @@
+#ifndef T3_RENDER_SERVER_HPP
+#define T3_RENDER_SERVER_HPP
+
+#include <deque>
+#include <string>
+#include <vector>
+#include "Scene.hpp"
+
+namespace T3
+{
+
+class Application;
+class Raytracer;
+class Image2D;
+
+/**
+ * Render request of a client. The camera and the sun default to the ones
+ * of the scene file.
+ */
+struct RenderRequest
+{
+    int id;
+    int client;
+    int sceneId;
+    int width;
+    int height;
+    bool hasPosition;
+    bool hasRotation;
+    bool hasSunDirection;
+    Vector3 position;
+    Vector3 rotation;
+    Vector3 sunDirection;
+    std::string output;
+    double receiveTime;
+};
+
+/**
+ * Scene kept loaded by the render server.
+ */
+struct CachedScene
+{
+    std::string fileName;
+    Scene *scene;
+    Camera camera;
+    Vector3 sunDirection;
+    double lastUsedTime;
+};
+
+/**
+ * Rendering daemon. It keeps the OpenCL context, the programs and the
+ * recently used scenes between the requests, which arrive as text lines
+ * over a Unix socket:
+ *
+ *     render scene=<file|#id> size=WxH [position=x,y,z] [rotation=x,y,z]
+ *            [sun=x,y,z] output=<file.ppm>
+ *     stats
+ *     quit
+ *
+ * Every line gets a single line reply, "ok ..." or "error ...". The queued
+ * requests are batched by scene, so the scene switches and the uploads are
+ * only paid once per batch, and by resolution inside the batch, so the
+ * frames are pipelined.
+ */
+class RenderServer
+{
+public:
+    RenderServer();
+    ~RenderServer();
+
+    void setSocketPath(const std::string &path);
+
+    /// File of the scene loaded by the application, which is the scene #0.
+    void setInitialScene(const std::string &fileName);
+
+    /// Scenes kept loaded, besides the current one.
+    void setMaxCachedScenes(int count);
+
+    bool isEnabled() const;
+
+    /// Serves the requests until a quit request.
+    bool run(Application *app, Raytracer *raytracer);
+
+private:
+    struct Client
+    {
+        int fd;
+        std::string input;
+    };
+
+    bool openSocket();
+    void closeSocket();
+    void pollClients(bool wait);
+    void handleLine(int client, const std::string &line);
+    bool parseRequest(const std::string &line, RenderRequest *request, std::string *error);
+    int findScene(const std::string &fileName);
+    void reply(int client, const std::string &message);
+
+    void renderBatch();
+    bool selectScene(int sceneId);
+    void evictScenes();
+    void applyRequestCamera(const RenderRequest &request);
+    void finishRequest(const RenderRequest &request, Image2D *image, double batchStartTime,
+        double enqueueTime, bool uploaded);
+
+    std::string socketPath;
+    std::string initialScene;
+    size_t maxCachedScenes;
+
+    Application *app;
+    Raytracer *raytracer;
+    int listener;
+    std::vector<Client> clients;
+    std::deque<RenderRequest> queue;
+    std::vector<CachedScene> scenes;
+    int currentScene;
+    int nextRequestId;
+    int completedRequests;
+    int failedRequests;
+    bool quitting;
+};
+
+} // namespace T3
+
+#endif //T3_RENDER_SERVER_HPP
@@ -2,14 +2,25 @@
 #include <fstream>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <set>
 #include <assert.h>
 #include <string.h>
 #include "rapidxml.hpp"
 #include "Scene.hpp"
+#include "SceneStreamer.hpp"
+#include "Mesh.hpp"
+#include "TraceProfiler.hpp"
 
 namespace T3
 {
 
+// Trace zone of the scene mutex waits.
+static const char *const SceneMutexZone = "Scene::mutex wait";
+
+// Default bounce limit of a camera path, including the primary hit.
+static const int DefaultMaxRayDepth = 7;
+
 //----------------------------------------------------------------------------
 // Camera
 //
@@ -59,19 +70,28 @@ const Vector3 *Camera::getScreenPlaneVerts() const
 //
 
 Scene::Scene()
-    : daySky(false), skyRadius(1000.0f), starThreshold(0.9f), starScale(1.0f),
+    : maxRayDepth(DefaultMaxRayDepth), lightCutoff(0.0f), daySky(false), skyRadius(1000.0f), starThreshold(0.9f), starScale(1.0f),
         sunColor(1, 1, 1, 1), sunDirection(Vector3(0, 1, 0).normalized())
 {
+    meshNodesOffset = 0;
+    meshVerticesOffset = 0;
+    meshIndicesOffset = 0;
+    meshDataVersion = 0;
+    meshDataDirty = false;
+    streamer = NULL;
+    contentVersion = 0;
 }
 
 Scene::~Scene()
 {
+    // The streamer leaves the resident shapes to the scene.
+    delete streamer;
     for(size_t i = 0; i < materials.size(); ++i)
         delete materials[i];
     for(size_t i = 0; i < textures.size(); ++i)
         delete textures[i];
     for(size_t i = 0; i < shapes.size(); ++i)
-        delete shapes[i];
+        deleteShape(shapes[i]);
 }
 
 //----------------------------------------------------------------------------
@@ -80,20 +100,21 @@ Scene::~Scene()
 
 size_t Scene::getMaterialCount() const
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return materials.size();
 }
 
 void Scene::addMaterial(Material* material)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     material->setId(materials.size());
     materials.push_back(material);
+    ++contentVersion;
 }
 
 Material *Scene::getMaterial(size_t index)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return materials[index];
 }
 
@@ -103,20 +124,21 @@ Material *Scene::getMaterial(size_t index)
 
 size_t Scene::getTextureCount() const
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return textures.size();
 }
 
 void Scene::addTexture(Texture* texture)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     texture->setId(textures.size());
     textures.push_back(texture);
+    ++contentVersion;
 }
 
 Texture *Scene::createColorTexture(const Color &color)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     Texture *tex = new Texture(color);
     addTexture(tex);
     return tex;
@@ -124,13 +146,13 @@ Texture *Scene::createColorTexture(const Color &color)
 
 int Scene::createColorTextureId(const Color &color)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return createColorTexture(color)->textureId;
 }
 
 Texture *Scene::getTexture(size_t index)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return textures[index];
 }
 
@@ -140,35 +162,86 @@ Texture *Scene::getTexture(size_t index)
 
 size_t Scene::getShapeCount() const
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return shapes.size();
 }
 
 void Scene::addShape(Shape *shape)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     shapes.push_back(shape);
+    if(shape->getType() == Shape::ShapeType_Mesh)
+        meshDataDirty = true;
+    ++contentVersion;
 }
 
 Shape *Scene::getShape(size_t index)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return shapes[index];
 }
 
+void Scene::addShapes(const std::vector<Shape*> &newShapes)
+{
+    TracedLock l(mutex, SceneMutexZone);
+    for(size_t i = 0; i < newShapes.size(); ++i)
+    {
+        shapes.push_back(newShapes[i]);
+        if(newShapes[i]->getType() == Shape::ShapeType_Mesh)
+            meshDataDirty = true;
+    }
+    ++contentVersion;
+}
+
+void Scene::removeShapes(const std::vector<Shape*> &oldShapes)
+{
+    TracedLock l(mutex, SceneMutexZone);
+    std::set<Shape*> removed(oldShapes.begin(), oldShapes.end());
+    size_t count = 0;
+    for(size_t i = 0; i < shapes.size(); ++i)
+    {
+        if(!removed.count(shapes[i]))
+            shapes[count++] = shapes[i];
+        else if(shapes[i]->getType() == Shape::ShapeType_Mesh)
+            meshDataDirty = true;
+    }
+    shapes.resize(count);
+    ++contentVersion;
+}
+
+void Scene::deleteShape(Shape *shape)
+{
+    // Shape does not have a virtual destructor.
+    if(shape->getType() == Shape::ShapeType_Mesh)
+        delete static_cast<MeshShape*> (shape);
+    else
+        delete shape;
+}
+
+SceneStreamer *Scene::getStreamer()
+{
+    return streamer;
+}
+
+void Scene::setStreamer(SceneStreamer *newStreamer)
+{
+    delete streamer;
+    streamer = newStreamer;
+}
+
 //----------------------------------------------------------------------------
 // Camera
 //
 
 Camera Scene::getCamera()
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return camera;
 }
 
 void Scene::setCamera(const Camera &camera)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     this->camera = camera;
 }
 
@@ -176,75 +249,101 @@ void Scene::setCamera(const Camera &camera)
 // Sky
 //
 
+int Scene::getMaxRayDepth() const
+{
+    TracedLock l(mutex, SceneMutexZone);
+    return maxRayDepth;
+}
+
+void Scene::setMaxRayDepth(int newDepth)
+{
+    TracedLock l(mutex, SceneMutexZone);
+    maxRayDepth = newDepth;
+    ++contentVersion;
+}
+
+float Scene::getLightCutoff() const
+{
+    TracedLock l(mutex, SceneMutexZone);
+    return lightCutoff;
+}
+
+void Scene::setLightCutoff(float newCutoff)
+{
+    TracedLock l(mutex, SceneMutexZone);
+    lightCutoff = newCutoff;
+    ++contentVersion;
+}
+
 bool Scene::isDay() const
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return daySky;
 }
 
 void Scene::setDay(bool value)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     daySky = value;
 }
 
 float Scene::getSkyRadius() const
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return skyRadius;
 }
 
 void Scene::setSkyRadius(float newRadius)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     skyRadius = newRadius;
 }
 
 float Scene::getStarThreshold() const
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return starThreshold;
 }
 
 void Scene::setStarThreshold(float newThreshold)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     starThreshold = newThreshold;
 }
 
 float Scene::getStarScale() const
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return starScale;
 }
 
 void Scene::setStarScale(float newScale)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     starScale = newScale;
 }
 
 Color Scene::getSunColor() const
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return sunColor;
 }
 
 void Scene::setSunColor(const Color &color)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     sunColor = color;
 }
 
 Vector3 Scene::getSunDirection() const
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     return sunDirection;
 }
 
 void Scene::setSunDirection(const Vector3 &direction)
 {
-    Lock l(mutex);
+    TracedLock l(mutex, SceneMutexZone);
     sunDirection = direction;
 }
 
@@ -252,73 +351,410 @@ void Scene::setSunDirection(const Vector3 &direction)
 // Buffer Writing
 //
 
-inline void writeUInt(unsigned int value, unsigned char **dst)
+/**
+ * Scene buffer writer. Lays out the buffer sections described in SceneAccess.
+ */
+class SceneBufferWriter
+{
+public:
+    SceneBufferWriter(size_t headerSize = SceneHeader_FieldCount*sizeof(SceneOffset))
+        : buffer(headerSize, 0)
+    {
+        align();
+    }
+
+    void setHeader(SceneHeaderField field, size_t value)
+    {
+        ((SceneOffset*)&buffer[0])[field] = value;
+    }
+
+    void beginSection(SceneHeaderField field)
+    {
+        setHeader(field, beginBlock());
+    }
+
+    size_t beginBlock()
+    {
+        align();
+        return buffer.size();
+    }
+
+    void write(const void *data, size_t size)
+    {
+        if(!size)
+            return;
+
+        const unsigned char *src = (const unsigned char*)data;
+        buffer.insert(buffer.end(), src, src + size);
+    }
+
+    size_t getSize() const
+    {
+        return buffer.size();
+    }
+
+    void getBuffer(std::vector<unsigned char> *result)
+    {
+        align();
+        result->swap(buffer);
+    }
+
+    unsigned char *finish()
+    {
+        align();
+        unsigned char *data = new unsigned char[buffer.size()];
+        memcpy(data, &buffer[0], buffer.size());
+        return data;
+    }
+
+private:
+    void align()
+    {
+        buffer.resize((buffer.size() + 15) & ~15, 0);
+    }
+
+    std::vector<unsigned char> buffer;
+};
+
+Color Scene::getFlatTextureColor(int textureId) const
 {
-    *((unsigned int*)*dst) = value;
-    *dst += 4;
+    if(textureId == -2)
+        return color_white();
+    else if(textureId < 0)
+        return color_black();
+    return textures[textureId]->color;
 }
 
-SceneDataHolder *Scene::getSceneData()
+int Scene::getPackedTextureId(int textureId, const std::vector<int> &packedIds) const
 {
-    Lock l(mutex);
+    if(textureId < 0)
+        return -1;
+    return packedIds[textureId];
+}
 
-    // Compute the sizes.
-    size_t size = 4*sizeof(unsigned int);
-    size += sizeof(Material)*materials.size();
-    size += sizeof(Texture)*textures.size();
+PackedMaterial Scene::packMaterial(const Material *material, const std::vector<int> &packedIds) const
+{
+    PackedMaterial packed;
+    packed.emissionTexture = getPackedTextureId(material->emissionTexture, packedIds);
+    packed.diffuseTexture = getPackedTextureId(material->diffuseTexture, packedIds);
+    packed.specularTexture = getPackedTextureId(material->specularTexture, packedIds);
+    packed.normalTexture = getPackedTextureId(material->normalTexture, packedIds);
+
+    // Fold the flat texture colors.
+    packed.emission = Color(material->emission, material->emission, material->emission, material->emission);
+    if(packed.emissionTexture < 0)
+        packed.emission = material->emission*getFlatTextureColor(material->emissionTexture);
+    packed.diffuse = Color(material->diffuse, material->diffuse, material->diffuse, material->diffuse);
+    if(packed.diffuseTexture < 0)
+        packed.diffuse = material->diffuse*getFlatTextureColor(material->diffuseTexture);
+    packed.specular = Color(material->specular, material->specular, material->specular, material->specular);
+    if(packed.specularTexture < 0)
+        packed.specular = material->specular*getFlatTextureColor(material->specularTexture);
+
+    packed.shininess = material->shininess;
+    packed.reflection = material->reflection;
+    packed.refraction = material->refraction;
+    packed.refractionIndex = material->refractionIndex;
+    packed.light = material->light;
+    packed.padding = 0;
+    return packed;
+}
 
-    // Compute the offsets.
-    std::vector<size_t> shapeOffsets;
-    size_t paddedOffsets = (shapes.size() + 3) & ~3;
-    size_t startOffset = size + sizeof(unsigned int)*paddedOffsets;
-    size_t offset = startOffset;
-    for(size_t i = 0; i < shapes.size(); ++i)
+size_t Scene::getMaterialDataSize() const
+{
+    TracedLock l(mutex, SceneMutexZone);
+    return std::max(materials.size(), (size_t)1)*sizeof(PackedMaterial);
+}
+
+float Scene::getEmissionIntensity(const Material *material) const
+{
+    Color color = getFlatTextureColor(material->emissionTexture);
+    if(material->emissionTexture >= 0 && textures[material->emissionTexture]->type != Texture::TT_None)
     {
-        shapeOffsets.push_back(offset);
-        offset += Shape::size(shapes[i]);
+        // Bound the noise between both colors.
+        const Texture *texture = textures[material->emissionTexture];
+        color = Color(std::max(texture->startColor.r, texture->color.r),
+                      std::max(texture->startColor.g, texture->color.g),
+                      std::max(texture->startColor.b, texture->color.b));
     }
-    size = offset;
-    
-    // Allocate the space.
-    unsigned char *data = new unsigned char[size];
-    unsigned char *dst = data;
-    writeUInt(materials.size(), &dst);
-    writeUInt(textures.size(), &dst);
-    writeUInt(shapes.size(), &dst);
-    dst += sizeof(unsigned int);
-
-    // Copy materials.
+
+    return material->emission*std::max(color.r, std::max(color.g, color.b));
+}
+
+int Scene::getContentVersion() const
+{
+    TracedLock l(mutex, SceneMutexZone);
+    return contentVersion;
+}
+
+SceneDataHolder *Scene::getSceneData()
+{
+    TracedLock l(mutex, SceneMutexZone);
+
+    // Only the procedural textures are stored.
+    std::vector<int> packedTextureIds(textures.size(), -1);
+    std::vector<Texture*> proceduralTextures;
+    for(size_t i = 0; i < textures.size(); ++i)
+    {
+        if(textures[i]->type == Texture::TT_None)
+            continue;
+        packedTextureIds[i] = proceduralTextures.size();
+        proceduralTextures.push_back(textures[i]);
+    }
+
+    // Pack the materials. Keep at least one, to avoid an empty buffer.
+    SceneBufferWriter materialWriter(0);
     for(size_t i = 0; i < materials.size(); ++i)
     {
-        memcpy(dst, materials[i], sizeof(Material));
-        dst += sizeof(Material);
+        PackedMaterial packed = packMaterial(materials[i], packedTextureIds);
+        materialWriter.write(&packed, sizeof(PackedMaterial));
+    }
+    if(materials.empty())
+    {
+        Material defaultMaterial;
+        PackedMaterial packed = packMaterial(&defaultMaterial, packedTextureIds);
+        materialWriter.write(&packed, sizeof(PackedMaterial));
     }
 
-    // Copy the textures.
-    for(size_t i = 0; i < textures.size(); ++i)
+    // Group the shapes by type.
+    std::vector<SphereShape*> spheres;
+    std::vector<PlaneShape*> planes;
+    std::vector<TerrainShape*> terrains;
+    std::vector<int> meshMaterials;
+    for(size_t i = 0; i < shapes.size(); ++i)
     {
-        memcpy(dst, textures[i], sizeof(Texture));
-        dst += sizeof(Texture);
+        switch(shapes[i]->getType())
+        {
+        case Shape::ShapeType_Sphere:
+            spheres.push_back(static_cast<SphereShape*> (shapes[i]));
+            break;
+        case Shape::ShapeType_Plane:
+            planes.push_back(static_cast<PlaneShape*> (shapes[i]));
+            break;
+        case Shape::ShapeType_Terrain:
+            terrains.push_back(static_cast<TerrainShape*> (shapes[i]));
+            break;
+        case Shape::ShapeType_Mesh:
+            meshMaterials.push_back(shapes[i]->materialId);
+            break;
+        }
     }
 
-    // Copy the shapes offsets.
-    for(size_t i = 0; i < shapeOffsets.size(); ++i)
+    // The mesh instances point into the mesh data buffer.
+    if(meshDataDirty)
+        buildMeshData();
+
+    // Collect the lights, with the unbounded ones first. With a cutoff, the
+    // reach of a sphere light ends where its falloff drops below it.
+    std::vector<int> lightShapes;
+    std::vector<float> lightRadii;
+    std::vector<int> boundedLightShapes;
+    std::vector<float> boundedLightRadii;
+    std::vector<Vector4> lightBounds;
+    size_t shapeCount = spheres.size() + planes.size() + terrains.size() + meshMaterials.size();
+    for(size_t id = 0; id < shapeCount; ++id)
+    {
+        int materialId;
+        if(id < spheres.size())
+            materialId = spheres[id]->materialId;
+        else if(id < spheres.size() + planes.size())
+            materialId = planes[id - spheres.size()]->materialId;
+        else if(id < spheres.size() + planes.size() + terrains.size())
+            materialId = terrains[id - spheres.size() - planes.size()]->materialId;
+        else
+            materialId = meshMaterials[id - spheres.size() - planes.size() - terrains.size()];
+        if(materialId < 0 || materialId >= (int)materials.size() || !materials[materialId]->light)
+            continue;
+
+        if(lightCutoff <= 0.0f || id >= spheres.size())
+        {
+            lightShapes.push_back(id);
+            lightRadii.push_back(INFINITY);
+            continue;
+        }
+
+        // Lights that never reach the cutoff are dropped.
+        float intensity = getEmissionIntensity(materials[materialId]);
+        if(intensity <= lightCutoff)
+            continue;
+
+        const SphereShape *sphere = spheres[id];
+        float radius = sphere->radius + sqrt(intensity/lightCutoff - 1.0f);
+        boundedLightShapes.push_back(id);
+        boundedLightRadii.push_back(radius);
+        lightBounds.push_back(Vector4(sphere->position, radius));
+    }
+    size_t unboundedLightCount = lightShapes.size();
+    lightShapes.insert(lightShapes.end(), boundedLightShapes.begin(), boundedLightShapes.end());
+    lightRadii.insert(lightRadii.end(), boundedLightRadii.begin(), boundedLightRadii.end());
+
+    // Write the counts.
+    SceneBufferWriter writer;
+    writer.setHeader(SceneHeader_MaterialCount, materials.size());
+    writer.setHeader(SceneHeader_TextureCount, proceduralTextures.size());
+    writer.setHeader(SceneHeader_SphereCount, spheres.size());
+    writer.setHeader(SceneHeader_PlaneCount, planes.size());
+    writer.setHeader(SceneHeader_TerrainCount, terrains.size());
+    writer.setHeader(SceneHeader_MeshCount, meshMaterials.size());
+    writer.setHeader(SceneHeader_LightCount, lightShapes.size());
+    writer.setHeader(SceneHeader_UnboundedLightCount, unboundedLightCount);
+    writer.setHeader(SceneHeader_MeshNodes, meshNodesOffset);
+    writer.setHeader(SceneHeader_MeshVertices, meshVerticesOffset);
+    writer.setHeader(SceneHeader_MeshIndices, meshIndicesOffset);
+
+    // Copy the procedural textures.
+    writer.beginSection(SceneHeader_Textures);
+    for(size_t i = 0; i < proceduralTextures.size(); ++i)
     {
-        writeUInt(shapeOffsets[i], &dst);
+        const Texture *texture = proceduralTextures[i];
+        PackedTexture packed;
+        *static_cast<NoiseElement*> (&packed) = *texture;
+        packed.startColor = texture->startColor;
+        packed.color = texture->color;
+        writer.write(&packed, sizeof(PackedTexture));
     }
 
-    // Copy the shapes;
-    dst = data + startOffset;
+    // Copy the spheres.
+    writer.beginSection(SceneHeader_SphereCenters);
+    for(size_t i = 0; i < spheres.size(); ++i)
+        writer.write(&spheres[i]->position, sizeof(Vector3));
+    writer.beginSection(SceneHeader_SphereRadii);
+    for(size_t i = 0; i < spheres.size(); ++i)
+        writer.write(&spheres[i]->radius, sizeof(float));
+    writer.beginSection(SceneHeader_SphereMaterials);
+    for(size_t i = 0; i < spheres.size(); ++i)
+        writer.write(&spheres[i]->materialId, sizeof(int));
+
+    // Copy the planes.
+    writer.beginSection(SceneHeader_PlaneNormals);
+    for(size_t i = 0; i < planes.size(); ++i)
+        writer.write(&planes[i]->normal, sizeof(Vector3));
+    writer.beginSection(SceneHeader_PlaneDistances);
+    for(size_t i = 0; i < planes.size(); ++i)
+        writer.write(&planes[i]->distance, sizeof(float));
+    writer.beginSection(SceneHeader_PlaneMaterials);
+    for(size_t i = 0; i < planes.size(); ++i)
+        writer.write(&planes[i]->materialId, sizeof(int));
+
+    // Copy the terrains.
+    writer.beginSection(SceneHeader_TerrainBoxes);
+    for(size_t i = 0; i < terrains.size(); ++i)
+        writer.write(&terrains[i]->boundingBox, sizeof(AABox));
+    writer.beginSection(SceneHeader_TerrainNoises);
+    for(size_t i = 0; i < terrains.size(); ++i)
+        writer.write(&terrains[i]->noise, sizeof(NoiseElement));
+    writer.beginSection(SceneHeader_TerrainMaterials);
+    for(size_t i = 0; i < terrains.size(); ++i)
+        writer.write(&terrains[i]->materialId, sizeof(int));
+
+    // Copy the meshes.
+    writer.beginSection(SceneHeader_Meshes);
+    for(size_t i = 0; i < meshInstances.size(); ++i)
+        writer.write(&meshInstances[i], sizeof(MeshInstance));
+    writer.beginSection(SceneHeader_MeshMaterials);
+    for(size_t i = 0; i < meshMaterials.size(); ++i)
+        writer.write(&meshMaterials[i], sizeof(int));
+
+    // Copy the lights.
+    writer.beginSection(SceneHeader_LightShapes);
+    for(size_t i = 0; i < lightShapes.size(); ++i)
+        writer.write(&lightShapes[i], sizeof(int));
+    writer.beginSection(SceneHeader_LightRadii);
+    for(size_t i = 0; i < lightRadii.size(); ++i)
+        writer.write(&lightRadii[i], sizeof(float));
+
+    // Create the data holder.
+    unsigned char *data = writer.finish();
+    size_t size = writer.getSize();
+    unsigned char *materialData = materialWriter.finish();
+    size_t materialSize = materialWriter.getSize();
+    SceneDataHolder *holder = new SceneDataHolder(data, size, materialData, materialSize);
+    holder->setLightBounds(lightBounds);
+    return holder;
+}
+
+bool Scene::updateMeshData(int *version, std::vector<unsigned char> *data)
+{
+    TracedLock l(mutex, SceneMutexZone);
+    if(meshDataDirty)
+        buildMeshData();
+    if(*version == meshDataVersion)
+        return false;
+
+    *version = meshDataVersion;
+    *data = meshData;
+    return true;
+}
+
+void Scene::buildMeshData()
+{
+    std::vector<MeshShape*> meshes;
     for(size_t i = 0; i < shapes.size(); ++i)
     {
-        size_t shapeSize = Shape::size(shapes[i]);
-        memcpy(dst, shapes[i], shapeSize);
-        dst += shapeSize;
+        if(shapes[i]->getType() == Shape::ShapeType_Mesh)
+            meshes.push_back(static_cast<MeshShape*> (shapes[i]));
     }
-    assert(dst == data + size);
 
-    // Create the data holder.
-    return new SceneDataHolder(data, size);
+    // Create the instances.
+    meshInstances.resize(meshes.size());
+    size_t nodeCount = 0;
+    size_t vertexCount = 0;
+    size_t triangleCount = 0;
+    for(size_t i = 0; i < meshes.size(); ++i)
+    {
+        MeshInstance &instance = meshInstances[i];
+        instance.padding[0] = instance.padding[1] = 0;
+        instance.boundsMin = meshes[i]->getBoundingBox().min;
+        instance.boundsMax = meshes[i]->getBoundingBox().max;
+        instance.quantizationScale = meshes[i]->getQuantizationScale();
+        instance.firstNode = nodeCount;
+        instance.firstTriangle = triangleCount;
+        nodeCount += meshes[i]->getNodes().size();
+        vertexCount += meshes[i]->getVertexCount();
+        triangleCount += meshes[i]->getTriangleCount();
+    }
+
+    // Write the nodes, the vertices and the indices. The vertex indices
+    // are made global.
+    SceneBufferWriter writer(0);
+    meshNodesOffset = writer.getSize();
+    for(size_t i = 0; i < meshes.size(); ++i)
+    {
+        const std::vector<QuantizedBVHNode> &nodes = meshes[i]->getNodes();
+        if(!nodes.empty())
+            writer.write(&nodes[0], nodes.size()*sizeof(QuantizedBVHNode));
+    }
+
+    meshVerticesOffset = writer.beginBlock();
+    for(size_t i = 0; i < meshes.size(); ++i)
+    {
+        const std::vector<float> &vertices = meshes[i]->getVertices();
+        if(!vertices.empty())
+            writer.write(&vertices[0], vertices.size()*sizeof(float));
+    }
+
+    meshIndicesOffset = writer.beginBlock();
+    size_t firstVertex = 0;
+    for(size_t i = 0; i < meshes.size(); ++i)
+    {
+        std::vector<int> indices = meshes[i]->getIndices();
+        for(size_t j = 0; j < indices.size(); ++j)
+            indices[j] += firstVertex;
+        if(!indices.empty())
+            writer.write(&indices[0], indices.size()*sizeof(int));
+        firstVertex += meshes[i]->getVertexCount();
+    }
+
+    writer.getBuffer(&meshData);
+    meshDataVersion++;
+    meshDataDirty = false;
+
+    if(triangleCount > 0)
+    {
+        printf("Mesh data: %lu triangles, %lu vertices, %lu BVH nodes, %.1f bytes per triangle\n",
+            (unsigned long)triangleCount, (unsigned long)vertexCount, (unsigned long)nodeCount,
+            meshData.size()/(float)triangleCount);
+    }
 }
 
 //-------------------------------------------------------------
@@ -446,7 +882,13 @@ inline int getTextureId(std::map<std::string, Texture*> &textures, const char *n
         return -1;
     else if(!strcmp(name, "<white>"))
         return -2;
-    return textures[name]->getId();
+    std::map<std::string, Texture*>::iterator it = textures.find(name);
+    if(it == textures.end())
+    {
+        fprintf(stderr, "Unknown texture %s\n", name);
+        return -1;
+    }
+    return it->second->getId();
 }
 
 inline int getTextureIdAttribute(xml_node<> *node, std::map<std::string, Texture*> &textures, const char *name, int def=-1)
@@ -504,7 +946,25 @@ static Shape *loadTerrainShape(xml_node<> *node)
     return terrain;
 }
 
-static Shape *loadShape(xml_node<> *node)
+static Shape *loadMeshShape(xml_node<> *node, const std::string &baseDir)
+{
+    // The mesh path is relative to the scene file.
+    std::string fileName = getAttribute(node, "file", "");
+    if(!fileName.empty() && fileName[0] != '/')
+        fileName = baseDir + fileName;
+
+    MeshShape *mesh = MeshShape::loadFromFile(fileName);
+    if(!mesh)
+        return NULL;
+
+    mesh->transform(getVectorAttribute(node, "scale", Vector3(1, 1, 1)), getVectorAttribute(node, "position"));
+    mesh->buildBVH();
+    printf("Mesh %s: %lu triangles, %.1f bytes per triangle\n", fileName.c_str(),
+        (unsigned long)mesh->getTriangleCount(), mesh->getMemorySize()/(float)mesh->getTriangleCount());
+    return mesh;
+}
+
+static Shape *loadShape(xml_node<> *node, const std::string &baseDir)
 {
     std::string type = getAttribute(node, "type");
     if(type == "sphere")
@@ -513,10 +973,66 @@ static Shape *loadShape(xml_node<> *node)
         return loadPlaneShape(node);
     else if(type == "terrain")
         return loadTerrainShape(node);
+    else if(type == "mesh")
+        return loadMeshShape(node, baseDir);
     else
         return NULL;
 }
 
+static int getMaterialIdAttribute(xml_node<> *node, const std::map<std::string, int> &materialIds, const char *name)
+{
+    const char *val = getAttribute(node, name);
+    std::map<std::string, int>::const_iterator it = materialIds.find(val ? val : "");
+    if(it == materialIds.end())
+    {
+        fprintf(stderr, "Unknown material %s\n", val ? val : "");
+        return -1;
+    }
+    return it->second;
+}
+
+static void loadStreaming(xml_node<> *node, Scene *scene, const std::map<std::string, int> &materialIds, const std::string &baseDir)
+{
+    SceneStreamer *streamer = new SceneStreamer(scene);
+    streamer->setChunkSize(getScalarAttribute(node, "chunk-size", 32.0f));
+    streamer->setRadius(getIntAttribute(node, "radius", 2));
+    streamer->setMemoryBudget((size_t)(getScalarAttribute(node, "budget-mb", 64.0f)*1024*1024));
+    streamer->setDeviceBudget((size_t)(getScalarAttribute(node, "device-budget-mb", 0.0f)*1024*1024));
+    streamer->setWorkerCount(getIntAttribute(node, "workers", 2));
+    streamer->setSeed(getIntAttribute(node, "seed", 1));
+    streamer->setMaterialIds(materialIds);
+
+    // The chunk directory is relative to the scene file.
+    std::string directory = getAttribute(node, "directory", "");
+    if(!directory.empty() && directory[0] != '/')
+        directory = baseDir + directory;
+    streamer->setDirectory(directory);
+
+    xml_node<> *terrainNode = node->first_node("terrain");
+    if(terrainNode)
+    {
+        NoiseElement noise;
+        loadNoiseData(terrainNode->first_node("noise"), &noise);
+        streamer->setTerrain(getMaterialIdAttribute(terrainNode, materialIds, "material"), noise,
+            getScalarAttribute(terrainNode, "min-height", 0.0f), getScalarAttribute(terrainNode, "max-height", 1.0f));
+    }
+
+    xml_node<> *scatterNode = node->first_node("scatter");
+    for(; scatterNode; scatterNode = scatterNode->next_sibling("scatter"))
+    {
+        ChunkScatter scatter;
+        scatter.materialId = getMaterialIdAttribute(scatterNode, materialIds, "material");
+        scatter.count = getIntAttribute(scatterNode, "count", 1);
+        scatter.minRadius = getScalarAttribute(scatterNode, "min-radius", 0.5f);
+        scatter.maxRadius = getScalarAttribute(scatterNode, "max-radius", scatter.minRadius);
+        scatter.height = getScalarAttribute(scatterNode, "height", 0.0f);
+        if(scatter.materialId >= 0)
+            streamer->addScatter(scatter);
+    }
+
+    scene->setStreamer(streamer);
+}
+
 static void loadSky(xml_node<> *node, Scene *scene)
 {
     scene->setDay(getBooleanAttribute(node, "day", false));
@@ -538,16 +1054,40 @@ Scene *Scene::loadFromFile(const std::string &filename)
     std::vector<char> sceneFileData = readWholeFile(filename.c_str());
     sceneFileData.push_back(0);
 
+    // A file that isn't a scene is an error, not a crash, since the render
+    // server loads the scenes of its clients.
     xml_document<> doc;    // character type defaults to char
-    doc.parse<0> (&sceneFileData[0]);    // 0 means default parse flags
-    
+    try
+    {
+        doc.parse<0> (&sceneFileData[0]);    // 0 means default parse flags
+    }
+    catch(const rapidxml::parse_error &error)
+    {
+        fprintf(stderr, "Failed to parse the scene %s: %s\n", filename.c_str(), error.what());
+        return NULL;
+    }
+
     // Get the root node.
     rapidxml::xml_node<> *rootNode = doc.first_node("scene");
+    if(!rootNode)
+    {
+        fprintf(stderr, "The file %s has no scene element\n", filename.c_str());
+        return NULL;
+    }
 
     // Create the scene.
     Scene *scene = new Scene();
+    int maxRayDepth = getIntAttribute(rootNode, "max-depth", DefaultMaxRayDepth);
+    if(maxRayDepth < 1)
+    {
+        fprintf(stderr, "Invalid scene max-depth %d, using %d.\n", maxRayDepth, DefaultMaxRayDepth);
+        maxRayDepth = DefaultMaxRayDepth;
+    }
+    scene->setMaxRayDepth(maxRayDepth);
+    scene->setLightCutoff(getScalarAttribute(rootNode, "light-cutoff", 0.0f));
+
     std::map<std::string, Texture*> textureMap;
-    std::map<std::string, Material*> materialMap;
+    std::map<std::string, int> materialIds;
 
     // Load the sky
     xml_node<> *skyNode = rootNode->first_node("sky");
@@ -577,28 +1117,94 @@ Scene *Scene::loadFromFile(const std::string &filename)
         {
             std::string name = getAttribute(materialNode, "name", "");
             Material *material = loadMaterial(textureMap, materialNode);
-            materialMap[name] = material;
             scene->addMaterial(material);
+            materialIds[name] = material->getId();
         }
     }
 
     // Load the shapes.
+    std::string baseDir;
+    size_t lastSlash = filename.rfind('/');
+    if(lastSlash != std::string::npos)
+        baseDir = filename.substr(0, lastSlash + 1);
     xml_node<> *shapesNode = rootNode->first_node("shapes");
     if(shapesNode)
     {
         xml_node<> *shapeNode = shapesNode->first_node("shape");
         for(; shapeNode; shapeNode = shapeNode->next_sibling("shape"))
         {
-            Shape *shape = loadShape(shapeNode);
+            Shape *shape = loadShape(shapeNode, baseDir);
             if(!shape)
                 continue;
-            shape->materialId = materialMap[getAttribute(shapeNode, "material")]->getId();
+            shape->materialId = getMaterialIdAttribute(shapeNode, materialIds, "material");
+            if(shape->materialId < 0)
+            {
+                deleteShape(shape);
+                delete scene;
+                return NULL;
+            }
             scene->addShape(shape);
         }
     }
 
+    // Load the streamed chunks settings.
+    xml_node<> *streamingNode = rootNode->first_node("streaming");
+    if(streamingNode)
+        loadStreaming(streamingNode, scene, materialIds, baseDir);
+
     return scene;
 }
 
+bool Scene::loadChunkFile(const std::string &filename, const std::map<std::string, int> &materialIds, std::vector<Shape*> *shapes)
+{
+    std::vector<char> chunkFileData = readWholeFile(filename.c_str());
+    if(chunkFileData.empty())
+        return false;
+    chunkFileData.push_back(0);
+
+    // The chunks are loaded in the streamer workers, where an exception
+    // would end the process. An invalid file falls back to the generated
+    // chunk.
+    xml_document<> doc;
+    try
+    {
+        doc.parse<0> (&chunkFileData[0]);
+    }
+    catch(const rapidxml::parse_error &error)
+    {
+        fprintf(stderr, "Failed to parse the chunk file %s: %s\n", filename.c_str(), error.what());
+        return false;
+    }
+    rapidxml::xml_node<> *rootNode = doc.first_node("chunk");
+    if(!rootNode)
+    {
+        fprintf(stderr, "Invalid chunk file %s\n", filename.c_str());
+        return false;
+    }
+
+    // The mesh paths are relative to the chunk file.
+    std::string baseDir;
+    size_t lastSlash = filename.rfind('/');
+    if(lastSlash != std::string::npos)
+        baseDir = filename.substr(0, lastSlash + 1);
+
+    xml_node<> *shapeNode = rootNode->first_node("shape");
+    for(; shapeNode; shapeNode = shapeNode->next_sibling("shape"))
+    {
+        Shape *shape = loadShape(shapeNode, baseDir);
+        if(!shape)
+            continue;
+        shape->materialId = getMaterialIdAttribute(shapeNode, materialIds, "material");
+        if(shape->materialId < 0)
+        {
+            deleteShape(shape);
+            continue;
+        }
+        shapes->push_back(shape);
+    }
+
+    return true;
+}
+
 }
 
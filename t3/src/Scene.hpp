@@ -3,24 +3,29 @@
 
 #include <vector>
 #include <string>
+#include <map>
 #include "Geometry.hpp"
+#include "Vector4.hpp"
 #include "Matrix3.hpp"
 #include "Threading.hpp"
 
 namespace T3
 {
 
+class SceneStreamer;
+
 /**
  * Serialized scene data holder.
  */
 class SceneDataHolder
 {
 public:
-    SceneDataHolder(unsigned char *data, size_t size)
-        : data(data), size(size) {}
+    SceneDataHolder(unsigned char *data, size_t size, unsigned char *materialData, size_t materialSize)
+        : data(data), size(size), materialData(materialData), materialSize(materialSize) {}
     ~SceneDataHolder()
     {
         delete [] data;
+        delete [] materialData;
     }
 
     const unsigned char *getData() const
@@ -33,9 +38,34 @@ public:
         return size;
     }
 
+    const unsigned char *getMaterialData() const
+    {
+        return materialData;
+    }
+
+    size_t getMaterialSize() const
+    {
+        return materialSize;
+    }
+
+    /// Center and influence radius of the bounded lights, in the order of
+    /// the scene buffer.
+    const std::vector<Vector4> &getLightBounds() const
+    {
+        return lightBounds;
+    }
+
+    void setLightBounds(std::vector<Vector4> &bounds)
+    {
+        lightBounds.swap(bounds);
+    }
+
 private:
     unsigned char *data;
     size_t size;
+    unsigned char *materialData;
+    size_t materialSize;
+    std::vector<Vector4> lightBounds;
 };
 
 /**
@@ -87,9 +117,37 @@ public:
     void addShape(Shape *shape);
     Shape *getShape(size_t index);
 
+    /// Adds and removes the shapes of the streamed chunks. The removed
+    /// shapes are not deleted.
+    void addShapes(const std::vector<Shape*> &newShapes);
+    void removeShapes(const std::vector<Shape*> &oldShapes);
+
+    static void deleteShape(Shape *shape);
+
+    // Streaming of the chunks around the camera. Can be NULL.
+    SceneStreamer *getStreamer();
+    void setStreamer(SceneStreamer *newStreamer);
+
     // Scene data.
     SceneDataHolder *getSceneData();
 
+    /// Changes with the materials, textures, shapes and settings that are
+    /// stored in the scene data.
+    int getContentVersion() const;
+    size_t getMaterialDataSize() const;
+
+    /// Copies the mesh data buffer, when it changed after the given version.
+    bool updateMeshData(int *version, std::vector<unsigned char> *data);
+
+    // Ray depth. It is baked into the raytracer program when it is built.
+    int getMaxRayDepth() const;
+    void setMaxRayDepth(int newDepth);
+
+    // Light intensity below which the sphere lights stop reaching. With a
+    // zero cutoff, every light has an unbounded reach and no falloff.
+    float getLightCutoff() const;
+    void setLightCutoff(float newCutoff);
+
     // Camera
     Camera getCamera();
     void setCamera(const Camera &camera);
@@ -113,13 +171,37 @@ public:
     Vector3 getSunDirection() const;
     void setSunDirection(const Vector3 &direction);
 
-    // File loading.
+    // File loading. Returns NULL when the file isn't a valid scene.
     static Scene *loadFromFile(const std::string &filename);
 
+    /// Loads the shapes of a streamed chunk. Returns false when the file
+    /// can't be read or parsed.
+    static bool loadChunkFile(const std::string &filename, const std::map<std::string, int> &materialIds, std::vector<Shape*> *shapes);
+
 private:
+    Color getFlatTextureColor(int textureId) const;
+    int getPackedTextureId(int textureId, const std::vector<int> &packedIds) const;
+    PackedMaterial packMaterial(const Material *material, const std::vector<int> &packedIds) const;
+    float getEmissionIntensity(const Material *material) const;
+    void buildMeshData();
+
     std::vector<Material*> materials;
     std::vector<Texture*> textures;
     std::vector<Shape*> shapes;
+    SceneStreamer *streamer;
+
+    // Mesh data buffer. It is only rebuilt when a mesh is added.
+    std::vector<MeshInstance> meshInstances;
+    std::vector<unsigned char> meshData;
+    size_t meshNodesOffset;
+    size_t meshVerticesOffset;
+    size_t meshIndicesOffset;
+    int meshDataVersion;
+    bool meshDataDirty;
+
+    int contentVersion;
+    int maxRayDepth;
+    float lightCutoff;
 
     // Sky
     bool daySky;
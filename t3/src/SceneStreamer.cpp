@@ -0,0 +1,494 @@
+#include <algorithm>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include "SceneStreamer.hpp"
+#include "Scene.hpp"
+#include "Mesh.hpp"
+#include "TraceProfiler.hpp"
+
+namespace T3
+{
+
+/**
+ * Small deterministic generator, so that a chunk is generated the same way
+ * every time that it is loaded.
+ */
+class ChunkRandom
+{
+public:
+    ChunkRandom(unsigned int state) : state(state) {}
+
+    float next(float minValue, float maxValue)
+    {
+        state = state*1664525u + 1013904223u;
+        return minValue + (maxValue - minValue)*((state >> 8)/16777216.0f);
+    }
+
+private:
+    unsigned int state;
+};
+
+static unsigned int hashChunk(const ChunkCoord &coord, unsigned int seed)
+{
+    unsigned int h = seed*0x9e3779b9u ^ (unsigned int)coord.x*0x85ebca6bu ^ (unsigned int)coord.z*0xc2b2ae35u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return h;
+}
+
+SceneStreamer::SceneStreamer(Scene *scene)
+    : scene(scene), chunkSize(32.0f), radius(2), memoryBudget(64 << 20), deviceBudget(0), workerCount(2),
+      terrainMaterial(-1), terrainMinHeight(0.0f), terrainMaxHeight(1.0f), seed(1),
+      usedMemory(0), frame(0), shapesChanged(false), deviceMemoryUsed(0), residentLimit(INT_MAX),
+      stopping(false)
+{
+}
+
+SceneStreamer::~SceneStreamer()
+{
+    stop();
+
+    // The shapes of the resident chunks belong to the scene.
+    for(ChunkMap::iterator it = chunks.begin(); it != chunks.end(); ++it)
+    {
+        if(it->second->resident)
+            delete it->second;
+        else
+            deleteChunk(it->second);
+    }
+}
+
+void SceneStreamer::setChunkSize(float size)
+{
+    chunkSize = size > 0.0f ? size : 1.0f;
+}
+
+void SceneStreamer::setRadius(int chunks)
+{
+    radius = std::max(chunks, 0);
+}
+
+void SceneStreamer::setMemoryBudget(size_t bytes)
+{
+    memoryBudget = bytes;
+}
+
+void SceneStreamer::setDeviceBudget(size_t bytes)
+{
+    deviceBudget = bytes;
+}
+
+void SceneStreamer::setDeviceMemoryUsed(size_t bytes)
+{
+    deviceMemoryUsed = bytes;
+}
+
+void SceneStreamer::setWorkerCount(int count)
+{
+    workerCount = std::max(count, 1);
+}
+
+void SceneStreamer::setDirectory(const std::string &directory)
+{
+    this->directory = directory;
+}
+
+void SceneStreamer::setMaterialIds(const std::map<std::string, int> &ids)
+{
+    materialIds = ids;
+}
+
+void SceneStreamer::setTerrain(int materialId, const NoiseElement &noise, float minHeight, float maxHeight)
+{
+    terrainMaterial = materialId;
+    terrainNoise = noise;
+    terrainMinHeight = minHeight;
+    terrainMaxHeight = maxHeight;
+}
+
+void SceneStreamer::addScatter(const ChunkScatter &scatter)
+{
+    scatters.push_back(scatter);
+}
+
+void SceneStreamer::setSeed(unsigned int seed)
+{
+    this->seed = seed;
+}
+
+size_t SceneStreamer::getUsedMemory() const
+{
+    return usedMemory;
+}
+
+int SceneStreamer::getResidentChunkCount() const
+{
+    int count = 0;
+    for(ChunkMap::const_iterator it = chunks.begin(); it != chunks.end(); ++it)
+        count += it->second->resident ? 1 : 0;
+    return count;
+}
+
+void SceneStreamer::start()
+{
+    printf("Streaming chunks of %.1f units, %d around the camera, within %.1f MB\n",
+        chunkSize, radius, memoryBudget/(1024.0*1024.0));
+    if(deviceBudget > 0)
+        printf("The scene buffers are limited to %.1f MB of device memory\n", deviceBudget/(1024.0*1024.0));
+
+    stopping = false;
+    for(int i = 0; i < workerCount; ++i)
+        threads.push_back(SDL_CreateThread(&threadEntryPoint, this));
+}
+
+void SceneStreamer::stop()
+{
+    {
+        Lock l(mutex);
+        stopping = true;
+        requests.clear();
+        requestsChanged.broadcast();
+    }
+
+    for(size_t i = 0; i < threads.size(); ++i)
+        SDL_WaitThread(threads[i], NULL);
+    threads.clear();
+
+    for(size_t i = 0; i < loaded.size(); ++i)
+        deleteChunk(loaded[i]);
+    loaded.clear();
+}
+
+bool SceneStreamer::update(const Vector3 &cameraPosition, bool wait)
+{
+    T3_TRACE_ZONE("SceneStreamer::update");
+    if(threads.empty())
+        start();
+    ++frame;
+
+    // The chunks rejected by the budgets are tried again when the camera
+    // enters another chunk.
+    ChunkCoord cameraChunk = getChunkAt(cameraPosition);
+    if(cameraChunk != lastCameraChunk)
+    {
+        rejected.clear();
+        residentLimit = INT_MAX;
+        lastCameraChunk = cameraChunk;
+    }
+
+    // While the last upload doesn't fit in the device budget, the farthest
+    // resident chunk leaves the scene.
+    if(deviceBudget > 0 && deviceMemoryUsed > deviceBudget)
+    {
+        residentLimit = std::max(std::min(residentLimit, getResidentChunkCount()) - 1, 0);
+        deviceMemoryUsed = 0;
+    }
+
+    std::vector<ChunkCoord> inRangeList;
+    collectChunksInRange(cameraPosition, &inRangeList);
+    std::set<ChunkCoord> inRange(inRangeList.begin(), inRangeList.end());
+    cacheLoadedChunks(inRange, cameraPosition);
+
+    // Request the missing chunks, the nearest first. The older requests
+    // that went out of range are dropped.
+    {
+        Lock l(mutex);
+        requests.clear();
+        for(size_t i = 0; i < inRangeList.size(); ++i)
+        {
+            const ChunkCoord &coord = inRangeList[i];
+            if(!chunks.count(coord) && !loading.count(coord) && !rejected.count(coord) && !isLoaded(coord))
+                requests.push_back(coord);
+        }
+        requestsChanged.broadcast();
+
+        // The offline frames wait for the chunks, so that they don't
+        // depend on the loading times.
+        if(wait)
+        {
+            while(!requests.empty() || !loading.empty())
+                chunkLoaded.wait(l);
+        }
+    }
+    if(wait)
+        cacheLoadedChunks(inRange, cameraPosition);
+
+    // Only the nearest loaded chunks in range are resident, up to the
+    // limit of the device budget.
+    std::set<ChunkCoord> residentRange;
+    for(size_t i = 0; i < inRangeList.size() && (int)residentRange.size() < residentLimit; ++i)
+    {
+        if(chunks.count(inRangeList[i]))
+            residentRange.insert(inRangeList[i]);
+    }
+
+    std::vector<Shape*> added;
+    std::vector<Shape*> removed;
+    for(ChunkMap::iterator it = chunks.begin(); it != chunks.end(); ++it)
+    {
+        SceneChunk *chunk = it->second;
+        if(inRange.count(it->first))
+            chunk->lastUsedFrame = frame;
+        bool wanted = residentRange.count(it->first) > 0;
+        if(wanted == chunk->resident)
+            continue;
+
+        std::vector<Shape*> &changes = wanted ? added : removed;
+        changes.insert(changes.end(), chunk->shapes.begin(), chunk->shapes.end());
+        chunk->resident = wanted;
+    }
+
+    if(!removed.empty())
+        scene->removeShapes(removed);
+    if(!added.empty())
+        scene->addShapes(added);
+
+    bool changed = shapesChanged || !added.empty() || !removed.empty();
+    shapesChanged = false;
+    return changed;
+}
+
+ChunkCoord SceneStreamer::getChunkAt(const Vector3 &position) const
+{
+    return ChunkCoord((int)floor(position.x/chunkSize), (int)floor(position.z/chunkSize));
+}
+
+float SceneStreamer::getChunkDistance(const ChunkCoord &coord, const Vector3 &position) const
+{
+    float dx = (coord.x + 0.5f)*chunkSize - position.x;
+    float dz = (coord.z + 0.5f)*chunkSize - position.z;
+    return sqrt(dx*dx + dz*dz);
+}
+
+void SceneStreamer::collectChunksInRange(const Vector3 &position, std::vector<ChunkCoord> *result) const
+{
+    ChunkCoord center = getChunkAt(position);
+    std::vector<std::pair<float, ChunkCoord> > sorted;
+    for(int z = center.z - radius; z <= center.z + radius; ++z)
+    {
+        for(int x = center.x - radius; x <= center.x + radius; ++x)
+        {
+            ChunkCoord coord(x, z);
+            sorted.push_back(std::make_pair(getChunkDistance(coord, position), coord));
+        }
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    result->clear();
+    for(size_t i = 0; i < sorted.size(); ++i)
+        result->push_back(sorted[i].second);
+}
+
+bool SceneStreamer::isLoaded(const ChunkCoord &coord) const
+{
+    for(size_t i = 0; i < loaded.size(); ++i)
+    {
+        if(loaded[i]->coord == coord)
+            return true;
+    }
+    return false;
+}
+
+void SceneStreamer::cacheLoadedChunks(const std::set<ChunkCoord> &inRange, const Vector3 &position)
+{
+    std::vector<std::pair<float, SceneChunk*> > newChunks;
+    {
+        Lock l(mutex);
+        for(size_t i = 0; i < loaded.size(); ++i)
+            newChunks.push_back(std::make_pair(getChunkDistance(loaded[i]->coord, position), loaded[i]));
+        loaded.clear();
+    }
+    std::sort(newChunks.begin(), newChunks.end());
+
+    for(size_t i = 0; i < newChunks.size(); ++i)
+    {
+        // The chunks that went out of range while loading are dropped.
+        SceneChunk *chunk = newChunks[i].second;
+        if(!inRange.count(chunk->coord) || chunks.count(chunk->coord))
+        {
+            deleteChunk(chunk);
+            continue;
+        }
+
+        if(!makeRoom(chunk, inRange, position))
+        {
+            fprintf(stderr, "Chunk %d %d does not fit in the streaming memory budget\n", chunk->coord.x, chunk->coord.z);
+            rejected.insert(chunk->coord);
+            deleteChunk(chunk);
+            continue;
+        }
+
+        chunk->lastUsedFrame = frame;
+        chunks[chunk->coord] = chunk;
+        usedMemory += chunk->memorySize;
+    }
+}
+
+bool SceneStreamer::makeRoom(const SceneChunk *chunk, const std::set<ChunkCoord> &inRange, const Vector3 &position)
+{
+    float distance = getChunkDistance(chunk->coord, position);
+    while(usedMemory + chunk->memorySize > memoryBudget)
+    {
+        // Evict the least recently used chunk out of range.
+        ChunkMap::iterator victim = chunks.end();
+        for(ChunkMap::iterator it = chunks.begin(); it != chunks.end(); ++it)
+        {
+            if(inRange.count(it->first))
+                continue;
+            if(victim == chunks.end() || it->second->lastUsedFrame < victim->second->lastUsedFrame)
+                victim = it;
+        }
+
+        // Or else, the farthest chunk in range, when it is farther than
+        // the new one.
+        if(victim == chunks.end())
+        {
+            float victimDistance = distance;
+            for(ChunkMap::iterator it = chunks.begin(); it != chunks.end(); ++it)
+            {
+                float chunkDistance = getChunkDistance(it->first, position);
+                if(chunkDistance > victimDistance)
+                {
+                    victim = it;
+                    victimDistance = chunkDistance;
+                }
+            }
+        }
+
+        if(victim == chunks.end())
+            return false;
+        evictChunk(victim);
+    }
+
+    return true;
+}
+
+void SceneStreamer::evictChunk(ChunkMap::iterator it)
+{
+    SceneChunk *chunk = it->second;
+    if(chunk->resident)
+    {
+        scene->removeShapes(chunk->shapes);
+        shapesChanged = true;
+    }
+
+    usedMemory -= chunk->memorySize;
+    chunks.erase(it);
+    deleteChunk(chunk);
+}
+
+void SceneStreamer::deleteChunk(SceneChunk *chunk)
+{
+    for(size_t i = 0; i < chunk->shapes.size(); ++i)
+        Scene::deleteShape(chunk->shapes[i]);
+    delete chunk;
+}
+
+int SceneStreamer::threadEntryPoint(void *obj)
+{
+    static_cast<SceneStreamer*> (obj)->threadEntry();
+    return 0;
+}
+
+void SceneStreamer::threadEntry()
+{
+    T3_TRACE_THREAD_NAME("scene streamer");
+    for(;;)
+    {
+        // Take the nearest request.
+        ChunkCoord coord;
+        {
+            Lock l(mutex);
+            while(requests.empty() && !stopping)
+                requestsChanged.wait(l);
+            if(stopping)
+                return;
+
+            coord = requests.front();
+            requests.pop_front();
+            loading.insert(coord);
+        }
+
+        SceneChunk *chunk = loadChunk(coord);
+        {
+            Lock l(mutex);
+            loading.erase(coord);
+            loaded.push_back(chunk);
+            chunkLoaded.broadcast();
+        }
+    }
+}
+
+SceneChunk *SceneStreamer::loadChunk(const ChunkCoord &coord) const
+{
+    T3_TRACE_ZONE("SceneStreamer::loadChunk");
+    SceneChunk *chunk = new SceneChunk(coord);
+
+    // The chunk files replace the generated chunks.
+    bool fromFile = false;
+    if(!directory.empty())
+    {
+        char fileName[64];
+        sprintf(fileName, "/chunk_%d_%d.xml", coord.x, coord.z);
+        fromFile = Scene::loadChunkFile(directory + fileName, materialIds, &chunk->shapes);
+    }
+    if(!fromFile)
+        generateChunk(chunk);
+
+    for(size_t i = 0; i < chunk->shapes.size(); ++i)
+        chunk->memorySize += getShapeMemorySize(chunk->shapes[i]);
+    return chunk;
+}
+
+void SceneStreamer::generateChunk(SceneChunk *chunk) const
+{
+    ChunkRandom random(hashChunk(chunk->coord, seed));
+    float x0 = chunk->coord.x*chunkSize;
+    float z0 = chunk->coord.z*chunkSize;
+
+    // The terrain noise is in world coordinates, so the tiles match.
+    if(terrainMaterial >= 0)
+    {
+        TerrainShape *terrain = new TerrainShape();
+        terrain->materialId = terrainMaterial;
+        terrain->noise = terrainNoise;
+        terrain->boundingBox.min = Vector3(x0, terrainMinHeight, z0);
+        terrain->boundingBox.max = Vector3(x0 + chunkSize, terrainMaxHeight, z0 + chunkSize);
+        chunk->shapes.push_back(terrain);
+    }
+
+    // The scattered spheres lie on their height, inside the chunk.
+    for(size_t i = 0; i < scatters.size(); ++i)
+    {
+        const ChunkScatter &scatter = scatters[i];
+        for(int j = 0; j < scatter.count; ++j)
+        {
+            float r = random.next(scatter.minRadius, scatter.maxRadius);
+            float margin = std::min(r, chunkSize*0.5f);
+            float x = random.next(x0 + margin, x0 + chunkSize - margin);
+            float z = random.next(z0 + margin, z0 + chunkSize - margin);
+            chunk->shapes.push_back(new SphereShape(Vector3(x, scatter.height + r, z), r, scatter.materialId));
+        }
+    }
+}
+
+size_t SceneStreamer::getShapeMemorySize(Shape *shape)
+{
+    // Size in the scene buffers.
+    switch(shape->getType())
+    {
+    case Shape::ShapeType_Sphere:
+    case Shape::ShapeType_Plane:
+        return sizeof(Vector3) + sizeof(float) + sizeof(int);
+    case Shape::ShapeType_Terrain:
+        return sizeof(AABox) + sizeof(NoiseElement) + sizeof(int);
+    case Shape::ShapeType_Mesh:
+        return static_cast<MeshShape*> (shape)->getMemorySize() + sizeof(MeshInstance) + sizeof(int);
+    default:
+        return 0;
+    }
+}
+
+} // namespace T3
@@ -0,0 +1,192 @@
+#ifndef T3_SCENE_STREAMER_HPP
+#define T3_SCENE_STREAMER_HPP
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "Geometry.hpp"
+#include "Threading.hpp"
+
+namespace T3
+{
+
+class Scene;
+
+/**
+ * Coordinates of a chunk in the XZ grid.
+ */
+struct ChunkCoord
+{
+    ChunkCoord(int x = 0, int z = 0)
+        : x(x), z(z) {}
+
+    bool operator<(const ChunkCoord &o) const
+    {
+        return x < o.x || (x == o.x && z < o.z);
+    }
+
+    bool operator==(const ChunkCoord &o) const
+    {
+        return x == o.x && z == o.z;
+    }
+
+    bool operator!=(const ChunkCoord &o) const
+    {
+        return !(*this == o);
+    }
+
+    int x;
+    int z;
+};
+
+/**
+ * Shapes of a chunk. They are owned by the chunk, except while the chunk
+ * is resident, when they are also in the scene.
+ */
+struct SceneChunk
+{
+    SceneChunk(const ChunkCoord &coord)
+        : coord(coord), memorySize(0), lastUsedFrame(0), resident(false) {}
+
+    ChunkCoord coord;
+    std::vector<Shape*> shapes;
+    size_t memorySize;
+    int lastUsedFrame;
+    bool resident;
+};
+
+/**
+ * Objects scattered over every generated chunk.
+ */
+struct ChunkScatter
+{
+    int materialId;
+    int count;
+    float minRadius;
+    float maxRadius;
+    float height;
+};
+
+/**
+ * Streams the chunks of a big world around the camera. The world is split
+ * into square chunks in the XZ plane, which are read from chunk files or
+ * generated on worker threads. Only the chunks in range of the camera are
+ * resident in the scene, so the uploaded shapes and the traced lists only
+ * hold them. The chunks out of range stay cached on the host until the
+ * memory budget needs their room, the least recently used first. The
+ * device budget limits the scene buffers, as measured by the raytracer.
+ *
+ * There is no device-side chunk pool: any change to the resident chunks
+ * makes the raytracer serialize and upload the whole scene again, and a
+ * change to the meshes rebuilds all the mesh data.
+ */
+class SceneStreamer
+{
+public:
+    SceneStreamer(Scene *scene);
+    ~SceneStreamer();
+
+    /// Side of a chunk.
+    void setChunkSize(float size);
+
+    /// Chunks around the one of the camera that are kept resident.
+    void setRadius(int chunks);
+
+    /// Host memory of the resident and the cached chunks, in bytes.
+    void setMemoryBudget(size_t bytes);
+
+    /// Device memory of the scene buffers, in bytes. Zero doesn't limit it.
+    void setDeviceBudget(size_t bytes);
+
+    /// Device memory taken by the last upload of the scene buffers.
+    void setDeviceMemoryUsed(size_t bytes);
+
+    void setWorkerCount(int count);
+
+    /// Directory with the chunk_<x>_<z>.xml files. The chunks without a
+    /// file are generated.
+    void setDirectory(const std::string &directory);
+
+    /// Material ids by name, for the chunk files.
+    void setMaterialIds(const std::map<std::string, int> &ids);
+
+    /// Terrain tile of the generated chunks. A negative material disables it.
+    void setTerrain(int materialId, const NoiseElement &noise, float minHeight, float maxHeight);
+
+    void addScatter(const ChunkScatter &scatter);
+    void setSeed(unsigned int seed);
+
+    /// Streams the chunks around the camera position, and updates the
+    /// shapes of the scene. With wait, it blocks until the chunks in range
+    /// are loaded. Returns true when the scene shapes changed.
+    bool update(const Vector3 &cameraPosition, bool wait);
+
+    /// Stops the workers.
+    void stop();
+
+    size_t getUsedMemory() const;
+    int getResidentChunkCount() const;
+
+private:
+    typedef std::map<ChunkCoord, SceneChunk*> ChunkMap;
+
+    void start();
+    ChunkCoord getChunkAt(const Vector3 &position) const;
+    float getChunkDistance(const ChunkCoord &coord, const Vector3 &position) const;
+    void collectChunksInRange(const Vector3 &position, std::vector<ChunkCoord> *result) const;
+    bool isLoaded(const ChunkCoord &coord) const;
+    void cacheLoadedChunks(const std::set<ChunkCoord> &inRange, const Vector3 &position);
+
+    bool makeRoom(const SceneChunk *chunk, const std::set<ChunkCoord> &inRange, const Vector3 &position);
+    void evictChunk(ChunkMap::iterator it);
+    void deleteChunk(SceneChunk *chunk);
+
+    static int threadEntryPoint(void *obj);
+    void threadEntry();
+    SceneChunk *loadChunk(const ChunkCoord &coord) const;
+    void generateChunk(SceneChunk *chunk) const;
+    static size_t getShapeMemorySize(Shape *shape);
+
+    Scene *scene;
+
+    // Settings.
+    float chunkSize;
+    int radius;
+    size_t memoryBudget;
+    size_t deviceBudget;
+    int workerCount;
+    std::string directory;
+    std::map<std::string, int> materialIds;
+    int terrainMaterial;
+    NoiseElement terrainNoise;
+    float terrainMinHeight;
+    float terrainMaxHeight;
+    std::vector<ChunkScatter> scatters;
+    unsigned int seed;
+
+    // Loaded chunks, only used by update.
+    ChunkMap chunks;
+    size_t usedMemory;
+    int frame;
+    bool shapesChanged;
+    std::set<ChunkCoord> rejected;
+    ChunkCoord lastCameraChunk;
+    size_t deviceMemoryUsed;
+    int residentLimit;
+
+    // Requests and results of the workers.
+    std::vector<SDL_Thread*> threads;
+    std::deque<ChunkCoord> requests;
+    std::set<ChunkCoord> loading;
+    std::vector<SceneChunk*> loaded;
+    bool stopping;
+    Mutex mutex;
+    Condition requestsChanged;
+    Condition chunkLoaded;
+};
+
+} // namespace T3
+
+#endif //T3_SCENE_STREAMER_HPP
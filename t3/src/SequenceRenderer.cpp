@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include "SequenceRenderer.hpp"
+#include "Application.hpp"
+#include "CameraPath.hpp"
+#include "FrameProfiler.hpp"
+#include "Image.hpp"
+#include "TraceProfiler.hpp"
+
+namespace T3
+{
+
+// Encoded frames that can wait for the writers.
+const size_t MaxQueuedFrames = 8;
+
+//-----------------------------------------------------------------------------
+// Frame writer
+//
+
+FrameWriter::FrameWriter()
+    : maxQueuedFrames(MaxQueuedFrames), finishing(false), failed(false)
+{
+}
+
+FrameWriter::~FrameWriter()
+{
+    finish();
+}
+
+void FrameWriter::start(int threadCount, size_t maxQueued)
+{
+    finishing = false;
+    failed = false;
+    maxQueuedFrames = maxQueued;
+    for(int i = 0; i < threadCount; ++i)
+        threads.push_back(SDL_CreateThread(&threadEntryPoint, this));
+}
+
+void FrameWriter::write(EncodedFrame *frame)
+{
+    Lock l(mutex);
+    while(queue.size() >= maxQueuedFrames)
+        queueChanged.wait(l);
+
+    queue.push_back(frame);
+    queueChanged.broadcast();
+}
+
+bool FrameWriter::finish()
+{
+    {
+        Lock l(mutex);
+        finishing = true;
+        queueChanged.broadcast();
+    }
+
+    for(size_t i = 0; i < threads.size(); ++i)
+        SDL_WaitThread(threads[i], NULL);
+    threads.clear();
+    return !failed;
+}
+
+int FrameWriter::threadEntryPoint(void *obj)
+{
+    static_cast<FrameWriter*> (obj)->threadEntry();
+    return 0;
+}
+
+void FrameWriter::threadEntry()
+{
+    T3_TRACE_THREAD_NAME("frame writer");
+    for(;;)
+    {
+        // Take the oldest frame.
+        EncodedFrame *frame;
+        {
+            Lock l(mutex);
+            while(queue.empty() && !finishing)
+                queueChanged.wait(l);
+            if(queue.empty())
+                return;
+
+            frame = queue.front();
+            queue.pop_front();
+            queueChanged.broadcast();
+        }
+
+        // Write it.
+        T3_TRACE_ZONE("FrameWriter::write");
+        FILE *file = fopen(frame->fileName.c_str(), "wb");
+        bool success = file && fwrite(&frame->data[0], frame->data.size(), 1, file) == 1;
+        if(file)
+            fclose(file);
+        if(!success)
+        {
+            fprintf(stderr, "Failed to write %s\n", frame->fileName.c_str());
+            Lock l(mutex);
+            failed = true;
+        }
+
+        delete frame;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Sequence renderer
+//
+
+SequenceRenderer::SequenceRenderer()
+    : outputDirectory("."), framesPerSecond(30.0f), writerThreads(2)
+{
+}
+
+SequenceRenderer::~SequenceRenderer()
+{
+}
+
+void SequenceRenderer::setCameraPathFile(const std::string &fileName)
+{
+    cameraPathFile = fileName;
+}
+
+bool SequenceRenderer::isEnabled() const
+{
+    return !cameraPathFile.empty();
+}
+
+void SequenceRenderer::setOutputDirectory(const std::string &directory)
+{
+    outputDirectory = directory;
+}
+
+void SequenceRenderer::setFramesPerSecond(float fps)
+{
+    framesPerSecond = fps > 0.0f ? fps : 30.0f;
+}
+
+void SequenceRenderer::setWriterThreads(int count)
+{
+    writerThreads = count > 0 ? count : 1;
+}
+
+/**
+ * Converts a frame into 8-bit colors and encodes it as a binary PPM.
+ */
+static void encodeFrame(const Image2D *image, EncodedFrame *encoded)
+{
+    T3_TRACE_ZONE("encodeFrame");
+    char header[64];
+    int headerSize = sprintf(header, "P6\n%d %d\n255\n", image->getWidth(), image->getHeight());
+    encoded->data.resize(headerSize + image->getWidth()*image->getHeight()*3);
+    std::copy(header, header + headerSize, encoded->data.begin());
+    image->getRGB8(&encoded->data[headerSize]);
+}
+
+bool SequenceRenderer::run(Application *app, Raytracer *raytracer)
+{
+    CameraPath path;
+    if(!path.loadFromFile(cameraPathFile))
+        return false;
+
+    int frameCount = path.getFrameCount(framesPerSecond);
+    int width = app->getDisplay()->getWidth();
+    int height = app->getDisplay()->getHeight();
+    printf("Rendering %d frames of %dx%d at %.1f fps into %s\n", frameCount, width, height,
+        framesPerSecond, outputDirectory.c_str());
+
+    FrameWriter writer;
+    writer.start(writerThreads, MaxQueuedFrames);
+
+    // One image is being rendered while the other one is encoded.
+    Image2D *images[2] = {new Image2D(width, height), new Image2D(width, height)};
+    FrameProfiler *profiler = app->getProfiler();
+    profiler->reset();
+    double startTime = FrameProfiler::now();
+    double waitTime = 0.0;
+
+    // A frame whose scene can't be uploaded stops the sequence.
+    bool rendered[2] = {false, false};
+    bool renderFailed = false;
+    app->applyCameraKeyframe(path.sample(0.0f));
+    rendered[0] = raytracer->enqueueFrame(images[0]);
+    for(int frame = 0; frame < frameCount; ++frame)
+    {
+        // Keep the device busy with the next frame.
+        if(frame + 1 < frameCount)
+        {
+            app->applyCameraKeyframe(path.sample((frame + 1)/framesPerSecond));
+            rendered[(frame + 1) % 2] = raytracer->enqueueFrame(images[(frame + 1) % 2]);
+        }
+
+        double waitStart = FrameProfiler::now();
+        raytracer->finishFrame();
+        waitTime += FrameProfiler::now() - waitStart;
+        if(!rendered[frame % 2])
+        {
+            fprintf(stderr, "Failed to render the frame %d\n", frame);
+            raytracer->finishFrame();
+            renderFailed = true;
+            break;
+        }
+
+        // Encode the frame, and leave the disk to the writers.
+        EncodedFrame *encoded = new EncodedFrame();
+        char fileName[64];
+        sprintf(fileName, "/frame_%05d.ppm", frame);
+        encoded->fileName = outputDirectory + fileName;
+        encodeFrame(images[frame % 2], encoded);
+        writer.write(encoded);
+    }
+
+    bool success = writer.finish() && !renderFailed;
+    double elapsed = FrameProfiler::now() - startTime;
+    delete images[0];
+    delete images[1];
+
+    // Estimate the device utilization from the average stage timings.
+    double hostAverages[ProfileStage_Count];
+    double deviceAverages[ProfileStage_Count];
+    profiler->getAverageTimes(hostAverages, deviceAverages);
+    double deviceFrameTime = 0.0;
+    for(int i = 0; i < ProfileStage_Count; ++i)
+    {
+        if(deviceAverages[i] > 0.0)
+            deviceFrameTime += deviceAverages[i];
+    }
+
+    printf("Rendered %d frames in %.2f s, %.2f frames/s\n", frameCount, elapsed*0.001, frameCount*1000.0/elapsed);
+    printf("Device busy %.1f%% of the time, the host waited for it %.1f%% of the time\n",
+        deviceFrameTime*frameCount*100.0/elapsed, waitTime*100.0/elapsed);
+    return success;
+}
+
+} // namespace T3
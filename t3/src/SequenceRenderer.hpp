@@ -0,0 +1,86 @@
+#ifndef T3_SEQUENCE_RENDERER_HPP
+#define T3_SEQUENCE_RENDERER_HPP
+
+#include <deque>
+#include <string>
+#include <vector>
+#include "Threading.hpp"
+
+namespace T3
+{
+
+class Application;
+class Raytracer;
+
+/**
+ * Encoded frame waiting to be written.
+ */
+struct EncodedFrame
+{
+    std::string fileName;
+    std::vector<unsigned char> data;
+};
+
+/**
+ * Writes the encoded frames into disk on background threads. The queue is
+ * bounded, so a slow disk throttles the rendering instead of the memory.
+ */
+class FrameWriter
+{
+public:
+    FrameWriter();
+    ~FrameWriter();
+
+    void start(int threadCount, size_t maxQueuedFrames);
+
+    /// Queues a frame, and takes its ownership. Blocks while the queue is full.
+    void write(EncodedFrame *frame);
+
+    /// Waits for the queued frames and stops the threads. Returns false if
+    /// a frame could not be written.
+    bool finish();
+
+private:
+    static int threadEntryPoint(void *obj);
+    void threadEntry();
+
+    std::vector<SDL_Thread*> threads;
+    std::deque<EncodedFrame*> queue;
+    size_t maxQueuedFrames;
+    bool finishing;
+    bool failed;
+
+    Mutex mutex;
+    Condition queueChanged;
+};
+
+/**
+ * Offline rendering of a camera path. The frames are pipelined: the device
+ * renders a frame while the previous one is converted and encoded on the
+ * host, and the frames before are written by the frame writer threads.
+ */
+class SequenceRenderer
+{
+public:
+    SequenceRenderer();
+    ~SequenceRenderer();
+
+    void setCameraPathFile(const std::string &fileName);
+    bool isEnabled() const;
+
+    void setOutputDirectory(const std::string &directory);
+    void setFramesPerSecond(float fps);
+    void setWriterThreads(int count);
+
+    bool run(Application *app, Raytracer *raytracer);
+
+private:
+    std::string cameraPathFile;
+    std::string outputDirectory;
+    float framesPerSecond;
+    int writerThreads;
+};
+
+} // namespace T3
+
+#endif //T3_SEQUENCE_RENDERER_HPP
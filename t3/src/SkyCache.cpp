@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "SkyCache.hpp"
+
+namespace T3
+{
+
+// Increased when the layout of the cache file changes.
+const int SkyCacheVersion = 1;
+
+// Keyframe size. The keyframes are smooth, the sky image samples them with
+// bilinear filtering.
+const int SkyKeyframeWidth = 256;
+const int SkyKeyframeHeight = 128;
+
+// Default keyframes, a step of 5.6 degrees from the nadir to the zenith.
+const int DefaultSkyKeyframes = 33;
+
+/**
+ * Header of the cache file, followed by the keyframes.
+ */
+struct SkyCacheHeader
+{
+    char magic[8];
+    int version;
+    int keyframeCount;
+    int width;
+    int height;
+    unsigned int sourceHash;
+};
+
+SkyCache::SkyCache()
+    : keyframeCount(DefaultSkyKeyframes),
+      keyframeWidth(SkyKeyframeWidth), keyframeHeight(SkyKeyframeHeight)
+{
+}
+
+SkyCache::~SkyCache()
+{
+}
+
+void SkyCache::setFileName(const std::string &fileName)
+{
+    this->fileName = fileName;
+}
+
+void SkyCache::setKeyframeCount(int count)
+{
+    keyframeCount = count >= 2 ? count : 2;
+}
+
+bool SkyCache::isEnabled() const
+{
+    return !fileName.empty();
+}
+
+int SkyCache::getKeyframeCount() const
+{
+    return keyframeCount;
+}
+
+int SkyCache::getKeyframeWidth() const
+{
+    return keyframeWidth;
+}
+
+int SkyCache::getKeyframeHeight() const
+{
+    return keyframeHeight;
+}
+
+size_t SkyCache::getKeyframesSize() const
+{
+    return (size_t)keyframeCount*keyframeWidth*keyframeHeight*4*sizeof(float);
+}
+
+Vector3 SkyCache::getKeyframeSunDirection(int index) const
+{
+    float elevation = -M_PI*0.5f + M_PI*index/(keyframeCount - 1);
+    return Vector3(cos(elevation), sin(elevation), 0.0f);
+}
+
+void SkyCache::locate(const Vector3 &sunDirection, int *firstKeyframe, float *blend, float *azimuth) const
+{
+    Vector3 direction = sunDirection.normalized();
+    float elevation = asin(std::max(-1.0f, std::min(direction.y, 1.0f)));
+    float position = (elevation + M_PI*0.5f)*(keyframeCount - 1)/M_PI;
+    int first = std::max(0, std::min((int)floor(position), keyframeCount - 2));
+
+    *firstKeyframe = first;
+    *blend = std::max(0.0f, std::min(position - first, 1.0f));
+    *azimuth = atan2(direction.z, direction.x);
+}
+
+bool SkyCache::load(const std::string &sourceFileName, std::vector<float> *pixels) const
+{
+    FILE *file = fopen(fileName.c_str(), "rb");
+    if(!file)
+        return false;
+
+    SkyCacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+        !memcmp(header.magic, "T3SKY", 6) && header.version == SkyCacheVersion &&
+        header.keyframeCount == keyframeCount && header.width == keyframeWidth &&
+        header.height == keyframeHeight && header.sourceHash == hashFile(sourceFileName);
+    if(valid)
+    {
+        pixels->resize(getKeyframesSize()/sizeof(float));
+        valid = fread(&(*pixels)[0], getKeyframesSize(), 1, file) == 1;
+    }
+
+    fclose(file);
+    return valid;
+}
+
+bool SkyCache::save(const std::string &sourceFileName, const std::vector<float> &pixels) const
+{
+    if(pixels.size()*sizeof(float) != getKeyframesSize())
+        return false;
+
+    SkyCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, "T3SKY");
+    header.version = SkyCacheVersion;
+    header.keyframeCount = keyframeCount;
+    header.width = keyframeWidth;
+    header.height = keyframeHeight;
+    header.sourceHash = hashFile(sourceFileName);
+
+    // Write a file of this process, and move it into place.
+    char suffix[32];
+    sprintf(suffix, ".%d.tmp", (int)getpid());
+    std::string tempFileName = fileName + suffix;
+    FILE *file = fopen(tempFileName.c_str(), "wb");
+    bool success = file &&
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(&pixels[0], getKeyframesSize(), 1, file) == 1;
+    if(file && fclose(file) != 0)
+        success = false;
+    if(success && rename(tempFileName.c_str(), fileName.c_str()) != 0)
+        success = false;
+
+    if(!success)
+    {
+        fprintf(stderr, "Failed to write the sky cache %s\n", fileName.c_str());
+        unlink(tempFileName.c_str());
+    }
+    return success;
+}
+
+unsigned int SkyCache::hashFile(const std::string &fileName)
+{
+    // FNV-1a of the content.
+    std::ifstream in(fileName.c_str(), std::ios::binary);
+    std::istreambuf_iterator<char> it(in), end;
+    unsigned int hash = 2166136261u;
+    for(; it != end; ++it)
+    {
+        hash ^= (unsigned char)*it;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+} // namespace T3
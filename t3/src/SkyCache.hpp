@@ -0,0 +1,64 @@
+#ifndef T3_SKY_CACHE_HPP
+#define T3_SKY_CACHE_HPP
+
+#include <string>
+#include <vector>
+#include "Vector3.hpp"
+
+namespace T3
+{
+
+/**
+ * Day sky keyframes at quantized sun elevations, stored in a cache file.
+ * The atmosphere is symmetric around the vertical axis, so the keyframes
+ * are computed with the sun at a zero azimuth, and the sky of any other
+ * sun is the blend of the two keyframes around its elevation, rotated by
+ * its azimuth. The scattering is linear in the sun color, so they are also
+ * computed for a white sun and tinted afterwards.
+ *
+ * The keyframes are packed as in the kernels, as keyframe after keyframe
+ * of width*height float4 pixels.
+ */
+class SkyCache
+{
+public:
+    SkyCache();
+    ~SkyCache();
+
+    /// Cache file. An empty name, the default, disables the keyframes.
+    void setFileName(const std::string &fileName);
+    void setKeyframeCount(int count);
+
+    bool isEnabled() const;
+    int getKeyframeCount() const;
+    int getKeyframeWidth() const;
+    int getKeyframeHeight() const;
+    size_t getKeyframesSize() const;
+
+    /// Sun direction of a keyframe, at a zero azimuth.
+    Vector3 getKeyframeSunDirection(int index) const;
+
+    /// Finds the keyframes around the elevation of a sun direction. The sky
+    /// is firstKeyframe blended with the next one, rotated by the azimuth.
+    void locate(const Vector3 &sunDirection, int *firstKeyframe, float *blend, float *azimuth) const;
+
+    /// Reads the keyframes, when the file was written with the same
+    /// settings and the same sky program source.
+    bool load(const std::string &sourceFileName, std::vector<float> *pixels) const;
+
+    /// Writes the keyframes. The file is replaced at once, so other
+    /// processes never read a partial file.
+    bool save(const std::string &sourceFileName, const std::vector<float> &pixels) const;
+
+private:
+    static unsigned int hashFile(const std::string &fileName);
+
+    std::string fileName;
+    int keyframeCount;
+    int keyframeWidth;
+    int keyframeHeight;
+};
+
+} // namespace T3
+
+#endif //T3_SKY_CACHE_HPP
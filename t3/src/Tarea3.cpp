@@ -10,8 +10,6 @@ int main(int argc, const char *argv[])
     Application app;
     if(!app.initialize(argc, argv))
         return -1;
-    app.run();
-    
-    return 0;
+    return app.run();
 }
 
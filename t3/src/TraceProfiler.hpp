@@ -0,0 +1,147 @@
+#ifndef T3_TRACE_PROFILER_HPP
+#define T3_TRACE_PROFILER_HPP
+
+#include <string>
+#include <vector>
+#include "Threading.hpp"
+
+namespace T3
+{
+
+#ifdef T3_ENABLE_TRACE
+
+/**
+ * A completed zone, with times in microseconds.
+ */
+struct TraceEvent
+{
+    const char *name;
+    Uint64 start;
+    Uint64 duration;
+};
+
+/**
+ * Ring buffer with the zones of a single thread. Only the owner thread
+ * writes into it.
+ */
+class TraceThreadBuffer
+{
+public:
+    TraceThreadBuffer(int threadId);
+
+    void add(const char *name, Uint64 start, Uint64 end);
+
+    int threadId;
+    std::string threadName;
+    std::vector<TraceEvent> events;
+    size_t next;
+    bool wrapped;
+};
+
+/**
+ * Scoped zone profiler that writes Chrome/Perfetto trace event files.
+ */
+class TraceProfiler
+{
+public:
+    static TraceProfiler &get();
+
+    /// Enables recording the zones.
+    void setEnabled(bool value);
+
+    static bool isEnabled()
+    {
+        return enabled;
+    }
+
+    /// Names the current thread in the trace.
+    void setThreadName(const char *name);
+
+    /// Adds a zone of the current thread.
+    void addZone(const char *name, Uint64 start, Uint64 end);
+
+    /// Writes the recorded zones. The other threads should be stopped.
+    bool writeJSON(const std::string &fileName);
+
+    /// Current time in microseconds.
+    static Uint64 now();
+
+private:
+    TraceProfiler();
+    ~TraceProfiler();
+
+    TraceThreadBuffer *getThreadBuffer();
+
+    static bool enabled;
+
+    Mutex mutex;
+    std::vector<TraceThreadBuffer*> buffers;
+    Uint64 startTime;
+};
+
+/**
+ * Records the lifetime of a scope.
+ */
+class TraceZone
+{
+public:
+    TraceZone(const char *name)
+        : name(name), start(TraceProfiler::isEnabled() ? TraceProfiler::now() : 0) {}
+    ~TraceZone()
+    {
+        if(start)
+            TraceProfiler::get().addZone(name, start, TraceProfiler::now());
+    }
+
+private:
+    const char *name;
+    Uint64 start;
+};
+
+/**
+ * Lock that records the time spent waiting for the mutex.
+ */
+class TracedLock
+{
+public:
+    TracedLock(const Mutex &mutex, const char *name)
+        : mutex(mutex)
+    {
+        TraceZone zone(name);
+        mutex.lock();
+    }
+
+    ~TracedLock()
+    {
+        mutex.unlock();
+    }
+
+private:
+    const Mutex &mutex;
+};
+
+#define T3_TRACE_CONCAT_(a, b) a##b
+#define T3_TRACE_CONCAT(a, b) T3_TRACE_CONCAT_(a, b)
+#define T3_TRACE_ZONE(name) T3::TraceZone T3_TRACE_CONCAT(traceZone, __LINE__)(name)
+#define T3_TRACE_THREAD_NAME(name) T3::TraceProfiler::get().setThreadName(name)
+
+#else
+
+/**
+ * Plain lock when the tracing is disabled.
+ */
+class TracedLock: public Lock
+{
+public:
+    TracedLock(const Mutex &mutex, const char *)
+        : Lock(mutex) {}
+};
+
+#define T3_TRACE_ZONE(name)
+#define T3_TRACE_THREAD_NAME(name)
+
+#endif
+
+} // namespace T3
+
+#endif //T3_TRACE_PROFILER_HPP
@@ -3,18 +3,28 @@
 
 #include <CL/cl.h>
 #include "Vector2.hpp"
+#include "VectorSIMD.hpp"
 
 namespace T3
 {
 
 /**
- * 3D vector.
+ * 3D vector. It is stored as a cl_float3, with a fourth lane that is kept
+ * at zero, so the operations use the SIMD lanes.
  */
 class Vector3
 {
 public:
     explicit Vector3(float x=0.0f, float y=0.0f, float z=0.0f)
-        : x(x), y(y), z(z) {}
+    {
+        simdStore(&this->x, simdSet(x, y, z, 0.0f));
+    }
+
+    explicit Vector3(SimdFloat4 v)
+    {
+        simdStore(&this->x, v);
+    }
+
     ~Vector3() {}
 
     union
@@ -26,36 +36,45 @@ public:
         cl_float3 data;
     };
 
+    SimdFloat4 simd() const
+    {
+        return simdLoad(&x);
+    }
 
 public:
     friend Vector3 operator+(const Vector3 &a, const Vector3 &b)
     {
-        return Vector3(a.x + b.x, a.y + b.y, a.z + b.z);
+        return Vector3(simdAdd(a.simd(), b.simd()));
     }
 
     friend Vector3 operator-(const Vector3 &v)
     {
-        return Vector3(-v.x, -v.y, -v.z);
+        return Vector3(simdNeg(v.simd()));
     }
 
     friend Vector3 operator-(const Vector3 &a, const Vector3 &b)
     {
-        return Vector3(a.x - b.x, a.y - b.y, a.z - b.z);
+        return Vector3(simdSub(a.simd(), b.simd()));
     }
 
     friend Vector3 operator*(const Vector3 &a, const Vector3 &b)
     {
-        return Vector3(a.x*b.x, a.y*b.y, a.z*b.z);
+        return Vector3(simdMul(a.simd(), b.simd()));
     }
 
     friend Vector3 operator*(const Vector3 &a, const float s)
     {
-        return Vector3(a.x*s, a.y*s, a.z*s);
+        return Vector3(simdMul(a.simd(), simdSplat(s)));
     }
 
     friend Vector3 operator*(const float s, const Vector3 &a)
     {
-        return Vector3(a.x*s, a.y*s, a.z*s);
+        return Vector3(simdMul(simdSplat(s), a.simd()));
+    }
+
+    friend Vector3 operator/(const Vector3 &a, const Vector3 &b)
+    {
+        return Vector3(simdDiv(a.simd(), simdSet(b.x, b.y, b.z, 1.0f)));
     }
 
     friend Vector3 operator/(const Vector3 &a, const float s)
@@ -75,30 +94,49 @@ public:
 
     Vector3 &operator+=(const Vector3 &b)
     {
-        x += b.x;
-        y += b.y;
-        z += b.z;
+        simdStore(&x, simdAdd(simd(), b.simd()));
+        return *this;
+    }
+
+    Vector3 &operator-=(const Vector3 &b)
+    {
+        simdStore(&x, simdSub(simd(), b.simd()));
+        return *this;
+    }
+
+    Vector3 &operator*=(const float s)
+    {
+        simdStore(&x, simdMul(simd(), simdSplat(s)));
         return *this;
     }
 
     float dot(const Vector3 &v) const
     {
-        return x*v.x + y*v.y + z*v.z;
+        return simdSum3(simdMul(simd(), v.simd()));
     }
 
     float length2() const
     {
-        return x*x + y*y + z*z;
+        return dot(*this);
     }
 
     float length() const
     {
-        return sqrt(x*x + y*y + z*z);
+        return sqrt(length2());
     }
 
+    /// As the OpenCL normalize, a zero vector stays zero.
     Vector3 normalized() const
     {
-        return (*this)/length();
+        float l2 = length2();
+        if(l2 == 0.0f)
+            return *this;
+        return (*this)/sqrt(l2);
+    }
+
+    bool closeTo(const Vector3 &v) const
+    {
+        return T3::closeTo(x, v.x) && T3::closeTo(y, v.y) && T3::closeTo(z, v.z);
     }
 
 public:
@@ -115,10 +153,31 @@ inline Vector3 make_vector3(float x, float y, float z)
 
 inline Vector3 cross(const Vector3 &a, const Vector3 &b)
 {
-    abort();
+    return Vector3(simdCross3(a.simd(), b.simd()));
 }
 
+inline float distance(const Vector3 &a, const Vector3 &b)
+{
+    return (a - b).length();
 }
 
-#endif //_T3_VECTOR3_HPP_
+// Component wise functions, as the OpenCL built-ins. The NaN handling of
+// fmin and fmax follows the SIMD instructions.
+inline Vector3 fmin(const Vector3 &a, const Vector3 &b)
+{
+    return Vector3(simdMin(a.simd(), b.simd()));
+}
 
+inline Vector3 fmax(const Vector3 &a, const Vector3 &b)
+{
+    return Vector3(simdMax(a.simd(), b.simd()));
+}
+
+inline Vector3 fabs(const Vector3 &v)
+{
+    return Vector3(simdAbs(v.simd()));
+}
+
+}
+
+#endif //_T3_VECTOR3_HPP_
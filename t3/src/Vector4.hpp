@@ -14,9 +14,20 @@ class Vector4
 {
 public:
     Vector4(const Vector3 &v, float w = 0.0f)
-        : x(v.x), y(v.y), z(v.z), w(w) {}
+    {
+        simdStore(&this->x, simdSet(v.x, v.y, v.z, w));
+    }
+
     explicit Vector4(float x=0.0f, float y=0.0f, float z=0.0f, float w=0.0f)
-        : x(x), y(y), z(z), w(w) {}
+    {
+        simdStore(&this->x, simdSet(x, y, z, w));
+    }
+
+    explicit Vector4(SimdFloat4 v)
+    {
+        simdStore(&this->x, v);
+    }
+
     ~Vector4() {}
 
     union
@@ -28,9 +39,80 @@ public:
         cl_float4 data;
     };
 
+    SimdFloat4 simd() const
+    {
+        return simdLoad(&x);
+    }
+
+public:
+    friend Vector4 operator+(const Vector4 &a, const Vector4 &b)
+    {
+        return Vector4(simdAdd(a.simd(), b.simd()));
+    }
+
+    friend Vector4 operator-(const Vector4 &v)
+    {
+        return Vector4(simdNeg(v.simd()));
+    }
+
+    friend Vector4 operator-(const Vector4 &a, const Vector4 &b)
+    {
+        return Vector4(simdSub(a.simd(), b.simd()));
+    }
+
+    friend Vector4 operator*(const Vector4 &a, const Vector4 &b)
+    {
+        return Vector4(simdMul(a.simd(), b.simd()));
+    }
+
+    friend Vector4 operator*(const Vector4 &a, const float s)
+    {
+        return Vector4(simdMul(a.simd(), simdSplat(s)));
+    }
+
+    friend Vector4 operator*(const float s, const Vector4 &a)
+    {
+        return Vector4(simdMul(simdSplat(s), a.simd()));
+    }
+
+    friend Vector4 operator/(const Vector4 &a, const Vector4 &b)
+    {
+        return Vector4(simdDiv(a.simd(), b.simd()));
+    }
+
+    friend Vector4 operator/(const Vector4 &a, const float s)
+    {
+        return a*(1.0f/s);
+    }
+
+    Vector4 &operator+=(const Vector4 &b)
+    {
+        simdStore(&x, simdAdd(simd(), b.simd()));
+        return *this;
+    }
+
     float dot(const Vector4 &v) const
     {
-        return x*v.x + y*v.y + z*v.z + w*v.w;
+        return simdSum4(simdMul(simd(), v.simd()));
+    }
+
+    float length2() const
+    {
+        return dot(*this);
+    }
+
+    float length() const
+    {
+        return sqrt(length2());
+    }
+
+    /// As the OpenCL normalize, a zero vector stays zero.
+    Vector4 normalized() const
+    {
+        float l2 = length2();
+        if(l2 == 0.0f)
+            return *this;
+        return (*this)/sqrt(l2);
     }
 
 };
@@ -40,6 +122,21 @@ inline Vector4 make_vector4(float x, float y, float z, float w)
     return Vector4(x, y, z, w);
 }
 
+inline Vector4 fmin(const Vector4 &a, const Vector4 &b)
+{
+    return Vector4(simdMin(a.simd(), b.simd()));
+}
+
+inline Vector4 fmax(const Vector4 &a, const Vector4 &b)
+{
+    return Vector4(simdMax(a.simd(), b.simd()));
+}
+
+inline Vector4 fabs(const Vector4 &v)
+{
+    return Vector4(simdAbs(v.simd()));
+}
+
 }
 
 #endif //T3_VECTOR4_HPP
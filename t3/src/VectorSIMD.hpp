@@ -0,0 +1,208 @@
+#ifndef T3_VECTOR_SIMD_HPP
+#define T3_VECTOR_SIMD_HPP
+
+#include <math.h>
+
+// Four float lanes for the host vector math. They use SSE on x86, NEON on
+// 64-bit ARM, and plain floats elsewhere or when T3_NO_SIMD is defined.
+#if defined(T3_NO_SIMD)
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define T3_SIMD_SSE
+#include <xmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define T3_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+namespace T3
+{
+
+// The vector classes overload these, so keep the float ones visible.
+using ::fmin;
+using ::fmax;
+using ::fabs;
+
+#if defined(T3_SIMD_SSE)
+typedef __m128 SimdFloat4;
+#elif defined(T3_SIMD_NEON)
+typedef float32x4_t SimdFloat4;
+#else
+struct SimdFloat4
+{
+    float v[4];
+};
+#endif
+
+/**
+ * Loads four floats. The pointer does not need to be aligned.
+ */
+inline SimdFloat4 simdLoad(const float *p)
+{
+#if defined(T3_SIMD_SSE)
+    return _mm_loadu_ps(p);
+#elif defined(T3_SIMD_NEON)
+    return vld1q_f32(p);
+#else
+    SimdFloat4 r = {{p[0], p[1], p[2], p[3]}};
+    return r;
+#endif
+}
+
+inline void simdStore(float *p, SimdFloat4 a)
+{
+#if defined(T3_SIMD_SSE)
+    _mm_storeu_ps(p, a);
+#elif defined(T3_SIMD_NEON)
+    vst1q_f32(p, a);
+#else
+    for(int i = 0; i < 4; ++i)
+        p[i] = a.v[i];
+#endif
+}
+
+inline SimdFloat4 simdSet(float x, float y, float z, float w)
+{
+#if defined(T3_SIMD_SSE)
+    return _mm_set_ps(w, z, y, x);
+#else
+    float p[4] = {x, y, z, w};
+    return simdLoad(p);
+#endif
+}
+
+inline SimdFloat4 simdSplat(float s)
+{
+#if defined(T3_SIMD_SSE)
+    return _mm_set1_ps(s);
+#elif defined(T3_SIMD_NEON)
+    return vdupq_n_f32(s);
+#else
+    return simdSet(s, s, s, s);
+#endif
+}
+
+inline float simdLane(SimdFloat4 a, int lane)
+{
+    float p[4];
+    simdStore(p, a);
+    return p[lane];
+}
+
+#if defined(T3_SIMD_SSE)
+// fmin and fmax return the other operand when one is a NaN, like in OpenCL.
+// minps and maxps return the second operand when either is a NaN, so the
+// lanes where the second one is a NaN take the first one.
+inline __m128 simdMinSSE(__m128 a, __m128 b)
+{
+    __m128 bNaN = _mm_cmpunord_ps(b, b);
+    return _mm_or_ps(_mm_and_ps(bNaN, a), _mm_andnot_ps(bNaN, _mm_min_ps(a, b)));
+}
+
+inline __m128 simdMaxSSE(__m128 a, __m128 b)
+{
+    __m128 bNaN = _mm_cmpunord_ps(b, b);
+    return _mm_or_ps(_mm_and_ps(bNaN, a), _mm_andnot_ps(bNaN, _mm_max_ps(a, b)));
+}
+
+#define T3_SIMD_BINARY_OP(name, sse, neon, expr) \
+    inline SimdFloat4 name(SimdFloat4 a, SimdFloat4 b) { return sse(a, b); }
+#elif defined(T3_SIMD_NEON)
+#define T3_SIMD_BINARY_OP(name, sse, neon, expr) \
+    inline SimdFloat4 name(SimdFloat4 a, SimdFloat4 b) { return neon(a, b); }
+#else
+#define T3_SIMD_BINARY_OP(name, sse, neon, expr) \
+    inline SimdFloat4 name(SimdFloat4 a, SimdFloat4 b) \
+    { \
+        SimdFloat4 r; \
+        for(int i = 0; i < 4; ++i) \
+        { \
+            float x = a.v[i], y = b.v[i]; \
+            r.v[i] = expr; \
+        } \
+        return r; \
+    }
+#endif
+
+T3_SIMD_BINARY_OP(simdAdd, _mm_add_ps, vaddq_f32, x + y)
+T3_SIMD_BINARY_OP(simdSub, _mm_sub_ps, vsubq_f32, x - y)
+T3_SIMD_BINARY_OP(simdMul, _mm_mul_ps, vmulq_f32, x*y)
+T3_SIMD_BINARY_OP(simdDiv, _mm_div_ps, vdivq_f32, x/y)
+T3_SIMD_BINARY_OP(simdMin, simdMinSSE, vminnmq_f32, fminf(x, y))
+T3_SIMD_BINARY_OP(simdMax, simdMaxSSE, vmaxnmq_f32, fmaxf(x, y))
+
+#undef T3_SIMD_BINARY_OP
+
+inline SimdFloat4 simdAbs(SimdFloat4 a)
+{
+#if defined(T3_SIMD_SSE)
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+#elif defined(T3_SIMD_NEON)
+    return vabsq_f32(a);
+#else
+    SimdFloat4 r = {{fabsf(a.v[0]), fabsf(a.v[1]), fabsf(a.v[2]), fabsf(a.v[3])}};
+    return r;
+#endif
+}
+
+inline SimdFloat4 simdNeg(SimdFloat4 a)
+{
+#if defined(T3_SIMD_SSE)
+    return _mm_xor_ps(_mm_set1_ps(-0.0f), a);
+#elif defined(T3_SIMD_NEON)
+    return vnegq_f32(a);
+#else
+    SimdFloat4 r = {{-a.v[0], -a.v[1], -a.v[2], -a.v[3]}};
+    return r;
+#endif
+}
+
+/**
+ * Adds the first three lanes, in the order of the scalar code.
+ */
+inline float simdSum3(SimdFloat4 a)
+{
+#if defined(T3_SIMD_SSE)
+    __m128 y = _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_movehl_ps(a, a);
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(a, y), z));
+#elif defined(T3_SIMD_NEON)
+    return vgetq_lane_f32(a, 0) + vgetq_lane_f32(a, 1) + vgetq_lane_f32(a, 2);
+#else
+    return a.v[0] + a.v[1] + a.v[2];
+#endif
+}
+
+inline float simdSum4(SimdFloat4 a)
+{
+#if defined(T3_SIMD_SSE)
+    __m128 w = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 3, 3));
+    return simdSum3(a) + _mm_cvtss_f32(w);
+#elif defined(T3_SIMD_NEON)
+    return simdSum3(a) + vgetq_lane_f32(a, 3);
+#else
+    return simdSum3(a) + a.v[3];
+#endif
+}
+
+/**
+ * Cross product of the first three lanes. The fourth lane is zero, when it
+ * is finite in both operands.
+ */
+inline SimdFloat4 simdCross3(SimdFloat4 a, SimdFloat4 b)
+{
+#if defined(T3_SIMD_SSE)
+    __m128 aYZX = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 bYZX = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a, bYZX), _mm_mul_ps(aYZX, b));
+    return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+#else
+    float p[4], q[4];
+    simdStore(p, a);
+    simdStore(q, b);
+    return simdSet(p[1]*q[2] - p[2]*q[1], p[2]*q[0] - p[0]*q[2], p[0]*q[1] - p[1]*q[0], p[3]*q[3] - p[3]*q[3]);
+#endif
+}
+
+} // namespace T3
+
+#endif //T3_VECTOR_SIMD_HPP
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include "WorkGroupTuner.hpp"
+
+namespace T3
+{
+
+// Number of timed runs per candidate.
+const int TuningRuns = 3;
+
+WorkGroupTuner::WorkGroupTuner()
+    : context(NULL), device(NULL), commandQueue(NULL), forceRetune(false)
+{
+}
+
+WorkGroupTuner::~WorkGroupTuner()
+{
+}
+
+void WorkGroupTuner::initialize(cl_context context, cl_device_id device, cl_command_queue commandQueue,
+    const std::string &cacheFileName, bool forceRetune)
+{
+    this->context = context;
+    this->device = device;
+    this->commandQueue = commandQueue;
+    this->cacheFileName = cacheFileName;
+    this->forceRetune = forceRetune;
+
+    // Identify the device by its name and driver.
+    char buffer[1024];
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(buffer), buffer, NULL);
+    deviceName = buffer;
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(buffer), buffer, NULL);
+    deviceName += " ";
+    deviceName += buffer;
+
+    loadCache();
+}
+
+bool WorkGroupTuner::needsTuning(const char *kernelName, const size_t *globalSize) const
+{
+    if(!context)
+        return false;
+
+    std::string key = makeKey(kernelName, globalSize);
+    return !localSizes.count(key) || (forceRetune && !retunedKeys.count(key));
+}
+
+bool WorkGroupTuner::getLocalSize(cl_kernel kernel, const char *kernelName, const size_t *globalSize, size_t *localSize)
+{
+    // Without a device, the driver chooses.
+    if(!context)
+        return false;
+
+    std::string key = makeKey(kernelName, globalSize);
+    LocalSize result;
+    if(!needsTuning(kernelName, globalSize))
+    {
+        result = localSizes[key];
+    }
+    else
+    {
+        result = tune(kernel, kernelName, globalSize);
+        localSizes[key] = result;
+        retunedKeys.insert(key);
+        saveCache();
+    }
+
+    // A zero size means the driver choice.
+    if(!result.width || !result.height)
+        return false;
+
+    localSize[0] = result.width;
+    localSize[1] = result.height;
+    return true;
+}
+
+std::string WorkGroupTuner::makeKey(const char *kernelName, const size_t *globalSize) const
+{
+    std::ostringstream out;
+    out << deviceName << '\t' << kernelName << '\t' << globalSize[0] << '\t' << globalSize[1];
+    return out.str();
+}
+
+WorkGroupTuner::LocalSize WorkGroupTuner::tune(cl_kernel kernel, const char *kernelName, const size_t *globalSize)
+{
+    LocalSize best = {0, 0};
+
+    // The trial runs read the buffers written by the pending commands.
+    if(commandQueue)
+        clFinish(commandQueue);
+
+    // Use a separate queue with profiling.
+    cl_command_queue queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, NULL);
+    if(!queue)
+        return best;
+
+    // Query the kernel limits.
+    size_t maxSize = 1;
+    size_t multiple = 1;
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxSize), &maxSize, NULL);
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL);
+    if(multiple > maxSize || multiple == 0)
+        multiple = 1;
+
+    // Start with the driver choice.
+    cl_ulong bestTime = timeKernel(queue, kernel, globalSize, NULL);
+
+    // Try the candidates.
+    for(size_t w = 1; w <= maxSize; w *= 2)
+    {
+        for(size_t h = 1; w*h <= maxSize; h *= 2)
+        {
+            if(globalSize[0] % w || globalSize[1] % h || (w*h) % multiple)
+                continue;
+
+            size_t localSize[] = {w, h};
+            cl_ulong time = timeKernel(queue, kernel, globalSize, localSize);
+            if(time < bestTime)
+            {
+                bestTime = time;
+                best.width = w;
+                best.height = h;
+            }
+        }
+    }
+
+    clReleaseCommandQueue(queue);
+    printf("Tuned %s %dx%d: local size %dx%d, %.3f ms\n", kernelName, (int)globalSize[0], (int)globalSize[1],
+            (int)best.width, (int)best.height, bestTime*1e-6/TuningRuns);
+    return best;
+}
+
+cl_ulong WorkGroupTuner::timeKernel(cl_command_queue queue, cl_kernel kernel, const size_t *globalSize, const size_t *localSize)
+{
+    // Warm up.
+    if(clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalSize, localSize, 0, NULL, NULL) != CL_SUCCESS)
+        return (cl_ulong)-1;
+    clFinish(queue);
+
+    // Time the runs.
+    cl_ulong total = 0;
+    for(int i = 0; i < TuningRuns; ++i)
+    {
+        cl_event event;
+        if(clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalSize, localSize, 0, NULL, &event) != CL_SUCCESS)
+            return (cl_ulong)-1;
+        clWaitForEvents(1, &event);
+
+        cl_ulong start = 0, end = 0;
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+        clReleaseEvent(event);
+        total += end - start;
+    }
+
+    return total;
+}
+
+void WorkGroupTuner::loadCache()
+{
+    std::ifstream in(cacheFileName.c_str());
+    std::string line;
+    while(std::getline(in, line))
+    {
+        if(line.empty() || line[0] == '#')
+            continue;
+
+        // The key is everything before the last two fields.
+        size_t heightPos = line.rfind('\t');
+        if(heightPos == std::string::npos || heightPos == 0)
+            continue;
+        size_t widthPos = line.rfind('\t', heightPos - 1);
+        if(widthPos == std::string::npos)
+            continue;
+
+        LocalSize size;
+        size.width = atoi(line.c_str() + widthPos + 1);
+        size.height = atoi(line.c_str() + heightPos + 1);
+        localSizes[line.substr(0, widthPos)] = size;
+    }
+}
+
+void WorkGroupTuner::saveCache()
+{
+    // Keep the sizes stored by other processes since the cache was read,
+    // except the ones tuned here.
+    std::map<std::string, LocalSize> tuned;
+    std::set<std::string>::iterator key = retunedKeys.begin();
+    for(; key != retunedKeys.end(); ++key)
+        tuned[*key] = localSizes[*key];
+    loadCache();
+    std::map<std::string, LocalSize>::iterator it = tuned.begin();
+    for(; it != tuned.end(); ++it)
+        localSizes[it->first] = it->second;
+
+    // Write a file of this process, and move it into place.
+    char suffix[32];
+    sprintf(suffix, ".%d.tmp", (int)getpid());
+    std::string tempFileName = cacheFileName + suffix;
+    {
+        std::ofstream out(tempFileName.c_str());
+        out << "# device\tkernel\tglobal width\tglobal height\tlocal width\tlocal height\n";
+        for(it = localSizes.begin(); it != localSizes.end(); ++it)
+            out << it->first << '\t' << it->second.width << '\t' << it->second.height << '\n';
+        out.close();
+        if(out && rename(tempFileName.c_str(), cacheFileName.c_str()) == 0)
+            return;
+    }
+
+    fprintf(stderr, "Failed to write the work group cache %s\n", cacheFileName.c_str());
+    unlink(tempFileName.c_str());
+}
+
+} // namespace T3
@@ -0,0 +1,63 @@
+#ifndef T3_WORK_GROUP_TUNER_HPP
+#define T3_WORK_GROUP_TUNER_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <CL/cl.h>
+
+namespace T3
+{
+
+/**
+ * Chooses the local work size of the 2D kernels by timing the candidates.
+ * The results are stored per device, kernel and global size in a cache file.
+ */
+class WorkGroupTuner
+{
+public:
+    WorkGroupTuner();
+    ~WorkGroupTuner();
+
+    /// Sets the cache file and loads it. The file name is relative to the
+    /// working directory, which also holds the cl sources. When forcing the
+    /// retune, the cached sizes are measured again the first time they are
+    /// used. The commands pending in the queue are finished before timing.
+    void initialize(cl_context context, cl_device_id device, cl_command_queue commandQueue,
+        const std::string &cacheFileName, bool forceRetune);
+
+    /// Tells whether the next getLocalSize of a kernel runs it to time the
+    /// candidates.
+    bool needsTuning(const char *kernelName, const size_t *globalSize) const;
+
+    /// Gets the local size for a kernel, whose arguments are already set.
+    /// Returns false when the driver choice should be used.
+    bool getLocalSize(cl_kernel kernel, const char *kernelName, const size_t *globalSize, size_t *localSize);
+
+private:
+    struct LocalSize
+    {
+        size_t width, height;
+    };
+
+    std::string makeKey(const char *kernelName, const size_t *globalSize) const;
+    LocalSize tune(cl_kernel kernel, const char *kernelName, const size_t *globalSize);
+    cl_ulong timeKernel(cl_command_queue queue, cl_kernel kernel, const size_t *globalSize, const size_t *localSize);
+
+    void loadCache();
+    void saveCache();
+
+    cl_context context;
+    cl_device_id device;
+    cl_command_queue commandQueue;
+    std::string deviceName;
+    std::string cacheFileName;
+    bool forceRetune;
+
+    std::map<std::string, LocalSize> localSizes;
+    std::set<std::string> retunedKeys;
+};
+
+} // namespace T3
+
+#endif //T3_WORK_GROUP_TUNER_HPP
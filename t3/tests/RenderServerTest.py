@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""
+Sends invalid scenes to the render server, which must reply with an error
+to each of them and keep serving the valid requests.
+
+Usage: RenderServerTest.py <Tarea3> <valid scene>
+"""
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+INVALID_SCENES = {
+    'malformed.xml': '<scene><shapes><shape type="sphere"',
+    'no-root.xml': '<?xml version="1.0"?>\n<world />\n',
+    'unknown-material.xml':
+        '<scene><shapes><shape type="sphere" material="missing" radius="1" /></shapes></scene>\n',
+}
+
+def connect(path, server):
+    # The server creates the socket once the raytracer is initialized.
+    for attempt in range(600):
+        if server.poll() is not None:
+            raise RuntimeError('the server exited with %d' % server.returncode)
+        try:
+            client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            client.connect(path)
+            return client
+        except (FileNotFoundError, ConnectionRefusedError):
+            client.close()
+            time.sleep(0.1)
+    raise RuntimeError('the server did not open %s' % path)
+
+def request(stream, line):
+    stream.write(line + '\n')
+    stream.flush()
+    reply = stream.readline().strip()
+    print('%s -> %s' % (line, reply))
+    return reply
+
+def main():
+    executable, validScene = os.path.abspath(sys.argv[1]), os.path.abspath(sys.argv[2])
+    with tempfile.TemporaryDirectory() as directory:
+        for name, content in INVALID_SCENES.items():
+            with open(os.path.join(directory, name), 'w') as f:
+                f.write(content)
+
+        socketPath = os.path.join(directory, 'server.sock')
+        server = subprocess.Popen([executable, '--serve', socketPath, validScene])
+        failures = 0
+        try:
+            stream = connect(socketPath, server).makefile('rw')
+            for name in sorted(INVALID_SCENES):
+                reply = request(stream, 'render scene=%s size=32x32 output=%s' %
+                    (os.path.join(directory, name), os.path.join(directory, name + '.ppm')))
+                if not reply.startswith('error'):
+                    failures += 1
+
+            # The server must still render after the invalid scenes.
+            reply = request(stream, 'render scene=%s size=32x32 output=%s' %
+                (validScene, os.path.join(directory, 'valid.ppm')))
+            if not reply.startswith('ok'):
+                failures += 1
+            request(stream, 'quit')
+            if server.wait(timeout=60) != 0:
+                failures += 1
+        finally:
+            if server.poll() is None:
+                server.kill()
+
+    print('%d failures' % failures)
+    return 1 if failures else 0
+
+if __name__ == '__main__':
+    sys.exit(main())